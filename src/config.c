@@ -46,6 +46,7 @@ find_param(char *name, ParameterTable *table, int table_size)
 	}
 
 
+#ifndef PIKRELLCAM_NO_MMAL
 ParameterTable	exposure_mode_table[] =
 	{
 	{ MMAL_PARAM_EXPOSUREMODE_OFF,          "off" },
@@ -388,6 +389,31 @@ color_effect_set(char *option, char *setting)
 	}
 
 
+#else
+  /* Without MMAL there is no camera to set, so camera parameters just
+  |  keep their config values.
+  */
+static MMAL_STATUS_T
+camera_parameter_keep(char *option, char *setting)
+	{
+	return MMAL_SUCCESS;
+	}
+
+#define	rational_control_set	camera_parameter_keep
+#define	uint32_control_set		camera_parameter_keep
+#define	int32_control_set		camera_parameter_keep
+#define	boolean_control_set		camera_parameter_keep
+#define	rotation_control_set	camera_parameter_keep
+#define	exposure_mode_set		camera_parameter_keep
+#define	image_effect_set		camera_parameter_keep
+#define	flip_control_set		camera_parameter_keep
+#define	crop_control_set		camera_parameter_keep
+#define	metering_mode_set		camera_parameter_keep
+#define	awb_mode_set			camera_parameter_keep
+#define	color_effect_set		camera_parameter_keep
+#endif
+
+
 /* ========================================== */
 
 static CameraParameter  camera_parameters[] =
@@ -650,6 +676,12 @@ static Config  config[] =
 	  "#",
 	"on_motion_end",    "", TRUE, {.string = &pikrellcam.on_motion_end_cmd}, config_string_set },
 
+	{ "# Command/script to run when the camera view looks tampered with: the\n"
+	  "# lens is covered or the camera is moved.  It is run with an argument\n"
+	  "# of \"covered\" or \"moved\".\n"
+	  "#",
+	"on_motion_tamper",    "", TRUE, {.string = &pikrellcam.on_motion_tamper_cmd}, config_string_set },
+
 	{ "# When to save the motion preview file.\n"
 	  "#     first  - when motion is first detected.\n"
 	  "#              The on_motion_preview_save command runs immediately.\n"
@@ -695,11 +727,46 @@ static Config  config[] =
 	  "#",
 	"motion_area_min_side",  "80", FALSE, {.value = &pikrellcam.motion_area_min_side}, config_value_int_set },
 
+	{ "# If on, learn which parts of the frame have chronic motion vector noise\n"
+	  "# (eg trees or water moving in the wind) and ignore their vectors unless\n"
+	  "# they are much larger than usual.  Learning takes a minute or two and\n"
+	  "# starts over after a servo move.  The ignored blocks are shown dark\n"
+	  "# when motion vectors are shown.\n"
+	  "#",
+	"motion_noise_filter",  "on", FALSE, {.value = &pikrellcam.motion_noise_filter}, config_value_bool_set },
+
+	{ "# If on, do not detect motion while most of the frame changes at once,\n"
+	  "# which is a lighting change (cloud shadows, IR switching) and not motion.\n"
+	  "#",
+	"motion_lighting_filter",  "on", FALSE, {.value = &pikrellcam.motion_lighting_filter}, config_value_bool_set },
+
+	{ "# Number of motion frames (2 - 16) to sum motion vectors over for also\n"
+	  "# detecting slow motion, eg far away walkers whose vectors are under the\n"
+	  "# magnitude limit on each frame.  0 for no slow motion detects.\n"
+	  "#",
+	"motion_slow_frames",  "0", FALSE, {.value = &pikrellcam.motion_slow_frames}, config_value_int_set },
+
+	{ "# Half life in hours (1 - 168) of the motion heatmap which counts where\n"
+	  "# motion vectors trigger over the whole frame, in regions or not, as an\n"
+	  "# aid to placing motion regions.  0 to not keep a heatmap.  The heatmap\n"
+	  "# is saved in the config directory and starts over if the video size\n"
+	  "# changes.  Show it with the FIFO command \"motion show_heatmap on\"\n"
+	  "# or export it with \"motion heatmap_export\".\n"
+	  "#",
+	"motion_heatmap_hours",  "24", FALSE, {.value = &pikrellcam.motion_heatmap_hours}, config_value_int_set },
+
 	{ "# Enable writing a motion statistics .csv file for each motion video.\n"
 	  "# For users who have a need for advanced video post processing.\n"
 	  "#",
 	"motion_stats",  "off", FALSE, {.value = &pikrellcam.motion_stats}, config_value_bool_set },
 
+	{ "# Enable writing a binary .mvlog file of the raw motion vectors and\n"
+	  "# per frame motion results for each motion video.  For rerunning\n"
+	  "# motion detection on recorded footage to tune motion settings.\n"
+	  "# Takes effect when the camera is (re)started.\n"
+	  "#",
+	"motion_vectors_record",  "off", FALSE, {.value = &pikrellcam.motion_vectors_record}, config_value_bool_set },
+
 	{ "# Command/script to run when receiving a user defined multicast\n"
 	  "# pkc-message sent by other PiKrellCams or separate scripts on your LAN.\n"
 	  "# Use this to run a script needing PiKrellCam variables passed to it,\n"
@@ -786,10 +853,11 @@ static Config  config[] =
 	  "#",
 	"video_fps",      "24", FALSE, {.value = &pikrellcam.camera_adjust.video_fps},        config_value_int_set },
 
-	{ "# MP4Box output frames per second if video filename is a .mp4\n"
+	{ "# mp4 output frames per second if video filename is a .mp4\n"
 	  "# If this is non zero and different from video_fps, the final mp4 will\n"
 	  "# be a slow or fast motion video.\n"
-	  "# Normally leave this set to zero so it will track video_fps.\n"
+	  "# Normally leave this set to zero so mp4 frame times will be the\n"
+	  "# camera frame times.\n"
 	  "#",
 	"video_mp4box_fps", "0", FALSE, {.value = &pikrellcam.camera_adjust.video_mp4box_fps},        config_value_int_set },
 
@@ -803,7 +871,7 @@ static Config  config[] =
 	  "#",
 	"video_bitrate",  "6000000", TRUE, {.value = &pikrellcam.camera_adjust.video_bitrate},    config_value_int_set },
 
-	{ "# Pixel width of the streamed jpeg file /run/pikrellcam/mjpeg.jpg.\n"
+	{ "# Pixel width of the stream jpeg.\n"
 	  "# Aspect ratio is determined by the video resolution setting.\n"
 	  "# This value will be rounded off to be a multiple of 16.\n"
 	  "# If bandwith is a problem you can reduce mjpeg_quality to 5 without\n"
@@ -825,6 +893,41 @@ static Config  config[] =
 	  "#",
 	"mjpeg_divider",  "4", FALSE, {.value = &pikrellcam.mjpeg_divider},    config_value_int_set },
 
+	{ "# Stream jpegs are kept in memory and served to the web page by PiKrellCam.\n"
+	  "# Set this on only if some program or script of yours keeps reading the\n"
+	  "# stream jpeg file /run/pikrellcam/mjpeg.jpg, which is then written for\n"
+	  "# every stream jpeg.  When off, the file is written with the latest stream\n"
+	  "# jpeg for each command run with $M.\n"
+	  "#",
+	"mjpeg_file_write",  "off", FALSE, {.value = &pikrellcam.mjpeg_file_write},    config_value_bool_set },
+
+	{ "# Port for the RTSP server, 0 to not run it.  An NVR or player can get the\n"
+	  "# live h264 video from rtsp://your_pi_addr:port/ (usually port 8554) over\n"
+	  "# TCP or UDP.  UDP uses server ports 6970-6971.  There is no authentication,\n"
+	  "# so only enable this on a network you trust.\n"
+	  "#",
+	"rtsp_port",  "0", FALSE, {.value = &pikrellcam.rtsp_port},    config_value_int_set },
+
+	{ "# Write a HLS live stream of the h264 video in fragmented mp4 segments to\n"
+	  "# /run/pikrellcam/hls (tmpfs) where the web server can get it as\n"
+	  "#     http://your_pi:port/hls/live.m3u8\n"
+	  "# Segments start on keyframes and are about hls_segment_time seconds long.\n"
+	  "# The playlist has the last hls_segments segments (2 - 30) and older\n"
+	  "# segments are deleted, so tmpfs use is about hls_segments * hls_segment_time\n"
+	  "# seconds of video.  Set hls_part_msec (eg 500) to also write low latency\n"
+	  "# HLS partial segments, or to 0 for plain HLS.\n"
+	  "#",
+	"hls_enable",  "off", FALSE, {.value = &pikrellcam.hls_enable},    config_value_bool_set },
+
+	{ "#",
+	"hls_segment_time",  "2", FALSE, {.value = &pikrellcam.hls_segment_time},    config_value_int_set },
+
+	{ "#",
+	"hls_part_msec",  "0", FALSE, {.value = &pikrellcam.hls_part_msec},    config_value_int_set },
+
+	{ "#",
+	"hls_segments",  "6", FALSE, {.value = &pikrellcam.hls_segments},    config_value_int_set },
+
 
 	{ "\n# ------------------ Still Capture Options -----------------------\n"
 	  "#\n"
@@ -1118,6 +1221,10 @@ config_set_defaults(char *home_dir)
 					pikrellcam.config_dir, PIKRELLCAM_MOTION_REGIONS_CONFIG);
 		asprintf(&pikrellcam.at_commands_config_file, "%s/%s",
 					pikrellcam.config_dir, PIKRELLCAM_AT_COMMANDS_CONFIG);
+		asprintf(&pikrellcam.motion_heatmap_file, "%s/%s",
+					pikrellcam.config_dir, PIKRELLCAM_MOTION_HEATMAP);
+		asprintf(&pikrellcam.motion_profiles_config_file, "%s/%s",
+					pikrellcam.config_dir, PIKRELLCAM_MOTION_PROFILES_CONFIG);
 		asprintf(&pikrellcam.timelapse_status_file, "%s/%s",
 					pikrellcam.config_dir, PIKRELLCAM_TIMELAPSE_STATUS);
 		}
@@ -1170,6 +1277,10 @@ config_load(char *config_file)
 		pikrellcam.motion_magnitude_limit = 3;
 	if (pikrellcam.motion_magnitude_limit_count < 2)
 		pikrellcam.motion_magnitude_limit_count = 2;
+	if (pikrellcam.motion_slow_frames > MOTION_SLOW_FRAMES_MAX)
+		pikrellcam.motion_slow_frames = MOTION_SLOW_FRAMES_MAX;
+	if (pikrellcam.motion_heatmap_hours > HEATMAP_HOURS_MAX)
+		pikrellcam.motion_heatmap_hours = HEATMAP_HOURS_MAX;
 
 	if (pikrellcam.motion_burst_count < 20)
 		pikrellcam.motion_burst_count = 20;
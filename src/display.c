@@ -181,8 +181,7 @@ static void
 i420_dim_frame(uint8_t *i420)
 	{
 	MotionFrame	*mf = &motion_frame;
-	int16_t		*ptrig;			/* ptr to motion frame trigger data */
-	int			x, y, x_mv, y_mv;
+	int			x, y, x_mv, y_mv, x_prev, state = TRIGGER_NONE;
 	uint8_t		*pY,		/* ptr to I420 intensity (Y) data */
 				Ydim, Ytrig, Ys;
 //	uint8_t		*pU, *pV;
@@ -190,10 +189,15 @@ i420_dim_frame(uint8_t *i420)
 	for (y = 0; y < pikrellcam.mjpeg_height; ++y)
 		{
 		y_mv = MJPEG_TO_MOTION_VECTOR_Y(y);
+		x_prev = -1;
 		for (x = 0; x < pikrellcam.mjpeg_width; ++x)
 			{
 			x_mv = MJPEG_TO_MOTION_VECTOR_X(x);
-			ptrig = mf->trigger + x_mv + mf->width * y_mv;
+			if (x_mv != x_prev)
+				{
+				state = motion_trigger_state(mf, x_mv, y_mv);
+				x_prev = x_mv;
+				}
 
 			pY = i420 + x + y * pikrellcam.mjpeg_width;
 
@@ -211,11 +215,13 @@ i420_dim_frame(uint8_t *i420)
 				Ytrig += 20;
 			else if (Ytrig < 245)
 				Ytrig += 10;
-			if (*ptrig > 2)			/* passing vector */
+			if (state == TRIGGER_PASS)
 				*pY = Ytrig;
-			else if (*ptrig == 2)	/* direction reject */
+			else if (state == TRIGGER_REJECT)	/* direction reject */
 				*pY = Ydim + (Ytrig - Ydim) / 4;
-			else if (*ptrig == 1)	/* sparkle */
+			else if (state == TRIGGER_NOISE)
+				*pY = Ydim / 2;
+			else if (state == TRIGGER_SPARKLE)
 				{
 				Ys = (Ytrig - Ydim) / 2;
 				if (Ys <= Ydim)
@@ -229,6 +235,44 @@ i420_dim_frame(uint8_t *i420)
 		}
 	}
 
+  /* Motion heatmap overlay, the frame is dimmed as for vectors and then
+  |  brightened by how busy each macroblock has been.
+  */
+static void
+i420_heatmap_frame(uint8_t *i420)
+	{
+	MotionFrame		*mf = &motion_frame;
+	static uint8_t	*levels;
+	static int		levels_size;
+	int				x, y, x_mv, y_mv, n, level;
+	uint8_t			*pY, Ydim;
+
+	n = mf->heat_width * mf->heat_height;
+	if (n != levels_size)
+		{
+		free(levels);
+		levels = malloc(n);
+		levels_size = n;
+		}
+	if (!motion_heatmap_levels(mf, levels))
+		return;
+
+	for (y = 0; y < pikrellcam.mjpeg_height; ++y)
+		{
+		y_mv = MJPEG_TO_MOTION_VECTOR_Y(y);
+		if (y_mv >= mf->heat_height)
+			break;
+		pY = i420 + y * pikrellcam.mjpeg_width;
+		for (x = 0; x < pikrellcam.mjpeg_width; ++x, ++pY)
+			{
+			x_mv = MJPEG_TO_MOTION_VECTOR_X(x);
+			level = (x_mv < mf->heat_width) ? levels[mf->heat_width * y_mv + x_mv] : 0;
+			Ydim = *pY * pikrellcam.motion_vectors_dimming / 100;
+			*pY = Ydim + (255 - Ydim) * level / 255;
+			}
+		}
+	}
+
 #define SERVO_BAR_WIDTH      7
 #define SERVO_TICK_WIDTH     5
 #define SERVO_CORNER_MARGIN  35
@@ -497,9 +541,11 @@ display_preset_settings(void)
 				JUSTIFY_LEFT, "Setup->Preset->New");
 		}
 
-	snprintf(info1, sizeof(info1), "Mag %d  Cnt %d   Burst %d,%d",
+	snprintf(info1, sizeof(info1), "%s%sMag %d  Cnt %d   Burst %d,%d",
+				mf->profile ? mf->profile->name : "",
+				mf->profile ? ": " : "",
 				(int) sqrt(mf->mag2_limit), mf->mag2_limit_count,
-				pikrellcam.motion_burst_count, pikrellcam.motion_burst_frames);
+				mf->settings.burst_count, mf->settings.burst_frames);
 	i420_print(&bottom_status_area, normal_font, 0xff,
 				pikrellcam.have_servos ? 1 : 2,
 				-6 * normal_font->char_width, 0,
@@ -523,6 +569,25 @@ inform_draw(void)
 		}
 	}
 
+  /* Outline a polygon motion region, shadowed like the rectangle regions.
+  */
+static void
+display_region_polygon(DrawArea *da, MotionRegion *mreg)
+	{
+	int		i, j, x0, y0, x1, y1;
+
+	for (i = 0; i < mreg->n_points; ++i)
+		{
+		j = (i + 1) % mreg->n_points;
+		x0 = MOTION_VECTOR_TO_MJPEG_X(mreg->x + mreg->px[i] * mreg->dx);
+		y0 = MOTION_VECTOR_TO_MJPEG_Y(mreg->y + mreg->py[i] * mreg->dy);
+		x1 = MOTION_VECTOR_TO_MJPEG_X(mreg->x + mreg->px[j] * mreg->dx);
+		y1 = MOTION_VECTOR_TO_MJPEG_Y(mreg->y + mreg->py[j] * mreg->dy);
+		glcd_draw_line(glcd, da, 0, x0 + 1, y0 + 1, x1 + 1, y1 + 1);
+		glcd_draw_line(glcd, da, 0xf0, x0, y0, x1, y1);
+		}
+	}
+
 static void
 motion_draw(uint8_t *i420)
 	{
@@ -531,41 +596,52 @@ motion_draw(uint8_t *i420)
 	DrawArea        *da;
 	MotionFrame     *mf = &motion_frame;
 	MotionRegion    *mreg;
+	MotionRegionSet *set;
+	MotionRegionState *rs;
 	CompositeVector *vec;
-	SList           *mrlist;
-	char            *msg, info[100], status[100];
+	char            *msg, info[200], status[40];
 	int16_t         color;			/* just B&W */
-	int             i, x, y, dx, dy, r, r_unit;
+	int             i, n, slot, x, y, dx, dy, r, r_unit;
 	int             t_record, t_hold;
 
 	if (!glcd)
 		return;
 	da = draw_area;
 
-	if (mf->show_vectors)
+	if (mf->show_heatmap)
+		i420_heatmap_frame(i420);
+	else if (mf->show_vectors)
 		i420_dim_frame(i420);
 
-	if (mf->show_vectors)
+	if (mf->show_vectors || mf->show_heatmap)
 		{
 		i = pikrellcam.have_servos ? 0 : 1;
 		x = pikrellcam.have_servos ? -12 : 0;
 		i420_print(&bottom_status_area, normal_font, 0xff, i, x, 0,
-					JUSTIFY_RIGHT(0), "Vectors: ON");
+					JUSTIFY_RIGHT(0),
+					mf->show_heatmap ? "Heatmap: ON" : "Vectors: ON");
 		}
 
 	if (!inform_shown && (mf->show_preset || pikrellcam.preset_notify))
 		{
-		for (mrlist = mf->motion_region_list; mrlist; mrlist = mrlist->next)
+		set = motion_region_set_acquire(mf, &slot);
+		for (n = 0; set && n < set->n_regions; ++n)
 			{
-			mreg = (MotionRegion *) mrlist->data;
+			mreg = &set->regions[n];
+			rs = &mf->region_state[n];
 
 			x  = MOTION_VECTOR_TO_MJPEG_X(mreg->x);
 			y  = MOTION_VECTOR_TO_MJPEG_Y(mreg->y);
 			dx = MOTION_VECTOR_TO_MJPEG_X(mreg->dx);
 			dy = MOTION_VECTOR_TO_MJPEG_Y(mreg->dy);
 
-			glcd_draw_rectangle(glcd, da, 0, x + 1, y + 1, dx, dy);
-			glcd_draw_rectangle(glcd, da, 0xf0, x, y, dx, dy);
+			if (mreg->n_points > 0)
+				display_region_polygon(da, mreg);
+			else
+				{
+				glcd_draw_rectangle(glcd, da, 0, x + 1, y + 1, dx, dy);
+				glcd_draw_rectangle(glcd, da, 0xf0, x, y, dx, dy);
+				}
 
 			if (mreg->region_number == mf->selected_region)
 				{
@@ -580,22 +656,22 @@ motion_draw(uint8_t *i420)
 			i420_draw_string(draw_area, font, 0xff, x + 2, y + 1, info);
 
 			if (   pikrellcam.on_preset && !pikrellcam.servo_moving
-			    && mreg->vector.mag2_count >= mf->mag2_limit_count
+			    && rs->vector.mag2_count >= mf->mag2_limit_count
 				&& !pikrellcam.preset_notify
 			   )
 				{
-				color = (mreg->motion > 0) ? 0xff : 0xb0;
+				color = (rs->motion > 0) ? 0xff : 0xb0;
 				snprintf(info, sizeof(info), "cnt: %d",
-						mreg->vector.mag2_count);
+						rs->vector.mag2_count);
 				i420_draw_string(draw_area, normal_font, color,
 						x + 2, y + dy - normal_font->char_height - 1, info);
 
 				snprintf(info, sizeof(info), "mag: %d",
-						(int) sqrt(mreg->vector.mag2));
+						(int) sqrt(rs->vector.mag2));
 				i420_draw_string(draw_area, normal_font, color,
 						x + 2, y + dy - 2 * normal_font->char_height - 1, info);
 
-				vec = &mreg->vector;
+				vec = &rs->vector;
 				x  = MOTION_VECTOR_TO_MJPEG_X(vec->x - vec->box_w / 2);
 				y  = MOTION_VECTOR_TO_MJPEG_Y(vec->y - vec->box_h / 2);
 				dx = MOTION_VECTOR_TO_MJPEG_X(vec->box_w);
@@ -608,7 +684,7 @@ motion_draw(uint8_t *i420)
 				dx = -vec->vx * r_unit;
 				dy = -vec->vy * r_unit;
 				glcd_draw_line(glcd, da, color, x, y, x + dx, y + dy);
-				if (mreg->motion > 0)
+				if (rs->motion > 0)
 					glcd_fill_circle(glcd, da, color, x + dx, y + dy, 6);
 				else
 					glcd_draw_circle(glcd, da, color, x + dx, y + dy, 6);
@@ -629,6 +705,7 @@ motion_draw(uint8_t *i420)
 					}
 				}
 			}
+		motion_region_set_release(mf, slot);
 		display_preset_settings();
 
 		if (pikrellcam.on_preset && !pikrellcam.preset_notify)
@@ -642,11 +719,19 @@ motion_draw(uint8_t *i420)
 				{
 				if (mf->motion_status & MOTION_BURST)
 					msg = "burst motion";
+				else if (   (mf->motion_status & MOTION_SLOW)
+				         && !(mf->motion_status & MOTION_DIRECTION)
+				        )
+					msg = "slow motion";
 				else if (mf->motion_status & MOTION_EXTERNAL)
 					msg = "ext motion";
 				else
 					msg = "motion";
 				}
+			else if (mf->tamper == TAMPER_COVERED)
+				msg = "covered";
+			else if (mf->lighting_frames > 0 && mf->settings.lighting_filter)
+				msg = "lighting";
 			else if (mf->frame_vector.mag2_count > 0)
 				msg = "counts";
 			else if (mf->sparkle_count > 0 || mf->reject_count > 0)
@@ -654,17 +739,17 @@ motion_draw(uint8_t *i420)
 			else
 				msg = "quiet";
 			if (mf->frame_vector.mag2_count > 0)
-				snprintf(status, sizeof(status), "%s:%-3d", msg, mf->frame_vector.mag2_count);
+				snprintf(status, sizeof(status), "%.16s:%-3d", msg, mf->frame_vector.mag2_count);
 			else
 				snprintf(status, sizeof(status), "%s", msg);
 
 			if (pikrellcam.motion_show_counts)
 				{
 				snprintf(info, sizeof(info),
-					"any:%-3d(%.1f) rej:%-3d spkl:%-3d(%.1f)  %s",
+					"any:%-3d(%.1f) rej:%-3d spkl:%-3d(%.1f) noise:%-3d  %s",
 					mf->any_count, mf->any_count_expma,
 					mf->reject_count, mf->sparkle_count, mf->sparkle_expma,
-					status);
+					mf->noise_count, status);
 				i420_print(&bottom_status_area, normal_font, 0xff, 0, 0, 0,
 					JUSTIFY_LEFT, info);
 				}
@@ -160,6 +160,7 @@ exec_command(char *command, char *arg, boolean wait, pid_t *pid, boolean do_log)
 				fmt_arg = pikrellcam.media_dir;
 				break;
 			case 'M':
+				mjpeg_file_update();
 				fmt_arg = pikrellcam.mjpeg_filename;
 				break;
 			case 'P':
@@ -396,67 +397,55 @@ event_child_signal(int sig_num)
 
 
   /* Handle various savings of a jpeg associated with a video recording.
-  |  For motion records: save a copy of the mjpeg.jpg for later processing
-  |  with on_motion_preview_save_cmd.  If mode is "best", this copy may be
-  |  written multiple times.  This copy will be disposed of.
+  |  For motion records: save the mjpeg frame picked for the preview by
+  |  video_mjpeg_data() for later processing with on_motion_preview_save_cmd.
+  |  If mode is "best", this copy may be written multiple times.  Without a
+  |  picked frame (manual records) the latest mjpeg frame is saved.
+  |  This copy will be disposed of.
   */
 void
 event_preview_save(void)
 	{
-	FILE	*f_src, *f_dst;
-	char	*s, *base, *path, *thumb, buf[BUFSIZ];
-	int		n;
+	MjpegFrame	*frame;
+	char		*s, *base, *path, *thumb;
+
+	if ((frame = mjpeg_preview_frame_take()) == NULL)
+		frame = mjpeg_frame_latest(0);
 
 	path = strdup(pikrellcam.video_pathname);
-	if (   (s = strstr(path, ".mp4")) != NULL
-	    || (s = strstr(path, ".h264")) != NULL
+	if (   frame
+	    && (   (s = strstr(path, ".mp4")) != NULL
+	        || (s = strstr(path, ".h264")) != NULL
+	       )
 	   )
 		{
 		*s = '\0';
 		asprintf(&thumb, "%s.th.jpg", path);
 		strcpy(s, ".jpg");
 
-		/* Copy the current mjpeg.jpg into a motion preview file.
+		base = fname_base(path);	// motion_xxx.jpg
+		if (pikrellcam.preview_filename)
+			free(pikrellcam.preview_filename);
+		asprintf(&pikrellcam.preview_filename, "%s/%s",
+						pikrellcam.tmpfs_dir, base);
+
+		/* thumb motion_xxx.th.jpg will be created in _thumb script, so
+		|  mirror create the filename here so it can be passed to
+		|  preview_save_cmd script.
 		*/
-		if ((f_src = fopen(pikrellcam.mjpeg_filename, "r")) != NULL)
-			{
-			base = fname_base(path);	// motion_xxx.jpg
-			if (pikrellcam.preview_filename)
-				free(pikrellcam.preview_filename);
-			asprintf(&pikrellcam.preview_filename, "%s/%s",
-							pikrellcam.tmpfs_dir, base);
-
-			/* thumb motion_xxx.th.jpg will be created in _thumb script, so
-			|  mirror create the filename here so it can be passed to
-			|  preview_save_cmd script.
-			*/
-			base = fname_base(thumb);	// motion_xxx.th.jpg
-			if (pikrellcam.preview_thumb_filename)
-				free(pikrellcam.preview_thumb_filename);
-			asprintf(&pikrellcam.preview_thumb_filename, "%s/%s",
-							pikrellcam.thumb_dir, base);
-
-			log_printf("event preview save: copy %s -> %s\n",
-								pikrellcam.mjpeg_filename,
-								pikrellcam.preview_filename);
-			if ((f_dst = fopen(pikrellcam.preview_filename, "w")) != NULL)
-				{
-				while ((n = fread(buf, 1, sizeof(buf), f_src)) > 0)
-					{
-					if (fwrite(buf, 1, n, f_dst) != n)
-						break;
-					}
-				fclose(f_dst);
-				}
-			fclose(f_src);
-			}
+		base = fname_base(thumb);	// motion_xxx.th.jpg
+		if (pikrellcam.preview_thumb_filename)
+			free(pikrellcam.preview_thumb_filename);
+		asprintf(&pikrellcam.preview_thumb_filename, "%s/%s",
+						pikrellcam.thumb_dir, base);
+
+		log_printf("event preview save: mjpeg frame %u -> %s\n",
+							frame->video_seq, pikrellcam.preview_filename);
+		mjpeg_frame_save(frame, pikrellcam.preview_filename);
 		free(thumb);
 		}
 	free(path);
-
-	/* Let mmalcam.c mjpeg_callback() continue renaming the mjpeg file.
-	*/
-	pikrellcam.mjpeg_rename_holdoff = FALSE;
+	mjpeg_frame_unref(frame);
 	}
 
   /* Generate a motion area thumb.
@@ -551,6 +540,8 @@ state_file_write(void)
 	fprintf(f, "motion_enable %s\n", mf->motion_enable ? "on" : "off");
 	fprintf(f, "show_preset %s\n",   mf->show_preset ? "on" : "off");
 	fprintf(f, "show_vectors %s\n",  mf->show_vectors ? "on" : "off");
+	fprintf(f, "show_heatmap %s\n",  mf->show_heatmap ? "on" : "off");
+	fprintf(f, "motion_profile %s\n",  mf->profile ? mf->profile->name : "none");
 
 	servo_get_position(&pan, &tilt);
 	pos = preset_find_at_position(pan, tilt);
@@ -811,6 +802,43 @@ sun_times_init(void)
 	}
 
 
+  /* Minute of the day of an at_time that is a sun time with an optional
+  |  +/- minute offset (eg "dusk+30") or a hh:mm time.  Returns FALSE for
+  |  a bad at_time.
+  */
+boolean
+at_time_minute(char *at_time, int *minute)
+	{
+	char	*p;
+	int		minute_offset = 0;
+
+	if ((p = strchr(at_time, '+')) != NULL)
+		minute_offset = atoi(p + 1);
+	else if ((p = strchr(at_time, '-')) != NULL)
+		minute_offset = -atoi(p + 1);
+
+	if (!strncmp(at_time, "dawn", 4))
+		*minute = sun.dawn + minute_offset;
+	else if (!strncmp(at_time, "dusk", 4))
+		*minute = sun.dusk + minute_offset;
+	else if (!strncmp(at_time, "sunrise", 7))
+		*minute = sun.sunrise + minute_offset;
+	else if (!strncmp(at_time, "sunset", 6))
+		*minute = sun.sunset + minute_offset;
+	else if (!strncmp(at_time, "nautical_dawn", 13))
+		*minute = sun.nautical_dawn + minute_offset;
+	else if (!strncmp(at_time, "nautical_dusk", 13))
+		*minute = sun.nautical_dusk + minute_offset;
+	else
+		{
+		*minute = (int) strtol(at_time, &p, 10) * 60;
+		if (*p != ':')
+			return FALSE;
+		*minute += strtol(p + 1, NULL, 10);
+		}
+	return TRUE;
+	}
+
 static char *weekdays = "SunMonTueWedThuFriSatSun";
 
 void
@@ -901,7 +929,7 @@ event_process(void)
 	if (minute_tick)
 		{
 		char		*p, buf[IBUF_LEN];
-		int			i, n, minute_now, minute_at, minute_offset = 0;
+		int			i, n, minute_now, minute_at;
 		static int	start = TRUE;
 		static int	at_notify_fd, at_notify_wd;
 		struct inotify_event *event;
@@ -961,16 +989,12 @@ event_process(void)
 			log_lines();
 			state_file_write();
 			}
+		motion_profile_check(minute_now);
 
 		for (list = at_command_list; list; list = list->next)
 			{
 			at = (AtCommand *) list->data;
 
-			if ((p = strchr(at->at_time, '+')) != NULL)
-				minute_offset = atoi(p + 1);
-			else if ((p = strchr(at->at_time, '-')) != NULL)
-				minute_offset = -atoi(p + 1);
-
 			if (!strcmp(at->at_time, "start"))
 				minute_at = start ? minute_now : -1;
 			else if (!strcmp(at->at_time, "minute"))
@@ -985,29 +1009,11 @@ event_process(void)
 				minute_at = thirty_minute_tick ? minute_now : -1;
 			else if (!strcmp(at->at_time, "hour"))
 				minute_at = hour_tick ? minute_now : -1;
-			else if (!strncmp(at->at_time, "dawn", 4))
-				minute_at = sun.dawn + minute_offset;
-			else if (!strncmp(at->at_time, "dusk", 4))
-				minute_at = sun.dusk + minute_offset;
-			else if (!strncmp(at->at_time, "sunrise", 7))
-				minute_at = sun.sunrise + minute_offset;
-			else if (!strncmp(at->at_time, "sunset", 6))
-				minute_at = sun.sunset + minute_offset;
-			else if (!strncmp(at->at_time, "nautical_dawn", 13))
-				minute_at = sun.nautical_dawn + minute_offset;
-			else if (!strncmp(at->at_time, "nautical_dusk", 13))
-				minute_at = sun.nautical_dusk + minute_offset;
-			else
+			else if (!at_time_minute(at->at_time, &minute_at))
 				{
-				minute_at = (int) strtol(at->at_time, &p, 10) * 60;
-				if (*p == ':')
-					minute_at += strtol(p + 1, NULL, 10);
-				else
-					{
-					minute_at = -1;	/* error in at_time string */
-					log_printf("Error in at_command: [%s] bad at_time: [%s]\n",
-							at->command, at->at_time);
-					}
+				minute_at = -1;	/* error in at_time string */
+				log_printf("Error in at_command: [%s] bad at_time: [%s]\n",
+						at->command, at->at_time);
 				}
 			if (minute_now != minute_at)
 				continue;
@@ -0,0 +1,533 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+#include "pikrellcam.h"
+#include <sys/stat.h>
+#include <dirent.h>
+
+  /* HLS live stream segmenter.  A thread follows the video circular buffer
+  |  with its own frame cursor like the stream servers (video_stream.c) and
+  |  cuts the h264 frames into fragmented mp4 segments in tmpfs_dir/hls:
+  |
+  |      init-<generation>.mp4   the init segment (SPS/PPS)
+  |      seg<number>.m4s         keyframe aligned segments
+  |      live.m3u8               rolling playlist of hls_segments segments
+  |
+  |  With hls_part_msec set, a segment is written as LL-HLS partial segments
+  |  which are each a fragment appended to the segment file as it grows, and
+  |  the playlist lists the parts of recent segments as byte ranges.  Only
+  |  the playlist segments, the one being written and the last one dropped
+  |  are kept, so tmpfs use is bounded by the segment settings.  One
+  |  fragment is held in memory, a part or else the whole segment, but it
+  |  is written out early if it grows past HLS_FRAGMENT_MAX.
+  |  Frames are copied out of the circular buffer holding the stream lock,
+  |  which is dropped for the segment file writes.
+  |  When a segment is due, a keyframe is requested from the h264 callback
+  |  so segments stay close to hls_segment_time even while recording.
+  */
+
+#define	HLS_DIR				"hls"
+#define	HLS_PLAYLIST		"live.m3u8"
+#define	HLS_MAX_SEGMENTS	32
+#define	HLS_MAX_PARTS		64		/* per segment */
+#define	HLS_FRAGMENT_MAX	(1024 * 1024)
+
+typedef struct
+	{
+	int			duration,			/* usec */
+				offset,
+				length;
+	boolean		independent;
+	}
+	HlsPart;
+
+typedef struct
+	{
+	unsigned int number;
+	int			duration,			/* usec */
+				size;
+	boolean		complete,
+				discontinuity;
+	HlsPart		part[HLS_MAX_PARTS];
+	int			n_parts;
+	}
+	HlsSegment;
+
+static struct
+	{
+	pthread_t		thread;
+	sem_t			sem;
+	boolean			running,
+					keyframe_wanted;
+	char			*dir;
+
+	VideoStreamCursor	cursor;
+	unsigned int	generation;		/* of the init segment */
+	boolean			discontinuity,
+					have_init;
+	uint8_t			*frame,
+					header[H264_MAX_HEADER_SIZE];	/* for the init segment */
+	int				frame_alloc,
+					header_length;
+	uint64_t		frame_pts;
+
+	Mp4Frag			frag;
+	uint32_t		frag_sequence;
+	uint64_t		segment_pts,
+					part_pts,
+					keyframe_request_pts;
+	boolean			part_independent;
+	FILE			*file;
+
+	HlsSegment		segment[HLS_MAX_SEGMENTS];
+	int				n_segments;
+	unsigned int	next_number,
+					discontinuity_sequence;
+	int				max_duration;
+	boolean			have_dropped;
+	unsigned int	dropped_number;
+	}
+	hls;
+
+
+static void
+hls_unlink(char *fmt, unsigned int n)
+	{
+	char	*name, *path;
+
+	asprintf(&name, fmt, n);
+	asprintf(&path, "%s/%s", hls.dir, name);
+	unlink(path);
+	free(name);
+	free(path);
+	}
+
+static void
+hls_playlist_write(void)
+	{
+	HlsSegment	*seg;
+	HlsPart		*part;
+	FILE		*f;
+	char		*path, *path_part;
+	boolean		ll = (pikrellcam.hls_part_msec > 0);
+	int			i, j, target, t_end, t_parts;
+
+	if (hls.n_segments == 0)
+		return;
+	target = MAX(pikrellcam.hls_segment_time, (hls.max_duration + 999999) / 1000000);
+
+	asprintf(&path, "%s/%s", hls.dir, HLS_PLAYLIST);
+	asprintf(&path_part, "%s.part", path);
+	if ((f = fopen(path_part, "w")) == NULL)
+		{
+		log_printf("HLS: could not write %s.  %m\n", path_part);
+		free(path);
+		free(path_part);
+		return;
+		}
+	fprintf(f, "#EXTM3U\n#EXT-X-VERSION:%d\n#EXT-X-TARGETDURATION:%d\n",
+				ll ? 9 : 7, target);
+	if (ll)
+		fprintf(f, "#EXT-X-PART-INF:PART-TARGET=%.3f\n"
+				"#EXT-X-SERVER-CONTROL:PART-HOLD-BACK=%.3f\n",
+				pikrellcam.hls_part_msec / 1000.0,
+				3 * pikrellcam.hls_part_msec / 1000.0);
+	fprintf(f, "#EXT-X-MEDIA-SEQUENCE:%u\n#EXT-X-DISCONTINUITY-SEQUENCE:%u\n"
+				"#EXT-X-MAP:URI=\"init-%u.mp4\"\n",
+				hls.segment[0].number, hls.discontinuity_sequence,
+				hls.generation);
+
+	/* Parts are listed for the segments within three target durations
+	|  of the end of the playlist.
+	*/
+	t_end = 0;
+	for (i = 0; i < hls.n_segments; ++i)
+		t_end += hls.segment[i].duration;
+	t_parts = t_end - 3 * target * 1000000;
+
+	for (i = 0; i < hls.n_segments; ++i)
+		{
+		seg = &hls.segment[i];
+		if (seg->discontinuity)
+			fprintf(f, "#EXT-X-DISCONTINUITY\n");
+		if (ll && t_parts < seg->duration && seg->n_parts < HLS_MAX_PARTS)
+			for (j = 0; j < seg->n_parts; ++j)
+				{
+				part = &seg->part[j];
+				fprintf(f, "#EXT-X-PART:DURATION=%.5f,URI=\"seg%u.m4s\","
+						"BYTERANGE=\"%d@%d\"%s\n",
+						part->duration / 1000000.0, seg->number,
+						part->length, part->offset,
+						part->independent ? ",INDEPENDENT=YES" : "");
+				}
+		t_parts -= seg->duration;
+		if (seg->complete)
+			fprintf(f, "#EXTINF:%.5f,\nseg%u.m4s\n",
+						seg->duration / 1000000.0, seg->number);
+		}
+	fclose(f);
+	rename(path_part, path);
+	free(path);
+	free(path_part);
+	}
+
+  /* Drop the oldest segment from the playlist.  Its file is kept until the
+  |  next drop for players still loading it.
+  */
+static void
+hls_segment_drop(void)
+	{
+	if (hls.have_dropped)
+		hls_unlink("seg%u.m4s", hls.dropped_number);
+	hls.dropped_number = hls.segment[0].number;
+	hls.have_dropped = TRUE;
+	if (hls.segment[0].discontinuity)
+		hls.discontinuity_sequence += 1;
+	hls.n_segments -= 1;
+	memmove(&hls.segment[0], &hls.segment[1], hls.n_segments * sizeof(HlsSegment));
+	}
+
+  /* Write out the fragment being built as the next part of the segment.
+  */
+static void
+hls_fragment_flush(uint64_t next_pts)
+	{
+	HlsSegment	*seg = &hls.segment[hls.n_segments - 1];
+	HlsPart		*part;
+	int			n, duration;
+
+	if (!hls.file)
+		return;
+	if (next_pts == 0)
+		next_pts = hls.frame_pts + 1000000 / MAX(pikrellcam.camera_adjust.video_fps, 1);
+	n = mp4_frag_write(&hls.frag, hls.file, ++hls.frag_sequence, next_pts);
+	if (n <= 0 || fflush(hls.file) != 0)
+		{
+		if (n < 0)
+			log_printf("HLS: segment write failed.  %m\n");
+		return;
+		}
+	duration = (int) (next_pts - hls.part_pts);
+	if (seg->n_parts < HLS_MAX_PARTS)
+		{
+		part = &seg->part[seg->n_parts];
+		part->duration = duration;
+		part->offset = seg->size;
+		part->length = n;
+		part->independent = hls.part_independent;
+		}
+	seg->n_parts += 1;		/* past HLS_MAX_PARTS, parts are not listed */
+	seg->size += n;
+	seg->duration = (int) (next_pts - hls.segment_pts);
+	if (pikrellcam.hls_part_msec > 0)
+		hls_playlist_write();
+	}
+
+static void
+hls_segment_end(uint64_t next_pts)
+	{
+	HlsSegment	*seg;
+
+	if (!hls.file)
+		return;
+	hls_fragment_flush(next_pts);
+	fclose(hls.file);
+	hls.file = NULL;
+
+	seg = &hls.segment[hls.n_segments - 1];
+	seg->complete = TRUE;
+	hls.max_duration = MAX(hls.max_duration, seg->duration);
+	while (hls.n_segments > pikrellcam.hls_segments)
+		hls_segment_drop();
+	hls_playlist_write();
+	}
+
+static boolean
+hls_init_write(void)
+	{
+	FILE	*f;
+	char	*path;
+	boolean	ok = FALSE;
+
+	asprintf(&path, "%s/init-%u.mp4", hls.dir, hls.generation);
+	if ((f = fopen(path, "w")) != NULL)
+		{
+		ok = mp4_frag_init_write(f, (int8_t *) hls.header, hls.header_length,
+					pikrellcam.camera_config.video_width,
+					pikrellcam.camera_config.video_height);
+		ok = (fclose(f) == 0 && ok);
+		}
+	if (!ok)
+		log_printf("HLS: could not write %s.  %m\n", path);
+	free(path);
+	return ok;
+	}
+
+static boolean
+hls_segment_start(void)
+	{
+	HlsSegment	*seg;
+	char		*path;
+
+	if (!hls.have_init && !(hls.have_init = hls_init_write()))
+		return FALSE;
+	if (hls.n_segments == HLS_MAX_SEGMENTS)
+		hls_segment_drop();
+	seg = &hls.segment[hls.n_segments];
+	memset(seg, 0, sizeof(HlsSegment));
+	seg->number = hls.next_number;
+	seg->discontinuity = hls.discontinuity;
+
+	asprintf(&path, "%s/seg%u.m4s", hls.dir, seg->number);
+	hls.file = fopen(path, "w");
+	if (!hls.file)
+		log_printf("HLS: could not create %s.  %m\n", path);
+	free(path);
+	if (!hls.file)
+		return FALSE;
+	hls.next_number += 1;
+	hls.n_segments += 1;
+	hls.discontinuity = FALSE;
+	hls.segment_pts = hls.frame_pts;
+	hls.keyframe_request_pts = 0;
+	return TRUE;
+	}
+
+static void
+hls_frame(VideoFrame *frame)
+	{
+	int64_t	dt_frame, segment_time, part_time;
+
+	dt_frame = 1000000 / MAX(pikrellcam.camera_adjust.video_fps, 1);
+	segment_time = (int64_t) pikrellcam.hls_segment_time * 1000000;
+	part_time = (int64_t) pikrellcam.hls_part_msec * 1000;
+
+	if (!hls.file)
+		{
+		if (!frame->keyframe || !hls_segment_start())
+			return;
+		}
+	else if (   frame->keyframe
+	         && hls.frame_pts - hls.segment_pts + dt_frame / 2 >= segment_time
+	        )
+		{
+		hls_segment_end(hls.frame_pts);
+		if (!hls_segment_start())
+			return;
+		}
+	else if (   part_time > 0 && hls.frag.n_samples > 0
+	         && hls.frame_pts + dt_frame - hls.part_pts > part_time
+	        )
+		hls_fragment_flush(hls.frame_pts);	/* part can't go over its target */
+	else if (hls.frag.length + frame->length > HLS_FRAGMENT_MAX)
+		hls_fragment_flush(hls.frame_pts);
+
+	/* Keyframes can come a frame after the request, so ask a little early
+	|  and again each second if one does not come.
+	*/
+	if (   hls.frame_pts - hls.segment_pts + 2 * dt_frame >= segment_time
+	    && hls.frame_pts >= hls.keyframe_request_pts + 1000000
+	   )
+		{
+		__atomic_store_n(&hls.keyframe_wanted, TRUE, __ATOMIC_RELEASE);
+		hls.keyframe_request_pts = hls.frame_pts;
+		}
+
+	if (hls.frag.n_samples == 0)
+		{
+		hls.part_pts = hls.frame_pts;
+		hls.part_independent = frame->keyframe;
+		}
+	mp4_frag_sample(&hls.frag, hls.frame, frame->length, frame->keyframe,
+				hls.frame_pts);
+	}
+
+  /* Start over after the circular buffer was reallocated, which may be
+  |  for a new video size.  Old segments can't go with the new init segment
+  |  so they are all dropped.
+  */
+static void
+hls_restart(unsigned int generation)
+	{
+	if (hls.file)
+		{
+		fclose(hls.file);
+		hls.file = NULL;
+		hls_unlink("seg%u.m4s", hls.segment[hls.n_segments - 1].number);
+		hls.n_segments -= 1;
+		}
+	while (hls.n_segments > 0)
+		hls_segment_drop();
+	if (hls.have_dropped)
+		hls_unlink("seg%u.m4s", hls.dropped_number);
+	hls.have_dropped = FALSE;
+	if (hls.have_init)
+		hls_unlink("init-%u.mp4", hls.generation);
+	hls.have_init = FALSE;
+
+	hls.generation = generation;
+	hls.discontinuity = TRUE;
+	hls.max_duration = 0;
+	mp4_frag_free(&hls.frag);
+	mp4_frag_start(&hls.frag, pikrellcam.camera_adjust.video_fps);
+	}
+
+static void
+hls_frames(void)
+	{
+	VideoCircularBuffer	*vcb = &video_circular_buffer;
+	VideoFrame			frame;
+	struct iovec		iov[2];
+	int					i, n, result;
+	uint64_t			dt_frame;
+	boolean				new_generation;
+
+	dt_frame = 1000000 / MAX(pikrellcam.camera_adjust.video_fps, 1);
+	while (1)
+		{
+		pthread_rwlock_rdlock(&vcb->stream_lock);
+		new_generation = video_stream_new_generation(&hls.cursor);
+		result = video_stream_next(&hls.cursor, &frame);
+		if (result != VIDEO_STREAM_WAIT)
+			{
+			if (result == VIDEO_STREAM_RESTART)
+				hls.header_length = video_stream_header(hls.header);
+			if (frame.length > hls.frame_alloc)
+				{
+				hls.frame_alloc = frame.length * 2;
+				hls.frame = realloc(hls.frame, hls.frame_alloc);
+				}
+			n = video_stream_iov(&frame, 0, iov);
+			for (i = 0; i < n; ++i)
+				memcpy(hls.frame + (i ? iov[0].iov_len : 0),
+						iov[i].iov_base, iov[i].iov_len);
+			if (!video_stream_valid(&frame, 0))
+				{
+				video_stream_skip(&hls.cursor);
+				result = VIDEO_STREAM_LOST;
+				}
+			}
+		pthread_rwlock_unlock(&vcb->stream_lock);
+
+		if (new_generation)
+			hls_restart(hls.cursor.generation);
+		if (result == VIDEO_STREAM_WAIT)
+			return;
+		if (result == VIDEO_STREAM_LOST)
+			continue;
+		if (result == VIDEO_STREAM_RESTART && hls.n_segments > 0)
+			{
+			/* Fell behind, end the segment at what we have */
+			hls_segment_end(0);
+			hls.discontinuity = TRUE;
+			}
+		if (frame.pts > hls.frame_pts)
+			hls.frame_pts = frame.pts;
+		else
+			hls.frame_pts += dt_frame;
+		hls_frame(&frame);
+		hls.cursor.seq += 1;
+		}
+	}
+
+static void *
+hls_thread(void *ptr)
+	{
+	while (1)
+		{
+		while (sem_wait(&hls.sem) < 0)
+			;
+		while (sem_trywait(&hls.sem) == 0)
+			;
+		hls_frames();
+		}
+	return NULL;
+	}
+
+  /* Called from video_stream_notify() at each frame end.
+  */
+void
+hls_notify(void)
+	{
+	if (hls.running)
+		sem_post(&hls.sem);
+	}
+
+  /* Called from the h264 callback, TRUE once when the segmenter wants a
+  |  keyframe to end a segment on.
+  */
+boolean
+hls_keyframe_wanted(void)
+	{
+	if (!hls.running)
+		return FALSE;
+	return __atomic_exchange_n(&hls.keyframe_wanted, FALSE, __ATOMIC_ACQ_REL);
+	}
+
+void
+hls_init(void)
+	{
+	DIR				*dir;
+	struct dirent	*d;
+	char			*path;
+
+	if (!pikrellcam.hls_enable)
+		return;
+	pikrellcam.hls_segments = MIN(MAX(pikrellcam.hls_segments, 2),
+					HLS_MAX_SEGMENTS - 2);
+	pikrellcam.hls_segment_time = MAX(pikrellcam.hls_segment_time, 1);
+	if (pikrellcam.hls_part_msec > 0)
+		pikrellcam.hls_part_msec = MIN(MAX(pikrellcam.hls_part_msec, 100),
+					pikrellcam.hls_segment_time * 1000);
+
+	asprintf(&hls.dir, "%s/%s", pikrellcam.tmpfs_dir, HLS_DIR);
+	if (mkdir(hls.dir, 0775) < 0 && errno != EEXIST)
+		{
+		log_printf("HLS: could not make %s.  %m\n", hls.dir);
+		return;
+		}
+
+	/* Segments from a previous run are stale.
+	*/
+	if ((dir = opendir(hls.dir)) != NULL)
+		{
+		while ((d = readdir(dir)) != NULL)
+			{
+			if (d->d_name[0] == '.')
+				continue;
+			asprintf(&path, "%s/%s", hls.dir, d->d_name);
+			unlink(path);
+			free(path);
+			}
+		closedir(dir);
+		}
+
+	video_stream_cursor_init(&hls.cursor, FALSE);
+	hls.generation = hls.cursor.generation;
+	mp4_frag_start(&hls.frag, pikrellcam.camera_adjust.video_fps);
+	sem_init(&hls.sem, 0, 0);
+	if (pthread_create(&hls.thread, NULL, hls_thread, NULL) != 0)
+		{
+		log_printf("HLS: thread create failed.  %m\n");
+		return;
+		}
+	hls.running = TRUE;
+	log_printf("HLS: writing %s/%s\n", hls.dir, HLS_PLAYLIST);
+	}
@@ -0,0 +1,217 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+#include "pikrellcam.h"
+
+  /* Encoded mjpeg frames are filled by video_mjpeg_data() and published
+  |  into a ring of the last MJPEG_RING_FRAMES frames.  A frame is
+  |  referenced by its ring slot, by each stream client sending it and by
+  |  a pending preview save, and goes back on the free list for reuse when
+  |  the last reference is dropped.  So after startup there is no per frame
+  |  allocation and no file writing unless mjpeg_file_write is set for
+  |  something still reading the mjpeg.jpg file, or a command with $M
+  |  has it written by mjpeg_file_update().
+  */
+#define	MJPEG_ALLOC_SIZE	(64 * 1024)
+#define	MJPEG_MAX_SIZE		(1920 * 1080 * 3 / 2)	/* worst case compression */
+
+static MjpegFrame		*ring[MJPEG_RING_FRAMES];
+static unsigned int		ring_seq;		/* of the newest frame, 0 for none */
+static MjpegFrame		*free_frames;
+static MjpegFrame		*preview_frame;
+static pthread_mutex_t	ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+  /* Call with the ring_mutex locked.
+  */
+static void
+frame_unref(MjpegFrame *frame)
+	{
+	if (frame && --frame->refs == 0)
+		{
+		frame->next = free_frames;
+		free_frames = frame;
+		}
+	}
+
+void
+mjpeg_frame_unref(MjpegFrame *frame)
+	{
+	pthread_mutex_lock(&ring_mutex);
+	frame_unref(frame);
+	pthread_mutex_unlock(&ring_mutex);
+	}
+
+  /* A frame for the encoder to write into.  It is not in the ring until
+  |  published and is dropped with mjpeg_frame_unref().
+  */
+MjpegFrame *
+mjpeg_frame_new(void)
+	{
+	MjpegFrame	*frame;
+
+	pthread_mutex_lock(&ring_mutex);
+	if ((frame = free_frames) != NULL)
+		free_frames = frame->next;
+	pthread_mutex_unlock(&ring_mutex);
+
+	if (!frame && (frame = calloc(1, sizeof(MjpegFrame))) == NULL)
+		return NULL;
+	frame->refs = 1;
+	frame->seq = 0;
+	frame->length = 0;
+	return frame;
+	}
+
+boolean
+mjpeg_frame_append(MjpegFrame *frame, uint8_t *data, int length)
+	{
+	uint8_t	*p;
+	int		size;
+
+	if (frame->length + length > frame->size)
+		{
+		if (frame->length + length > MJPEG_MAX_SIZE)
+			return FALSE;
+		for (size = MAX(frame->size, MJPEG_ALLOC_SIZE);
+					size < frame->length + length; )
+			size *= 2;
+		if ((p = realloc(frame->data, size)) == NULL)
+			{
+			log_printf("mjpeg frame alloc of %d failed. %m\n", size);
+			return FALSE;
+			}
+		frame->data = p;
+		frame->size = size;
+		}
+	memcpy(frame->data + frame->length, data, length);
+	frame->length += length;
+	return TRUE;
+	}
+
+  /* The frame reference from mjpeg_frame_new() becomes the ring slot's.
+  */
+void
+mjpeg_frame_publish(MjpegFrame *frame)
+	{
+	MjpegFrame	**slot;
+
+	pthread_mutex_lock(&ring_mutex);
+	if (++ring_seq == 0)		/* 0 is no frame */
+		++ring_seq;
+	frame->seq = ring_seq;
+	slot = &ring[ring_seq % MJPEG_RING_FRAMES];
+	frame_unref(*slot);
+	*slot = frame;
+	pthread_mutex_unlock(&ring_mutex);
+
+	mjpeg_server_notify();
+	}
+
+  /* Reference the newest frame if it is not the frame with seq.
+  */
+MjpegFrame *
+mjpeg_frame_latest(unsigned int seq)
+	{
+	MjpegFrame	*frame = NULL;
+
+	pthread_mutex_lock(&ring_mutex);
+	if (ring_seq != 0 && ring_seq != seq)
+		{
+		frame = ring[ring_seq % MJPEG_RING_FRAMES];
+		++frame->refs;
+		}
+	pthread_mutex_unlock(&ring_mutex);
+	return frame;
+	}
+
+  /* Write to a .part file and rename so readers never see a partial jpeg.
+  */
+boolean
+mjpeg_frame_save(MjpegFrame *frame, char *path)
+	{
+	FILE	*f;
+	char	*part;
+	boolean	ok = FALSE;
+
+	asprintf(&part, "%s.part", path);
+	if ((f = fopen(part, "w")) != NULL)
+		{
+		ok = (fwrite(frame->data, frame->length, 1, f) == 1);
+		if (fclose(f) != 0)
+			ok = FALSE;
+		if (ok)
+			rename(part, path);
+		else
+			unlink(part);
+		}
+	if (!ok)
+		log_printf("mjpeg frame save %s failed. %m\n", path);
+	free(part);
+	return ok;
+	}
+
+  /* The preview save frame is picked in video_mjpeg_data() by its motion
+  |  frame tag and held here for event_preview_save().  A newer preview
+  |  replaces one not saved yet.
+  */
+void
+mjpeg_preview_frame_set(MjpegFrame *frame)
+	{
+	pthread_mutex_lock(&ring_mutex);
+	++frame->refs;
+	frame_unref(preview_frame);
+	preview_frame = frame;
+	pthread_mutex_unlock(&ring_mutex);
+	}
+
+MjpegFrame *
+mjpeg_preview_frame_take(void)
+	{
+	MjpegFrame	*frame;
+
+	pthread_mutex_lock(&ring_mutex);
+	frame = preview_frame;
+	preview_frame = NULL;
+	pthread_mutex_unlock(&ring_mutex);
+	return frame;
+	}
+
+  /* With mjpeg_file_write off, the mjpeg.jpg file is only written when a
+  |  command has a $M for it to read, from the newest frame in the ring.
+  |  Frames already in the file are not written again.
+  */
+void
+mjpeg_file_update(void)
+	{
+	static pthread_mutex_t	file_mutex = PTHREAD_MUTEX_INITIALIZER;
+	static unsigned int		file_seq;
+	MjpegFrame				*frame;
+
+	if (pikrellcam.mjpeg_file_write || !pikrellcam.mjpeg_filename)
+		return;
+	pthread_mutex_lock(&file_mutex);
+	if ((frame = mjpeg_frame_latest(file_seq)) != NULL)
+		{
+		if (mjpeg_frame_save(frame, pikrellcam.mjpeg_filename))
+			file_seq = frame->seq;
+		mjpeg_frame_unref(frame);
+		}
+	pthread_mutex_unlock(&file_mutex);
+	}
@@ -28,18 +28,6 @@ CameraObject	video_h264_encoder;
 CameraObject	stream_splitter;		/* Currently not used in PiKrellCam */
 CameraObject	stream_resizer;
 
-VideoCircularBuffer video_circular_buffer;
-
-extern char*	mjpeg_server_queue_get(void);
-extern void	mjpeg_server_queue_put(char *data, int len);
-
-static boolean      motion_frame_event;
-static int          mjpeg_do_preview_save;
-
-static pthread_mutex_t mjpeg_encoder_count_lock;
-static unsigned int	   mjpeg_encoder_send_count,
-                       mjpeg_encoder_recv_count;
-
   /* TODO: handle annotateV3
   */
 static void
@@ -160,162 +148,46 @@ return_buffer_to_port(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 		}
 	}
 
-  /* If video_fps is too high and strains GPU, resized frames to this
-  |  callback may be dropped.  Set debug_fps to 1 to check things... or
-  |  just watch the web mjpeg stream and see it slow down.
+  /* The port callbacks hand buffer data to the video.c frame handlers
+  |  and then return the buffer to the port.
   */
-void
-mjpeg_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+static int
+video_flags(MMAL_BUFFER_HEADER_T *buffer)
 	{
-	CameraObject           *data = (CameraObject *) port->userdata;
-	static struct timeval  timer;
-	int                    n, utime;
-	static FILE            *file	= NULL;
-	static char            *fname_part;
-	boolean                do_preview_save = FALSE;
-	static char	           *tcp_buf;
-	static int	           tcp_buf_offset;
-
-
-	if (!fname_part)
-		asprintf(&fname_part, "%s.part", pikrellcam.mjpeg_filename);
-
-	if (!tcp_buf)
-		tcp_buf = mjpeg_server_queue_get();
-
-	if (file && buffer->length > 0)
-		{
-		mmal_buffer_header_mem_lock(buffer);
-		n = fwrite(buffer->data, 1, buffer->length, file);
-		if (tcp_buf)
-			{
-			memcpy(tcp_buf + tcp_buf_offset, buffer->data, buffer->length);
-			tcp_buf_offset += buffer->length;
-			}
-		mmal_buffer_header_mem_unlock(buffer);
-		if (n != buffer->length)
-			{
-			log_printf("mjpeg_callback: %s file write error.  %m\n", data->name);
-			exit(1);
-			}
-		}
+	int		flags = 0;
+
+	if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)
+		flags |= VIDEO_FLAG_CONFIG;
+	if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)
+		flags |= VIDEO_FLAG_SIDEINFO;
+	if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)
+		flags |= VIDEO_FLAG_KEYFRAME;
 	if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
-		{
-		if (tcp_buf)
-			{
-			mjpeg_server_queue_put(tcp_buf, tcp_buf_offset);
-			tcp_buf = NULL;
-			tcp_buf_offset = 0;
-			}
-
-		if (pikrellcam.debug_fps && (utime = micro_elapsed_time(&timer)) > 0)
-			printf("%s fps %d\n", data->name, 1000000 / utime);
-		if (file)
-			{
-			fclose(file);
-			file = NULL;
+		flags |= VIDEO_FLAG_FRAME_END;
+	return flags;
+	}
 
-			pthread_mutex_lock(&mjpeg_encoder_count_lock);
-			++mjpeg_encoder_recv_count;
-			if (mjpeg_do_preview_save == 1)
-				{
-				mjpeg_do_preview_save = 0;
-				do_preview_save = TRUE;
-				}
-			else if (mjpeg_do_preview_save > 1)
-				--mjpeg_do_preview_save;
-			pthread_mutex_unlock(&mjpeg_encoder_count_lock);
-
-			/* When adding an event_preview_save, set a rename holdoff that
-			|  will be reset when the preview_save is done.  Don't do
-			|  any renames until the holdoff reset to ensure the correct
-			|  mjpeg image is saved into the preview.  Otherwise there is
-			|  a race condition.  Could just directly run the preview save
-			|  function here, but we are inside a GPU callback and I don't
-			|  want to overload the time spent here.
-			*/
-			if (!pikrellcam.mjpeg_rename_holdoff)
-				rename(fname_part, pikrellcam.mjpeg_filename);
-			else if (pikrellcam.debug)
-				printf("%s: holdoff not clear -> rename skipped\n",
-						fname_base(pikrellcam.video_pathname));
-			if (do_preview_save)
-				{
-				pikrellcam.mjpeg_rename_holdoff = TRUE;
-				event_add("motion preview save", pikrellcam.t_now, 0,
-						event_preview_save, NULL);
-				if (motion_frame.do_preview_save_cmd)
-					{
-					event_add("motion area thumb", pikrellcam.t_now, 0,
-							event_motion_area_thumb, NULL);
-					event_add("preview save command", pikrellcam.t_now, 0,
-							event_preview_save_cmd,
-							pikrellcam.on_motion_preview_save_cmd);
-					}
-				}
-			motion_frame.do_preview_save_cmd = FALSE;
-			}
-		file = fopen(fname_part, "w");
-		if (!file)
-			log_printf("mjpeg_callback: could not open %s file. %m", fname_part);
-		}
+void
+mjpeg_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+	{
+	mmal_buffer_header_mem_lock(buffer);
+	video_mjpeg_data(buffer->data, buffer->length, video_flags(buffer));
+	mmal_buffer_header_mem_unlock(buffer);
 	return_buffer_to_port(port, buffer);
 	}
 
-
 void
 still_jpeg_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 	{
-	CameraObject			*data = (CameraObject *) port->userdata;
-	int						n;
-	static int		bytes_written;
-
-	if (buffer->length && still_jpeg_encoder.file)
-		{
-		mmal_buffer_header_mem_lock(buffer);
-		n = fwrite(buffer->data, 1, buffer->length, still_jpeg_encoder.file);
-		bytes_written += n;
-		mmal_buffer_header_mem_unlock(buffer);
-		if (n != buffer->length)
-			{
-			log_printf("still_jpeg_callback: %s file write error.  %m\n", data->name);
-			exit(1);
-			}
-		}
-	if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
-		{
-		fclose(still_jpeg_encoder.file);
-		if (pikrellcam.still_capture_event)
-			event_add("still capture command", pikrellcam.t_now, 0,
-					event_still_capture_cmd,
-					pikrellcam.on_still_capture_cmd);
-		else if (pikrellcam.timelapse_capture_event)
-			{
-			if (bytes_written > 0)
-				time_lapse.sequence += 1;
-			else if (pikrellcam.timelapse_jpeg_last)
-				{
-				unlink(pikrellcam.timelapse_jpeg_last);
-				dup_string(&pikrellcam.timelapse_jpeg_last, "failed");
-				}
-			}
-		pikrellcam.still_capture_event = FALSE;
-		pikrellcam.timelapse_capture_event = FALSE;
-		bytes_written = 0;
-		pikrellcam.state_modified = TRUE;
-		still_jpeg_encoder.file = NULL;
-		}
+	mmal_buffer_header_mem_lock(buffer);
+	video_still_data(buffer->data, buffer->length, video_flags(buffer));
+	mmal_buffer_header_mem_unlock(buffer);
 	return_buffer_to_port(port, buffer);
 	}
 
-
-  /* In pikrellcam, this callback receives resized I420 frames before
-  |  sending them on to a jpeg encoder component which generates the
-  |  mjpeg.jpg stream image.  Here we send the frame data to the motion display
-  |  routine for possible drawing of region outlines, motion vectors
-  |  and/or various status text.  Motion detection was done in the h264
-  |  callback and a flag is set there so these two paths can be synchronized
-  |  so motion vectors can be drawn on the right frame.
+  /* This callback receives resized I420 frames and if video.c wants the
+  |  frame, copies it to a buffer for the mjpeg encoder input after it has
+  |  been drawn on.
   */
 void
 I420_video_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
@@ -324,70 +196,22 @@ I420_video_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 	MMAL_BUFFER_HEADER_T  *buffer_in;
 	static struct timeval timer;
 	int                   utime;
-	static int            encoder_busy_count;
 
-	if (   buffer->length > 0
-	    && motion_frame_event
-	   )
+	if (buffer->length > 0 && video_i420_frame_wanted())
 		{
-		motion_frame_event = FALSE;
-
-		/* Do not send buffer to encoder if it has not received the previous
-		|  one we sent unless this is the frame we want for a preview save.
-		|  In that case, we may be sending a buffer to preview save before
-		|  the previous buffer is handled.  This is accounted for below.
-		*/
-		if (   mjpeg_encoder_send_count == mjpeg_encoder_recv_count
-		    || motion_frame.do_preview_save
-		   )
+		if (obj->callback_port_in && obj->callback_pool_in)
 			{
-			if (obj->callback_port_in && obj->callback_pool_in)
-				{
-				buffer_in = mmal_queue_get(obj->callback_pool_in->queue);
-				if (   buffer_in
-				    && obj->callback_port_in->buffer_size >= buffer->length
-				   )
-					{
-					mmal_buffer_header_mem_lock(buffer);
-					memcpy(buffer_in->data, buffer->data, buffer->length);
-					buffer_in->length = buffer->length;
-					mmal_buffer_header_mem_unlock(buffer);
-					display_draw(buffer_in->data);
-
-					if (motion_frame.do_preview_save)
-						{
-						/* If mjpeg encoder has not received previous buffer,
-						|  then the buffer to save will be the second buffer
-						|  it gets from now. Otherwise it's the next buffer.
-						*/
-						pthread_mutex_lock(&mjpeg_encoder_count_lock);
-						if (mjpeg_encoder_send_count == mjpeg_encoder_recv_count)
-							mjpeg_do_preview_save = 1;
-						else
-							mjpeg_do_preview_save = 2;
-						pthread_mutex_unlock(&mjpeg_encoder_count_lock);
-						if (mjpeg_do_preview_save == 2 && pikrellcam.debug)
-							printf("%s: encoder not clear -> preview save delayed\n",
-								fname_base(pikrellcam.video_pathname));
-						}
-					motion_frame.do_preview_save = FALSE;
-					++mjpeg_encoder_send_count;
-					mmal_port_send_buffer(obj->callback_port_in, buffer_in);
-					}
-				}
-			}
-		else
-			{
-			++encoder_busy_count;
-			if (pikrellcam.debug)
-				printf("encoder not clear (%d) -> skipping mjpeg frame.\n",
-					   encoder_busy_count);
-			if (encoder_busy_count > 2)	/* Frame maybe dropped ??, move on */
+			buffer_in = mmal_queue_get(obj->callback_pool_in->queue);
+			if (   buffer_in
+			    && obj->callback_port_in->buffer_size >= buffer->length
+			   )
 				{
-				if (pikrellcam.debug)
-					printf("  Syncing recv/send counts.\n");
-				encoder_busy_count = 0;
-				mjpeg_encoder_recv_count = mjpeg_encoder_send_count;
+				mmal_buffer_header_mem_lock(buffer);
+				memcpy(buffer_in->data, buffer->data, buffer->length);
+				buffer_in->length = buffer->length;
+				mmal_buffer_header_mem_unlock(buffer);
+				video_i420_frame_send(buffer_in->data);
+				mmal_port_send_buffer(obj->callback_port_in, buffer_in);
 				}
 			}
 		if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
@@ -399,415 +223,17 @@ I420_video_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 	return_buffer_to_port(port, buffer);
 	}
 
-
-void
-circular_buffer_init()
-	{
-	VideoCircularBuffer *vcb = &video_circular_buffer;
-	int					i, seconds, size;
-
-	/* When waiting for motion, we need at least pre_capture in the circular
-	|  buffer, and after motion recording starts, we need the event_gap time
-	|  in the buffer.  So make sure either will fit.
-	*/
-	seconds = MAX(pikrellcam.motion_times.event_gap,
-							pikrellcam.motion_times.pre_capture) + 5;
-	size = pikrellcam.camera_adjust.video_bitrate * seconds / 8;
-	vcb->seconds = seconds;
-
-	if (size != vcb->size)
-		{
-		if (vcb->data)
-			free(vcb->data);
-		vcb->data = (int8_t *)malloc(size);
-		log_printf("circular buffer allocate: %.2f MBytes (%d seconds at %.1f Mbits/sec)\n",
-				(float) size / 1000000.0, seconds,
-				(double)pikrellcam.camera_adjust.video_bitrate / 1000000.0);
-		}
-	if (!vcb->data)
-		{
-		log_printf("Aborting because circular buffer malloc() failed.\n");
-		exit(1);
-		}
-	vcb->size = size;
-	vcb->head = 0;
-	vcb->cur_frame_index = 0;
-	vcb->pre_frame_index = 0;
-	vcb->in_keyframe = FALSE;
-	for (i = 0; i < KEYFRAME_SIZE; ++i)
-		{
-		vcb->key_frame[i].position = 0;
-		vcb->key_frame[i].t_frame = 0;
-		vcb->key_frame[i].frame_count = 0;
-		}
-	}
-
-  /* Write circular buffer data from the tail to head and upate the tail.
-  */
-void
-vcb_video_write(VideoCircularBuffer *vcb)
-	{
-	if (!vcb || !vcb->file)
-		return;
-
-	if (vcb->tail < vcb->head)
-		{
-		fwrite(vcb->data + vcb->tail, vcb->head - vcb->tail, 1, vcb->file);
-		pikrellcam.video_size += vcb->head - vcb->tail;
-		}
-	else
-		{
-		fwrite(vcb->data + vcb->tail, vcb->size - vcb->tail, 1, vcb->file);
-		fwrite(vcb->data, vcb->head, 1, vcb->file);
-		pikrellcam.video_size += vcb->head + vcb->size - vcb->tail;
-		}
-	vcb->tail = vcb->head;
-	}
-
-static void
-h264_header_save(MMAL_BUFFER_HEADER_T *mmalbuf)
-	{
-	VideoCircularBuffer *vcb = &video_circular_buffer;
-
-	if (vcb->h264_header_position + mmalbuf->length > H264_MAX_HEADER_SIZE)
-		log_printf("h264 header bytes error.\n");
-	else
-		{
-		/* Save header bytes to write to .mp4 video files
-		*/
-		mmal_buffer_header_mem_lock(mmalbuf);
-		memcpy(vcb->h264_header + vcb->h264_header_position,
-					mmalbuf->data, mmalbuf->length);
-		mmal_buffer_header_mem_unlock(mmalbuf);
-		vcb->h264_header_position += mmalbuf->length;
-		}
-	}
-
 void
 video_h264_encoder_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *mmalbuf)
 	{
-	VideoCircularBuffer *vcb = &video_circular_buffer;
-	MotionFrame		*mf = &motion_frame;
-	KeyFrame		*kf;
-	int				i, end_space, t_elapsed, event = 0;
-	int				t_usec, dt_frame;
-	boolean			force_stop;
-	time_t			t_cur = pikrellcam.t_now;
-	static int		fps_count, pause_frame_count_adjust;
-	static time_t	t_sec, t_prev;
-	uint64_t		t64_now;
-	static int		t_annotate, t_key_frame;
-	static struct timeval	tv;
-	static uint64_t	t0_stc, pts_prev;
-	static boolean	prev_pause;
-
-	if (vcb->state == VCB_STATE_RESTARTING)
-		{
-		if (mmalbuf->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)
-			h264_header_save(mmalbuf);
-		fps_count = 0;
-		return_buffer_to_port(port, mmalbuf);
-		return;
-		}
-
-	if (mmalbuf->pts > 0)
-		{
-		if (pikrellcam.t_now > tv.tv_sec + 10)
-			{	/* Rarely, but time skew can change if ntp updates. */
-			gettimeofday(&tv, NULL);
-			mmal_port_parameter_get_uint64(port, MMAL_PARAMETER_SYSTEM_TIME, &t0_stc);
-			t0_stc = (uint64_t) tv.tv_sec * 1000000LL + (uint64_t) tv.tv_usec - t0_stc;
-			}
-
-		/* Skew adjust to the system clock to get second transitions.
-		|  Annotate times need to be set early to get displayed time synced
-		|  with system time.  Needs >2 frames + offset to get it to work over
-		|  range of fps values.
-		|  Key frames can be delivered one frame after a request, so request
-		|  within 1 1/2 frames before second time transitions.
-		*/
-		t64_now = t0_stc + mmalbuf->pts;
-		t_sec = (int) (t64_now / 1000000LL);
-		t_usec = (int) (t64_now % 1000000LL);
-		dt_frame = 1000000 / pikrellcam.camera_adjust.video_fps;
+	int64_t		pts = mmalbuf->pts;
 
-		if (   t_annotate < t_sec
-		    && t_usec > 900000 - 5 * dt_frame / 2
-		   )
-			{
-			t_annotate = t_sec;
-			annotate_text_update(t_annotate + 1);
-			}
-
-		if (   (vcb->state == VCB_STATE_NONE || vcb->pause)
-		    && t_key_frame < t_sec
-		    && t_usec > 1000000 - 3 * dt_frame / 2
-		   )
-			{
-			t_key_frame = t_sec;
-			mmal_port_parameter_set_boolean(port,
-						MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1);
-			}
-		if (   (mmalbuf->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)
-		         && t_cur < t_sec
-		        )
-			t_cur = t_sec;
-		}
-
-	pthread_mutex_lock(&vcb->mutex);
-	
-	if (mmalbuf->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)
-		h264_header_save(mmalbuf);
-	else if (mmalbuf->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)
-		{
-		if (++fps_count >= pikrellcam.mjpeg_divider)
-			{
-			motion_frame_event = TRUE;		/* synchronize with i420 callback */
-			fps_count = 0;
-			mmal_buffer_header_mem_lock(mmalbuf);
-			memcpy(motion_frame.vectors, mmalbuf->data, motion_frame.vectors_size);
-			mmal_buffer_header_mem_unlock(mmalbuf);
-			motion_frame_process(vcb, &motion_frame);
-			}
-		}
-	else
-		{
-		if (  (mmalbuf->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)
-		    && !vcb->in_keyframe
-		   )
-			{
-			/* Keep key_frame[cur_frame_index] always pointing to the latest
-			|  keyframe (this one) in the video buffer.  Then adjust the
-			|  key_frame[pre_frame_index] to point to a keyframe
-			|  in the video buffer that is pre_capture time behind.
-			|  If paused, always keep tail pointing to the latest keyframe.
-			*/
-			vcb->in_keyframe = TRUE;
-			vcb->cur_frame_index = (vcb->cur_frame_index + 1) % KEYFRAME_SIZE;
-			kf = &vcb->key_frame[vcb->cur_frame_index];
-			kf->position = vcb->head;
-			kf->frame_count = 0;
-			pause_frame_count_adjust = 0;
-			if (vcb->pause && vcb->state == VCB_STATE_MANUAL_RECORD)
-				{
-				vcb->tail = vcb->head;
-				pts_prev = mmalbuf->pts;
-				pause_frame_count_adjust = 0;
-				}
-			kf->t_frame = t_cur;
-			kf->frame_pts = mmalbuf->pts;
-			while (t_cur - vcb->key_frame[vcb->pre_frame_index].t_frame
-						 > pikrellcam.motion_times.pre_capture)
-				{
-				vcb->pre_frame_index = (vcb->pre_frame_index + 1) % KEYFRAME_SIZE;
-				if (vcb->pre_frame_index == vcb->cur_frame_index)
-					break;
-				}
-			}
-		if (mmalbuf->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
-			{
-			vcb->in_keyframe = FALSE;
-			i = vcb->pre_frame_index; 
-			while (1)
-				{
-				vcb->key_frame[i].frame_count += 1;
-				if (i++ == vcb->cur_frame_index)
-					break;
-				i %= KEYFRAME_SIZE;
-				}
-			if (   vcb->state == VCB_STATE_MOTION_RECORD
-			    || vcb->state == VCB_STATE_MANUAL_RECORD
-			   )
-				{
-				if (!vcb->pause)
-					vcb->frame_count += 1;
-				else
-					pause_frame_count_adjust += 1;
-				}
-			}
-
-		if (t_cur > t_prev)
-			{
-			if (!vcb->pause)
-				++vcb->record_elapsed_time;
-			t_prev = t_cur;
-			}
-
-		if (vcb->state == VCB_STATE_MOTION_RECORD_START)
-			{
-			/* Write mp4 header and set tail to beginning of pre_capture
-			|  video data, then write the entire pre_capture time data.
-			|  The keyframe data we collected above keeps a pointer to
-			|  video data close to the pre_capture time we want.
-			*/
-			fwrite(vcb->h264_header, 1, vcb->h264_header_position, vcb->file);
-			pikrellcam.video_header_size = vcb->h264_header_position;
-			pikrellcam.video_size = vcb->h264_header_position;
-
-			vcb->tail = vcb->key_frame[vcb->record_start_frame_index].position;
-			vcb_video_write(vcb);
-			vcb->frame_count = vcb->key_frame[vcb->record_start_frame_index].frame_count;
-			vcb->video_frame_count = vcb->frame_count;
-			motion_event_write(vcb, mf);
-			vcb->state = VCB_STATE_MOTION_RECORD;
-			if (mf->external_trigger_time_limit > 0)
-				{
-				vcb->motion_sync_time = t_cur + mf->external_trigger_time_limit;
-				vcb->max_record_time = mf->external_trigger_time_limit;
-				}
-			else
-				{
-				vcb->motion_sync_time = t_cur + pikrellcam.motion_times.post_capture;
-				vcb->max_record_time = pikrellcam.motion_record_time_limit;
-				}
-
-			/* Schedule any motion begin command.
-			*/
-			event |= EVENT_MOTION_BEGIN;
-			}
-
-		if (vcb->state == VCB_STATE_MANUAL_RECORD_START)
-			{
-			/* Write mp4 header and set tail to most recent keyframe.
-			|  So manual records may have up to about a sec pre_capture.
-			*/
-			fwrite(vcb->h264_header, 1, vcb->h264_header_position, vcb->file);
-			pikrellcam.video_header_size = vcb->h264_header_position;
-			pikrellcam.video_size = vcb->h264_header_position;
-
-			vcb->tail = vcb->key_frame[vcb->record_start_frame_index].position;
-
-			vcb_video_write(vcb);
-			vcb->frame_count = vcb->key_frame[vcb->record_start_frame_index].frame_count;
-			pts_prev = 0;
-			vcb->state = VCB_STATE_MANUAL_RECORD;
-			event |= EVENT_PREVIEW_SAVE;
-			}
-
-		if (h264_conn_status == H264_TCP_SEND_HEADER) 
-			tcp_send_h264_header(vcb->h264_header, vcb->h264_header_position);
-
-		/* Save video data into the circular buffer.
-		*/
-		mmal_buffer_header_mem_lock(mmalbuf);
-		end_space = vcb->size - vcb->head;
-		if (mmalbuf->length <= end_space)
-			{
-			memcpy(vcb->data + vcb->head, mmalbuf->data, mmalbuf->length);
-			if(h264_conn_status == H264_TCP_SEND_DATA) 
-				tcp_send_h264_data("data 1",vcb->data + vcb->head, mmalbuf->length);
-			}
-		else
-			{
-			memcpy(vcb->data + vcb->head, mmalbuf->data, end_space);
-			memcpy(vcb->data, mmalbuf->data + end_space, mmalbuf->length - end_space);
-			if (h264_conn_status == H264_TCP_SEND_DATA) 
-      			{
-				tcp_send_h264_data("data 2",vcb->data + vcb->head, end_space);
-				tcp_send_h264_data("data 3",vcb->data, mmalbuf->length - end_space);
-				}
-			}
-		vcb->head = (vcb->head + mmalbuf->length) % vcb->size;
-		mmal_buffer_header_mem_unlock(mmalbuf);
-
-		/* And write video data to a video file according to record state.
-		|  Record time limit (if any) does not include pre capture times or
-		|  manual paused time which is accounted for in record_elapsed_time.
-		*/
-		force_stop = FALSE;
-		if (vcb->max_record_time > 0)
-			{
-			t_elapsed = vcb->record_elapsed_time;
-			if (vcb->state == VCB_STATE_MOTION_RECORD)
-				t_elapsed -= (mf->external_trigger_pre_capture > 0) ?
-							  mf->external_trigger_pre_capture
-							: pikrellcam.motion_times.pre_capture;
-			else
-				t_elapsed -= vcb->manual_pre_capture;
-
-			if (t_elapsed >= vcb->max_record_time)
-				force_stop = TRUE;
-			}
-
-		if (vcb->state == VCB_STATE_MANUAL_RECORD)
-			{
-			if (!vcb->pause)
-				{
-				if (mmalbuf->pts > 0)
-					{
-					if (pts_prev > 0)
-						vcb->last_pts += mmalbuf->pts - pts_prev;
-					else
-						vcb->last_pts = mmalbuf->pts;
-					pts_prev = mmalbuf->pts;
-					}
-				if (prev_pause)
-					{
-					vcb->frame_count += pause_frame_count_adjust;
-					pause_frame_count_adjust = 0;
-					}
-				vcb->video_frame_count = vcb->frame_count;
-				vcb_video_write(vcb);	/* Continuously write video data */
-				}
-			prev_pause = vcb->pause;
-	
-			if (force_stop)
-				video_record_stop(vcb);
-			}
-		else if (vcb->state == VCB_STATE_MOTION_RECORD)
-			{
-			/* Always write until we reach motion_sync time (which is last
-			|  motion detect time + post_capture time), then hold during
-			|  event_gap time.  Motion events during event_gap time will bump
-			|  motion_sync_time and event_gap expiration time higher thus
-			|  triggering more writes up to the new sync_time.
-			|  If there is not another motion event, event_gap time will be
-			|  reached and we stop recording with the post_capture time
-			|  already written.
-			*/
-			if (t_cur <= vcb->motion_sync_time)
-				{
-				if (mmalbuf->pts > 0)
-					vcb->last_pts = mmalbuf->pts;
-				vcb->video_frame_count = vcb->frame_count;
-				vcb_video_write(vcb);
-				}
-			if (   force_stop
-		        || (   mf->external_trigger_time_limit == 0
-			        && t_cur >= vcb->motion_last_detect_time + pikrellcam.motion_times.event_gap
-			       )
-		       )
-				{
-				/* For motion recording, preview_save_mode "first" has been
-				|  handled in motion_frame_process().  But if not "first",
-				|  there is a preview save waiting to be handled.
-				*/
-				video_record_stop(vcb);
-				event |= EVENT_MOTION_END;
-				if (strcmp(pikrellcam.motion_preview_save_mode, "first") != 0)
-					event |= EVENT_MOTION_PREVIEW_SAVE_CMD;
-				}
-			}
-		}
-	pthread_mutex_unlock(&vcb->mutex);
+	if (pts == MMAL_TIME_UNKNOWN)
+		pts = 0;
+	mmal_buffer_header_mem_lock(mmalbuf);
+	video_h264_data(mmalbuf->data, mmalbuf->length, video_flags(mmalbuf), pts);
+	mmal_buffer_header_mem_unlock(mmalbuf);
 	return_buffer_to_port(port, mmalbuf);
-
-	/* This handles preview saves for manual records for possible future use.
-	|  preview_save_cmd does not apply for manual records.
-	|  All preview saves for motion records are scheduled in motion_frame_process().
-	|  preview_save_cmd for save mode "best" is handled in video_record_stop().
-	*/
-	if (event & EVENT_PREVIEW_SAVE)
-		event_add("manual preview save", pikrellcam.t_now, 0,
-					event_preview_save, NULL);
-
-	if (   (event & EVENT_MOTION_BEGIN)
-	    && *pikrellcam.on_motion_begin_cmd != '\0'
-	   )
-		event_add("motion begin", pikrellcam.t_now, 0,
-					exec_no_wait, pikrellcam.on_motion_begin_cmd);
-	/* motion end event and preview dispose are handled in video_record_stop()
-	*/
 	}
 
 static void
@@ -1000,7 +426,6 @@ camera_create(void)
 			mmal_component_destroy(camera.component);
 		return FALSE;
 		}
-	video_circular_buffer.h264_header_position = 0;
 
 	MMAL_PARAMETER_CAMERA_CONFIG_T camera_config =
 		{
@@ -1297,3 +722,115 @@ camera_object_destroy(CameraObject *obj)
 
 	memset(obj, 0, sizeof(CameraObject));
 	}
+
+
+/* ========================================== */
+
+  /* The MMAL camera source.  camera_start() in pikrellcam.c sets up the
+  |  circular buffer and motion frame before starting the source.
+  */
+static boolean
+mmal_camera_start(void)
+	{
+	MMAL_STATUS_T	status;
+
+	if (!camera_create())
+		return FALSE;
+
+	/* ====== Create the camera preview port path ====== :
+	|  preview --(tunnel)--> resizer --> I420_callback --> jpeg_encoder --> mjpeg_callback
+	|                                   (draws on frame)                   (publishes to the mjpeg ring)
+	*/
+	resizer_create("stream_resizer", &stream_resizer,
+							camera.component->output[CAMERA_PREVIEW_PORT],
+							pikrellcam.mjpeg_width, pikrellcam.mjpeg_height);
+	ports_tunnel_connect(&camera, CAMERA_PREVIEW_PORT, &stream_resizer);
+	jpeg_encoder_create("mjpeg_encoder", &mjpeg_encoder,
+					stream_resizer.component->output[0], pikrellcam.mjpeg_quality);
+	ports_callback_connect(&stream_resizer, 0, &mjpeg_encoder,
+					I420_video_callback);
+	out_port_callback(&mjpeg_encoder, 0, mjpeg_callback);
+
+
+	/* ====== Create the camera still port path ====== :
+	|  camera_capture --(tunnel)--> jpeg_encoder --> still_jpeg__callback
+	|                                               (writes stills and timelapse jpegs)
+	*/
+	jpeg_encoder_create("still_jpeg_encoder", &still_jpeg_encoder,
+					NULL, pikrellcam.camera_adjust.still_quality);
+	ports_tunnel_connect(&camera, CAMERA_CAPTURE_PORT, &still_jpeg_encoder);
+	out_port_callback(&still_jpeg_encoder, 0, still_jpeg_callback);
+
+
+	/* ====== Create the camera video port path ====== :
+	|  camera_video--(tunnel)-->h264 encoder-->video_h264_encoder_callback
+	|                                         (writes data into video circular buffer)
+	|                                         (records video / checks motion vectors)
+	|                                         (flags the mjpeg frame to save as preview)
+	*/
+	h264_encoder_create("video_h264_encoder", &video_h264_encoder, NULL);
+	ports_tunnel_connect(&camera, CAMERA_VIDEO_PORT, &video_h264_encoder);
+	out_port_callback(&video_h264_encoder, 0, video_h264_encoder_callback);
+
+	/* Turn on the video stream. It free runs into the video circular buffer.
+	*/
+	if ((status = mmal_port_parameter_set_boolean(
+				camera.component->output[CAMERA_VIDEO_PORT],
+				MMAL_PARAMETER_CAPTURE, 1)) != MMAL_SUCCESS)
+		log_printf("Video capture startup failed. Status %s\n",
+					mmal_status[status]);
+	return TRUE;
+	}
+
+static void
+mmal_camera_stop(void)
+	{
+	mmal_port_parameter_set_boolean(camera.component->output[CAMERA_VIDEO_PORT],
+				MMAL_PARAMETER_CAPTURE, 0);
+
+	camera_object_destroy(&video_h264_encoder);
+	camera_object_destroy(&still_jpeg_encoder);
+	camera_object_destroy(&stream_resizer);
+	camera_object_destroy(&mjpeg_encoder);
+	camera_object_destroy(&camera);
+	}
+
+static boolean
+mmal_still_capture(void)
+	{
+	MMAL_STATUS_T	status;
+
+	if ((status = mmal_port_parameter_set_boolean(
+					camera.component->output[CAMERA_CAPTURE_PORT],
+					MMAL_PARAMETER_CAPTURE, 1)) != MMAL_SUCCESS)
+		{
+		log_printf("Camera capture failed. Status %s\n", mmal_status[status]);
+		return FALSE;
+		}
+	return TRUE;
+	}
+
+static void
+mmal_keyframe_request(void)
+	{
+	mmal_port_parameter_set_boolean(video_h264_encoder.port_out,
+				MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1);
+	}
+
+static boolean
+mmal_system_time(uint64_t *stc)
+	{
+	return (mmal_port_parameter_get_uint64(video_h264_encoder.port_out,
+				MMAL_PARAMETER_SYSTEM_TIME, stc) == MMAL_SUCCESS);
+	}
+
+CameraSource	mmal_camera_source =
+	{
+	"RPi camera",
+	mmal_camera_start,
+	mmal_camera_stop,
+	mmal_still_capture,
+	mmal_keyframe_request,
+	mmal_system_time,
+	annotate_text_update
+	};
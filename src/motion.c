@@ -21,15 +21,37 @@
 #include "pikrellcam.h"
 #include <dirent.h>
 
-#define EXPMA_SMOOTHING	0.01
 
-#define SMALL_OBJECT_COUNT  15
-#define IN_BOX_COUNT_MIN    (2 * cvec->mag2_count)
+MotionFrame		motion_frame;
 
+  /* Motion vectors are processed on a motion worker thread so the h264
+  |  callback only has to copy them into a queue slot.  If the worker falls
+  |  behind, the oldest queued frame is dropped.  The worker does not touch
+  |  the video circular buffer record state, it posts a detect back to
+  |  video_h264_data() and waits for motion_detect_done().
+  */
+#define MOTION_QUEUE_SIZE	4
 
-MotionFrame		motion_frame;
+typedef struct
+	{
+	pthread_t		thread;
+	pthread_mutex_t	mutex;
+	pthread_cond_t	work_cond,
+					done_cond;
+	MotionVector	*frames[MOTION_QUEUE_SIZE];
+	unsigned int	video_seq[MOTION_QUEUE_SIZE];
+	int64_t			pts[MOTION_QUEUE_SIZE];
+	int				frames_size;
+	unsigned int	head,
+					tail;
+	boolean			busy,
+					detect;
+	}
+	MotionQueue;
 
-static CompositeVector	zero_cvec;
+static MotionQueue	motion_queue;
+
+static void	motion_detect_post(void);
 
 
 static boolean
@@ -54,284 +76,6 @@ composite_vector_better(CompositeVector *cvec1, CompositeVector *cvec2)
 	}
 
 
-static void
-get_composite_vector(MotionFrame *mf, MotionRegion *mreg)
-	{
-	CompositeVector *cvec, tvec;
-	MotionVector    *mv;
-	Area            *area;
-	char            *mt, *mtb;
-	int             x, y, mag2, mb_index, mvmag2, dot, cos2,
-	                x0, y0, x1, y1;
-	int16_t         *pm, *pp, *pn;
-
-	cvec = &mreg->vector;
-	*cvec = zero_cvec;
-	tvec = zero_cvec;
-	mreg->reject_count = 0;
-	mreg->sparkle_count = 0;
-
-	/* Don't look at frame perimeter blocks except when excluding sparkles.
-	|  (They have limited vector direction).
-	*/
-	if ((y0 = mreg->y) == 0)
-		y0 = 1;
-	if ((y1 = mreg->y + mreg->dy) >= mf->height)
-		y1 = mf->height - 1;
-	if ((x0 = mreg->x) == 0)
-		x0 = 1;
-	if ((x1 = mreg->x + mreg->dx) >= mf->width)
-		x1 = mf->width - 1;
-
-	/* First pass, filter out any vector < mag2_limit
-	*/
-	for (y = y0; y < y1; ++y)
-		{
-		for (x = x0; x < x1; ++x)
-			{
-			mb_index = mf->width * y + x;
-			mv = &mf->vectors[mb_index];
-			mag2 = mv->vx * mv->vx + mv->vy * mv->vy;
-			if (mag2 >= mf->mag2_limit)
-				{
-				*(mf->trigger + mb_index) = mag2;
-				}
-			}
-		}
-
-	/* Remove isolated sparkles & build the initial composite vector which
-	|  will then consist of motion vector clustering of at least count 2.
-	|  Camera can produce large sparkle counts during dim light (dusk/dawn).
-	*/
-	for (y = y0; y < y1; ++y)
-		{
-		for (x = x0; x < x1; ++x)
-			{
-			pm = mf->trigger + mf->width * y + x;
-			pp = pm - mf->width;
-			pn = pm + mf->width;
-			if (   *pm
-			    && !*(pm - 1) && !*(pm + 1)
-				&& !*(pp - 1) && !*pp && !*(pp + 1)
-				&& !*(pn - 1) && !*pn && !*(pn + 1)
-			   )
-				{
-				*pm = 1;	/* mag2 value becomes a sparkle flag */
-				mf->sparkle_count += 1;
-				mreg->sparkle_count += 1;
-				}
-			if (*pm > 1)
-				{
-				mv = &mf->vectors[mf->width * y + x];
-				tvec.mag2_count += 1;
-				tvec.vx += mv->vx;
-				tvec.vy += mv->vy;
-				tvec.x  += x;
-				tvec.y  += y;
-				mf->any_count += 1;
-				}
-			}
-		}
-
-	/* If sparkle noise, override configured limit_count (for dusk/dawn times).
-	|  In regions with no motion, this reduces chances of a spurious reject.
-	|  In regions with motion, this tries to raise limit_count above the noise
-	|  background, but sensitivity is reduced.
-	*/
-	x = SMALL_OBJECT_COUNT;
-	if (mf->mag2_limit_count < x)
-		{
-		mf->mag2_limit_count += 2 * mreg->sparkle_count / 3;
-		if (mf->mag2_limit_count > x)
-			mf->mag2_limit_count = x;
-		}
-
-	/* If we are left with enough counts for a composite vector, filter out
-	|  motion vectors not pointing in the composite directon.
-	|  Vectors of sufficient mag2 but not pointing in the right direction
-	|  will be rejects and their count can be large for noisy frames.
-	|  Dot product to allow a spread,
-	|    (avoiding sqrt() to get magnitude and scale by 100 for integer math):
-	|
-	|  cos(a) = (v1 dot v2) / mag(v1) * mag(v2))	# cos(25) = 0.906
-	|  100 * cos(25)^2 = 82 = 100 * (v1 dot v2)^2 / mag(v1)^2 * mag(v2)^2)
-	*/
-	if (tvec.mag2_count >= mf->mag2_limit_count)
-		{
-		tvec.vx /= tvec.mag2_count;
-		tvec.vy /= tvec.mag2_count;
-		tvec.mag2 = tvec.vx * tvec.vx + tvec.vy * tvec.vy;
-
-		for (y = y0; y < y1; ++y)
-			{
-			for (x = x0; x < x1; ++x)
-				{
-				mb_index = mf->width * y + x;
-				mvmag2 = *(mf->trigger + mb_index);
-				if (mvmag2 <= 1)
-					continue;
-
-				mv = &mf->vectors[mb_index];
-				dot = tvec.vx * mv->vx + tvec.vy * mv->vy;
-				if (   dot > 0		/* angle at least < 90 deg */
-				    && tvec.mag2 > 0
-					&& (cos2 = 100 * dot * dot / (tvec.mag2 * mvmag2)) >= 82
-				   )
-					{
-					cvec->mag2_count += 1;
-					cvec->vx += mv->vx;
-					cvec->vy += mv->vy;
-					cvec->x  += x;
-					cvec->y  += y;
-
-					area = &mf->motion_area;
-					if (area->x0 == 0 || area->x0 > x)
-						area->x0 = x;
-					if (area->x1 < x)
-						area->x1 = x;
-					if (area->y0 == 0 || area->y0 > y)
-						area->y0 = y;
-					if (area->y1 < y)
-						area->y1 = y;
-					}
-				else
-					{
-					*(mf->trigger + mf->width * y + x) = 2;	/* reject flag */
-					mf->reject_count += 1;
-					mreg->reject_count += 1;
-					}
-				}
-			}
-		}
-
-	/* Now every vector in mag2_count has magnitude >= mag2_limit and points
-	|  with some spread in the same direction.  If there is enough of them,
-	|  we have a final composite vector.  But look at the motion vector
-	|  distribution/concentration within the region to filter for final
-	|  motion detection.
-	*/
-	mreg->motion = MOTION_NONE;
-	if (cvec->mag2_count >= mf->mag2_limit_count)
-		{
-		cvec->x /= cvec->mag2_count;
-		cvec->y /= cvec->mag2_count;
-		cvec->vx /= cvec->mag2_count;
-		cvec->vy /= cvec->mag2_count;
-		cvec->mag2 = cvec->vx * cvec->vx + cvec->vy * cvec->vy;
-
-		/* Set a vertical flag.  The idea was vertical filtering would be
-		|  usefull for rain, but it turns out it's just as likely the
-		|  vectors will match in some random direction and reject counts
-		|  are a better rain filter, but look again later.
-		*/
-		cvec->vertical =
-			(cvec->vy * cvec->vy > 20 * cvec->vx * cvec->vx) ? TRUE : FALSE;
-		if (cvec->vertical)
-			mf->vertical_count += 1;
-
-		/* Get a box that will hold at least 2x mag2_count vectors
-		|  and count the vectors within the box.
-		*/
-		for (cvec->box_w = 4, cvec->box_h = 4;
-					cvec->box_w * cvec->box_h <= IN_BOX_COUNT_MIN; )
-			{
-			if (cvec->box_h <= cvec->box_w)
-				cvec->box_h += 2;
-			else
-				cvec->box_w += 2;
-			}
-
-		cvec->in_box_count = 0;
-		cvec->in_box_rejects = 0;
-		for (y = cvec->y - cvec->box_h / 2; y <= cvec->y + cvec->box_h / 2; ++y)
-			{
-			for (x = cvec->x - cvec->box_w / 2; x <= cvec->x + cvec->box_w / 2; ++x)
-				{
-				int  trig = *(mf->trigger + mf->width * y + x);
-
-				if (trig > 2)
-					cvec->in_box_count += 1;
-				else if (trig == 2)
-					cvec->in_box_rejects += 1;
-				}
-			}
-
-		/* Filter out smaller fast moving objects which can be fast bird fly
-		|  bys or close flying insects.
-		|  For smaller objects, always enforce reject_count rejections
-		|  (filters noisy frames: rain, camera burps).
-		|  Comparison ratios here are empirical from looking at
-		|  motion-debug output wrt drawn OSD motion vector frames.
-		*/
-		if (   !cvec->vertical
-		    || !pikrellcam.motion_vertical_filter
-		   )
-			{
-			if (cvec->mag2_count < SMALL_OBJECT_COUNT)
-				{
-				if (   cvec->in_box_count > cvec->mag2_count * 8 / 10
-				    && cvec->mag2 < 5 * mf->mag2_limit
-				    && mreg->reject_count < cvec->mag2_count / 2
-				   )
-					mreg->motion = MOTION_TYPE_DIR_SMALL;
-				}
-			else
-				if (   cvec->in_box_count > cvec->mag2_count * 7 / 10
-			        || (   cvec->in_box_count > cvec->mag2_count * 5 / 10
-			            && mreg->reject_count < cvec->mag2_count * 4 / 10
-			           )
-			       )
-				mreg->motion = MOTION_TYPE_DIR_NORMAL;
-			}
-		/* Flag it if a density of count+rejects is sufficient for a burst
-		|  detect (which still has to pass a total count check).
-		*/
-		if (mf->any_count_expma < 100.0)
-			{
-			if (cvec->in_box_count + cvec->in_box_rejects > 4 * IN_BOX_COUNT_MIN / 10)
-				mreg->motion |= MOTION_TYPE_BURST_DENSITY;
-			}
-		else if (mf->any_count_expma < 300.0)
-			{
-			if (cvec->in_box_count + cvec->in_box_rejects > 7 * IN_BOX_COUNT_MIN / 10)
-				mreg->motion |= MOTION_TYPE_BURST_DENSITY;
-			}
-		else
-			if (cvec->in_box_count + cvec->in_box_rejects > 9 * IN_BOX_COUNT_MIN / 10)
-				mreg->motion |= MOTION_TYPE_BURST_DENSITY;
-
-		if (pikrellcam.verbose_motion)
-			{
-			printf(
-"cvec[%d]: x,y(%d,%d) dx,dy(%d,%d) mag2,count,lim(%d,%d,%d) rej,spkl,vert(%d,%d,%d)\n",
-				mreg->region_number,
-				cvec->x, cvec->y, cvec->vx, cvec->vy, cvec->mag2,
-				cvec->mag2_count, mf->mag2_limit_count, mreg->reject_count,
-				mreg->sparkle_count, cvec->vertical);
-			mt = "----";
-			mtb = "------";
-			if (mreg->motion & MOTION_TYPE_DIR_SMALL)
-				mt = "dirS";
-			else if (mreg->motion & MOTION_TYPE_DIR_NORMAL)
-				mt = "dirN";
-			if (mreg->motion & MOTION_TYPE_BURST_DENSITY)
-				mtb = "burstD";
-			/* in_box density is what counts are compared to, not in_size
-			*/
-			printf(
-"   box:%dx%d in_box[cnt:%d rej:%d] density[dir:%.1f burst:%.1f]  **motion[%s,%s]\n",
-				cvec->box_w, cvec->box_h,
-				cvec->in_box_count, cvec->in_box_rejects,
-				(float) cvec->in_box_count / (float) cvec->mag2_count,
-				(float) (cvec->in_box_count + cvec->in_box_rejects)
-						/ (float) IN_BOX_COUNT_MIN,
-				mt, mtb);
-			}
-		}
-	else
-		*cvec = zero_cvec;
-	}
-
 static void
 motion_stats_write(VideoCircularBuffer *vcb, MotionFrame *mf)
 	{
@@ -358,10 +102,11 @@ motion_event_write(VideoCircularBuffer *vcb, MotionFrame *mf)
 	{
 	static FILE		*f;
 	CompositeVector *cvec, *frame_vec = &mf->frame_vector;
-	MotionRegion	*mreg;
+	MotionRegionSet	*set;
+	MotionRegionState	*rs;
+	MotionTrack		*track;
 	PresetPosition	*pos;
 	PresetSettings	*settings = NULL;
-	SList			*mrlist;
 	int				burst, i, pan, tilt;
 	boolean			dir_motion;
 
@@ -408,20 +153,41 @@ motion_event_write(VideoCircularBuffer *vcb, MotionFrame *mf)
 				sqrt((float)frame_vec->mag2), frame_vec->mag2_count);
 		if (mf->motion_status & MOTION_DIRECTION)
 			{
-			for (i = 0, mrlist = mf->motion_region_list; mrlist;
-						mrlist = mrlist->next, ++i)
+			/* region_state goes with the set it was detected against,
+			|  which may no longer be the published one.
+			*/
+			set = mf->detect_set;
+			for (i = 0; set && i < set->n_regions; ++i)
 				{
-				mreg = (MotionRegion *) mrlist->data;
-				dir_motion = mreg->motion
+				rs = &mf->region_state[i];
+				dir_motion = rs->motion
 						& (MOTION_TYPE_DIR_SMALL | MOTION_TYPE_DIR_NORMAL);
 				if (!dir_motion)
 					continue;
-				cvec = &mreg->vector;
+				cvec = &rs->vector;
 				fprintf(f, "%d %3d %3d %3d %3d %3.0f %4d\n",
 						i, cvec->x, cvec->y, -cvec->vx, -cvec->vy,
 						sqrt((float)cvec->mag2), cvec->mag2_count);
 				}
 			}
+		if (mf->motion_status & MOTION_SLOW)
+			{
+			cvec = &mf->slow_vector;
+			fprintf(f, "s %3d %3d %3d %3d %3.0f %4d\n",
+					cvec->x, cvec->y, -cvec->vx, -cvec->vy,
+					sqrt((float)cvec->mag2), cvec->mag2_count);
+			}
+		for (i = 0; i < MOTION_TRACK_MAX; ++i)
+			{
+			track = &mf->tracks[i];
+			if (!motion_track_visible(track))
+				continue;
+			fprintf(f, "t %d %3d %3d %3d %3d %3.0f %4d\n",
+					track->id, track->x >> 4, track->y >> 4,
+					-track->vx, -track->vy,
+					sqrt((float)(track->vx * track->vx + track->vy * track->vy)),
+					track->count);
+			}
 		fprintf(f, "</motion>\n");
 		fflush(f);
 		}
@@ -434,199 +200,83 @@ motion_event_write(VideoCircularBuffer *vcb, MotionFrame *mf)
 	/* else a MANUAL record state */
 	}
 
+static void
+motion_tamper_cmd(char *cmd)
+	{
+	exec_no_wait(cmd, NULL);
+	free(cmd);
+	}
+
+  /* The command gets the tamper type, "covered" or "moved", as an argument.
+  |  Each event gets its own copy of the command, freed when it is run.
+  */
+static void
+motion_tamper_event(int tamper)
+	{
+	char		*cmd, *type;
+
+	type = (tamper == TAMPER_COVERED) ? "covered" : "moved";
+	log_printf("Camera tamper detected: view %s\n", type);
+	if (   *pikrellcam.on_motion_tamper_cmd
+	    && asprintf(&cmd, "%s %s", pikrellcam.on_motion_tamper_cmd, type) > 0
+	   )
+		event_add("motion tamper", pikrellcam.t_now, 0, motion_tamper_cmd, cmd);
+	}
+
+  /* Live motion detection, run by the motion worker for each queued frame.
+  */
 void
 motion_frame_process(VideoCircularBuffer *vcb, MotionFrame *mf)
 	{
-	MotionRegion    *mreg;
-	CompositeVector *cvec, *frame_vec;
-	SList           *mrlist;
-	int             motion_count, fail_count, direction_motion;
-	boolean         burst_density_pass, motion_enabled;
-	char            tbuf[50], *msg;
-	int             x0, y0, x1, y1, t;
-	static int      mfp_number, motion_burst_frame;
+	MotionSettings	*s = &mf->settings;
+	MotionProfile	*profile;
+	boolean			motion_enabled;
+	char			tbuf[50], *msg;
+	static int		mfp_number;
 
 	/* Allow some startup camera settle time before motion detecting.
 	*/
 	if (pikrellcam.t_now < pikrellcam.t_start + 3)
 		return;
 
-	mf->motion_status = MOTION_NONE;
-
-	mf->sparkle_count  = 0;
-	mf->reject_count   = 0;
-	mf->any_count      = 0;
-	mf->vertical_count = 0;
-
-	memset(mf->trigger, 0, MF_TRIGGER_SIZE);
-	mf->motion_area.x0 = mf->motion_area.y0 = mf->motion_area.x1 = mf->motion_area.y1 = 0;
-	mf->mag2_limit  = pikrellcam.motion_magnitude_limit * pikrellcam.motion_magnitude_limit;
-	mf->mag2_limit_count = pikrellcam.motion_magnitude_limit_count;
-
-	pthread_mutex_lock(&mf->region_list_mutex);
-	for (mrlist = mf->motion_region_list; mrlist; mrlist = mrlist->next)
-		{
-		mreg = (MotionRegion *) mrlist->data;
-
-		get_composite_vector(mf, mreg);
-
-		/* Revert any dynamic mag2 adjust done in get_composite_vector().
-		*/
-		mf->mag2_limit  = pikrellcam.motion_magnitude_limit * pikrellcam.motion_magnitude_limit;
-		mf->mag2_limit_count = pikrellcam.motion_magnitude_limit_count;
-		}
-
-	motion_count = 0;
-	fail_count = 0;
-	burst_density_pass = FALSE;
-	mf->frame_vector = zero_cvec;
-	frame_vec = &mf->frame_vector;
-	mf->cvec_count = 0;
-
-	for (mrlist = mf->motion_region_list; mrlist; mrlist = mrlist->next)
-		{
-		mreg = (MotionRegion *) mrlist->data;
-		cvec = &mreg->vector;
-		direction_motion = mreg->motion & (MOTION_TYPE_DIR_SMALL | MOTION_TYPE_DIR_NORMAL);
-
-		if (   cvec->mag2_count > 0
-		    && !direction_motion
-		   )
-			fail_count += 1;
-		else if (direction_motion)
-			motion_count += 1;
-
-		if (mreg->motion & MOTION_TYPE_BURST_DENSITY)
-			burst_density_pass = TRUE;
-
-		if (cvec->mag2_count > 0)
-			{
-			frame_vec->x  += cvec->x;
-			frame_vec->y  += cvec->y;
-			frame_vec->vx += cvec->vx;
-			frame_vec->vy += cvec->vy;
-			frame_vec->mag2_count += cvec->mag2_count;
-			mf->cvec_count += 1;
-			}
-		}
-
-	/* The frame composite vector is the vector sum of all the region composite
-	|  vectors and the box is formed from the max dx and dy of the region
-	|  vector box extents from the frame vector center.  This vector box is
-	|  likely smaller than the geometric box recorded in the motion_area values.
-	*/
-	if (mf->cvec_count > 0)
-		{
-		frame_vec->x /= mf->cvec_count;
-		frame_vec->y /= mf->cvec_count;
-		frame_vec->vx /= mf->cvec_count;
-		frame_vec->vy /= mf->cvec_count;
-		frame_vec->mag2 =
-			frame_vec->vx * frame_vec->vx + frame_vec->vy * frame_vec->vy;
-
-		x0 = y0 = x1 = y1 = 0;
-		for (mrlist = mf->motion_region_list; mrlist; mrlist = mrlist->next)
-			{
-			mreg = (MotionRegion *) mrlist->data;
-			cvec = &mreg->vector;
-			if (cvec->mag2_count == 0)
-				continue;
-
-			t = cvec->x - cvec->box_w / 2;
-			if (x0 == 0 || t < x0)
-				x0 = t;
-			t = cvec->x + cvec->box_w / 2;
-			if (t > x1)
-				x1 = t;
-			t = cvec->y - cvec->box_h / 2;
-			if (y0 == 0 || t < y0)
-				y0 = t;
-			t = cvec->y + cvec->box_h / 2;
-			if (t > y1)
-				y1 = t;
-			}
-		frame_vec->box_w = 2 * MAX(frame_vec->x - x0, x1 - frame_vec->x);
-		frame_vec->box_h = 2 * MAX(frame_vec->y - y0, y1 - frame_vec->y);
-		}
-	pthread_mutex_unlock(&mf->region_list_mutex);
-
-	/* To be used (large sparkle counts after sunset / before sunrise).
-	*/
-	mf->sparkle_expma = EXPMA_SMOOTHING * (float) mf->sparkle_count +
-							(1.0 - EXPMA_SMOOTHING) * mf->sparkle_expma;
-
-	mf->motion_status = MOTION_NONE;
-
-	/* Burst motion triggers on counts above the any_count_expma
-	|  background count noise.
-	*/
-	if (   burst_density_pass
-	    && frame_vec->mag2_count + mf->reject_count >
-				pikrellcam.motion_burst_count + (int) mf->any_count_expma
+	s->magnitude_limit = pikrellcam.motion_magnitude_limit;
+	s->magnitude_limit_count = pikrellcam.motion_magnitude_limit_count;
+	s->burst_count = pikrellcam.motion_burst_count;
+	s->burst_frames = pikrellcam.motion_burst_frames;
+	s->confirm_frames = 0;
+	if (pikrellcam.motion_times.confirm_gap > 0)
+		s->confirm_frames = pikrellcam.camera_adjust.video_fps *
+				pikrellcam.motion_times.confirm_gap / pikrellcam.mjpeg_divider;
+	s->vertical_filter = pikrellcam.motion_vertical_filter;
+	s->noise_filter = pikrellcam.motion_noise_filter;
+	s->lighting_filter = pikrellcam.motion_lighting_filter;
+	s->slow_frames = pikrellcam.motion_slow_frames;
+	s->heatmap_hours = pikrellcam.motion_heatmap_hours;
+	s->heatmap_frames = 0;
+	if (   s->heatmap_hours > 0
+	    && pikrellcam.on_preset && !pikrellcam.servo_moving
 	   )
-		{
-		if (motion_burst_frame < pikrellcam.motion_burst_frames)
-			++motion_burst_frame;
-		mf->motion_status = MOTION_PENDING_BURST;
-		}
-	else
-		{
-		/* any_count_expma is background noise counts so exclude from it
-		|  activity that caused any pass or fail cvecs.  It already
-		|  excludes sparkles.
-		*/
-		if (motion_count == 0)
-			mf->any_count_expma = 0.02 * (float) mf->any_count +
-					(1.0 - 0.02) * mf->any_count_expma;
-		if (motion_burst_frame > 0)
-			--motion_burst_frame;
-		}
+		s->heatmap_frames = pikrellcam.camera_adjust.video_fps * 3600
+				/ pikrellcam.mjpeg_divider;
+	s->verbose = pikrellcam.verbose_motion;
+	if ((profile = __atomic_load_n(&mf->profile, __ATOMIC_ACQUIRE)) != NULL)
+		motion_profile_apply(profile, s);
 
-	if (   motion_count > 0
-	    && fail_count == 0
-	   )
-		{
-		if (   vcb->state != VCB_STATE_MOTION_RECORD
-		    && mf->frame_window == 0
-		    && pikrellcam.motion_times.confirm_gap > 0
-		   )
-			{
-			mf->frame_window = pikrellcam.camera_adjust.video_fps *
-					pikrellcam.motion_times.confirm_gap / pikrellcam.mjpeg_divider;
-			mf->motion_status |= MOTION_PENDING_DIR;
-			}
-		else
-			mf->motion_status = (MOTION_DETECTED | MOTION_DIRECTION);
-		}
+	/* The noise model is for a camera view, so relearn after a servo move.
+	*/
+	if (pikrellcam.servo_moving)
+		mf->noise_reset = TRUE;
 
-	if (motion_burst_frame == pikrellcam.motion_burst_frames)
-		{
-		mf->motion_status &= ~(MOTION_PENDING_DIR | MOTION_PENDING_BURST);
-		mf->motion_status |= (MOTION_DETECTED | MOTION_BURST);
-		mf->frame_window = 0;
-		}
-	if (mf->external_trigger)
-		{
-		mf->external_trigger = FALSE;
-		mf->motion_status &= ~(MOTION_PENDING_DIR | MOTION_PENDING_BURST);
-		mf->motion_status |= (MOTION_DETECTED | MOTION_EXTERNAL);
-		mf->frame_window = 0;
-		}
+	motion_frame_detect(mf, vcb->state == VCB_STATE_MOTION_RECORD);
 
-	if (mf->frame_window > 0)
-		mf->frame_window -= 1;
+	if (mf->tamper_event)
+		motion_tamper_event(mf->tamper);
 
 	if (   pikrellcam.verbose_motion
-	    && frame_vec->mag2_count > 0
+	    && (   mf->region_fail_count > 0 || mf->region_motion_count > 0
+	        || (mf->motion_status & MOTION_SLOW)
+	       )
 	   )
-		{
-		printf(
-"frame:   x,y(%d,%d) dx,dy(%d,%d) mag2:%d count,rej(%d,%d) any[%d,%.1f] burst:%d\n",
-			frame_vec->x, frame_vec->y, frame_vec->vx, frame_vec->vy,
-			frame_vec->mag2, frame_vec->mag2_count, mf->reject_count,
-			mf->any_count, mf->any_count_expma, motion_burst_frame);
-		}
-	if (pikrellcam.verbose_motion && (fail_count > 0 || motion_count > 0))
 		{
 		strftime(tbuf, sizeof(tbuf), "%T", &pikrellcam.tm_local);
 		msg = "";
@@ -637,6 +287,8 @@ motion_frame_process(VideoCircularBuffer *vcb, MotionFrame *mf)
 			msg = "***MOTION DIRECTION***";
 		else if (mf->motion_status & MOTION_BURST)
 			msg = "***MOTION BURST***";
+		else if (mf->motion_status & MOTION_SLOW)
+			msg = "***MOTION SLOW***";
 		else if (mf->motion_status & MOTION_EXTERNAL)
 			msg = "***MOTION EXTERNAL***";
 		else
@@ -651,13 +303,11 @@ motion_frame_process(VideoCircularBuffer *vcb, MotionFrame *mf)
 			}
 
 		printf("%s [%d] regions[motion:%d fail:%d] spkl[%d,%.1f] window:%d  %s\n\n",
-			tbuf, mfp_number,  motion_count, fail_count,
+			tbuf, mfp_number,  mf->region_motion_count, mf->region_fail_count,
 			mf->sparkle_count, mf->sparkle_expma,
 			mf->frame_window, msg);
 		}
 	++mfp_number;
-	if (motion_burst_frame == pikrellcam.motion_burst_frames)
-		motion_burst_frame = 0;
 
 	motion_enabled = (  (  mf->motion_enable
 	                     || (mf->external_trigger_mode & EXT_TRIG_MODE_ENABLE)
@@ -672,94 +322,266 @@ motion_frame_process(VideoCircularBuffer *vcb, MotionFrame *mf)
 	       )
 	    || ( (mf->motion_status & MOTION_EXTERNAL) && motion_enabled)
 	   )
-		{
-		vcb->motion_last_detect_time = pikrellcam.t_now;
+		motion_detect_post();
+	}
+
+static void
+motion_detect_post(void)
+	{
+	MotionQueue	*q = &motion_queue;
+
+	pthread_mutex_lock(&q->mutex);
+	__atomic_store_n(&q->detect, TRUE, __ATOMIC_RELEASE);
+	while (q->detect)
+		pthread_cond_wait(&q->done_cond, &q->mutex);
+	pthread_mutex_unlock(&q->mutex);
+	}
+
+void
+motion_detect_done(void)
+	{
+	MotionQueue	*q = &motion_queue;
 
-		/* Motion detection will be ignored if a manual record is in progress.
+	if (!__atomic_load_n(&q->detect, __ATOMIC_ACQUIRE))
+		return;
+	pthread_mutex_lock(&q->mutex);
+	q->detect = FALSE;
+	pthread_cond_broadcast(&q->done_cond);
+	pthread_mutex_unlock(&q->mutex);
+	}
+
+  /* Run from video_h264_data() with vcb locked when the motion worker has
+  |  posted a detect.  The worker waits until motion_detect_done() so the
+  |  motion_frame results stay put while the record is started or bumped.
+  */
+void
+motion_detect_record(VideoCircularBuffer *vcb)
+	{
+	MotionFrame		*mf = &motion_frame;
+	CompositeVector *frame_vec = &mf->frame_vector;
+
+	if (!__atomic_load_n(&motion_queue.detect, __ATOMIC_ACQUIRE))
+		return;
+	if (vcb->state == VCB_STATE_MOTION_RECORD_START)
+		return;		/* Still using the detect that started the record */
+	vcb->motion_last_detect_time = pikrellcam.t_now;
+
+	/* Motion detection will be ignored if a manual record is in progress.
+	*/
+	if (vcb->state == VCB_STATE_NONE)
+		{
+		/* Always preview save in case there is a motion preview save
+		|  command. For preview save mode "first", set flag so mjpeg
+		|  callback can immediately schedule the on_preview_save command
+		|  so there is no wait to execute it.
 		*/
-		if (vcb->state == VCB_STATE_NONE)
+		video_record_start(vcb, VCB_STATE_MOTION_RECORD_START);
+		mf->do_preview_save = TRUE;
+		mf->preview_frame_vector = mf->frame_vector;
+		if (mf->motion_status & MOTION_EXTERNAL)
+			{
+			mf->preview_motion_area.x0 = mf->preview_motion_area.y0 = 0;
+			mf->preview_motion_area.x1 = mf->width - 1;
+			mf->preview_motion_area.y1 = mf->height - 1;
+			}
+		else if (   (mf->motion_status & (MOTION_DIRECTION | MOTION_BURST))
+		         == 0
+		        )
 			{
-			/* Always preview save in case there is a motion preview save
-			|  command. For preview save mode "first", set flag so mjpeg
-			|  callback can immediately schedule the on_preview_save command
-			|  so there is no wait to execute it.
+			/* Slow motion only, box the slow vector center.
 			*/
-			video_record_start(vcb, VCB_STATE_MOTION_RECORD_START);
-			mf->do_preview_save = TRUE;
-			mf->preview_frame_vector = mf->frame_vector;
-			if (mf->motion_status & MOTION_EXTERNAL)
-				{
-				mf->preview_motion_area.x0 = mf->preview_motion_area.y0 = 0;
-				mf->preview_motion_area.x1 = mf->width - 1;
-				mf->preview_motion_area.y1 = mf->height - 1;
-				}
-			else
-				mf->preview_motion_area = mf->motion_area;
-			pikrellcam.video_notify = FALSE;
-			pikrellcam.still_notify = FALSE;
-			pikrellcam.timelapse_notify = FALSE;
-
-			if (!strcmp(pikrellcam.motion_preview_save_mode, "first"))
-				{
-				motion_preview_area_fixup();
-				mf->do_preview_save_cmd = TRUE;
-				}
-			mf->first_detect = mf->motion_status;
-			mf->burst_detects = 0;
-			mf->direction_detects = 0;
-			mf->max_burst_count = 0;
-			mf->first_burst_count = 0;
-			if (mf->motion_status & MOTION_DIRECTION)
-				{
-				mf->direction_detects = 1;
-				}
-			if (mf->motion_status & MOTION_BURST)
-				{
-				mf->burst_detects = 1;
-				mf->first_burst_count = frame_vec->mag2_count;
-				mf->max_burst_count = frame_vec->mag2_count + mf->reject_count;
-				}
+			mf->preview_frame_vector = mf->slow_vector;
+			mf->preview_motion_area.x0 = MAX(mf->slow_vector.x - 4, 0);
+			mf->preview_motion_area.y0 = MAX(mf->slow_vector.y - 4, 0);
+			mf->preview_motion_area.x1 = MIN(mf->slow_vector.x + 4, mf->width - 1);
+			mf->preview_motion_area.y1 = MIN(mf->slow_vector.y + 4, mf->height - 1);
+			}
+		else
+			mf->preview_motion_area = mf->motion_area;
+		pikrellcam.video_notify = FALSE;
+		pikrellcam.still_notify = FALSE;
+		pikrellcam.timelapse_notify = FALSE;
 
-			if (pikrellcam.verbose_motion && !pikrellcam.verbose)
-				printf("***Motion record start: %s\n\n", pikrellcam.video_pathname);
+		if (!strcmp(pikrellcam.motion_preview_save_mode, "first"))
+			{
+			motion_preview_area_fixup();
+			mf->do_preview_save_cmd = TRUE;
 			}
-		else if (vcb->state == VCB_STATE_MOTION_RECORD)
+		mf->first_detect = mf->motion_status;
+		mf->burst_detects = 0;
+		mf->direction_detects = 0;
+		mf->slow_detects = 0;
+		mf->max_burst_count = 0;
+		mf->first_burst_count = 0;
+		if (mf->motion_status & MOTION_DIRECTION)
+			{
+			mf->direction_detects = 1;
+			}
+		if (mf->motion_status & MOTION_SLOW)
+			mf->slow_detects = 1;
+		if (mf->motion_status & MOTION_BURST)
+			{
+			mf->burst_detects = 1;
+			mf->first_burst_count = frame_vec->mag2_count;
+			mf->max_burst_count = frame_vec->mag2_count + mf->reject_count;
+			}
+
+		if (pikrellcam.verbose_motion && !pikrellcam.verbose)
+			printf("***Motion record start: %s\n\n", pikrellcam.video_pathname);
+		}
+	else if (vcb->state == VCB_STATE_MOTION_RECORD)
+		{
+		/* Already recording, so each motion trigger bumps up the record
+		|  time to now + post capture time.
+		|  If mode "best" and better composite vector, save a new preview.
+		*/
+		vcb->motion_sync_time = pikrellcam.t_now + pikrellcam.motion_times.post_capture;
+
+		if (   !(mf->motion_status & MOTION_EXTERNAL)
+		    && !strcmp(pikrellcam.motion_preview_save_mode, "best")
+		    && composite_vector_better(&mf->frame_vector, &mf->preview_frame_vector)
+		   )
 			{
-			/* Already recording, so each motion trigger bumps up the record
-			|  time to now + post capture time.
-			|  If mode "best" and better composite vector, save a new preview.
+			mf->preview_frame_vector = mf->frame_vector;
+			mf->preview_motion_area = mf->motion_area;
+			mf->do_preview_save = TRUE;
+			/* on_preview_save_cmd for save mode "best" is handled
+			|  in video_record_stop().
 			*/
-			vcb->motion_sync_time = pikrellcam.t_now + pikrellcam.motion_times.post_capture;
+			}
+		if (mf->motion_status & MOTION_DIRECTION)
+			++mf->direction_detects;
+		if (mf->motion_status & MOTION_SLOW)
+			++mf->slow_detects;
+		if (mf->motion_status & MOTION_BURST)
+			{
+			++mf->burst_detects;
+			if (mf->max_burst_count < frame_vec->mag2_count + mf->reject_count)
+				mf->max_burst_count = frame_vec->mag2_count + mf->reject_count;
+			}
+		motion_event_write(vcb, mf);
 
-			if (   !(mf->motion_status & MOTION_EXTERNAL)
-			    && !strcmp(pikrellcam.motion_preview_save_mode, "best")
-			    && composite_vector_better(&mf->frame_vector, &mf->preview_frame_vector)
-			   )
-				{
-				mf->preview_frame_vector = mf->frame_vector;
-				mf->preview_motion_area = mf->motion_area;
-				mf->do_preview_save = TRUE;
-				/* on_preview_save_cmd for save mode "best" is handled
-				|  in video_record_stop().
-				*/
-				}
-			if (mf->motion_status & MOTION_DIRECTION)
-				++mf->direction_detects;
-			if (mf->motion_status & MOTION_BURST)
-				{
-				++mf->burst_detects;
-				if (mf->max_burst_count < frame_vec->mag2_count + mf->reject_count)
-					mf->max_burst_count = frame_vec->mag2_count + mf->reject_count;
-				}
-			motion_event_write(vcb, mf);
+		if (pikrellcam.verbose_motion)
+			printf("==>Motion record bump: %s\n\n", pikrellcam.video_pathname);
+		}
+	if (pikrellcam.motion_stats)
+		motion_stats_write(vcb, mf);
 
-			if (pikrellcam.verbose_motion)
-				printf("==>Motion record bump: %s\n\n", pikrellcam.video_pathname);
+	/* A record start has motion_event_write() to do when the record
+	|  header is written, so motion_detect_done() is called after that.
+	*/
+	if (vcb->state != VCB_STATE_MOTION_RECORD_START)
+		motion_detect_done();
+	}
+
+  /* Called from the h264 callback with vcb locked with motion vectors for
+  |  the last video frame.
+  */
+void
+motion_frame_queue(uint8_t *data, int length, int64_t pts)
+	{
+	MotionQueue	*q = &motion_queue;
+	int			i;
+
+	pthread_mutex_lock(&q->mutex);
+	if (q->frames_size > 0)
+		{
+		if (q->head - q->tail >= MOTION_QUEUE_SIZE)
+			{
+			++q->tail;
+			++motion_frame.frames_dropped;
+			if (pikrellcam.debug)
+				printf("motion worker behind -> dropping motion frame.\n");
+			}
+		i = q->head % MOTION_QUEUE_SIZE;
+		memcpy(q->frames[i], data, MIN(length, q->frames_size));
+		q->video_seq[i] = video_circular_buffer.frame_seq - 1;
+		q->pts[i] = pts;
+		++q->head;
+		++motion_frame.frames_queued;
+		pthread_cond_signal(&q->work_cond);
+		}
+	pthread_mutex_unlock(&q->mutex);
+	}
+
+  /* Queued vectors are swapped into motion_frame.vectors so the queue slot
+  |  can be reused without copying while the frame is processed.
+  */
+static void *
+motion_worker(void *ptr)
+	{
+	MotionQueue		*q = &motion_queue;
+	MotionVector	*vectors;
+	unsigned int	video_seq;
+	int64_t			pts;
+	int				i;
+
+	pthread_mutex_lock(&q->mutex);
+	while (1)
+		{
+		while (q->head == q->tail)
+			pthread_cond_wait(&q->work_cond, &q->mutex);
+		i = q->tail++ % MOTION_QUEUE_SIZE;
+		vectors = motion_frame.vectors;
+		motion_frame.vectors = q->frames[i];
+		q->frames[i] = vectors;
+		video_seq = q->video_seq[i];
+		pts = q->pts[i];
+		q->busy = TRUE;
+		pthread_mutex_unlock(&q->mutex);
+
+		motion_frame_process(&video_circular_buffer, &motion_frame);
+		motion_log_frame(&motion_frame, video_seq, pts);
+
+		pthread_mutex_lock(&q->mutex);
+		q->busy = FALSE;
+		pthread_cond_broadcast(&q->done_cond);
+		}
+	return NULL;
+	}
+
+  /* Drop queued frames, release a worker waiting on a posted detect and
+  |  wait for it to go idle.  Then motion_frame can be reconfigured.
+  */
+static void
+motion_worker_sync(void)
+	{
+	MotionQueue	*q = &motion_queue;
+	int			i;
+
+	pthread_mutex_lock(&q->mutex);
+	q->tail = q->head;
+	q->detect = FALSE;
+	pthread_cond_broadcast(&q->done_cond);
+	while (q->busy)
+		pthread_cond_wait(&q->done_cond, &q->mutex);
+
+	if (q->frames_size != motion_frame.vectors_size)
+		{
+		for (i = 0; i < MOTION_QUEUE_SIZE; ++i)
+			{
+			free(q->frames[i]);
+			q->frames[i] = malloc(motion_frame.vectors_size);
 			}
-		if (pikrellcam.motion_stats)
-			motion_stats_write(vcb, mf);
+		q->frames_size = motion_frame.vectors_size;
+		}
+	pthread_mutex_unlock(&q->mutex);
+	}
+
+void
+motion_worker_init(void)
+	{
+	MotionQueue	*q = &motion_queue;
 
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->work_cond, NULL);
+	pthread_cond_init(&q->done_cond, NULL);
+	if (pthread_create(&q->thread, NULL, motion_worker, NULL) != 0)
+		{
+		log_printf("Aborting because motion worker thread create failed.  %m\n");
+		exit(1);
 		}
+	pthread_detach(q->thread);
 	}
 
 
@@ -889,6 +711,10 @@ atof_range(float *result, char *value, double low, double high)
 #define CONFIRM_GAP      18
 #define EVENT_GAP        19
 #define POST_CAPTURE     20
+#define SHOW_HEATMAP     21
+#define HEATMAP_EXPORT   22
+#define HEATMAP_RESET    23
+#define PROFILE          24
 
 typedef struct
 	{
@@ -903,8 +729,16 @@ static MotionCommand motion_commands[] =
 	{ "show_preset",  SHOW_PRESET,    1 },
 	{ "show_regions", SHOW_PRESET,    1 },
 	{ "show_vectors", SHOW_VECTORS,    1 },
+	{ "show_heatmap", SHOW_HEATMAP,    1 },
+	{ "heatmap_export", HEATMAP_EXPORT, 0 },
+	{ "heatmap_reset", HEATMAP_RESET,  0 },
+	{ "profile", PROFILE,  1 },
 	{ "new_region",    NEW_REGION,    4 },
 	{ "add_region",    ADD_REGION,    4 },		// Not a regions modify
+	{ "new_polygon",   NEW_REGION,    5 },
+	{ "add_polygon",   ADD_REGION,    5 },
+	{ "new_mask",      NEW_REGION,    5 },
+	{ "add_mask",      ADD_REGION,    5 },
 	{ "move_region",   MOVE_REGION,   5 },
 	{ "move_coarse",   MOVE_COARSE, 2 },
 	{ "move_fine",     MOVE_FINE,   2 },
@@ -926,41 +760,6 @@ static MotionCommand motion_commands[] =
 
 #define N_MOTION_COMMANDS	(sizeof(motion_commands) / sizeof(MotionCommand))
 
-static void
-motion_region_fixup(MotionRegion *mreg)
-	{
-	float	delta;
-
-	if (mreg->xf0 < 0.0)
-		mreg->xf0 = 0.0;
-	if (mreg->yf0 < 0.0)
-		mreg->yf0 = 0.0;
-
-	if (motion_frame.width > 0)
-		{
-		delta = 2.0 / (float) motion_frame.width;
-		if (mreg->xf0 > 1.0 - delta)
-			mreg->xf0 = 1.0 - delta;
-		if (mreg->dxf < delta)
-			mreg->dxf = delta;
-		delta = 2.0 / (float) motion_frame.height;
-		if (mreg->yf0 > 1.0 - delta)
-			mreg->yf0 = 1.0 - delta;
-		if (mreg->dyf < delta)
-			mreg->dyf = delta;
-		}
-
-	if (mreg->xf0 + mreg->dxf > 1.0)
-		mreg->dxf = 1.0 - mreg->xf0;
-	if (mreg->yf0 + mreg->dyf > 1.0)
-		mreg->dyf = 1.0 - mreg->yf0;
-
-	mreg->x  = motion_frame.width  * mreg->xf0;
-	mreg->y  = motion_frame.height * mreg->yf0;
-	mreg->dx = motion_frame.width  * mreg->dxf;
-	mreg->dy = motion_frame.height * mreg->dyf;
-	}
-
 static boolean
 get_motion_args(MotionRegion *mreg, char *xs, char *ys, char *dxs, char *dys,
 				double low, double high)
@@ -997,8 +796,8 @@ motion_command(char *cmd_line)
 	MotionCommand *mcmd;
 	MotionFrame   *mf = &motion_frame;
 	MotionRegion  *mreg, mrtmp;
+	MotionRegionSet *set;
 	VideoCircularBuffer *vcb = &video_circular_buffer;
-	SList         *list;
 	char          buf[64], arg1[32], arg2[32], arg3[32], arg4[32], arg5[32];
 	char          *path, *reg_name;
 	int           i, n, id = -1;
@@ -1041,47 +840,70 @@ motion_command(char *cmd_line)
 			config_set_boolean(&mf->show_vectors, arg1);
 			pikrellcam.state_modified = TRUE;
 			break;
+		case SHOW_HEATMAP:
+			config_set_boolean(&mf->show_heatmap, arg1);
+			pikrellcam.state_modified = TRUE;
+			break;
+		case HEATMAP_EXPORT:	/* heatmap_export [file.pgm|file.jpg] */
+			motion_heatmap_export(arg1);
+			break;
+		case HEATMAP_RESET:
+			mf->heat_reset = TRUE;	/* done by the motion worker */
+			log_printf("command process: motion %s\n", cmd_line);
+			break;
+		case PROFILE:			/* profile name|none */
+			if (!motion_profile_set(arg1))
+				log_printf("command process: no motion profile %s\n", arg1);
+			break;
 		/* A new_region is an edit modify from the web page.
 		|  An add_region is a load from a config file and is not a modify.
+		|  Region edits are made on a copy of the region set which is then
+		|  published, see motion_region.c
 		*/
 		case NEW_REGION:		/* new_region x y dx dy */
 			new_region = TRUE;
-		case ADD_REGION:		/* load_region x y dx dy */
-			memset((char *) &mrtmp, 0, sizeof(MotionRegion));
-			if (get_motion_args(&mrtmp, arg1, arg2, arg3, arg4, 0.00, 1.0))
+		case ADD_REGION:		/* load_region x y dx dy, see motion_region.c */
+			pthread_mutex_lock(&mf->region_write_mutex);
+			set = motion_region_set_copy(mf->region_set);
+			if (set->n_regions >= MOTION_REGIONS_MAX)
 				{
-				pthread_mutex_lock(&mf->region_list_mutex);
-				mreg = calloc(1, sizeof(MotionRegion));
-				*mreg = mrtmp;
-				motion_region_fixup(mreg);
-				mf->motion_region_list =
-							slist_append(mf->motion_region_list, mreg);
-				mf->n_regions = slist_length(mf->motion_region_list);
-				mreg->region_number = mf->n_regions - 1;
-				mf->selected_region = mreg->region_number;
+				display_inform("\"Too many motion regions.\" 3 3 1");
+				display_inform("timeout 2");
+				motion_region_set_free(set);
+				}
+			else if (motion_region_set_add(mf, set, cmd_line, pikrellcam.config_dir))
+				{
+				motion_region_set_publish(mf, set);
+				mf->selected_region = set->n_regions - 1;
 				mf->show_preset = TRUE;
 				pikrellcam.state_modified = TRUE;
 				if (new_region)
 					preset_regions_set_modified();
-				pthread_mutex_unlock(&mf->region_list_mutex);
 				}
 			else
-				;
+				{
+				log_printf("Bad motion region: %s\n", cmd_line);
+				motion_region_set_free(set);
+				}
+			pthread_mutex_unlock(&mf->region_write_mutex);
 			break;
 
 		case SELECT_REGION:		/* select_region last / select_region < / select_region > (def) */
-			if (mf->n_regions > 0)
+			pthread_mutex_lock(&mf->region_write_mutex);
+			n = mf->region_set ? mf->region_set->n_regions : 0;
+			pthread_mutex_unlock(&mf->region_write_mutex);
+			if (n > 0)
 				{
 				if (!strcmp(arg1, "last"))
-					mf->selected_region = mf->n_regions - 1;
+					mf->selected_region = n - 1;
 				else if (mf->selected_region == -1)	/* short out < or > */
 					mf->selected_region = mf->prev_selected_region;
 				else
 					{
 					mf->selected_region += (arg1[0] == '<') ? -1 : 1;
 					if (mf->selected_region < 0)
-						mf->selected_region = mf->n_regions - 1;
-					else if (mf->selected_region >= mf->n_regions)
+						mf->selected_region = n - 1;
+					else if (mf->selected_region >= n)
 						mf->selected_region = 0;
 					}
 				mf->prev_selected_region = mf->selected_region;
@@ -1100,13 +922,15 @@ motion_command(char *cmd_line)
 		case MOVE_COARSE:	/* move_coarse {x,y,dx,dy} {+,p,-,m} */
 			if ((n = mf->selected_region) >= 0)
 				{
-				pthread_mutex_lock(&mf->region_list_mutex);
+				pthread_mutex_lock(&mf->region_write_mutex);
 				if (delta == 0.0)
 					delta = 0.1;
 				if (arg2[0] == '-' || arg2[0] == 'm')
 					delta = -delta;
-				if ((mreg = slist_nth_data(mf->motion_region_list, n)) != NULL)
+				set = motion_region_set_copy(mf->region_set);
+				if (n < set->n_regions)
 					{
+					mreg = &set->regions[n];
 					if (!strcmp(arg1, "x"))
 						mreg->xf0 += delta;
 					if (!strcmp(arg1, "y"))
@@ -1115,10 +939,11 @@ motion_command(char *cmd_line)
 						mreg->dxf += delta;
 					if (!strcmp(arg1, "dy"))
 						mreg->dyf += delta;
-					motion_region_fixup(mreg);
+					motion_region_fixup(&motion_frame, mreg);
 					}
+				motion_region_set_publish(mf, set);
 				preset_regions_set_modified();
-				pthread_mutex_unlock(&mf->region_list_mutex);
+				pthread_mutex_unlock(&mf->region_write_mutex);
 				}
 			else
 				{
@@ -1128,37 +953,35 @@ motion_command(char *cmd_line)
 			break;
 
 		case MOVE_REGION:	/* 	move_region r  x y dx dy */
-			pthread_mutex_lock(&mf->region_list_mutex);
+		case ASSIGN_REGION:	/* assign_region r  x y dx dy */
+			pthread_mutex_lock(&mf->region_write_mutex);
 			n = atoi(arg1);
-			if (   (mreg = slist_nth_data(mf->motion_region_list, n)) != NULL
-			    && get_motion_args(&mrtmp, arg2, arg3, arg4, arg5, -1.0, 1.0)
+			set = motion_region_set_copy(mf->region_set);
+			if (   n >= 0 && n < set->n_regions
+			    && get_motion_args(&mrtmp, arg2, arg3, arg4, arg5,
+						(id == MOVE_REGION) ? -1.0 : 0.0, 1.0)
 		       )
 				{
-				mreg->xf0 += mrtmp.xf0;
-				mreg->yf0 += mrtmp.yf0;
-				mreg->dxf += mrtmp.dxf;
-				mreg->dyf += mrtmp.dyf;
-				motion_region_fixup(mreg);
-				}
-			preset_regions_set_modified();
-			pthread_mutex_unlock(&mf->region_list_mutex);
-			break;
-
-		case ASSIGN_REGION:		/* assign_region r  x y dx dy */
-			pthread_mutex_lock(&mf->region_list_mutex);
-			n = atoi(arg1);
-			if (   (mreg = slist_nth_data(mf->motion_region_list, n)) != NULL
-			    && get_motion_args(&mrtmp, arg2, arg3, arg4, arg5, 0.0, 1.0)
-			   )
-				{
-				mreg->xf0 = mrtmp.xf0;
-				mreg->yf0 = mrtmp.yf0;
-				mreg->dxf = mrtmp.dxf;
-				mreg->dyf = mrtmp.dyf;
-				motion_region_fixup(mreg);
+				mreg = &set->regions[n];
+				if (id == MOVE_REGION)
+					{
+					mreg->xf0 += mrtmp.xf0;
+					mreg->yf0 += mrtmp.yf0;
+					mreg->dxf += mrtmp.dxf;
+					mreg->dyf += mrtmp.dyf;
+					}
+				else
+					{
+					mreg->xf0 = mrtmp.xf0;
+					mreg->yf0 = mrtmp.yf0;
+					mreg->dxf = mrtmp.dxf;
+					mreg->dyf = mrtmp.dyf;
+					}
+				motion_region_fixup(&motion_frame, mreg);
 				}
+			motion_region_set_publish(mf, set);
 			preset_regions_set_modified();
-			pthread_mutex_unlock(&mf->region_list_mutex);
+			pthread_mutex_unlock(&mf->region_write_mutex);
 			break;
 
 		case SAVE_REGIONS:		/* save_regions config-name */
@@ -1206,46 +1029,40 @@ motion_command(char *cmd_line)
 		|  from the web page and is an edit modify of the regions.
 		*/
 		case DELETE_REGIONS:		/* delete_regions all / delete r */
-			pthread_mutex_lock(&mf->region_list_mutex);
+			pthread_mutex_lock(&mf->region_write_mutex);
+			set = motion_region_set_copy(mf->region_set);
 			if (!strcmp(arg1, "all"))
+				set->n_regions = 0;
+			else if (   !strcmp(arg1, "selected")
+			         && mf->selected_region >= 0
+			         && mf->selected_region < set->n_regions
+			        )
 				{
-				slist_and_data_free(mf->motion_region_list);
-				mf->motion_region_list = NULL;
+				motion_region_set_remove(set, mf->selected_region);
+				new_region = TRUE;
 				}
-			else if (   (   !strcmp(arg1, "selected")
-			             && mf->selected_region >= 0
-			             && (mreg = slist_nth_data(mf->motion_region_list,
-								mf->selected_region)) != NULL
-			            )
-			         || (   isdigit(arg1[0])
-			             && (mreg = slist_nth_data(mf->motion_region_list,
-									atoi(arg1))) != NULL
-			            )
+			else if (   isdigit(arg1[0])
+			         && (n = atoi(arg1)) < set->n_regions
 			        )
 				{
-				mf->motion_region_list =
-						slist_remove(mf->motion_region_list, mreg);
-				free(mreg);
-				preset_regions_set_modified();
+				motion_region_set_remove(set, n);
+				new_region = TRUE;
 				}
 			else
 				{
 				display_inform("\"Select a region first.\" 3 3 1");
 				display_inform("timeout 1");
 				}
+			motion_region_set_publish(mf, set);
+			if (new_region)		/* a region was deleted */
+				preset_regions_set_modified();
 
-			for (i = 0, list = mf->motion_region_list; list; list = list->next)
+			if (mf->selected_region >= set->n_regions - 1)
 				{
-				mreg = (MotionRegion *) list->data;
-				mreg->region_number = i++;
-				}
-			mf->n_regions = i;
-			if (mf->selected_region >= mf->n_regions - 1)
-				{
-				mf->selected_region = mf->n_regions - 1;
+				mf->selected_region = set->n_regions - 1;
 				mf->prev_selected_region = 0;
 				}
-			pthread_mutex_unlock(&mf->region_list_mutex);
+			pthread_mutex_unlock(&mf->region_write_mutex);
 			break;
 
 		case SET_LIMITS:		/* limits magnitude count */
@@ -1347,9 +1164,8 @@ motion_command(char *cmd_line)
 void
 motion_init(void)
 	{
-	MotionRegion	*mreg;
-	SList			*list;
-	static boolean	done_once = FALSE;
+	static boolean	done_once = FALSE,
+					heatmap_loaded = FALSE;
 
 	if (!done_once)
 		{
@@ -1364,23 +1180,18 @@ motion_init(void)
 	motion_frame.vectors_size =
 			motion_frame.width * motion_frame.height * sizeof(MotionVector);
 
-	for (list = motion_frame.motion_region_list; list; list = list->next)
+	if (motion_frame.frames_queued > 0)
+		log_printf("motion worker: %u frames queued, %u dropped\n",
+				motion_frame.frames_queued, motion_frame.frames_dropped);
+	motion_worker_sync();
+	motion_log_init();
+	motion_frame_alloc(&motion_frame);	/* republishes the regions */
+	if (!heatmap_loaded)
 		{
-		mreg = (MotionRegion *) list->data;
-		mreg->x  = motion_frame.width * mreg->xf0;
-		mreg->y  = motion_frame.height * mreg->yf0;
-		mreg->dx = motion_frame.width * mreg->dxf;
-		mreg->dy = motion_frame.height * mreg->dyf;
+		heatmap_loaded = TRUE;
+		motion_heatmap_load();
 		}
-
-	if (motion_frame.vectors)
-		free(motion_frame.vectors);
-	motion_frame.vectors = malloc(motion_frame.vectors_size);
-
-	if (motion_frame.trigger)
-		free(motion_frame.trigger);
-	motion_frame.trigger = malloc(MF_TRIGGER_SIZE);
-	motion_frame.motion_status = MOTION_NONE;
+	motion_profiles_compile();
 	}
 
 
@@ -1388,9 +1199,9 @@ void
 motion_regions_config_save(char *config_file, boolean inform)
 	{
 	FILE         *f;
-	SList        *list;
-	MotionRegion *mreg;
-	char         buf[128];
+	MotionRegionSet *set;
+	char         buf[256];
+	int          i, slot;
 
 	if (   !config_file
 	    || (f = fopen(config_file, "w")) == NULL
@@ -1400,12 +1211,14 @@ motion_regions_config_save(char *config_file, boolean inform)
 		return;
 		}
 
-	for (list = motion_frame.motion_region_list; list; list = list->next)
+	set = motion_region_set_acquire(&motion_frame, &slot);
+	for (i = 0; set && i < set->n_regions; ++i)
 		{
-		mreg = (MotionRegion *) list->data;
-		fprintf(f, "add_region %.3f %.3f %.3f %.3f\n",
-				mreg->xf0, mreg->yf0, mreg->dxf, mreg->dyf);
+		motion_region_config_line(&set->regions[i], buf, sizeof(buf),
+					pikrellcam.config_dir);
+		fprintf(f, "%s", buf);
 		}
+	motion_region_set_release(&motion_frame, slot);
 	fclose(f);
 
 	if (inform)
@@ -1420,9 +1233,10 @@ motion_regions_config_save(char *config_file, boolean inform)
 boolean
 motion_regions_config_load(char *config_file, boolean inform)
 	{
-	boolean	save_show;
+	MotionFrame		*mf = &motion_frame;
+	MotionRegionSet	*set;
 	FILE	*f;
-	char	*reg_name, buf[128], dbuf[128];
+	char	*reg_name, buf[256], dbuf[128];
 
 	reg_name = motion_regions_name(config_file);
 	snprintf(dbuf, sizeof(dbuf), "\"%s\" 4 3 1", reg_name);
@@ -1440,12 +1254,22 @@ motion_regions_config_load(char *config_file, boolean inform)
 		return FALSE;
 		}
 
-	save_show = motion_frame.show_preset;
-
-	motion_command("delete_regions all");
+	/* The regions are published once as a new set.
+	*/
+	pthread_mutex_lock(&mf->region_write_mutex);
+	set = motion_region_set_copy(NULL);
 	while (fgets(buf, sizeof(buf), f) != NULL)
-		motion_command(buf);
+		{
+		if (strncmp(buf, "add_", 4))
+			continue;
+		if (!motion_region_set_add(mf, set, buf, pikrellcam.config_dir))
+			log_printf("Bad or too many motion regions: %s", buf);
+		}
 	fclose(f);
+	motion_region_set_publish(mf, set);
+	mf->selected_region = set->n_regions - 1;
+	pthread_mutex_unlock(&mf->region_write_mutex);
+	pikrellcam.state_modified = TRUE;
 
 	dup_string(&pikrellcam.motion_regions_name, reg_name);
 	if (inform)
@@ -1454,6 +1278,5 @@ motion_regions_config_load(char *config_file, boolean inform)
 		display_inform(dbuf);
 		display_inform("timeout 1");
 		}
-	motion_frame.show_preset = save_show;		/* can't double send_cmd()??*/
 	return TRUE;
 	}
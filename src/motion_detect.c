@@ -0,0 +1,1196 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+#include "pikrellcam.h"
+
+  /* The motion detection of a MotionFrame.  Everything it uses is in the
+  |  MotionFrame, including the detection settings, so besides the live
+  |  motion_frame run by motion.c, other MotionFrames can be run side by side
+  |  on recorded vectors (see motion_sweep.c).
+  */
+
+#define EXPMA_SMOOTHING	0.01
+
+  /* Per macroblock noise averages are over about 2^NOISE_RATE_SHIFT motion
+  |  frames (~85 seconds at 6 motion frames/sec) so an object passing through
+  |  or stopping for a while is not learned as noise.  A block becomes noisy
+  |  when it hits on more than 1/4 of the frames and is noisy until that
+  |  drops below 1/8.  Vectors of a noisy block are masked unless their mag2
+  |  is NOISE_MAG2_SCALE times its average hit mag2.
+  */
+#define NOISE_RATE_SHIFT    9
+#define NOISE_RATE_ON       (65536 / 4)
+#define NOISE_RATE_OFF      (65536 / 8)
+#define NOISE_MAG2_SHIFT    3
+#define NOISE_MAG2_SCALE    4
+
+  /* Frame wide SAD changes are lighting changes (cloud shadows, IR switch)
+  |  or tampering.  A block SAD is high if over SAD_HIGH_SCALE times the
+  |  sad_expma baseline of the frame mean SAD and when 2/3 of the blocks are
+  |  high, detects are ignored until LIGHTING_HOLD frames after it ends.
+  |  If 3/4 of the blocks also hit mag2_limit the view has moved.  The lens
+  |  is covered when the SAD mean and spread drop under 1/8 of the slow
+  |  sad_long_expma for COVERED_FRAMES frames.
+  */
+#define SAD_EXPMA_SMOOTHING      0.05
+#define SAD_LONG_EXPMA_SMOOTHING 0.002
+#define SAD_HIGH_SCALE      3
+#define LIGHTING_HOLD       3
+#define COVERED_FRAMES      10
+
+#define SMALL_OBJECT_COUNT  15
+#define IN_BOX_COUNT_MIN    (2 * cvec->mag2_count)
+
+static CompositeVector	zero_cvec;
+
+
+  /* Sums of the passing vectors in the rectangle x0,y0 to x1-1,y1-1.
+  */
+static void
+motion_sum_area(MotionFrame *mf, int x0, int y0, int x1, int y1,
+			MotionSum *sum)
+	{
+	int			w = mf->width + 1;
+	MotionSum	*s00, *s01, *s10, *s11;
+
+	s00 = mf->sums + w * y0 + x0;
+	s01 = mf->sums + w * y0 + x1;
+	s10 = mf->sums + w * y1 + x0;
+	s11 = mf->sums + w * y1 + x1;
+
+	sum->count    = s11->count    - s01->count    - s10->count    + s00->count;
+	sum->sparkles = s11->sparkles - s01->sparkles - s10->sparkles + s00->sparkles;
+	sum->vx       = s11->vx       - s01->vx       - s10->vx       + s00->vx;
+	sum->vy       = s11->vy       - s01->vy       - s10->vy       + s00->vy;
+	sum->x        = s11->x        - s01->x        - s10->x        + s00->x;
+	sum->y        = s11->y        - s01->y        - s10->y        + s00->y;
+	}
+
+  /* Trigger states are kept in bit planes with a bit per macroblock:
+  |    trigger_hit      mag2 >= mag2_limit and inside of a motion region.
+  |    trigger_sparkle  isolated hits.
+  |    trigger_reject   hits not pointing in a region composite direction.
+  |  Hit and sparkle rows are rewritten every frame.  Reject bits are only
+  |  written for passing vectors, so instead of clearing the plane each
+  |  frame a reject row is cleared when first written in a frame and is
+  |  zero to readers unless its reject_gen is the frame trigger_gen.
+  */
+static int
+trigger_bits_count(uint64_t *row, int x0, int x1)
+	{
+	uint64_t	bits;
+	int			k, count = 0;
+
+	for (k = x0 >> 6; k <= (x1 - 1) >> 6; ++k)
+		{
+		bits = row[k];
+		if (k == x0 >> 6)
+			bits &= ~(uint64_t) 0 << (x0 & 63);
+		if (k == (x1 - 1) >> 6 && (x1 & 63))
+			bits &= ~(~(uint64_t) 0 << (x1 & 63));
+		count += __builtin_popcountll(bits);
+		}
+	return count;
+	}
+
+static uint64_t *
+trigger_reject_row(MotionFrame *mf, int y)
+	{
+	uint64_t	*row = mf->trigger_reject + mf->trigger_words * y;
+
+	if (mf->reject_gen[y] != mf->trigger_gen)
+		{
+		memset(row, 0, mf->trigger_words * sizeof(uint64_t));
+		mf->reject_gen[y] = mf->trigger_gen;
+		}
+	return row;
+	}
+
+int
+motion_trigger_state(MotionFrame *mf, int x, int y)
+	{
+	int			k = mf->trigger_words * y + (x >> 6);
+	uint64_t	bit = (uint64_t) 1 << (x & 63);
+
+	if (!(mf->trigger_hit[k] & bit))
+		return (mf->noise_bits[k] & bit) ? TRIGGER_NOISE : TRIGGER_NONE;
+	if (mf->trigger_sparkle[k] & bit)
+		return TRIGGER_SPARKLE;
+	if (mf->reject_gen[y] == mf->trigger_gen && (mf->trigger_reject[k] & bit))
+		return TRIGGER_REJECT;
+	return TRIGGER_PASS;
+	}
+
+  /* Update the noise model of a row from its mag2_limit hits and mask out
+  |  the hits of noisy blocks.  Frame wide background noise is left to
+  |  any_count_expma, this is for noise confined to parts of the frame,
+  |  eg a tree waving in the wind, that would otherwise raise the burst
+  |  background for the whole frame or keep failing region composite vectors.
+  */
+static void
+motion_noise_row(MotionFrame *mf, int y, uint64_t *hit)
+	{
+	MotionNoise		*nz = mf->noise + mf->width * y;
+	MotionVector	*mv = mf->vectors + mf->width * y;
+	uint64_t		*noisy = mf->noise_bits + mf->trigger_words * y, bit;
+	int				k, x, mag2;
+
+	for (x = 0; x < mf->width; ++x, ++nz, ++mv)
+		{
+		k = x >> 6;
+		bit = (uint64_t) 1 << (x & 63);
+		if (hit[k] & bit)
+			{
+			mag2 = mv->vx * mv->vx + mv->vy * mv->vy;
+			if ((noisy[k] & bit) && mag2 < NOISE_MAG2_SCALE * nz->mag2)
+				{
+				hit[k] &= ~bit;
+				mf->noise_count += 1;
+				}
+			nz->hit_rate += (65535 - nz->hit_rate) >> NOISE_RATE_SHIFT;
+			nz->mag2 += (MIN(mag2, 65535) - nz->mag2) >> NOISE_MAG2_SHIFT;
+			}
+		else
+			nz->hit_rate -= nz->hit_rate >> NOISE_RATE_SHIFT;
+
+		if (nz->hit_rate > NOISE_RATE_ON)
+			noisy[k] |= bit;
+		else if (nz->hit_rate < NOISE_RATE_OFF)
+			noisy[k] &= ~bit;
+		}
+	}
+
+static void
+motion_noise_reset(MotionFrame *mf)
+	{
+	memset(mf->noise, 0, mf->width * mf->height * sizeof(MotionNoise));
+	memset(mf->noise_bits, 0,
+			mf->trigger_words * mf->height * sizeof(uint64_t));
+	mf->noise_reset = FALSE;
+	}
+
+  /* SAD sums of a row for motion_sad_check() and its mag2_limit hits
+  |  before masking.  The SAD is unsigned.
+  */
+static void
+motion_sad_row(MotionFrame *mf, int y, uint64_t *hit)
+	{
+	MotionVector	*mv = mf->vectors + mf->width * y;
+	uint64_t		sum = 0, sum2 = 0;
+	int				k, x, sad, high = 0, limit;
+
+	limit = (mf->sad_expma > 0) ? SAD_HIGH_SCALE * mf->sad_expma : 65536;
+	for (x = 0; x < mf->width; ++x)
+		{
+		sad = (uint16_t) mv[x].sad;
+		sum += sad;
+		sum2 += (uint64_t) sad * sad;
+		if (sad > limit)
+			++high;
+		}
+	mf->sad_sum += sum;
+	mf->sad_sum2 += sum2;
+	mf->sad_high_count += high;
+	mf->sad_blocks += mf->width;
+	for (k = 0; k < mf->trigger_words; ++k)
+		mf->hit_count += __builtin_popcountll(hit[k]);
+	}
+
+static void
+motion_sad_check(MotionFrame *mf)
+	{
+	double	mean, var;
+	int		n = mf->sad_blocks, tamper = TAMPER_NONE;
+
+	mf->tamper_event = FALSE;
+	if (n == 0)
+		return;
+	mean = (double) mf->sad_sum / n;
+	var = (double) mf->sad_sum2 / n - mean * mean;
+	mf->sad_mean = (int) mean;
+	mf->sad_stddev = (var > 0) ? (int) sqrt(var) : 0;
+	if (mf->sad_expma == 0)
+		{
+		mf->sad_expma = mf->sad_long_expma = mean;
+		return;
+		}
+
+	if (mf->sad_high_count * 3 > n * 2)
+		{
+		mf->lighting_frames = LIGHTING_HOLD;
+		if (mf->hit_count * 4 > n * 3)
+			tamper = TAMPER_MOVED;
+		if (mf->settings.verbose)
+			printf("lighting: sad mean,sd(%d,%d) high:%d/%d expma:%.0f hits:%d\n",
+				mf->sad_mean, mf->sad_stddev, mf->sad_high_count, n,
+				mf->sad_expma, mf->hit_count);
+		}
+	else if (mf->lighting_frames > 0)
+		--mf->lighting_frames;
+
+	if (   mf->sad_mean * 8 < mf->sad_long_expma
+	    && mf->sad_stddev * 8 < mf->sad_long_expma
+	   )
+		{
+		if (++mf->covered_frames >= COVERED_FRAMES)
+			tamper = TAMPER_COVERED;
+		}
+	else
+		{
+		mf->covered_frames = 0;
+		mf->sad_long_expma = SAD_LONG_EXPMA_SMOOTHING * mean +
+					(1.0 - SAD_LONG_EXPMA_SMOOTHING) * mf->sad_long_expma;
+		}
+	mf->sad_expma = SAD_EXPMA_SMOOTHING * mean +
+					(1.0 - SAD_EXPMA_SMOOTHING) * mf->sad_expma;
+
+	/* A moved view is over once the lighting hold runs out, covered
+	|  until the SAD comes back.
+	*/
+	if (tamper != TAMPER_NONE && tamper != mf->tamper)
+		{
+		mf->tamper_event = TRUE;
+		if (tamper == TAMPER_MOVED)
+			{
+			mf->noise_reset = TRUE;
+			motion_track_reset(mf);
+			}
+		}
+	if (tamper != TAMPER_NONE)
+		mf->tamper = tamper;
+	else if (   (mf->tamper == TAMPER_MOVED && mf->lighting_frames == 0)
+	         || (mf->tamper == TAMPER_COVERED && mf->covered_frames == 0)
+	        )
+		mf->tamper = TAMPER_NONE;
+	}
+
+  /* Long term activity heatmap for placing motion regions.  Each trigger
+  |  hit left after the noise filter adds to its macroblock whether it is in
+  |  a region or not, which is the one add per hit.  Lighting changes and
+  |  tampers are left out.  Once an hour of motion frames all counts decay
+  |  by the heatmap_hours half life.
+  */
+static void
+motion_heat_row(uint32_t *heat, uint64_t *hit, int n_words)
+	{
+	uint64_t	bits;
+	int			k;
+
+	for (k = 0; k < n_words; ++k)
+		for (bits = hit[k]; bits; bits &= bits - 1)
+			heat[(k << 6) + __builtin_ctzll(bits)] += HEATMAP_HIT;
+	}
+
+static void
+motion_heat_decay(MotionFrame *mf)
+	{
+	MotionSettings	*s = &mf->settings;
+	uint32_t		*heat = mf->heat;
+	uint64_t		keep;
+	int				i, n = mf->width * mf->height;
+
+	if (s->heatmap_frames == 0 || ++mf->heat_frames < s->heatmap_frames)
+		return;
+	mf->heat_frames = 0;
+	keep = 65536.0 * pow(0.5, 1.0 / MAX(s->heatmap_hours, 1));
+	for (i = 0; i < n; ++i)
+		heat[i] = MIN(heat[i] * keep >> 16, HEATMAP_MAX);
+	}
+
+  /* Credit a passing vector or sparkle to each region it is inside of.
+  */
+static void
+motion_region_credit(MotionFrame *mf, uint64_t ids, MotionVector *mv,
+			int x, int y)
+	{
+	MotionSum	*rsum;
+
+	while (ids)
+		{
+		rsum = &mf->region_sums[__builtin_ctzll(ids)];
+		ids &= ids - 1;
+		if (!mv)
+			{
+			rsum->sparkles += 1;
+			continue;
+			}
+		rsum->count += 1;
+		rsum->vx += mv->vx;
+		rsum->vy += mv->vy;
+		rsum->x  += x;
+		rsum->y  += y;
+		}
+	}
+
+  /* One pass over the frame motion vectors so the region composite vectors
+  |  are summed no matter how many regions there are, what their shapes are
+  |  or how much they overlap.
+  |  Vectors < mag2_limit and hits of noisy blocks are filtered out, then
+  |  isolated sparkles are removed and what is left is credited to the
+  |  regions of the compiled region map, summed into the table for box
+  |  counts and listed by row for the direction filtering done per region.
+  |  Only vectors inside of motion regions are looked at.
+  */
+static void
+motion_frame_sums(MotionFrame *mf, MotionRegionMap *map)
+	{
+	MotionVector	*mv;
+	MotionSum		*sum, *above, row;
+	uint64_t		*hit, *sparkle, *region_bits, passing, bit;
+	uint32_t		*heat = NULL;
+	int				k, x, y, mb_index, n_passing,
+					w = mf->width + 1,
+					n_words = mf->trigger_words;
+
+	if (++mf->trigger_gen == 0)
+		{
+		memset(mf->reject_gen, 0, mf->height * sizeof(unsigned int));
+		mf->trigger_gen = 1;
+		}
+
+	if (mf->noise_reset)
+		motion_noise_reset(mf);
+	mf->noise_count = 0;
+	mf->sad_sum = mf->sad_sum2 = 0;
+	mf->sad_blocks = mf->sad_high_count = mf->hit_count = 0;
+
+	region_bits = map->bits;
+	memset(mf->region_sums, 0, sizeof(mf->region_sums));
+
+	if (mf->heat_reset)
+		{
+		memset(mf->heat, 0, mf->width * mf->height * sizeof(uint32_t));
+		mf->heat_frames = 0;
+		mf->heat_reset = FALSE;
+		}
+	if (   mf->settings.heatmap_frames > 0
+	    && mf->lighting_frames == 0 && mf->tamper == TAMPER_NONE
+	   )
+		heat = mf->heat;
+
+	/* Region bounds keep off the frame perimeter, so perimeter bits are
+	|  always zero and the sparkle pass can look at neighbors of any row
+	|  and bit it flags.
+	|  Camera can produce large sparkle counts during dim light (dusk/dawn).
+	*/
+	for (y = 1; y < mf->height - 1; ++y)
+		{
+		hit = mf->trigger_hit + n_words * y;
+		motion_mag2_threshold(mf->vectors + mf->width * y, hit,
+					mf->width, mf->mag2_limit);
+		motion_sad_row(mf, y, hit);
+		if (mf->settings.noise_filter)
+			motion_noise_row(mf, y, hit);
+		if (heat)
+			motion_heat_row(heat + mf->width * y, hit, n_words);
+		for (k = 0; k < n_words; ++k)
+			hit[k] &= region_bits[n_words * y + k];
+		}
+	motion_sad_check(mf);
+	motion_heat_decay(mf);
+
+	for (y = 1; y < mf->height - 1; ++y)
+		{
+		hit = mf->trigger_hit + n_words * y;
+		motion_sparkle_flag(hit - n_words, hit, hit + n_words,
+					mf->trigger_sparkle + n_words * y, n_words);
+		}
+
+	/* Table row 0 and column 0 stay zero.
+	*/
+	n_passing = 0;
+	memset(mf->sums, 0, w * sizeof(MotionSum));
+	for (y = 0; y < mf->height; ++y)
+		{
+		mf->passing_row[y] = n_passing;
+		memset(&row, 0, sizeof(MotionSum));
+		sum = mf->sums + w * (y + 1);
+		above = mf->sums + w * y;
+		memset(sum, 0, sizeof(MotionSum));
+		hit = mf->trigger_hit + n_words * y;
+		sparkle = mf->trigger_sparkle + n_words * y;
+		passing = 0;
+		for (x = 0; x < mf->width; ++x)
+			{
+			k = x >> 6;
+			bit = (uint64_t) 1 << (x & 63);
+			if ((x & 63) == 0)
+				passing = hit[k] & ~sparkle[k];
+			mb_index = mf->width * y + x;
+			if (sparkle[k] & bit)
+				{
+				row.sparkles += 1;
+				motion_region_credit(mf, map->ids[mb_index],
+							NULL, x, y);
+				}
+			else if (passing & bit)
+				{
+				mv = &mf->vectors[mb_index];
+				motion_region_credit(mf, map->ids[mb_index],
+							mv, x, y);
+				row.count += 1;
+				row.vx += mv->vx;
+				row.vy += mv->vy;
+				row.x  += x;
+				row.y  += y;
+				mf->passing[n_passing] = mb_index;
+				mf->passing_vectors[n_passing++] = *mv;
+				}
+			++sum;
+			++above;
+			sum->count    = above->count    + row.count;
+			sum->sparkles = above->sparkles + row.sparkles;
+			sum->vx       = above->vx       + row.vx;
+			sum->vy       = above->vy       + row.vy;
+			sum->x        = above->x        + row.x;
+			sum->y        = above->y        + row.y;
+			}
+		}
+	mf->passing_row[mf->height] = n_passing;
+	}
+
+static void
+get_composite_vector(MotionFrame *mf, MotionRegionMap *map, MotionRegion *mreg)
+	{
+	MotionRegionState *rs = &mf->region_state[mreg->region_number];
+	CompositeVector *cvec, tvec;
+	MotionVector    *mv;
+	MotionSum       sum;
+	Area            *area;
+	char            *mt, *mtb;
+	uint64_t        *reject, bit, id;
+	int             i, x, y, mb_index,
+	                x0, y0, x1, y1, bx0, by0, bx1, by1;
+
+	cvec = &rs->vector;
+	*cvec = zero_cvec;
+	tvec = zero_cvec;
+	rs->reject_count = 0;
+	rs->sparkle_count = 0;
+
+	motion_region_bounds(mf, mreg, &x0, &y0, &x1, &y1);
+	if (x1 <= x0 || y1 <= y0)
+		return;
+	id = (uint64_t) 1 << mreg->region_number;
+
+	/* The initial composite vector consists of motion vector clustering
+	|  of at least count 2.
+	*/
+	sum = mf->region_sums[mreg->region_number];
+	tvec.mag2_count = sum.count;
+	tvec.vx = sum.vx;
+	tvec.vy = sum.vy;
+	tvec.x  = sum.x;
+	tvec.y  = sum.y;
+	rs->sparkle_count = sum.sparkles;
+	mf->sparkle_count += sum.sparkles;
+	mf->any_count += sum.count;
+
+	/* If sparkle noise, override configured limit_count (for dusk/dawn times).
+	|  In regions with no motion, this reduces chances of a spurious reject.
+	|  In regions with motion, this tries to raise limit_count above the noise
+	|  background, but sensitivity is reduced.
+	*/
+	x = SMALL_OBJECT_COUNT;
+	if (mf->mag2_limit_count < x)
+		{
+		mf->mag2_limit_count += 2 * rs->sparkle_count / 3;
+		if (mf->mag2_limit_count > x)
+			mf->mag2_limit_count = x;
+		}
+
+	/* If we are left with enough counts for a composite vector, filter out
+	|  motion vectors not pointing in the composite directon.
+	|  Vectors of sufficient mag2 but not pointing in the right direction
+	|  will be rejects and their count can be large for noisy frames.
+	|  Dot product to allow a spread,
+	|    (avoiding sqrt() to get magnitude and scale by 100 for integer math):
+	|
+	|  cos(a) = (v1 dot v2) / mag(v1) * mag(v2))	# cos(25) = 0.906
+	|  100 * cos(25)^2 = 82 = 100 * (v1 dot v2)^2 / mag(v1)^2 * mag(v2)^2)
+	*/
+	if (tvec.mag2_count >= mf->mag2_limit_count)
+		{
+		tvec.vx /= tvec.mag2_count;
+		tvec.vy /= tvec.mag2_count;
+		tvec.mag2 = tvec.vx * tvec.vx + tvec.vy * tvec.vy;
+
+		i = mf->passing_row[y0];
+		motion_direction_filter(mf->passing_vectors + i,
+					mf->passing_row[y1] - i, tvec.vx, tvec.vy, tvec.mag2,
+					mf->passing_accept + i);
+		for (y = y0; y < y1; ++y)
+			{
+			for (i = mf->passing_row[y]; i < mf->passing_row[y + 1]; ++i)
+				{
+				mb_index = mf->passing[i];
+				if (!(map->ids[mb_index] & id))
+					continue;
+				x = mb_index - mf->width * y;
+
+				mv = &mf->passing_vectors[i];
+				reject = trigger_reject_row(mf, y) + (x >> 6);
+				bit = (uint64_t) 1 << (x & 63);
+				if (mf->passing_accept[i])
+					{
+					*reject &= ~bit;	/* if another region rejected */
+					cvec->mag2_count += 1;
+					cvec->vx += mv->vx;
+					cvec->vy += mv->vy;
+					cvec->x  += x;
+					cvec->y  += y;
+
+					area = &mf->motion_area;
+					if (area->x0 == 0 || area->x0 > x)
+						area->x0 = x;
+					if (area->x1 < x)
+						area->x1 = x;
+					if (area->y0 == 0 || area->y0 > y)
+						area->y0 = y;
+					if (area->y1 < y)
+						area->y1 = y;
+					}
+				else
+					{
+					*reject |= bit;
+					mf->reject_count += 1;
+					rs->reject_count += 1;
+					}
+				}
+			}
+		}
+
+	/* Now every vector in mag2_count has magnitude >= mag2_limit and points
+	|  with some spread in the same direction.  If there is enough of them,
+	|  we have a final composite vector.  But look at the motion vector
+	|  distribution/concentration within the region to filter for final
+	|  motion detection.
+	*/
+	rs->motion = MOTION_NONE;
+	if (cvec->mag2_count >= mf->mag2_limit_count)
+		{
+		cvec->x /= cvec->mag2_count;
+		cvec->y /= cvec->mag2_count;
+		cvec->vx /= cvec->mag2_count;
+		cvec->vy /= cvec->mag2_count;
+		cvec->mag2 = cvec->vx * cvec->vx + cvec->vy * cvec->vy;
+
+		/* Set a vertical flag.  The idea was vertical filtering would be
+		|  usefull for rain, but it turns out it's just as likely the
+		|  vectors will match in some random direction and reject counts
+		|  are a better rain filter, but look again later.
+		*/
+		cvec->vertical =
+			(cvec->vy * cvec->vy > 20 * cvec->vx * cvec->vx) ? TRUE : FALSE;
+		if (cvec->vertical)
+			mf->vertical_count += 1;
+
+		/* Get a box that will hold at least 2x mag2_count vectors
+		|  and count the vectors within the box.
+		*/
+		for (cvec->box_w = 4, cvec->box_h = 4;
+					cvec->box_w * cvec->box_h <= IN_BOX_COUNT_MIN; )
+			{
+			if (cvec->box_h <= cvec->box_w)
+				cvec->box_h += 2;
+			else
+				cvec->box_w += 2;
+			}
+
+		/* Passing vectors in the box are from the sums table and only the
+		|  rejects need to be counted.  The box can reach into other regions.
+		*/
+		bx0 = MAX(cvec->x - cvec->box_w / 2, 0);
+		bx1 = MIN(cvec->x + cvec->box_w / 2 + 1, mf->width);
+		by0 = MAX(cvec->y - cvec->box_h / 2, 0);
+		by1 = MIN(cvec->y + cvec->box_h / 2 + 1, mf->height);
+
+		cvec->in_box_count = 0;
+		cvec->in_box_rejects = 0;
+		if (bx1 > bx0 && by1 > by0)
+			{
+			for (y = by0; y < by1; ++y)
+				if (mf->reject_gen[y] == mf->trigger_gen)
+					cvec->in_box_rejects += trigger_bits_count(
+						mf->trigger_reject + mf->trigger_words * y, bx0, bx1);
+			motion_sum_area(mf, bx0, by0, bx1, by1, &sum);
+			cvec->in_box_count = sum.count - cvec->in_box_rejects;
+			}
+
+		/* Filter out smaller fast moving objects which can be fast bird fly
+		|  bys or close flying insects.
+		|  For smaller objects, always enforce reject_count rejections
+		|  (filters noisy frames: rain, camera burps).
+		|  Comparison ratios here are empirical from looking at
+		|  motion-debug output wrt drawn OSD motion vector frames.
+		*/
+		if (   !cvec->vertical
+		    || !mf->settings.vertical_filter
+		   )
+			{
+			if (cvec->mag2_count < SMALL_OBJECT_COUNT)
+				{
+				if (   cvec->in_box_count > cvec->mag2_count * 8 / 10
+				    && cvec->mag2 < 5 * mf->mag2_limit
+				    && rs->reject_count < cvec->mag2_count / 2
+				   )
+					rs->motion = MOTION_TYPE_DIR_SMALL;
+				}
+			else
+				if (   cvec->in_box_count > cvec->mag2_count * 7 / 10
+			        || (   cvec->in_box_count > cvec->mag2_count * 5 / 10
+			            && rs->reject_count < cvec->mag2_count * 4 / 10
+			           )
+			       )
+				rs->motion = MOTION_TYPE_DIR_NORMAL;
+			}
+		/* Flag it if a density of count+rejects is sufficient for a burst
+		|  detect (which still has to pass a total count check).
+		*/
+		if (mf->any_count_expma < 100.0)
+			{
+			if (cvec->in_box_count + cvec->in_box_rejects > 4 * IN_BOX_COUNT_MIN / 10)
+				rs->motion |= MOTION_TYPE_BURST_DENSITY;
+			}
+		else if (mf->any_count_expma < 300.0)
+			{
+			if (cvec->in_box_count + cvec->in_box_rejects > 7 * IN_BOX_COUNT_MIN / 10)
+				rs->motion |= MOTION_TYPE_BURST_DENSITY;
+			}
+		else
+			if (cvec->in_box_count + cvec->in_box_rejects > 9 * IN_BOX_COUNT_MIN / 10)
+				rs->motion |= MOTION_TYPE_BURST_DENSITY;
+
+		if (mf->settings.verbose)
+			{
+			printf(
+"cvec[%d]: x,y(%d,%d) dx,dy(%d,%d) mag2,count,lim(%d,%d,%d) rej,spkl,vert(%d,%d,%d)\n",
+				mreg->region_number,
+				cvec->x, cvec->y, cvec->vx, cvec->vy, cvec->mag2,
+				cvec->mag2_count, mf->mag2_limit_count, rs->reject_count,
+				rs->sparkle_count, cvec->vertical);
+			mt = "----";
+			mtb = "------";
+			if (rs->motion & MOTION_TYPE_DIR_SMALL)
+				mt = "dirS";
+			else if (rs->motion & MOTION_TYPE_DIR_NORMAL)
+				mt = "dirN";
+			if (rs->motion & MOTION_TYPE_BURST_DENSITY)
+				mtb = "burstD";
+			/* in_box density is what counts are compared to, not in_size
+			*/
+			printf(
+"   box:%dx%d in_box[cnt:%d rej:%d] density[dir:%.1f burst:%.1f]  **motion[%s,%s]\n",
+				cvec->box_w, cvec->box_h,
+				cvec->in_box_count, cvec->in_box_rejects,
+				(float) cvec->in_box_count / (float) cvec->mag2_count,
+				(float) (cvec->in_box_count + cvec->in_box_rejects)
+						/ (float) IN_BOX_COUNT_MIN,
+				mt, mtb);
+			}
+		}
+	else
+		*cvec = zero_cvec;
+	}
+
+  /* Slow motion: a far away walker can have vectors under mag2_limit on
+  |  every frame.  The vectors of the last slow_frames frames are summed per
+  |  macroblock, adding the new frame and subtracting the oldest, and the
+  |  sums scaled by 1/sqrt(slow_frames) go through the mag2_limit, sparkle
+  |  and direction filtering.  Vectors steady over the frames grow by
+  |  sqrt(slow_frames) with the scaling while random noise does not.
+  */
+  /* The slow buffers are allocated together on the first use of
+  |  slow_frames and are freed together for a new frame size.
+  */
+static void
+motion_slow_free(MotionFrame *mf)
+	{
+	free(mf->slow_ring);
+	free(mf->slow_sums);
+	free(mf->slow_vectors);
+	free(mf->slow_hit);
+	free(mf->slow_sparkle);
+	mf->slow_ring = NULL;
+	mf->slow_sums = NULL;
+	mf->slow_vectors = NULL;
+	mf->slow_hit = NULL;
+	mf->slow_sparkle = NULL;
+	mf->slow_n = 0;
+	}
+
+static void
+motion_slow_accumulate(MotionFrame *mf)
+	{
+	MotionVector	*mv = mf->vectors, *sv = mf->slow_vectors;
+	int8_t			*old;
+	int16_t			*sum = mf->slow_sums;
+	int				i, vx, vy, scale,
+					n_mb = mf->width * mf->height,
+					n = MIN(mf->settings.slow_frames, MOTION_SLOW_FRAMES_MAX);
+
+	if (n != mf->slow_n || mf->noise_reset)
+		{
+		if (!mf->slow_ring && n > 1)
+			{
+			mf->slow_ring = malloc(MOTION_SLOW_FRAMES_MAX * n_mb * 2);
+			mf->slow_sums = calloc(n_mb * 2, sizeof(int16_t));
+			mf->slow_vectors = calloc(n_mb, sizeof(MotionVector));
+			mf->slow_hit = calloc(mf->trigger_words * mf->height, sizeof(uint64_t));
+			mf->slow_sparkle = calloc(mf->trigger_words * mf->height, sizeof(uint64_t));
+			}
+		if (mf->slow_ring)
+			{
+			memset(mf->slow_ring, 0, MOTION_SLOW_FRAMES_MAX * n_mb * 2);
+			memset(mf->slow_sums, 0, n_mb * 2 * sizeof(int16_t));
+			}
+		mf->slow_n = n;
+		mf->slow_index = 0;
+		mf->slow_filled = 0;
+		sum = mf->slow_sums;
+		sv = mf->slow_vectors;
+		}
+	if (n <= 1)
+		return;
+
+	scale = (int) (256.0 / sqrt((double) n));
+	old = mf->slow_ring + mf->slow_index * n_mb * 2;
+	for (i = 0; i < n_mb; ++i, ++mv, ++sv, old += 2, sum += 2)
+		{
+		sum[0] += mv->vx - old[0];
+		sum[1] += mv->vy - old[1];
+		old[0] = mv->vx;
+		old[1] = mv->vy;
+		vx = (sum[0] * scale) >> 8;
+		vy = (sum[1] * scale) >> 8;
+		sv->vx = MAX(MIN(vx, 127), -128);
+		sv->vy = MAX(MIN(vy, 127), -128);
+		}
+	mf->slow_index = (mf->slow_index + 1) % n;
+	if (mf->slow_filled < n)
+		++mf->slow_filled;
+	}
+
+  /* Slow motion if a region has enough passing accumulated vectors and
+  |  most of them point the same way on two motion frames in a row.  Noise
+  |  can sum into small clusters, so twice the limit count is needed.
+  |  slow_vector is the composite of the region with the most.
+  */
+#define SLOW_COUNT_MIN    (2 * mf->mag2_limit_count)
+
+static boolean
+motion_slow_detect(MotionFrame *mf, MotionRegionSet *set)
+	{
+	MotionRegion	*mreg;
+	MotionVector	*mv;
+	CompositeVector	cvec;
+	uint64_t		*hit, bit, id;
+	int				i, r, k, n, x, y, x0, y0, x1, y1, count, vx, vy,
+					n_words = mf->trigger_words;
+	boolean			detect = FALSE;
+
+	mf->slow_vector = zero_cvec;
+	if (mf->slow_n <= 1 || mf->slow_filled < mf->slow_n)
+		{
+		mf->slow_passes = 0;
+		return FALSE;
+		}
+
+	for (y = 1; y < mf->height - 1; ++y)
+		{
+		hit = mf->slow_hit + n_words * y;
+		motion_mag2_threshold(mf->slow_vectors + mf->width * y, hit,
+					mf->width, mf->mag2_limit);
+		for (k = 0; k < n_words; ++k)
+			hit[k] &= set->map->bits[n_words * y + k]
+						& ~mf->noise_bits[n_words * y + k];
+		}
+	for (y = 1; y < mf->height - 1; ++y)
+		{
+		hit = mf->slow_hit + n_words * y;
+		motion_sparkle_flag(hit - n_words, hit, hit + n_words,
+					mf->slow_sparkle + n_words * y, n_words);
+		}
+
+	/* The passing buffers are done with for this frame, so reuse them.
+	*/
+	for (r = 0; r < set->n_regions; ++r)
+		{
+		mreg = &set->regions[r];
+		id = (uint64_t) 1 << r;
+		motion_region_bounds(mf, mreg, &x0, &y0, &x1, &y1);
+		n = vx = vy = 0;
+		for (y = y0; y < y1; ++y)
+			for (x = x0; x < x1; ++x)
+				{
+				k = n_words * y + (x >> 6);
+				bit = (uint64_t) 1 << (x & 63);
+				if (   !(mf->slow_hit[k] & bit) || (mf->slow_sparkle[k] & bit)
+				    || !(set->map->ids[mf->width * y + x] & id)
+				   )
+					continue;
+				mv = &mf->slow_vectors[mf->width * y + x];
+				mf->passing[n] = mf->width * y + x;
+				mf->passing_vectors[n++] = *mv;
+				vx += mv->vx;
+				vy += mv->vy;
+				}
+		if (n < mf->mag2_limit_count)
+			continue;
+
+		cvec = zero_cvec;
+		cvec.vx = vx / n;
+		cvec.vy = vy / n;
+		cvec.mag2 = cvec.vx * cvec.vx + cvec.vy * cvec.vy;
+		motion_direction_filter(mf->passing_vectors, n, cvec.vx, cvec.vy,
+					cvec.mag2, mf->passing_accept);
+		vx = vy = count = 0;
+		for (i = 0; i < n; ++i)
+			{
+			if (!mf->passing_accept[i])
+				continue;
+			++count;
+			vx += mf->passing_vectors[i].vx;
+			vy += mf->passing_vectors[i].vy;
+			cvec.x += mf->passing[i] % mf->width;
+			cvec.y += mf->passing[i] / mf->width;
+			}
+		if (count < SLOW_COUNT_MIN || count < n * 7 / 10)
+			continue;
+		detect = TRUE;
+		if (count > mf->slow_vector.mag2_count)
+			{
+			cvec.mag2_count = count;
+			cvec.x /= count;
+			cvec.y /= count;
+			cvec.vx = vx / count;
+			cvec.vy = vy / count;
+			cvec.mag2 = cvec.vx * cvec.vx + cvec.vy * cvec.vy;
+			mf->slow_vector = cvec;
+			}
+		}
+	mf->slow_passes = detect ? mf->slow_passes + 1 : 0;
+	if (mf->slow_passes < 2)
+		return FALSE;
+	if (mf->settings.verbose)
+		printf("slow:    x,y(%d,%d) dx,dy(%d,%d) mag2:%d count:%d frames:%d\n",
+			mf->slow_vector.x, mf->slow_vector.y,
+			mf->slow_vector.vx, mf->slow_vector.vy,
+			mf->slow_vector.mag2, mf->slow_vector.mag2_count, mf->slow_n);
+	return TRUE;
+	}
+
+  /* Run detection on the vectors in mf->vectors with the mf->settings.
+  |  recording is TRUE if a motion record is in progress, which skips the
+  |  confirm gap.  Results are in the motion_frame fields, eg motion_status.
+  */
+void
+motion_frame_detect(MotionFrame *mf, boolean recording)
+	{
+	MotionSettings	*s = &mf->settings;
+	MotionRegionSet	*set;
+	MotionRegionState	*rs;
+	CompositeVector	*cvec, *frame_vec;
+	int				direction_motion;
+	boolean			burst_density_pass, slow_motion;
+	int				i, slot, x0, y0, x1, y1, t;
+
+	mf->motion_status = MOTION_NONE;
+
+	mf->sparkle_count  = 0;
+	mf->reject_count   = 0;
+	mf->any_count      = 0;
+	mf->vertical_count = 0;
+
+	mf->motion_area.x0 = mf->motion_area.y0 = mf->motion_area.x1 = mf->motion_area.y1 = 0;
+	mf->mag2_limit  = s->magnitude_limit * s->magnitude_limit;
+	mf->mag2_limit_count = s->magnitude_limit_count;
+
+	/* The region set is held without blocking region edits until the next
+	|  frame, so region_state users after this frame get the matching set.
+	*/
+	if (mf->detect_set)
+		motion_region_set_release(mf, mf->detect_slot);
+	mf->detect_set = NULL;
+	if ((set = motion_region_set_acquire(mf, &slot)) == NULL)
+		return;
+	mf->detect_set = set;
+	mf->detect_slot = slot;
+	motion_slow_accumulate(mf);
+	motion_frame_sums(mf, set->map);
+	for (i = 0; i < set->n_regions; ++i)
+		{
+		get_composite_vector(mf, set->map, &set->regions[i]);
+
+		/* Revert any dynamic mag2 adjust done in get_composite_vector().
+		*/
+		mf->mag2_limit  = s->magnitude_limit * s->magnitude_limit;
+		mf->mag2_limit_count = s->magnitude_limit_count;
+		}
+
+	mf->region_motion_count = 0;
+	mf->region_fail_count = 0;
+	burst_density_pass = FALSE;
+	mf->frame_vector = zero_cvec;
+	frame_vec = &mf->frame_vector;
+	mf->cvec_count = 0;
+
+	for (i = 0; i < set->n_regions; ++i)
+		{
+		rs = &mf->region_state[i];
+		cvec = &rs->vector;
+		direction_motion = rs->motion & (MOTION_TYPE_DIR_SMALL | MOTION_TYPE_DIR_NORMAL);
+
+		if (   cvec->mag2_count > 0
+		    && !direction_motion
+		   )
+			mf->region_fail_count += 1;
+		else if (direction_motion)
+			mf->region_motion_count += 1;
+
+		if (rs->motion & MOTION_TYPE_BURST_DENSITY)
+			burst_density_pass = TRUE;
+
+		if (cvec->mag2_count > 0)
+			{
+			frame_vec->x  += cvec->x;
+			frame_vec->y  += cvec->y;
+			frame_vec->vx += cvec->vx;
+			frame_vec->vy += cvec->vy;
+			frame_vec->mag2_count += cvec->mag2_count;
+			mf->cvec_count += 1;
+			}
+		}
+
+	/* The frame composite vector is the vector sum of all the region composite
+	|  vectors and the box is formed from the max dx and dy of the region
+	|  vector box extents from the frame vector center.  This vector box is
+	|  likely smaller than the geometric box recorded in the motion_area values.
+	*/
+	if (mf->cvec_count > 0)
+		{
+		frame_vec->x /= mf->cvec_count;
+		frame_vec->y /= mf->cvec_count;
+		frame_vec->vx /= mf->cvec_count;
+		frame_vec->vy /= mf->cvec_count;
+		frame_vec->mag2 =
+			frame_vec->vx * frame_vec->vx + frame_vec->vy * frame_vec->vy;
+
+		x0 = y0 = x1 = y1 = 0;
+		for (i = 0; i < set->n_regions; ++i)
+			{
+			cvec = &mf->region_state[i].vector;
+			if (cvec->mag2_count == 0)
+				continue;
+
+			t = cvec->x - cvec->box_w / 2;
+			if (x0 == 0 || t < x0)
+				x0 = t;
+			t = cvec->x + cvec->box_w / 2;
+			if (t > x1)
+				x1 = t;
+			t = cvec->y - cvec->box_h / 2;
+			if (y0 == 0 || t < y0)
+				y0 = t;
+			t = cvec->y + cvec->box_h / 2;
+			if (t > y1)
+				y1 = t;
+			}
+		frame_vec->box_w = 2 * MAX(frame_vec->x - x0, x1 - frame_vec->x);
+		frame_vec->box_h = 2 * MAX(frame_vec->y - y0, y1 - frame_vec->y);
+		}
+	slow_motion = motion_slow_detect(mf, set);
+
+	/* To be used (large sparkle counts after sunset / before sunrise).
+	*/
+	mf->sparkle_expma = EXPMA_SMOOTHING * (float) mf->sparkle_count +
+							(1.0 - EXPMA_SMOOTHING) * mf->sparkle_expma;
+
+	mf->motion_status = MOTION_NONE;
+
+	/* Burst motion triggers on counts above the any_count_expma
+	|  background count noise.
+	*/
+	if (   burst_density_pass
+	    && frame_vec->mag2_count + mf->reject_count >
+				s->burst_count + (int) mf->any_count_expma
+	   )
+		{
+		if (mf->burst_frame < s->burst_frames)
+			++mf->burst_frame;
+		mf->motion_status = MOTION_PENDING_BURST;
+		}
+	else
+		{
+		/* any_count_expma is background noise counts so exclude from it
+		|  activity that caused any pass or fail cvecs.  It already
+		|  excludes sparkles.
+		*/
+		if (mf->region_motion_count == 0 && mf->lighting_frames == 0)
+			mf->any_count_expma = 0.02 * (float) mf->any_count +
+					(1.0 - 0.02) * mf->any_count_expma;
+		if (mf->burst_frame > 0)
+			--mf->burst_frame;
+		}
+
+	if (   mf->region_motion_count > 0
+	    && mf->region_fail_count == 0
+	   )
+		{
+		if (   !recording
+		    && mf->frame_window == 0
+		    && s->confirm_frames > 0
+		   )
+			{
+			mf->frame_window = s->confirm_frames;
+			mf->motion_status |= MOTION_PENDING_DIR;
+			}
+		else
+			mf->motion_status = (MOTION_DETECTED | MOTION_DIRECTION);
+		}
+
+	if (mf->burst_frame == s->burst_frames)
+		{
+		mf->motion_status &= ~(MOTION_PENDING_DIR | MOTION_PENDING_BURST);
+		mf->motion_status |= (MOTION_DETECTED | MOTION_BURST);
+		mf->frame_window = 0;
+		}
+	if (slow_motion)
+		mf->motion_status |= (MOTION_DETECTED | MOTION_SLOW);
+
+	if (s->lighting_filter && mf->lighting_frames > 0)
+		{
+		mf->motion_status = MOTION_NONE;
+		mf->frame_window = 0;
+		mf->burst_frame = 0;
+		}
+	if (mf->external_trigger)
+		{
+		mf->external_trigger = FALSE;
+		mf->motion_status &= ~(MOTION_PENDING_DIR | MOTION_PENDING_BURST);
+		mf->motion_status |= (MOTION_DETECTED | MOTION_EXTERNAL);
+		mf->frame_window = 0;
+		}
+
+	if (mf->frame_window > 0)
+		mf->frame_window -= 1;
+
+	if (   s->verbose
+	    && frame_vec->mag2_count > 0
+	   )
+		{
+		printf(
+"frame:   x,y(%d,%d) dx,dy(%d,%d) mag2:%d count,rej(%d,%d) any[%d,%.1f] burst:%d noise:%d\n",
+			frame_vec->x, frame_vec->y, frame_vec->vx, frame_vec->vy,
+			frame_vec->mag2, frame_vec->mag2_count, mf->reject_count,
+			mf->any_count, mf->any_count_expma, mf->burst_frame,
+			mf->noise_count);
+		}
+	if (mf->burst_frame == s->burst_frames)
+		mf->burst_frame = 0;
+
+	motion_track_frame(mf);
+	}
+
+  /* Allocate the per frame buffers for mf->width x mf->height macroblocks.
+  */
+void
+motion_frame_alloc(MotionFrame *mf)
+	{
+	MotionRegionSet	*set;
+	MotionRegion	*mreg;
+	int				i, n;
+
+	mf->vectors_size = mf->width * mf->height * sizeof(MotionVector);
+	free(mf->vectors);
+	mf->vectors = malloc(mf->vectors_size);
+
+	mf->trigger_words = (mf->width + 63) / 64;
+	n = mf->trigger_words * mf->height;
+	free(mf->trigger_hit);
+	mf->trigger_hit = calloc(n, sizeof(uint64_t));
+	free(mf->trigger_sparkle);
+	mf->trigger_sparkle = calloc(n, sizeof(uint64_t));
+	free(mf->trigger_reject);
+	mf->trigger_reject = calloc(n, sizeof(uint64_t));
+
+	/* Regions are kept as fractions of the frame, so republish them
+	|  compiled for the new size.
+	*/
+	pthread_mutex_lock(&mf->region_write_mutex);
+	set = motion_region_set_copy(mf->region_set);
+	for (i = 0; i < set->n_regions; ++i)
+		{
+		mreg = &set->regions[i];
+		mreg->x  = mf->width * mreg->xf0;
+		mreg->y  = mf->height * mreg->yf0;
+		mreg->dx = mf->width * mreg->dxf;
+		mreg->dy = mf->height * mreg->dyf;
+		}
+	motion_region_set_publish(mf, set);
+	pthread_mutex_unlock(&mf->region_write_mutex);
+	free(mf->noise_bits);
+	mf->noise_bits = calloc(n, sizeof(uint64_t));
+	free(mf->noise);
+	mf->noise = calloc(mf->width * mf->height, sizeof(MotionNoise));
+	free(mf->reject_gen);
+	mf->reject_gen = calloc(mf->height, sizeof(unsigned int));
+	if (mf->heat_width != mf->width || mf->heat_height != mf->height)
+		{
+		free(mf->heat);
+		mf->heat = calloc(mf->width * mf->height, sizeof(uint32_t));
+		mf->heat_width = mf->width;
+		mf->heat_height = mf->height;
+		mf->heat_frames = 0;
+		}
+	mf->trigger_gen = 0;
+	free(mf->sums);
+	mf->sums = malloc((mf->width + 1) * (mf->height + 1) * sizeof(MotionSum));
+	free(mf->passing);
+	mf->passing = malloc(mf->width * mf->height * sizeof(int));
+	free(mf->passing_vectors);
+	mf->passing_vectors = malloc(mf->width * mf->height * sizeof(MotionVector));
+	free(mf->passing_accept);
+	mf->passing_accept = malloc(mf->width * mf->height);
+	free(mf->passing_row);
+	mf->passing_row = malloc((mf->height + 1) * sizeof(int));
+	motion_track_alloc(mf);
+	motion_slow_free(mf);
+	mf->motion_status = MOTION_NONE;
+	}
+
+  /* Forget the detection history, eg before running a different recording.
+  */
+void
+motion_frame_detect_reset(MotionFrame *mf)
+	{
+	mf->motion_status = MOTION_NONE;
+	mf->sparkle_expma = 0;
+	mf->any_count_expma = 0;
+	mf->frame_window = 0;
+	mf->burst_frame = 0;
+	motion_noise_reset(mf);
+	motion_track_reset(mf);
+	mf->sad_expma = mf->sad_long_expma = 0;
+	mf->lighting_frames = 0;
+	mf->covered_frames = 0;
+	mf->slow_n = 0;		/* restart the accumulation */
+	mf->tamper = TAMPER_NONE;
+	}
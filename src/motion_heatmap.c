@@ -0,0 +1,257 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+#include "pikrellcam.h"
+
+  /* The motion heatmap counts are kept by the motion worker, see
+  |  motion_heat_row() in motion_detect.c.  Here they are saved, loaded,
+  |  turned into display levels and exported.  The save and export run
+  |  from the main thread, so the counts may be a frame out of date while
+  |  they are read.
+  |
+  |  A saved heatmap is a HeatmapHeader followed by the byte planes of the
+  |  counts (low byte first) run length encoded with motion_log_encode().
+  |  Most of a frame is quiet so the planes are mostly zero runs.
+  */
+#define	HEATMAP_MAGIC		"PKHM"
+#define	HEATMAP_VERSION		1
+
+typedef struct
+	{
+	char		magic[4];
+	uint16_t	version,
+				width,
+				height,
+				hit;			/* HEATMAP_HIT of the counts */
+	uint32_t	length;			/* of the encoded planes that follow */
+	}
+	HeatmapHeader;
+
+void
+motion_heatmap_save(void)
+	{
+	MotionFrame		*mf = &motion_frame;
+	HeatmapHeader	hdr;
+	FILE			*f;
+	uint8_t			*planes, *enc;
+	uint32_t		v;
+	char			*fname_part;
+	int				i, n, length;
+
+	if (   !mf->heat || !pikrellcam.motion_heatmap_file
+	    || pikrellcam.motion_heatmap_hours == 0
+	   )
+		return;
+
+	n = mf->heat_width * mf->heat_height;
+	planes = malloc(4 * n);
+	enc = malloc(MOTION_LOG_ENCODE_MAX(4 * n));
+	if (!planes || !enc)
+		{
+		free(planes);
+		free(enc);
+		return;
+		}
+	for (i = 0; i < n; ++i)
+		{
+		v = mf->heat[i];
+		planes[i] = v;
+		planes[n + i] = v >> 8;
+		planes[2 * n + i] = v >> 16;
+		planes[3 * n + i] = v >> 24;
+		}
+	length = motion_log_encode(enc, planes, 4 * n);
+
+	memcpy(hdr.magic, HEATMAP_MAGIC, 4);
+	hdr.version = HEATMAP_VERSION;
+	hdr.width = mf->heat_width;
+	hdr.height = mf->heat_height;
+	hdr.hit = HEATMAP_HIT;
+	hdr.length = length;
+
+	asprintf(&fname_part, "%s.part", pikrellcam.motion_heatmap_file);
+	if ((f = fopen(fname_part, "w")) == NULL)
+		log_printf("Failed to save motion heatmap %s. %m\n", fname_part);
+	else
+		{
+		if (   fwrite(&hdr, sizeof(hdr), 1, f) == 1
+		    && fwrite(enc, length, 1, f) == 1
+		    && fclose(f) == 0
+		   )
+			rename(fname_part, pikrellcam.motion_heatmap_file);
+		else
+			log_printf("Failed to write motion heatmap %s.\n", fname_part);
+		}
+	free(fname_part);
+	free(planes);
+	free(enc);
+	}
+
+  /* Called from motion_init() with the motion worker idle.  A heatmap of a
+  |  different video size is ignored and starts over.
+  */
+void
+motion_heatmap_load(void)
+	{
+	MotionFrame		*mf = &motion_frame;
+	HeatmapHeader	hdr;
+	FILE			*f;
+	uint8_t			*planes = NULL, *enc = NULL;
+	int				i, n;
+	boolean			ok = FALSE;
+
+	if (   !mf->heat || !pikrellcam.motion_heatmap_file
+	    || (f = fopen(pikrellcam.motion_heatmap_file, "r")) == NULL
+	   )
+		return;
+
+	n = mf->heat_width * mf->heat_height;
+	if (   fread(&hdr, sizeof(hdr), 1, f) == 1
+	    && !strncmp(hdr.magic, HEATMAP_MAGIC, 4)
+	    && hdr.version == HEATMAP_VERSION
+	    && hdr.hit == HEATMAP_HIT
+	   )
+		{
+		if (hdr.width != mf->heat_width || hdr.height != mf->heat_height)
+			{
+			log_printf("Motion heatmap %dx%d is not the video size, starting over.\n",
+					hdr.width, hdr.height);
+			fclose(f);
+			return;
+			}
+		/* The length is bounded by what the encoder can write for the
+		|  planes, so a corrupt header can't ask for a huge buffer.
+		*/
+		if (hdr.length > 0 && hdr.length <= MOTION_LOG_ENCODE_MAX(4 * n))
+			{
+			planes = malloc(4 * n);
+			enc = malloc(hdr.length);
+			}
+		if (   planes && enc
+		    && fread(enc, hdr.length, 1, f) == 1
+		    && motion_log_rle_decode(enc, hdr.length, planes, 4 * n) == 0
+		   )
+			{
+			for (i = 0; i < n; ++i)
+				mf->heat[i] = planes[i] | planes[n + i] << 8
+						| planes[2 * n + i] << 16
+						| (uint32_t) planes[3 * n + i] << 24;
+			ok = TRUE;
+			}
+		}
+	fclose(f);
+	free(planes);
+	free(enc);
+
+	if (!ok)
+		log_printf("Bad motion heatmap file %s, starting over.\n",
+				pikrellcam.motion_heatmap_file);
+	}
+
+  /* Heatmap counts scaled to 0 - 255 levels of the busiest macroblock for
+  |  display and export.  The square root keeps occasional motion visible
+  |  next to blocks that are busy all day.  Returns FALSE if there are no
+  |  counts yet.
+  */
+boolean
+motion_heatmap_levels(MotionFrame *mf, uint8_t *levels)
+	{
+	uint32_t	max = 0;
+	int			i, n = mf->heat_width * mf->heat_height;
+
+	if (!mf->heat)
+		return FALSE;
+	for (i = 0; i < n; ++i)
+		max = MAX(max, mf->heat[i]);
+	if (max == 0)
+		{
+		memset(levels, 0, n);
+		return FALSE;
+		}
+	for (i = 0; i < n; ++i)
+		levels[i] = 255.0 * sqrt((double) mf->heat[i] / max);
+	return TRUE;
+	}
+
+  /* Export the heatmap as a PGM image with a HEATMAP_EXPORT_SCALE pixel
+  |  square per macroblock.  A name ending in .jpg is converted from a PGM
+  |  in the tmpfs directory by ImageMagick convert, which the install
+  |  already requires for thumbs.  Names without a '/' are in the media
+  |  directory.
+  */
+void
+motion_heatmap_export(char *name)
+	{
+	MotionFrame	*mf = &motion_frame;
+	FILE		*f;
+	uint8_t		*levels, *row;
+	char		*path, *pgm, *cmd, *s;
+	int			x, y, i, width, height;
+	boolean		jpeg;
+
+	if (!mf->heat)
+		return;
+	if (!name || !*name)
+		name = "motion-heatmap.jpg";
+	if (strchr(name, '/'))
+		path = strdup(name);
+	else
+		asprintf(&path, "%s/%s", pikrellcam.media_dir, name);
+
+	s = strrchr(path, '.');
+	jpeg = (s && !strcmp(s, ".jpg"));
+	if (jpeg)
+		asprintf(&pgm, "%s/motion-heatmap.pgm", pikrellcam.tmpfs_dir);
+	else
+		pgm = path;
+
+	width = mf->heat_width * HEATMAP_EXPORT_SCALE;
+	height = mf->heat_height * HEATMAP_EXPORT_SCALE;
+	levels = malloc(mf->heat_width * mf->heat_height);
+	row = malloc(width);
+	motion_heatmap_levels(mf, levels);
+
+	if ((f = fopen(pgm, "w")) == NULL)
+		log_printf("Failed to export motion heatmap %s. %m\n", pgm);
+	else
+		{
+		fprintf(f, "P5\n%d %d\n255\n", width, height);
+		for (y = 0; y < mf->heat_height; ++y)
+			{
+			for (x = 0; x < width; ++x)
+				row[x] = levels[mf->heat_width * y + x / HEATMAP_EXPORT_SCALE];
+			for (i = 0; i < HEATMAP_EXPORT_SCALE; ++i)
+				fwrite(row, width, 1, f);
+			}
+		fclose(f);
+		if (jpeg)
+			{
+			asprintf(&cmd, "convert %s %s", pgm, path);
+			exec_no_wait(cmd, NULL);
+			free(cmd);
+			}
+		log_printf("Motion heatmap exported to %s\n", path);
+		}
+	free(levels);
+	free(row);
+	if (pgm != path)
+		free(pgm);
+	free(path);
+	}
@@ -0,0 +1,401 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+#include "pikrellcam.h"
+
+  /* Motion vector log.  With motion_vectors_record on, each motion .mp4
+  |  video gets a .mvlog file with the raw motion vectors and the motion
+  |  frame results for every processed motion frame so detection can be
+  |  rerun on real footage.  Layout (native byte order):
+  |
+  |      MotionLogHeader
+  |      frame records:  MotionLogFrameHeader, encoded vectors, pad to 8
+  |      MotionLogIndex[n_frames] at header.index_offset
+  |
+  |  The index and n_frames are written when the log is closed.  An
+  |  unfinished log (index_offset 0) can still be read by walking the frame
+  |  record lengths.
+  |  The encoded vectors are described in motion_log_codec.c.  A log starts
+  |  on a keyframe and there is one every MOTION_LOG_KEY_INTERVAL frames.
+  |
+  |  Motion frames are encoded by the motion worker into a ring big enough
+  |  for the pre capture time, and the video writer thread writes them out
+  |  along with the video frames they go with.
+  */
+
+MotionLog	motion_log;
+
+
+  /* (Re)allocate the ring when motion vector recording is on.  Called from
+  |  motion_init() with the motion worker idle.
+  */
+void
+motion_log_init(void)
+	{
+	VideoCircularBuffer	*vcb = &video_circular_buffer;
+	MotionLog			*log = &motion_log;
+	int					i, n, seconds, n_frames, size = 0;
+
+	n = motion_frame.width * motion_frame.height;
+	if (pikrellcam.motion_vectors_record)
+		{
+		seconds = MAX(pikrellcam.motion_times.event_gap,
+					pikrellcam.motion_times.pre_capture) + 5;
+		n_frames = seconds * pikrellcam.camera_adjust.video_fps
+					/ MAX(pikrellcam.mjpeg_divider, 1);
+
+		/* Typical frames are mostly zero planes and a noisy sad plane.
+		*/
+		size = MAX(n_frames * sizeof(MotionVector) * n / 4,
+					4 * sizeof(MotionVector) * n);
+		}
+	if (size == log->size && n == log->n_vectors)
+		return;
+
+	/* The writer thread may still be reading out of the old ring.  Keep
+	|  vcb locked until the new ring is set up so no record can start
+	|  writing out of it before then.
+	*/
+	pthread_mutex_lock(&vcb->mutex);
+	video_writer_sync(vcb);
+
+	free(log->data);
+	free(log->index);
+	free(log->prev);
+	free(log->delta);
+	free(log->buf);
+	log->data = NULL;
+	log->index = NULL;
+	log->prev = NULL;
+	log->delta = NULL;
+	log->buf = NULL;
+	log->size = size;
+	log->n_vectors = n;
+	if (size == 0)
+		{
+		pthread_mutex_unlock(&vcb->mutex);
+		return;
+		}
+
+	for (i = 64; i < 2 * n_frames; i <<= 1)
+		;
+	log->index_size = i;
+	log->index = calloc(i, sizeof(MotionLogEntry));
+	log->data = malloc(size);
+	log->prev = malloc(n * sizeof(MotionVector));
+	log->delta = malloc(4 * n);
+	log->buf_size = sizeof(MotionLogFrameHeader) + 4 * n
+				+ 4 * n / MOTION_LOG_RUN_MAX + 16;
+	log->buf = malloc(log->buf_size);
+	if (!log->index || !log->data || !log->prev || !log->delta || !log->buf)
+		{
+		log_printf("Aborting because motion log malloc() failed.\n");
+		exit(1);
+		}
+
+	/* Every entry must look older than the next frame.
+	*/
+	for (i = 0; i < log->index_size; ++i)
+		log->index[i].seq = log->seq - log->index_size
+				+ ((i - log->seq) & (log->index_size - 1));
+	log->key_count = 0;
+	pthread_mutex_unlock(&vcb->mutex);
+	log_printf("motion log allocate: %.2f MBytes\n", (float) size / 1000000.0);
+	}
+
+  /* Called by the motion worker after motion_frame_process().
+  */
+void
+motion_log_frame(MotionFrame *mf, unsigned int video_seq, uint64_t pts)
+	{
+	MotionLog				*log = &motion_log;
+	MotionLogFrameHeader	*fh;
+	MotionLogSummary		*s;
+	MotionLogEntry			*entry;
+	MotionVector			*mv, *pv;
+	boolean					keyframe;
+	int						i, n = log->n_vectors, length, end_space, position;
+
+	if (!log->data || !pikrellcam.motion_vectors_record)
+		return;
+
+	keyframe = (log->key_count == 0);
+	if (keyframe)
+		memset(log->prev, 0, n * sizeof(MotionVector));
+	log->key_count = (log->key_count + 1) % MOTION_LOG_KEY_INTERVAL;
+
+	for (i = 0; i < n; ++i)
+		{
+		mv = &mf->vectors[i];
+		pv = &log->prev[i];
+		log->delta[i]         = (uint8_t) (mv->vx - pv->vx);
+		log->delta[n + i]     = (uint8_t) (mv->vy - pv->vy);
+		log->delta[2 * n + i] = (uint8_t) (mv->sad - pv->sad);
+		log->delta[3 * n + i] = (uint8_t) ((uint16_t) (mv->sad - pv->sad) >> 8);
+		}
+	memcpy(log->prev, mf->vectors, n * sizeof(MotionVector));
+
+	fh = (MotionLogFrameHeader *) log->buf;
+	memset(fh, 0, sizeof(MotionLogFrameHeader));
+	length = sizeof(MotionLogFrameHeader)
+				+ motion_log_encode(log->buf + sizeof(MotionLogFrameHeader),
+							log->delta, 4 * n);
+	while (length & 7)
+		log->buf[length++] = 0;
+	fh->length = length;
+	fh->flags = keyframe ? MOTION_LOG_KEYFRAME : 0;
+	fh->pts = pts;
+	s = &fh->summary;
+	s->x = mf->frame_vector.x;
+	s->y = mf->frame_vector.y;
+	s->vx = mf->frame_vector.vx;
+	s->vy = mf->frame_vector.vy;
+	s->mag2 = mf->frame_vector.mag2;
+	s->mag2_count = mf->frame_vector.mag2_count;
+	s->reject_count = mf->reject_count;
+	s->sparkle_count = mf->sparkle_count;
+	s->any_count = mf->any_count;
+	s->motion_status = mf->motion_status;
+	s->mag2_limit = mf->mag2_limit;
+	s->mag2_limit_count = mf->mag2_limit_count;
+
+	/* Let a reader see what is about to be overwritten before it is.
+	*/
+	__atomic_store_n(&log->write_end, log->head_offset + length,
+				__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	position = log->head_offset % log->size;
+	end_space = log->size - position;
+	if (length <= end_space)
+		memcpy(log->data + position, log->buf, length);
+	else
+		{
+		memcpy(log->data + position, log->buf, end_space);
+		memcpy(log->data, log->buf + end_space, length - end_space);
+		}
+
+	/* Same index entry publishing as the video frame index.
+	*/
+	entry = &log->index[log->seq & (log->index_size - 1)];
+	__atomic_store_n(&entry->seq, log->seq - 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	entry->video_seq = video_seq;
+	entry->offset = log->head_offset;
+	entry->length = length;
+	entry->keyframe = keyframe;
+	__atomic_store_n(&entry->seq, log->seq, __ATOMIC_RELEASE);
+
+	log->head_offset += length;
+	__atomic_store_n(&log->seq, log->seq + 1, __ATOMIC_RELEASE);
+	}
+
+static void
+motion_log_write_error(MotionLogFile *lf)
+	{
+	if (!lf->write_error)
+		{
+		lf->write_error = TRUE;
+		log_printf("Motion log write error: %s.  %m\n", lf->pathname);
+		}
+	}
+
+  /* Writer thread, when the record header is written.  Start the log on the
+  |  newest keyframe at or before the first video frame of the record.
+  */
+void
+motion_log_start(VideoRecord *record)
+	{
+	VideoCircularBuffer	*vcb = &video_circular_buffer;
+	MotionLog			*log = &motion_log;
+	MotionLogFile		*lf = &record->mvlog;
+	MotionLogEntry		entry;
+	MotionLogHeader		header;
+	VideoFrame			*frame;
+	unsigned int		seq, start;
+	int					i;
+
+	if (!lf->pathname || !log->data)
+		return;
+	if ((lf->file = fopen(lf->pathname, "w+")) == NULL)
+		{
+		log_printf("Could not create motion log %s.  %m\n", lf->pathname);
+		return;
+		}
+
+	seq = __atomic_load_n(&log->seq, __ATOMIC_ACQUIRE);
+	start = seq;
+	for (i = 1; i < log->index_size; ++i)
+		{
+		entry = log->index[(seq - i) & (log->index_size - 1)];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (entry.seq != seq - i)
+			break;
+		if (entry.keyframe)
+			{
+			start = entry.seq;
+			if ((int) (entry.video_seq - record->frame_seq) <= 0)
+				break;
+			}
+		}
+	lf->seq = start;
+	lf->video_seq = record->frame_seq;
+	lf->need_keyframe = TRUE;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MOTION_LOG_MAGIC, sizeof(header.magic));
+	header.version = MOTION_LOG_VERSION;
+	header.header_size = sizeof(MotionLogHeader);
+	header.frame_header_size = sizeof(MotionLogFrameHeader);
+	header.width = motion_frame.width;
+	header.height = motion_frame.height;
+	header.key_interval = MOTION_LOG_KEY_INTERVAL;
+	header.video_fps = record->nominal_fps;
+	header.mjpeg_divider = MAX(pikrellcam.mjpeg_divider, 1);
+	frame = &vcb->frame_index[record->frame_seq & (vcb->frame_index_size - 1)];
+	if (__atomic_load_n(&frame->seq, __ATOMIC_ACQUIRE) == record->frame_seq)
+		header.start_pts = frame->pts;
+	if (fwrite(&header, sizeof(header), 1, lf->file) != 1)
+		motion_log_write_error(lf);
+	lf->offset = sizeof(header);
+	}
+
+  /* Writer thread, after video data is muxed.  Write out the logged frames
+  |  for the video frames muxed so far.
+  */
+void
+motion_log_write(VideoRecord *record)
+	{
+	MotionLog				*log = &motion_log;
+	MotionLogFile			*lf = &record->mvlog;
+	MotionLogEntry			*entry, e;
+	MotionLogFrameHeader	*fh;
+	MotionLogIndex			*index;
+	static uint8_t			*buf;
+	static int				buf_size;
+	unsigned int			seq;
+	int						lost, position, end_space;
+
+	if (!lf->file)
+		return;
+
+	while (1)
+		{
+		entry = &log->index[lf->seq & (log->index_size - 1)];
+		seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+		lost = (int) (seq - lf->seq);
+		if (lost < 0)		/* not logged yet */
+			break;
+		e = *entry;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq)
+			continue;		/* rewritten while copying, so now lost */
+		if (lost > 0)
+			{
+			lf->overruns += 1;
+			lf->seq = e.seq;
+			lf->need_keyframe = TRUE;
+			continue;
+			}
+		if ((int) (e.video_seq - record->frame_seq) >= 0)
+			break;			/* video not muxed that far yet */
+		lf->seq += 1;
+
+		if (e.length > buf_size)
+			{
+			buf_size = e.length + e.length / 4;
+			buf = realloc(buf, buf_size);
+			}
+		position = e.offset % log->size;
+		end_space = log->size - position;
+		if (e.length <= end_space)
+			memcpy(buf, log->data + position, e.length);
+		else
+			{
+			memcpy(buf, log->data + position, end_space);
+			memcpy(buf + end_space, log->data, e.length - end_space);
+			}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&log->write_end, __ATOMIC_RELAXED) - e.offset
+					> (unsigned int) log->size)
+			{
+			lf->overruns += 1;		/* overwritten while copying */
+			lf->need_keyframe = TRUE;
+			continue;
+			}
+		if (lf->need_keyframe && !e.keyframe)
+			continue;
+		lf->need_keyframe = FALSE;
+
+		fh = (MotionLogFrameHeader *) buf;
+		fh->video_frame = (int) (e.video_seq - lf->video_seq);
+		if (fwrite(buf, 1, e.length, lf->file) != e.length)
+			motion_log_write_error(lf);
+
+		if (lf->n_frames >= lf->index_alloc)
+			{
+			lf->index_alloc += 256;
+			lf->index = realloc(lf->index,
+						lf->index_alloc * sizeof(MotionLogIndex));
+			}
+		index = &lf->index[lf->n_frames++];
+		index->pts = fh->pts;
+		index->offset = lf->offset;
+		index->flags = fh->flags;
+		index->video_frame = fh->video_frame;
+		lf->offset += e.length;
+		}
+	}
+
+  /* Writer thread, at record close.  Write the index and patch the header.
+  */
+void
+motion_log_finish(VideoRecord *record)
+	{
+	MotionLogFile	*lf = &record->mvlog;
+	MotionLogHeader	header;
+
+	if (lf->file)
+		{
+		motion_log_write(record);
+		if (   fwrite(lf->index, sizeof(MotionLogIndex), lf->n_frames, lf->file)
+		           != lf->n_frames
+		    || fseek(lf->file, 0, SEEK_SET) != 0
+		    || fread(&header, sizeof(header), 1, lf->file) != 1
+		   )
+			motion_log_write_error(lf);
+		else
+			{
+			header.n_frames = lf->n_frames;
+			header.index_offset = lf->offset;
+			if (   fseek(lf->file, 0, SEEK_SET) != 0
+			    || fwrite(&header, sizeof(header), 1, lf->file) != 1
+			   )
+				motion_log_write_error(lf);
+			}
+		if (fclose(lf->file) != 0)
+			motion_log_write_error(lf);
+		lf->file = NULL;
+		if (lf->overruns > 0)
+			log_printf("    motion log overruns: %d\n", lf->overruns);
+		}
+	free(lf->index);
+	lf->index = NULL;
+	}
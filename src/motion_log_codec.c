@@ -0,0 +1,163 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+#include "pikrellcam.h"
+
+  /* Motion log vector encoding, shared by the motion log writer and the
+  |  tools that read logs back.
+  |  Encoded vectors are the vx, vy, sad low byte and sad high byte planes
+  |  of a frame, each byte the difference from the previous frame (from zero
+  |  for a MOTION_LOG_KEYFRAME), run length encoded with a control byte c:
+  |      c < 128:   c + 1 zero bytes
+  |      c >= 128:  c - 127 literal bytes follow
+  |  Encoded length is at most MOTION_LOG_ENCODE_MAX(length).
+  */
+
+int
+motion_log_encode(uint8_t *out, uint8_t *in, int length)
+	{
+	uint8_t	*start = out;
+	int		i = 0, n;
+
+	while (i < length)
+		{
+		if (in[i] == 0)
+			{
+			for (n = 1; i + n < length && n < MOTION_LOG_RUN_MAX; ++n)
+				if (in[i + n] != 0)
+					break;
+			*out++ = n - 1;
+			}
+		else
+			{
+			/* A single zero is cheaper kept in a literal than ending it.
+			*/
+			for (n = 1; i + n < length && n < MOTION_LOG_RUN_MAX; ++n)
+				if (   in[i + n] == 0
+				    && (i + n + 1 >= length || in[i + n + 1] == 0)
+				   )
+					break;
+			*out++ = 127 + n;
+			memcpy(out, in + i, n);
+			out += n;
+			}
+		i += n;
+		}
+	return out - start;
+	}
+
+  /* Walk encoded data that decodes to length bytes, calling literal() for
+  |  each literal run.  Zero runs are only skipped over.  Returns the number
+  |  of encoded bytes used (a motion log frame is padded after them), or -1
+  |  if the data is bad.
+  */
+static int
+rle_walk(uint8_t *in, int in_length, int length,
+			void (*literal)(void *data, int i, uint8_t *bytes, int run),
+			void *data)
+	{
+	uint8_t	*start = in, *end = in + in_length, c;
+	int		i = 0, run;
+
+	while (in < end && i < length)
+		{
+		c = *in++;
+		if (c < 128)
+			{
+			i += c + 1;
+			continue;
+			}
+		run = c - 127;
+		if (in + run > end || i + run > length)
+			return -1;
+		(*literal)(data, i, in, run);
+		in += run;
+		i += run;
+		}
+	return (i == length) ? in - start : -1;
+	}
+
+static void
+bytes_literal(void *data, int i, uint8_t *bytes, int run)
+	{
+	memcpy((uint8_t *) data + i, bytes, run);
+	}
+
+  /* Decode to length plain bytes, eg the saved motion heatmap planes.
+  |  All of the in_length encoded bytes must be used.  Returns -1 if the
+  |  data is bad.
+  */
+int
+motion_log_rle_decode(uint8_t *in, int in_length, uint8_t *out, int length)
+	{
+	memset(out, 0, length);
+	if (rle_walk(in, in_length, length, bytes_literal, out) != in_length)
+		return -1;
+	return 0;
+	}
+
+typedef struct
+	{
+	MotionVector	*vectors;
+	int				n;
+	}
+	VectorPlanes;
+
+static void
+vectors_literal(void *data, int i, uint8_t *bytes, int run)
+	{
+	VectorPlanes	*vp = (VectorPlanes *) data;
+	MotionVector	*vectors = vp->vectors;
+	int				k, n = vp->n;
+	uint8_t			d;
+
+	for (k = 0; k < run; ++k, ++i)
+		{
+		d = bytes[k];
+		switch (i / n)
+			{
+			case 0:
+				vectors[i].vx += d;
+				break;
+			case 1:
+				vectors[i - n].vy += d;
+				break;
+			case 2:
+				vectors[i - 2 * n].sad += d;
+				break;
+			case 3:
+				vectors[i - 3 * n].sad += d << 8;
+				break;
+			}
+		}
+	}
+
+  /* Apply an encoded frame to vectors holding the previous frame (or zeros
+  |  for a keyframe).  Returns -1 if the data is bad.
+  */
+int
+motion_log_decode(uint8_t *in, int length, MotionVector *vectors, int n)
+	{
+	VectorPlanes	vp;
+
+	vp.vectors = vectors;
+	vp.n = n;
+	return (rle_walk(in, length, 4 * n, vectors_literal, &vp) < 0) ? -1 : 0;
+	}
@@ -0,0 +1,340 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+#include "pikrellcam.h"
+
+  /* Motion profiles are named sets of motion settings and regions read
+  |  once at startup from motion-profiles.conf, eg:
+  |
+  |      <profile night dusk-10>
+  |      magnitude_limit 9
+  |      burst_count 800
+  |      noise_filter on
+  |      noise_reset on
+  |      regions night
+  |
+  |      <profile day dawn+20>
+  |
+  |  The at time is an at-command time of day.  Each minute the profile
+  |  whose at time passed last is the scheduled one, and switching to it
+  |  is an atomic store of the motion_frame profile pointer read by the
+  |  motion worker each frame, plus a publish of the profile's region set
+  |  which was compiled when the camera started.  Nothing is parsed at a
+  |  switch.  Settings a profile does not have keep their config or preset
+  |  values.  A "motion profile name" FIFO command switches to a profile
+  |  until the next scheduled switch.
+  */
+static SList			*profile_list;
+static MotionProfile	*profile_scheduled;
+
+static void
+profile_regions_load(MotionProfile *profile, char *name)
+	{
+	FILE			*f;
+	MotionRegionSet	*set;
+	char			*path, buf[256];
+
+	asprintf(&path, "%s/" PIKRELLCAM_MOTION_REGIONS_CUSTOM_CONFIG,
+				pikrellcam.config_dir, name);
+	if ((f = fopen(path, "r")) == NULL)
+		{
+		log_printf("Motion profile %s: cannot open regions %s. %m\n",
+				profile->name, path);
+		free(path);
+		return;
+		}
+	set = motion_region_set_copy(NULL);
+	while (fgets(buf, sizeof(buf), f) != NULL)
+		{
+		if (strncmp(buf, "add_", 4))
+			continue;
+		if (!motion_region_set_add(&motion_frame, set, buf, pikrellcam.config_dir))
+			log_printf("Bad or too many motion regions: %s", buf);
+		}
+	fclose(f);
+	free(path);
+	motion_region_set_free(profile->regions);
+	profile->regions = set;
+	}
+
+void
+motion_profiles_config_load(char *config_file)
+	{
+	FILE			*f;
+	MotionProfile	*profile = NULL;
+	MotionSettings	*s = NULL;
+	char			buf[256], name[64], at_time[64], key[32], value[64];
+	int				minute, n = 0;
+
+	if (!config_file || (f = fopen(config_file, "r")) == NULL)
+		return;		/* no profiles */
+
+	while (fgets(buf, sizeof(buf), f) != NULL)
+		{
+		if (buf[0] == '#' || buf[0] == '\n')
+			continue;
+		if (sscanf(buf, "<profile %63s %63[^>]>", name, at_time) == 2)
+			{
+			profile = calloc(1, sizeof(MotionProfile));
+			profile->name = strdup(name);
+			if (at_time_minute(at_time, &minute))
+				profile->at_time = strdup(at_time);
+			else
+				log_printf("Motion profile %s: bad at time %s, only set by command.\n",
+						name, at_time);
+			s = &profile->settings;
+			profile_list = slist_append(profile_list, profile);
+			++n;
+			continue;
+			}
+		if (!profile || sscanf(buf, "%31s %63s", key, value) != 2)
+			continue;
+
+		if (!strcmp(key, "magnitude_limit"))
+			{
+			s->magnitude_limit = MAX(atoi(value), 3);
+			profile->set_mask |= PROFILE_MAGNITUDE_LIMIT;
+			}
+		else if (!strcmp(key, "magnitude_count"))
+			{
+			s->magnitude_limit_count = MAX(atoi(value), 2);
+			profile->set_mask |= PROFILE_MAGNITUDE_COUNT;
+			}
+		else if (!strcmp(key, "burst_count"))
+			{
+			s->burst_count = MAX(atoi(value), 20);
+			profile->set_mask |= PROFILE_BURST_COUNT;
+			}
+		else if (!strcmp(key, "burst_frames"))
+			{
+			s->burst_frames = MAX(atoi(value), 2);
+			profile->set_mask |= PROFILE_BURST_FRAMES;
+			}
+		else if (!strcmp(key, "slow_frames"))
+			{
+			s->slow_frames = MIN(atoi(value), MOTION_SLOW_FRAMES_MAX);
+			profile->set_mask |= PROFILE_SLOW_FRAMES;
+			}
+		else if (!strcmp(key, "vertical_filter"))
+			{
+			s->vertical_filter = config_boolean_value(value);
+			profile->set_mask |= PROFILE_VERTICAL_FILTER;
+			}
+		else if (!strcmp(key, "noise_filter"))
+			{
+			s->noise_filter = config_boolean_value(value);
+			profile->set_mask |= PROFILE_NOISE_FILTER;
+			}
+		else if (!strcmp(key, "lighting_filter"))
+			{
+			s->lighting_filter = config_boolean_value(value);
+			profile->set_mask |= PROFILE_LIGHTING_FILTER;
+			}
+		else if (!strcmp(key, "noise_reset"))
+			profile->noise_reset = config_boolean_value(value);
+		else if (!strcmp(key, "regions"))
+			profile_regions_load(profile, value);
+		else
+			log_printf("Motion profile %s: bad line: %s", profile->name, buf);
+		}
+	fclose(f);
+	log_printf("Loaded %d motion profiles from %s\n", n, config_file);
+	}
+
+  /* Compile the profile regions for the motion frame size, called from
+  |  motion_init() so switching to a profile does not compile.
+  */
+void
+motion_profiles_compile(void)
+	{
+	MotionFrame		*mf = &motion_frame;
+	MotionProfile	*profile;
+	SList			*list;
+
+	pthread_mutex_lock(&mf->region_write_mutex);
+	for (list = profile_list; list; list = list->next)
+		{
+		profile = (MotionProfile *) list->data;
+		if (profile->regions)
+			motion_region_set_compile(mf, profile->regions);
+		}
+	pthread_mutex_unlock(&mf->region_write_mutex);
+	}
+
+  /* Replace the config or preset settings with those of the active profile,
+  |  called by the motion worker each frame.
+  */
+void
+motion_profile_apply(MotionProfile *profile, MotionSettings *s)
+	{
+	MotionSettings	*ps = &profile->settings;
+	int				mask = profile->set_mask;
+
+	if (mask & PROFILE_MAGNITUDE_LIMIT)
+		s->magnitude_limit = ps->magnitude_limit;
+	if (mask & PROFILE_MAGNITUDE_COUNT)
+		s->magnitude_limit_count = ps->magnitude_limit_count;
+	if (mask & PROFILE_BURST_COUNT)
+		s->burst_count = ps->burst_count;
+	if (mask & PROFILE_BURST_FRAMES)
+		s->burst_frames = ps->burst_frames;
+	if (mask & PROFILE_SLOW_FRAMES)
+		s->slow_frames = ps->slow_frames;
+	if (mask & PROFILE_VERTICAL_FILTER)
+		s->vertical_filter = ps->vertical_filter;
+	if (mask & PROFILE_NOISE_FILTER)
+		s->noise_filter = ps->noise_filter;
+	if (mask & PROFILE_LIGHTING_FILTER)
+		s->lighting_filter = ps->lighting_filter;
+	}
+
+  /* Publish the regions of the active profile if it has any.  Returns FALSE
+  |  if the preset regions should be used.
+  */
+boolean
+motion_profile_regions_publish(void)
+	{
+	MotionFrame		*mf = &motion_frame;
+	MotionProfile	*profile = __atomic_load_n(&mf->profile, __ATOMIC_ACQUIRE);
+	MotionRegionSet	*set;
+
+	if (!profile || !profile->regions)
+		return FALSE;
+	pthread_mutex_lock(&mf->region_write_mutex);
+	motion_region_set_compile(mf, profile->regions);	/* normally ready */
+	set = motion_region_set_copy(profile->regions);
+	set->map = motion_region_map_ref(profile->regions->map);
+	motion_region_set_publish(mf, set);
+	mf->selected_region = set->n_regions - 1;
+	pthread_mutex_unlock(&mf->region_write_mutex);
+	return TRUE;
+	}
+
+  /* Called after a region edit is published.  While the active profile has
+  |  regions, the published set is the profile's, so the edit goes to the
+  |  profile regions and not to the preset.  Returns FALSE if the preset
+  |  regions should be modified.
+  */
+boolean
+motion_profile_regions_modified(void)
+	{
+	MotionFrame		*mf = &motion_frame;
+	MotionProfile	*profile = __atomic_load_n(&mf->profile, __ATOMIC_ACQUIRE);
+	MotionRegionSet	*set, *edit;
+	char			buf[128];
+	int				slot;
+
+	if (!profile || !profile->regions)
+		return FALSE;
+	if ((set = motion_region_set_acquire(mf, &slot)) == NULL)
+		return TRUE;
+	edit = motion_region_set_copy(set);
+	edit->map = motion_region_map_ref(set->map);
+	motion_region_set_release(mf, slot);
+	motion_region_set_free(profile->regions);
+	profile->regions = edit;
+
+	log_printf("Motion regions edit applies to motion profile %s.\n",
+				profile->name);
+	snprintf(buf, sizeof(buf), "\"Profile %s regions edited\" 3 3 1",
+				profile->name);
+	display_inform(buf);
+	display_inform("\"(not saved to the preset)\" 4 3 1");
+	display_inform("timeout 2");
+	return TRUE;
+	}
+
+static void
+profile_switch(MotionProfile *profile)
+	{
+	MotionFrame		*mf = &motion_frame;
+	MotionProfile	*prev = mf->profile;
+
+	if (profile == prev)
+		return;
+	__atomic_store_n(&mf->profile, profile, __ATOMIC_RELEASE);
+	if (profile && profile->noise_reset)
+		mf->noise_reset = TRUE;
+	if (!motion_profile_regions_publish() && prev && prev->regions)
+		preset_load_values(FALSE);		/* back to the preset regions */
+	log_printf("Motion profile: %s\n", profile ? profile->name : "none");
+	pikrellcam.state_modified = TRUE;
+	}
+
+  /* Called each minute after the sun times are set for the day.
+  */
+void
+motion_profile_check(int minute_now)
+	{
+	MotionProfile	*profile, *latest = NULL, *last = NULL;
+	SList			*list;
+	int				minute, latest_minute = -1, last_minute = -1;
+
+	for (list = profile_list; list; list = list->next)
+		{
+		profile = (MotionProfile *) list->data;
+		if (!profile->at_time || !at_time_minute(profile->at_time, &minute))
+			continue;
+		minute = (minute + 24 * 60) % (24 * 60);
+		if (minute <= minute_now && minute > latest_minute)
+			{
+			latest = profile;
+			latest_minute = minute;
+			}
+		if (minute > last_minute)
+			{
+			last = profile;
+			last_minute = minute;
+			}
+		}
+	if (!latest)
+		latest = last;		/* still on the last switch of yesterday */
+	if (latest != profile_scheduled)
+		{
+		profile_scheduled = latest;
+		profile_switch(latest);
+		}
+	}
+
+  /* Switch to a profile by name ("none" for no profile) until the next
+  |  scheduled switch.
+  */
+boolean
+motion_profile_set(char *name)
+	{
+	MotionProfile	*profile;
+	SList			*list;
+
+	if (!strcmp(name, "none"))
+		{
+		profile_switch(NULL);
+		return TRUE;
+		}
+	for (list = profile_list; list; list = list->next)
+		{
+		profile = (MotionProfile *) list->data;
+		if (!strcmp(profile->name, name))
+			{
+			profile_switch(profile);
+			return TRUE;
+			}
+		}
+	return FALSE;
+	}
@@ -0,0 +1,569 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+#include "pikrellcam.h"
+
+  /* Motion regions are a rectangle, a polygon or a painted mask and all
+  |  have a rectangle in 0 - 1.0 fractions of the frame that the editing
+  |  commands move and resize.  Polygon points and masks are relative to the
+  |  rectangle so they follow it.
+  |  A set of regions is compiled into a MotionRegionMap with a bit per
+  |  region for each macroblock when it is published, so the motion pass
+  |  visits each macroblock once no matter the region shapes or overlaps.
+  |  Maps are reference counted so a preset can keep the map of its regions
+  |  and swap it in when the preset is loaded.
+  |
+  |  Published sets are read without locks.  A reader claims a hazard slot
+  |  holding the set it uses and a publisher only frees a replaced set when
+  |  no hazard slot holds it.
+  */
+
+static SList	*mask_list;		/* MotionMask images loaded so far */
+
+
+  /* Skip white space and # comments in a pnm header and get a number.
+  */
+static int
+pnm_header_int(FILE *f)
+	{
+	int		c, n = 0;
+
+	while ((c = getc(f)) != EOF)
+		{
+		if (c == '#')
+			while ((c = getc(f)) != EOF && c != '\n')
+				;
+		else if (!isspace(c))
+			break;
+		}
+	if (!isdigit(c))
+		return -1;
+	for ( ; isdigit(c); c = getc(f))
+		n = 10 * n + c - '0';
+	return n;		/* The single white space after a number is eaten */
+	}
+
+  /* Read a binary PGM (P5) or PBM (P4) mask image.  PGM pixels over half of
+  |  maxval and PBM white (0) pixels are inside.  Images are kept once read
+  |  so reloading regions, eg for a preset, does not read them again.
+  */
+static MotionMask *
+motion_mask_load(char *path)
+	{
+	MotionMask	*mask;
+	FILE		*f;
+	SList		*list;
+	uint8_t		*row;
+	int			x, y, type, maxval = 1, row_bytes;
+
+	for (list = mask_list; list; list = list->next)
+		{
+		mask = (MotionMask *) list->data;
+		if (!strcmp(mask->path, path))
+			return mask;
+		}
+	if ((f = fopen(path, "r")) == NULL)
+		return NULL;
+	mask = calloc(1, sizeof(MotionMask));
+	type = (getc(f) == 'P') ? getc(f) : 0;
+	mask->width = pnm_header_int(f);
+	mask->height = pnm_header_int(f);
+	if (type == '5')
+		maxval = pnm_header_int(f);
+	if (   (type != '4' && type != '5')
+	    || mask->width <= 0 || mask->height <= 0
+	    || maxval <= 0 || maxval > 255
+	   )
+		{
+		fclose(f);
+		free(mask);
+		return NULL;
+		}
+	row_bytes = (type == '4') ? (mask->width + 7) / 8 : mask->width;
+	row = malloc(row_bytes);
+	mask->pixels = calloc(mask->width, mask->height);
+	for (y = 0; y < mask->height; ++y)
+		{
+		if (fread(row, 1, row_bytes, f) != row_bytes)
+			break;		/* short file, rest is outside */
+		for (x = 0; x < mask->width; ++x)
+			{
+			if (type == '4')
+				mask->pixels[mask->width * y + x] =
+						!(row[x >> 3] & (0x80 >> (x & 7)));
+			else
+				mask->pixels[mask->width * y + x] = (row[x] > maxval / 2);
+			}
+		}
+	free(row);
+	fclose(f);
+	mask->path = strdup(path);
+	mask_list = slist_append(mask_list, mask);
+	return mask;
+	}
+
+static boolean
+fraction_get(char **s, float *f)
+	{
+	char	*end;
+
+	*f = strtof(*s, &end);
+	if (end == *s || *f < 0.0 || *f > 1.0)
+		return FALSE;
+	*s = end;
+	return TRUE;
+	}
+
+  /* Set a region from a regions config line:
+  |      add_region  x y dx dy
+  |      add_polygon x0 y0 x1 y1 x2 y2 ...
+  |      add_mask    x y dx dy mask-file
+  |  The new_ commands of the web page are the same.  Values are 0 - 1.0
+  |  fractions of the frame and a mask-file not starting with '/' is in dir.
+  */
+boolean
+motion_region_parse(MotionRegion *mreg, char *line, char *dir)
+	{
+	char	cmd[32], name[128], *path, *s;
+	float	x[MOTION_REGION_POINTS_MAX], y[MOTION_REGION_POINTS_MAX],
+			x0 = 1.0, y0 = 1.0, x1 = 0.0, y1 = 0.0;
+	int		i, n, len;
+
+	memset((char *) mreg, 0, sizeof(MotionRegion));
+	if (   sscanf(line, "%31s%n", cmd, &len) != 1
+	    || (strncmp(cmd, "add_", 4) && strncmp(cmd, "new_", 4))
+	   )
+		return FALSE;
+	s = line + len;
+
+	if (!strcmp(cmd + 4, "region") || !strcmp(cmd + 4, "mask"))
+		{
+		if (   !fraction_get(&s, &mreg->xf0) || !fraction_get(&s, &mreg->yf0)
+		    || !fraction_get(&s, &mreg->dxf) || !fraction_get(&s, &mreg->dyf)
+		   )
+			return FALSE;
+		if (!strcmp(cmd + 4, "region"))
+			return TRUE;
+		if (sscanf(s, "%127s", name) != 1)
+			return FALSE;
+		if (name[0] == '/' || !dir)
+			path = strdup(name);
+		else
+			asprintf(&path, "%s/%s", dir, name);
+		mreg->mask = motion_mask_load(path);
+		free(path);
+		return (mreg->mask != NULL);
+		}
+	if (strcmp(cmd + 4, "polygon"))
+		return FALSE;
+
+	for (n = 0; n < MOTION_REGION_POINTS_MAX; ++n)
+		{
+		while (isspace(*s))
+			++s;
+		if (*s == '\0')
+			break;
+		if (!fraction_get(&s, &x[n]) || !fraction_get(&s, &y[n]))
+			return FALSE;
+		x0 = MIN(x0, x[n]);
+		y0 = MIN(y0, y[n]);
+		x1 = MAX(x1, x[n]);
+		y1 = MAX(y1, y[n]);
+		}
+	if (n < 3)
+		return FALSE;
+
+	/* The polygon bounding box is the region rectangle.
+	*/
+	mreg->xf0 = x0;
+	mreg->yf0 = y0;
+	mreg->dxf = x1 - x0;
+	mreg->dyf = y1 - y0;
+	mreg->n_points = n;
+	for (i = 0; i < n; ++i)
+		{
+		mreg->px[i] = (x1 > x0) ? (x[i] - x0) / (x1 - x0) : 0.0;
+		mreg->py[i] = (y1 > y0) ? (y[i] - y0) / (y1 - y0) : 0.0;
+		}
+	return TRUE;
+	}
+
+  /* The add_ config line for a region that motion_region_parse() reads back
+  |  with the same dir.
+  */
+void
+motion_region_config_line(MotionRegion *mreg, char *buf, int size, char *dir)
+	{
+	char	*name;
+	int		i, n, len;
+
+	if (mreg->n_points > 0)
+		{
+		n = snprintf(buf, size, "add_polygon");
+		for (i = 0; i < mreg->n_points && n < size; ++i)
+			n += snprintf(buf + n, size - n, " %.3f %.3f",
+					mreg->xf0 + mreg->px[i] * mreg->dxf,
+					mreg->yf0 + mreg->py[i] * mreg->dyf);
+		if (n < size)
+			snprintf(buf + n, size - n, "\n");
+		}
+	else if (mreg->mask)
+		{
+		name = mreg->mask->path;
+		len = dir ? strlen(dir) : 0;
+		if (len > 0 && !strncmp(name, dir, len) && name[len] == '/')
+			name += len + 1;
+		snprintf(buf, size, "add_mask %.3f %.3f %.3f %.3f %s\n",
+				mreg->xf0, mreg->yf0, mreg->dxf, mreg->dyf, name);
+		}
+	else
+		snprintf(buf, size, "add_region %.3f %.3f %.3f %.3f\n",
+				mreg->xf0, mreg->yf0, mreg->dxf, mreg->dyf);
+	}
+
+  /* Keep a region inside the frame and at least 2 macroblocks in size
+  |  and compute its macroblock rectangle.
+  */
+void
+motion_region_fixup(MotionFrame *mf, MotionRegion *mreg)
+	{
+	float	delta;
+
+	if (mreg->xf0 < 0.0)
+		mreg->xf0 = 0.0;
+	if (mreg->yf0 < 0.0)
+		mreg->yf0 = 0.0;
+
+	if (mf->width > 0)
+		{
+		delta = 2.0 / (float) mf->width;
+		if (mreg->xf0 > 1.0 - delta)
+			mreg->xf0 = 1.0 - delta;
+		if (mreg->dxf < delta)
+			mreg->dxf = delta;
+		delta = 2.0 / (float) mf->height;
+		if (mreg->yf0 > 1.0 - delta)
+			mreg->yf0 = 1.0 - delta;
+		if (mreg->dyf < delta)
+			mreg->dyf = delta;
+		}
+
+	if (mreg->xf0 + mreg->dxf > 1.0)
+		mreg->dxf = 1.0 - mreg->xf0;
+	if (mreg->yf0 + mreg->dyf > 1.0)
+		mreg->dyf = 1.0 - mreg->yf0;
+
+	mreg->x  = mf->width  * mreg->xf0;
+	mreg->y  = mf->height * mreg->yf0;
+	mreg->dx = mf->width  * mreg->dxf;
+	mreg->dy = mf->height * mreg->dyf;
+	}
+
+  /* Get the region rectangle, but don't look at frame perimeter blocks
+  |  except when excluding sparkles. (They have limited vector direction).
+  */
+void
+motion_region_bounds(MotionFrame *mf, MotionRegion *mreg,
+			int *x0, int *y0, int *x1, int *y1)
+	{
+	if ((*y0 = mreg->y) == 0)
+		*y0 = 1;
+	if ((*y1 = mreg->y + mreg->dy) >= mf->height)
+		*y1 = mf->height - 1;
+	if ((*x0 = mreg->x) == 0)
+		*x0 = 1;
+	if ((*x1 = mreg->x + mreg->dx) >= mf->width)
+		*x1 = mf->width - 1;
+	}
+
+static int
+float_cmp(const void *a, const void *b)
+	{
+	float	fa = *(float *) a, fb = *(float *) b;
+
+	return (fa > fb) - (fa < fb);
+	}
+
+  /* A macroblock is inside of a polygon or mask if its center is.
+  */
+static void
+region_compile(MotionFrame *mf, MotionRegion *mreg, MotionRegionMap *map)
+	{
+	MotionMask	*mask = mreg->mask;
+	uint64_t	id = (uint64_t) 1 << mreg->region_number;
+	float		xc[MOTION_REGION_POINTS_MAX], ax, ay, bx, by, yc;
+	int			i, j, k, n, x, y, x0, y0, x1, y1, xa, xb, mx, my;
+
+	motion_region_bounds(mf, mreg, &x0, &y0, &x1, &y1);
+	for (y = y0; y < y1; ++y)
+		{
+		if (mreg->n_points > 0)
+			{
+			/* Even-odd scan line fill between sorted edge crossings.
+			*/
+			yc = (float) y + 0.5;
+			for (i = 0, n = 0; i < mreg->n_points; ++i)
+				{
+				j = (i + 1) % mreg->n_points;
+				ax = mreg->x + mreg->px[i] * mreg->dx;
+				ay = mreg->y + mreg->py[i] * mreg->dy;
+				bx = mreg->x + mreg->px[j] * mreg->dx;
+				by = mreg->y + mreg->py[j] * mreg->dy;
+				if ((ay <= yc) != (by <= yc))
+					xc[n++] = ax + (yc - ay) * (bx - ax) / (by - ay);
+				}
+			qsort(xc, n, sizeof(float), float_cmp);
+			for (k = 0; k + 1 < n; k += 2)
+				{
+				xa = MAX((int) ceilf(xc[k] - 0.5), x0);
+				xb = MIN((int) ceilf(xc[k + 1] - 0.5), x1);
+				for (x = xa; x < xb; ++x)
+					map->ids[map->width * y + x] |= id;
+				}
+			continue;
+			}
+		my = mask ? (2 * (y - mreg->y) + 1) * mask->height
+						/ (2 * MAX(mreg->dy, 1)) : 0;
+		for (x = x0; x < x1; ++x)
+			{
+			if (mask)
+				{
+				mx = (2 * (x - mreg->x) + 1) * mask->width
+						/ (2 * MAX(mreg->dx, 1));
+				if (!mask->pixels[mask->width * MIN(my, mask->height - 1)
+								+ MIN(mx, mask->width - 1)])
+					continue;
+				}
+			map->ids[map->width * y + x] |= id;
+			}
+		}
+	}
+
+  /* Compile the regions of a set into a map for the motion frame size.
+  */
+static MotionRegionMap *
+motion_region_map_compile(MotionFrame *mf, MotionRegionSet *set)
+	{
+	MotionRegionMap	*map;
+	int				i, x, y;
+
+	map = calloc(1, sizeof(MotionRegionMap));
+	map->width = mf->width;
+	map->height = mf->height;
+	map->words = (mf->width + 63) / 64;
+	map->refs = 1;
+	map->ids = calloc(mf->width * mf->height, sizeof(uint64_t));
+	map->bits = calloc(map->words * mf->height, sizeof(uint64_t));
+
+	for (i = 0; i < set->n_regions; ++i)
+		region_compile(mf, &set->regions[i], map);
+	for (y = 0; y < map->height; ++y)
+		for (x = 0; x < map->width; ++x)
+			if (map->ids[map->width * y + x])
+				map->bits[map->words * y + (x >> 6)] |= (uint64_t) 1 << (x & 63);
+	return map;
+	}
+
+MotionRegionMap *
+motion_region_map_ref(MotionRegionMap *map)
+	{
+	if (map)
+		++map->refs;
+	return map;
+	}
+
+void
+motion_region_map_unref(MotionRegionMap *map)
+	{
+	if (!map || --map->refs > 0)
+		return;
+	free(map->ids);
+	free(map->bits);
+	free(map);
+	}
+
+
+  /* An unpublished copy of a set (or an empty set if src is NULL) for an
+  |  edit to be made on and then published.
+  */
+MotionRegionSet *
+motion_region_set_copy(MotionRegionSet *src)
+	{
+	MotionRegionSet	*set;
+
+	set = calloc(1, sizeof(MotionRegionSet));
+	if (src && src->n_regions > 0)
+		{
+		set->n_regions = src->n_regions;
+		set->regions = malloc(src->n_regions * sizeof(MotionRegion));
+		memcpy(set->regions, src->regions, src->n_regions * sizeof(MotionRegion));
+		}
+	return set;
+	}
+
+void
+motion_region_set_free(MotionRegionSet *set)
+	{
+	if (!set)
+		return;
+	motion_region_map_unref(set->map);
+	free(set->regions);
+	free(set);
+	}
+
+boolean
+motion_region_set_append(MotionFrame *mf, MotionRegionSet *set,
+			MotionRegion *mreg)
+	{
+	if (set->n_regions >= MOTION_REGIONS_MAX)
+		return FALSE;
+	set->regions = realloc(set->regions,
+				(set->n_regions + 1) * sizeof(MotionRegion));
+	set->regions[set->n_regions] = *mreg;
+	motion_region_fixup(mf, &set->regions[set->n_regions]);
+	set->n_regions += 1;
+	return TRUE;
+	}
+
+  /* Append a region from a regions config line, see motion_region_parse().
+  */
+boolean
+motion_region_set_add(MotionFrame *mf, MotionRegionSet *set,
+			char *line, char *dir)
+	{
+	MotionRegion	mreg;
+
+	if (!motion_region_parse(&mreg, line, dir))
+		return FALSE;
+	return motion_region_set_append(mf, set, &mreg);
+	}
+
+void
+motion_region_set_remove(MotionRegionSet *set, int n)
+	{
+	if (n < 0 || n >= set->n_regions)
+		return;
+	memmove(&set->regions[n], &set->regions[n + 1],
+				(set->n_regions - n - 1) * sizeof(MotionRegion));
+	set->n_regions -= 1;
+	}
+
+  /* Number a set and compile its map for the motion frame size unless it
+  |  already has one that fits, eg from a preset or a motion profile.  The
+  |  region rectangles are recomputed in case the set was made for a
+  |  different frame size.
+  */
+void
+motion_region_set_compile(MotionFrame *mf, MotionRegionSet *set)
+	{
+	MotionRegion	*mreg;
+	int				i;
+
+	for (i = 0; i < set->n_regions; ++i)
+		set->regions[i].region_number = i;
+	if (   set->map
+	    && set->map->width == mf->width && set->map->height == mf->height
+	   )
+		return;
+	motion_region_map_unref(set->map);
+	for (i = 0; i < set->n_regions; ++i)
+		{
+		mreg = &set->regions[i];
+		mreg->x  = mf->width  * mreg->xf0;
+		mreg->y  = mf->height * mreg->yf0;
+		mreg->dx = mf->width  * mreg->dxf;
+		mreg->dy = mf->height * mreg->dyf;
+		}
+	set->map = motion_region_map_compile(mf, set);
+	}
+
+  /* Publish a set as the motion frame regions.  The set is compiled if
+  |  needed before it is swapped in, and the replaced set is retired until
+  |  no reader holds it.
+  |  Publishers are serialized by the region_write_mutex, readers are not
+  |  locked out.
+  */
+void
+motion_region_set_publish(MotionFrame *mf, MotionRegionSet *set)
+	{
+	MotionRegionSet	*old, *retired;
+	SList			*list, *next;
+	int				i;
+	boolean			in_use;
+
+	motion_region_set_compile(mf, set);
+	old = __atomic_exchange_n(&mf->region_set, set, __ATOMIC_SEQ_CST);
+	if (old)
+		mf->region_retired = slist_append(mf->region_retired, old);
+
+	/* A reader stores its hazard before checking region_set again, so once
+	|  the new set is stored a retired set no hazard holds is unreachable.
+	*/
+	for (list = mf->region_retired; list; list = next)
+		{
+		next = list->next;
+		retired = (MotionRegionSet *) list->data;
+		for (i = 0, in_use = FALSE; i < MOTION_REGION_READERS; ++i)
+			if (__atomic_load_n(&mf->region_hazard[i], __ATOMIC_SEQ_CST) == retired)
+				in_use = TRUE;
+		if (!in_use)
+			{
+			mf->region_retired = slist_remove(mf->region_retired, retired);
+			motion_region_set_free(retired);
+			}
+		}
+	}
+
+  /* Get the published set and hold it until motion_region_set_release()
+  |  with the returned slot.  Never blocks on a publisher.  Returns NULL if
+  |  no set was published yet.
+  */
+MotionRegionSet *
+motion_region_set_acquire(MotionFrame *mf, int *slot)
+	{
+	MotionRegionSet	*set, *expected;
+	int				i;
+
+	for (i = 0; ; i = (i + 1) % MOTION_REGION_READERS)
+		{
+		expected = NULL;
+		set = __atomic_load_n(&mf->region_set, __ATOMIC_SEQ_CST);
+		if (!set)
+			{
+			*slot = -1;
+			return NULL;
+			}
+		if (!__atomic_compare_exchange_n(&mf->region_hazard[i], &expected,
+					set, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			continue;
+		if (__atomic_load_n(&mf->region_set, __ATOMIC_SEQ_CST) == set)
+			break;
+		__atomic_store_n(&mf->region_hazard[i], NULL, __ATOMIC_SEQ_CST);
+		}
+	*slot = i;
+	return set;
+	}
+
+void
+motion_region_set_release(MotionFrame *mf, int slot)
+	{
+	if (slot >= 0)
+		__atomic_store_n(&mf->region_hazard[slot], NULL, __ATOMIC_RELEASE);
+	}
@@ -0,0 +1,361 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+#include "pikrellcam.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MOTION_SIMD_NEON
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define MOTION_SIMD_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define MOTION_SIMD_SSE2
+#endif
+
+  /* Kernels for the per macroblock motion vector passes in motion.c.
+  |  The _scalar functions are the reference and the SIMD versions must give
+  |  the same results.  They also handle the tail elements of the SIMD loops.
+  |  Trigger results are rows of bits, bit x & 63 of word x >> 6, so the
+  |  sparkle pass works 64 macroblocks at a time with plain word ops.
+  |  Which SIMD version is used is selected at compile time, eg for a Pi 2/3:
+  |      make SIMD_FLAGS=-mfpu=neon-vfpv4
+  |  A Pi Zero/1 has no NEON and uses the scalar functions.
+  |
+  |  The direction test is the integer cos(a)^2 test from get_composite_vector()
+  |  with the divide multiplied out and done in 64 bits so it can't overflow:
+  |      100 * dot^2 / (t_mag2 * mag2) >= 82
+  |      100 * dot^2 >= 82 * t_mag2 * mag2
+  */
+
+#define COS2_LIMIT	82
+
+
+  /* Set bit i of bits for vectors[i] with mag2 >= mag2_limit for i from
+  |  i0 to n.  bits must already be cleared.
+  */
+static void
+mag2_threshold_bits(MotionVector *vectors, uint64_t *bits, int i0, int n,
+			int mag2_limit)
+	{
+	int		i, mag2;
+
+	for (i = i0; i < n; ++i)
+		{
+		mag2 = vectors[i].vx * vectors[i].vx + vectors[i].vy * vectors[i].vy;
+		if (mag2 >= mag2_limit)
+			bits[i >> 6] |= (uint64_t) 1 << (i & 63);
+		}
+	}
+
+void
+motion_mag2_threshold_scalar(MotionVector *vectors, uint64_t *bits,
+			int n, int mag2_limit)
+	{
+	memset(bits, 0, ((n + 63) / 64) * sizeof(uint64_t));
+	mag2_threshold_bits(vectors, bits, 0, n, mag2_limit);
+	}
+
+  /* A sparkle is a row bit with none of its 8 neighbors set in the up, row
+  |  and down bit rows.  Bits shifted in from the neighbor words give the
+  |  left and right neighbors across word boundaries.
+  */
+void
+motion_sparkle_flag(uint64_t *up, uint64_t *row, uint64_t *down,
+			uint64_t *sparkle, int n_words)
+	{
+	uint64_t	n, n_prev = 0, n_next, near;
+	int			k;
+
+	n = up[0] | row[0] | down[0];
+	for (k = 0; k < n_words; ++k)
+		{
+		n_next = (k + 1 < n_words) ? (up[k + 1] | row[k + 1] | down[k + 1]) : 0;
+		near = up[k] | down[k] | (n << 1) | (n_prev >> 63)
+				| (n >> 1) | (n_next << 63);
+		sparkle[k] = row[k] & ~near;
+		n_prev = n;
+		n = n_next;
+		}
+	}
+
+void
+motion_direction_filter_scalar(MotionVector *vectors, int n,
+			int t_vx, int t_vy, int t_mag2, uint8_t *accept)
+	{
+	int			i, dot, mag2;
+	int64_t		k = (int64_t) COS2_LIMIT * t_mag2;
+
+	for (i = 0; i < n; ++i)
+		{
+		dot = t_vx * vectors[i].vx + t_vy * vectors[i].vy;
+		mag2 = vectors[i].vx * vectors[i].vx + vectors[i].vy * vectors[i].vy;
+		accept[i] = (   dot > 0		/* angle at least < 90 deg */
+		             && t_mag2 > 0
+		             && (int64_t) 100 * dot * dot >= k * mag2
+		            );
+		}
+	}
+
+
+#if defined(MOTION_SIMD_NEON)
+
+void
+motion_mag2_threshold(MotionVector *vectors, uint64_t *bits,
+			int n, int mag2_limit)
+	{
+	static const uint8_t	weights[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+	int8x8x4_t	mv;
+	int16x8_t	xx, yy;
+	int32x4_t	lo, hi, limit = vdupq_n_s32(mag2_limit);
+	uint8x8_t	pass, w = vld1_u8(weights);
+	int			i;
+
+	memset(bits, 0, ((n + 63) / 64) * sizeof(uint64_t));
+	for (i = 0; i + 8 <= n; i += 8)
+		{
+		mv = vld4_s8((int8_t *) (vectors + i));	/* vx, vy, sad lo, sad hi */
+		xx = vmull_s8(mv.val[0], mv.val[0]);
+		yy = vmull_s8(mv.val[1], mv.val[1]);
+		lo = vaddl_s16(vget_low_s16(xx), vget_low_s16(yy));
+		hi = vaddl_s16(vget_high_s16(xx), vget_high_s16(yy));
+
+		/* Narrow the compare masks to a byte each and add up their bit
+		|  weights to get the 8 result bits.
+		*/
+		pass = vmovn_u16(vcombine_u16(vmovn_u32(vcgeq_s32(lo, limit)),
+					vmovn_u32(vcgeq_s32(hi, limit))));
+		pass = vand_u8(pass, w);
+		pass = vpadd_u8(pass, pass);
+		pass = vpadd_u8(pass, pass);
+		pass = vpadd_u8(pass, pass);
+		bits[i >> 6] |= (uint64_t) vget_lane_u8(pass, 0) << (i & 63);
+		}
+	mag2_threshold_bits(vectors, bits, i, n, mag2_limit);
+	}
+
+void
+motion_direction_filter(MotionVector *vectors, int n,
+			int t_vx, int t_vy, int t_mag2, uint8_t *accept)
+	{
+	int8x8x4_t	mv;
+	int16x8_t	vx, vy, xx, yy;
+	int32x4_t	dot[2], mag2[2], d10;
+	int32x2_t	k = vdup_n_s32(COS2_LIMIT * t_mag2);
+	int64x2_t	diff_lo, diff_hi;
+	uint32x4_t	pass;
+	uint16x4_t	p16[2];
+	int			i, j;
+
+	if (t_mag2 <= 0)
+		{
+		memset(accept, 0, n);
+		return;
+		}
+	for (i = 0; i + 8 <= n; i += 8)
+		{
+		mv = vld4_s8((int8_t *) (vectors + i));
+		vx = vmovl_s8(mv.val[0]);
+		vy = vmovl_s8(mv.val[1]);
+		xx = vmull_s8(mv.val[0], mv.val[0]);
+		yy = vmull_s8(mv.val[1], mv.val[1]);
+
+		dot[0] = vmlal_n_s16(vmull_n_s16(vget_low_s16(vx), t_vx),
+					vget_low_s16(vy), t_vy);
+		dot[1] = vmlal_n_s16(vmull_n_s16(vget_high_s16(vx), t_vx),
+					vget_high_s16(vy), t_vy);
+		mag2[0] = vaddl_s16(vget_low_s16(xx), vget_low_s16(yy));
+		mag2[1] = vaddl_s16(vget_high_s16(xx), vget_high_s16(yy));
+
+		for (j = 0; j < 2; ++j)
+			{
+			/* (10 * dot)^2 - 82 * t_mag2 * mag2, sign from the high words
+			*/
+			d10 = vmulq_n_s32(dot[j], 10);
+			diff_lo = vsubq_s64(
+					vmull_s32(vget_low_s32(d10), vget_low_s32(d10)),
+					vmull_s32(k, vget_low_s32(mag2[j])));
+			diff_hi = vsubq_s64(
+					vmull_s32(vget_high_s32(d10), vget_high_s32(d10)),
+					vmull_s32(k, vget_high_s32(mag2[j])));
+			pass = vcgeq_s32(vcombine_s32(vshrn_n_s64(diff_lo, 32),
+					vshrn_n_s64(diff_hi, 32)), vdupq_n_s32(0));
+			pass = vandq_u32(pass, vcgtq_s32(dot[j], vdupq_n_s32(0)));
+			p16[j] = vmovn_u32(pass);
+			}
+		vst1_u8(accept + i, vand_u8(vmovn_u16(vcombine_u16(p16[0], p16[1])),
+					vdup_n_u8(1)));
+		}
+	motion_direction_filter_scalar(vectors + i, n - i, t_vx, t_vy, t_mag2,
+				accept + i);
+	}
+
+#elif defined(MOTION_SIMD_AVX2) || defined(MOTION_SIMD_SSE2)
+
+#if defined(MOTION_SIMD_AVX2)
+typedef __m256i	simd_t;
+#define SIMD_N32				8
+#define simd_load(p)			_mm256_loadu_si256((__m256i *) (p))
+#define simd_set1_32(x)			_mm256_set1_epi32(x)
+#define simd_zero()				_mm256_setzero_si256()
+#define simd_and(a, b)			_mm256_and_si256(a, b)
+#define simd_andnot(a, b)		_mm256_andnot_si256(a, b)
+#define simd_or(a, b)			_mm256_or_si256(a, b)
+#define simd_add32(a, b)		_mm256_add_epi32(a, b)
+#define simd_sub64(a, b)		_mm256_sub_epi64(a, b)
+#define simd_mul_u32(a, b)		_mm256_mul_epu32(a, b)
+#define simd_madd16(a, b)		_mm256_madd_epi16(a, b)
+#define simd_cmpgt32(a, b)		_mm256_cmpgt_epi32(a, b)
+#define simd_slli32(a, n)		_mm256_slli_epi32(a, n)
+#define simd_srai32(a, n)		_mm256_srai_epi32(a, n)
+#define simd_srai16(a, n)		_mm256_srai_epi16(a, n)
+#define simd_srli64(a, n)		_mm256_srli_epi64(a, n)
+#define simd_shuffle32(a, n)	_mm256_shuffle_epi32(a, n)
+#define simd_unpacklo32(a, b)	_mm256_unpacklo_epi32(a, b)
+#define simd_movemask32(a)		_mm256_movemask_ps(_mm256_castsi256_ps(a))
+#else
+typedef __m128i	simd_t;
+#define SIMD_N32				4
+#define simd_load(p)			_mm_loadu_si128((__m128i *) (p))
+#define simd_set1_32(x)			_mm_set1_epi32(x)
+#define simd_zero()				_mm_setzero_si128()
+#define simd_and(a, b)			_mm_and_si128(a, b)
+#define simd_andnot(a, b)		_mm_andnot_si128(a, b)
+#define simd_or(a, b)			_mm_or_si128(a, b)
+#define simd_add32(a, b)		_mm_add_epi32(a, b)
+#define simd_sub64(a, b)		_mm_sub_epi64(a, b)
+#define simd_mul_u32(a, b)		_mm_mul_epu32(a, b)
+#define simd_madd16(a, b)		_mm_madd_epi16(a, b)
+#define simd_cmpgt32(a, b)		_mm_cmpgt_epi32(a, b)
+#define simd_slli32(a, n)		_mm_slli_epi32(a, n)
+#define simd_srai32(a, n)		_mm_srai_epi32(a, n)
+#define simd_srai16(a, n)		_mm_srai_epi16(a, n)
+#define simd_srli64(a, n)		_mm_srli_epi64(a, n)
+#define simd_shuffle32(a, n)	_mm_shuffle_epi32(a, n)
+#define simd_unpacklo32(a, b)	_mm_unpacklo_epi32(a, b)
+#define simd_movemask32(a)		_mm_movemask_ps(_mm_castsi128_ps(a))
+#endif
+
+  /* Load SIMD_N32 motion vectors as int16 (vx, vy) pairs in each 32 bits
+  |  and their mag2 = vx * vx + vy * vy.
+  */
+static inline simd_t
+simd_vectors_load(MotionVector *vectors, simd_t *mag2)
+	{
+	simd_t	v, pairs;
+
+	v = simd_load(vectors);
+	pairs = simd_or(
+			simd_and(simd_srai32(simd_slli32(v, 24), 24), simd_set1_32(0xffff)),
+			simd_slli32(simd_srai16(v, 8), 16));
+	*mag2 = simd_madd16(pairs, pairs);
+	return pairs;
+	}
+
+void
+motion_mag2_threshold(MotionVector *vectors, uint64_t *bits,
+			int n, int mag2_limit)
+	{
+	simd_t		mag2, limit = simd_set1_32(mag2_limit - 1);
+	uint64_t	chunk;
+	int			i, j;
+
+	memset(bits, 0, ((n + 63) / 64) * sizeof(uint64_t));
+	for (i = 0; i + 16 <= n; i += 16)
+		{
+		chunk = 0;
+		for (j = 0; j < 16; j += SIMD_N32)
+			{
+			simd_vectors_load(vectors + i + j, &mag2);
+			chunk |= (uint64_t) simd_movemask32(simd_cmpgt32(mag2, limit)) << j;
+			}
+		bits[i >> 6] |= chunk << (i & 63);
+		}
+	mag2_threshold_bits(vectors, bits, i, n, mag2_limit);
+	}
+
+  /* Per 32 bit element sign of a - b where the even and odd elements are
+  |  64 bit products: (a_even - b_even), (a_odd - b_odd).
+  */
+static inline simd_t
+simd_sign_even_odd(simd_t even, simd_t odd)
+	{
+	simd_t	s_even, s_odd;
+
+	s_even = simd_shuffle32(simd_srai32(even, 31), 0xdd);	/* 1, 3, 1, 3 */
+	s_odd = simd_shuffle32(simd_srai32(odd, 31), 0xdd);
+	return simd_unpacklo32(s_even, s_odd);
+	}
+
+void
+motion_direction_filter(MotionVector *vectors, int n,
+			int t_vx, int t_vy, int t_mag2, uint8_t *accept)
+	{
+	simd_t		pairs, mag2, dot, d10, neg, pass,
+				t_pair = simd_set1_32((t_vx & 0xffff) | (t_vy << 16)),
+				k = simd_set1_32(COS2_LIMIT * t_mag2),
+				zero = simd_zero();
+	int			i, j, bits;
+
+	if (t_mag2 <= 0)
+		{
+		memset(accept, 0, n);
+		return;
+		}
+	for (i = 0; i + SIMD_N32 <= n; i += SIMD_N32)
+		{
+		pairs = simd_vectors_load(vectors + i, &mag2);
+		dot = simd_madd16(pairs, t_pair);
+
+		/* (10 * dot)^2 - 82 * t_mag2 * mag2 in 64 bits.  The unsigned
+		|  multiplies are right because only dot > 0 is kept.
+		*/
+		d10 = simd_add32(simd_slli32(dot, 3), simd_slli32(dot, 1));
+		neg = simd_sign_even_odd(
+				simd_sub64(simd_mul_u32(d10, d10), simd_mul_u32(k, mag2)),
+				simd_sub64(simd_mul_u32(simd_srli64(d10, 32), simd_srli64(d10, 32)),
+				           simd_mul_u32(k, simd_srli64(mag2, 32))));
+		pass = simd_andnot(neg, simd_cmpgt32(dot, zero));
+		bits = simd_movemask32(pass);
+		for (j = 0; j < SIMD_N32; ++j)
+			accept[i + j] = (bits >> j) & 1;
+		}
+	motion_direction_filter_scalar(vectors + i, n - i, t_vx, t_vy, t_mag2,
+				accept + i);
+	}
+
+#else
+
+void
+motion_mag2_threshold(MotionVector *vectors, uint64_t *bits,
+			int n, int mag2_limit)
+	{
+	motion_mag2_threshold_scalar(vectors, bits, n, mag2_limit);
+	}
+
+void
+motion_direction_filter(MotionVector *vectors, int n,
+			int t_vx, int t_vy, int t_mag2, uint8_t *accept)
+	{
+	motion_direction_filter_scalar(vectors, n, t_vx, t_vy, t_mag2, accept);
+	}
+
+#endif
@@ -0,0 +1,181 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+  /* Check that the motion_simd.c kernels compiled for this machine give
+  |  bit exact results against the _scalar reference functions.  Run with
+  |  "make test", and with the SIMD_FLAGS of the target, eg:
+  |      make test SIMD_FLAGS=-mfpu=neon-vfpv4
+  |      make test SIMD_FLAGS=-mavx2
+  |  Vectors are random and edge case values (+-127, -128, 0) over lengths
+  |  that exercise the SIMD loop tails and unaligned vector arrays.
+  */
+
+#include "pikrellcam.h"
+
+#define	MAX_VECTORS	(2 * 1024)
+#define	N_RANDOM	2000
+
+static int	edge_values[] = { -128, -127, -65, -64, -1, 0, 1, 63, 64, 127 };
+#define	N_EDGE	(sizeof(edge_values) / sizeof(int))
+
+static int	n_checks,
+			n_failures;
+
+static int
+test_value(boolean edge)
+	{
+	if (edge)
+		return edge_values[random() % N_EDGE];
+	return (int) (random() % 256) - 128;
+	}
+
+static void
+vectors_fill(MotionVector *vectors, int n, boolean edge)
+	{
+	int		i;
+
+	for (i = 0; i < n; ++i)
+		{
+		vectors[i].vx = test_value(edge);
+		vectors[i].vy = test_value(edge);
+		vectors[i].sad = (int16_t) random();
+		}
+	}
+
+static void
+check_mag2_threshold(MotionVector *vectors, int n, int mag2_limit)
+	{
+	uint64_t	bits[MAX_VECTORS / 64 + 1], ref[MAX_VECTORS / 64 + 1];
+
+	motion_mag2_threshold(vectors, bits, n, mag2_limit);
+	motion_mag2_threshold_scalar(vectors, ref, n, mag2_limit);
+	++n_checks;
+	if (memcmp(bits, ref, ((n + 63) / 64) * sizeof(uint64_t)) != 0)
+		{
+		if (n_failures++ < 10)
+			printf("motion_mag2_threshold: n=%d mag2_limit=%d differs\n",
+					n, mag2_limit);
+		}
+	}
+
+static void
+check_direction_filter(MotionVector *vectors, int n,
+			int t_vx, int t_vy, int t_mag2)
+	{
+	uint8_t		accept[MAX_VECTORS], ref[MAX_VECTORS];
+
+	motion_direction_filter(vectors, n, t_vx, t_vy, t_mag2, accept);
+	motion_direction_filter_scalar(vectors, n, t_vx, t_vy, t_mag2, ref);
+	++n_checks;
+	if (memcmp(accept, ref, n) != 0)
+		{
+		if (n_failures++ < 10)
+			printf("motion_direction_filter: n=%d t=(%d,%d) t_mag2=%d differs\n",
+					n, t_vx, t_vy, t_mag2);
+		}
+	}
+
+  /* The sparkle pass has no SIMD version, but its word boundary shifts
+  |  are checked against a plain 8 neighbor test.
+  */
+static void
+check_sparkle_flag(int n_bits)
+	{
+	uint64_t	rows[3][MAX_VECTORS / 64 + 1], sparkle[MAX_VECTORS / 64 + 1];
+	int			n_words = (n_bits + 63) / 64, r, x, dx, bit, near;
+
+	for (r = 0; r < 3; ++r)
+		for (x = 0; x < n_words; ++x)
+			rows[r][x] = ((uint64_t) random() << 62) ^ ((uint64_t) random() << 31)
+						^ random();
+	for (r = 0; r < 3; ++r)		/* sparse rows, so there are sparkles */
+		for (x = 0; x < n_words; ++x)
+			rows[r][x] &= rows[r][(x + 1) % n_words] & (rows[r][x] >> 3);
+	for (r = 0; r < 3 && n_bits & 63; ++r)
+		rows[r][n_words - 1] &= ((uint64_t) 1 << (n_bits & 63)) - 1;
+
+	motion_sparkle_flag(rows[0], rows[1], rows[2], sparkle, n_words);
+	++n_checks;
+	for (x = 0; x < n_bits; ++x)
+		{
+		near = 0;
+		for (r = 0; r < 3; ++r)
+			for (dx = -1; dx <= 1; ++dx)
+				{
+				if ((r == 1 && dx == 0) || x + dx < 0 || x + dx >= n_bits)
+					continue;
+				near |= (rows[r][(x + dx) >> 6] >> ((x + dx) & 63)) & 1;
+				}
+		bit = (rows[1][x >> 6] >> (x & 63)) & 1;
+		if ((int) ((sparkle[x >> 6] >> (x & 63)) & 1) != (bit && !near))
+			{
+			if (n_failures++ < 10)
+				printf("motion_sparkle_flag: n_bits=%d bit %d differs\n",
+						n_bits, x);
+			break;
+			}
+		}
+	}
+
+int
+main(int argc, char *argv[])
+	{
+	static MotionVector	buf[MAX_VECTORS + 1];
+	static int	limits[] = { -1, 0, 1, 2, 64, 16383, 16384, 32768, 32769 };
+	MotionVector	*vectors;
+	int			i, j, n, t_vx, t_vy, t_mag2;
+	boolean		edge;
+
+	srandom(argc > 1 ? atoi(argv[1]) : 1);
+
+	for (i = 0; i < N_RANDOM; ++i)
+		{
+		edge = (i & 1);
+		n = (i < 200) ? i : (int) (random() % MAX_VECTORS);
+		vectors = buf + (i & 2 ? 1 : 0);		/* unaligned half the time */
+		vectors_fill(vectors, n, edge);
+
+		for (j = 0; j < sizeof(limits) / sizeof(int); ++j)
+			check_mag2_threshold(vectors, n, limits[j]);
+		check_mag2_threshold(vectors, n, (int) (random() % 32770));
+
+		t_vx = test_value(edge);
+		t_vy = test_value(edge);
+		t_mag2 = t_vx * t_vx + t_vy * t_vy;
+		check_direction_filter(vectors, n, t_vx, t_vy, t_mag2);
+		check_direction_filter(vectors, n, t_vx, t_vy, (int) (random() % 32769));
+		check_direction_filter(vectors, n, t_vx, t_vy, 0);
+
+		check_sparkle_flag(n);
+		}
+
+	printf("motion_simd_test: %s kernels, %d checks, %d failed\n",
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+			"NEON",
+#elif defined(__AVX2__)
+			"AVX2",
+#elif defined(__SSE2__)
+			"SSE2",
+#else
+			"scalar",
+#endif
+			n_checks, n_failures);
+	return n_failures ? 1 : 0;
+	}
@@ -0,0 +1,561 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+  /* pikrellcam-sweep: run recorded motion vectors through the motion
+  |  detection of motion_detect.c for a grid of motion settings and report
+  |  detections for each setting.  Settings are run in parallel, each on
+  |  its own MotionFrame.  Build with "make sweep".
+  |
+  |  Inputs are .mvlog files from motion_vectors_record or raw inline motion
+  |  vector files (raspivid -x) for which -size and -fps must be given.
+  |  A motion log has its own fps and mjpeg_divider (-divider for logs
+  |  from before the divider was logged) and all inputs must have the
+  |  same motion frame rate since confirm_frames is shared.
+  |  Files given with -quiet are footage where nothing should be detected
+  |  and detections there are counted as false triggers.
+  */
+
+#include "pikrellcam.h"
+#include <sys/mman.h>
+
+typedef struct
+	{
+	char		*name;
+	uint8_t		*data;
+	size_t		size;
+	boolean		quiet,
+				mvlog;
+	int			fps,
+				divider;
+	}
+	SweepInput;
+
+typedef struct
+	{
+	int			low,
+				high,
+				step;
+	}
+	SweepRange;
+
+typedef struct
+	{
+	MotionSettings	settings;
+
+	int			frames,
+				events,				/* detects starting a motion event */
+				direction_detects,
+				burst_detects,
+				slow_detects,
+				files_detected,		/* non quiet files with an event */
+				false_events;		/* events in quiet files */
+	double		msec;
+	}
+	SweepSet;
+
+static SweepInput	*inputs;
+static int			n_inputs;
+
+static SweepSet		*sets;
+static int			n_sets,
+					next_set;
+
+static SList		*region_list;	/* MotionRegion fractions to copy */
+
+static int			mb_width,
+					mb_height,
+					video_width,
+					video_height,
+					video_fps = 24,
+					divider = 4,
+					event_gap = 30;
+
+
+static void
+usage(void)
+	{
+	printf(
+"usage: pikrellcam-sweep [options] [-quiet] file ...\n"
+"  Ranges are low[:high[:step]]\n"
+"  -mag range          motion_magnitude_limit (default 5)\n"
+"  -count range        motion_magnitude_limit_count (default 4)\n"
+"  -burst range        motion_burst_count (default 400)\n"
+"  -burst_frames range motion_burst_frames (default 3)\n"
+"  -confirm secs       motion_confirm_gap (default 4)\n"
+"  -slow_frames n      motion_slow_frames (default 0)\n"
+"  -event_gap secs     motion_event_gap (default 30)\n"
+"  -vertical_filter    motion_vertical_filter on\n"
+"  -no_noise_filter    motion_noise_filter off\n"
+"  -no_lighting_filter motion_lighting_filter off\n"
+"  -regions file       motion regions file (default is the whole frame)\n"
+"  -j n                number of threads (default is all cores)\n"
+"  -size WxH           video size for raw motion vector files\n"
+"  -fps n              video fps for raw motion vector files (default 24)\n"
+"  -divider n          mjpeg_divider for raw files and old logs (default 4)\n"
+"  -quiet file         footage with no motion, detections are false triggers\n"
+	);
+	exit(1);
+	}
+
+static void
+range_arg(SweepRange *range, char *arg)
+	{
+	int		n;
+
+	n = sscanf(arg, "%d:%d:%d", &range->low, &range->high, &range->step);
+	if (n < 1)
+		usage();
+	if (n < 2)
+		range->high = range->low;
+	if (n < 3 || range->step < 1)
+		range->step = 1;
+	}
+
+static int
+range_count(SweepRange *range)
+	{
+	if (range->high < range->low)
+		return 1;
+	return (range->high - range->low) / range->step + 1;
+	}
+
+static boolean
+input_add(char *name, boolean quiet)
+	{
+	SweepInput		*in;
+	MotionLogHeader	*header;
+	struct stat		st;
+	int				fd, width, height;
+
+	if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+		{
+		fprintf(stderr, "Cannot open %s: %s\n", name, strerror(errno));
+		return FALSE;
+		}
+	inputs = realloc(inputs, (n_inputs + 1) * sizeof(SweepInput));
+	in = &inputs[n_inputs];
+	memset(in, 0, sizeof(SweepInput));
+	in->name = name;
+	in->quiet = quiet;
+	in->size = st.st_size;
+	in->data = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (in->data == MAP_FAILED)
+		{
+		fprintf(stderr, "Cannot mmap %s: %s\n", name, strerror(errno));
+		return FALSE;
+		}
+
+	header = (MotionLogHeader *) in->data;
+	if (   in->size >= sizeof(MotionLogHeader)
+	    && !memcmp(header->magic, MOTION_LOG_MAGIC, sizeof(header->magic))
+	   )
+		{
+		if (   header->version != MOTION_LOG_VERSION
+		    || header->header_size != sizeof(MotionLogHeader)
+		    || header->frame_header_size != sizeof(MotionLogFrameHeader)
+		   )
+			{
+			fprintf(stderr, "%s: unknown motion log version\n", name);
+			return FALSE;
+			}
+		in->mvlog = TRUE;
+		in->fps = header->video_fps;
+		in->divider = header->mjpeg_divider;
+		width = header->width;
+		height = header->height;
+		}
+	else
+		{
+		if (video_width == 0)
+			{
+			fprintf(stderr, "%s: not a motion log, so -size is needed\n", name);
+			return FALSE;
+			}
+		width = ((video_width + 15) / 16) + 1;
+		height = (video_height / 16) + 1;
+		}
+	if (mb_width == 0)
+		{
+		mb_width = width;
+		mb_height = height;
+		}
+	else if (width != mb_width || height != mb_height)
+		{
+		fprintf(stderr, "%s: %dx%d motion frames do not match %dx%d\n",
+				name, width, height, mb_width, mb_height);
+		return FALSE;
+		}
+	++n_inputs;
+	return TRUE;
+	}
+
+  /* Fill in the rates of raw inputs and older logs from -fps and -divider
+  |  and make the sweep rates those of the inputs, which must all match.
+  */
+static boolean
+input_rates_check(void)
+	{
+	SweepInput	*in;
+	int			i;
+
+	for (i = 0; i < n_inputs; ++i)
+		{
+		in = &inputs[i];
+		if (in->fps <= 0)
+			in->fps = video_fps;
+		if (in->divider <= 0)
+			in->divider = divider;
+		if (   i > 0
+		    && (in->fps != inputs[0].fps || in->divider != inputs[0].divider)
+		   )
+			{
+			fprintf(stderr, "%s: fps %d divider %d do not match %d %d of %s\n",
+					in->name, in->fps, in->divider,
+					inputs[0].fps, inputs[0].divider, inputs[0].name);
+			return FALSE;
+			}
+		}
+	video_fps = inputs[0].fps;
+	divider = inputs[0].divider;
+	return TRUE;
+	}
+
+static void
+regions_load(char *file)
+	{
+	FILE			*f;
+	MotionRegion	*mreg;
+	char			buf[256], *dir, *s;
+
+	if ((f = fopen(file, "r")) == NULL)
+		{
+		fprintf(stderr, "Cannot open regions file %s: %s\n", file, strerror(errno));
+		exit(1);
+		}
+	dir = strdup(file);		/* masks are relative to the regions file */
+	if ((s = strrchr(dir, '/')) != NULL)
+		*s = '\0';
+	else
+		strcpy(dir, ".");
+	while (fgets(buf, sizeof(buf), f) != NULL)
+		{
+		if (strncmp(buf, "add_", 4))
+			continue;
+		mreg = calloc(1, sizeof(MotionRegion));
+		if (   slist_length(region_list) >= MOTION_REGIONS_MAX
+		    || !motion_region_parse(mreg, buf, dir)
+		   )
+			{
+			fprintf(stderr, "Bad or too many regions in %s: %s", file, buf);
+			exit(1);
+			}
+		region_list = slist_append(region_list, mreg);
+		}
+	free(dir);
+	fclose(f);
+	}
+
+static void
+motion_frame_setup(MotionFrame *mf)
+	{
+	MotionRegionSet	*set;
+	SList			*list;
+
+	memset(mf, 0, sizeof(MotionFrame));
+	pthread_mutex_init(&mf->region_write_mutex, NULL);
+	mf->width = mb_width;
+	mf->height = mb_height;
+	motion_frame_alloc(mf);
+	set = motion_region_set_copy(NULL);
+	for (list = region_list; list; list = list->next)
+		motion_region_set_append(mf, set, (MotionRegion *) list->data);
+	motion_region_set_publish(mf, set);
+	}
+
+  /* Simplified motion record state: a detect starts an event if not in one
+  |  and the event ends event_gap seconds after the last detect.
+  */
+static int
+sweep_frame(MotionFrame *mf, SweepSet *set, double t, boolean *in_event,
+			double *t_detect)
+	{
+	int		event = 0;
+
+	if (*in_event && t >= *t_detect + event_gap)
+		*in_event = FALSE;
+	motion_frame_detect(mf, *in_event);
+	set->frames += 1;
+	if (mf->motion_status & MOTION_DETECTED)
+		{
+		if (!*in_event)
+			event = 1;
+		*in_event = TRUE;
+		*t_detect = t;
+		if (mf->motion_status & MOTION_DIRECTION)
+			set->direction_detects += 1;
+		if (mf->motion_status & MOTION_BURST)
+			set->burst_detects += 1;
+		if (mf->motion_status & MOTION_SLOW)
+			set->slow_detects += 1;
+		}
+	return event;
+	}
+
+static int
+sweep_mvlog(MotionFrame *mf, SweepSet *set, SweepInput *in)
+	{
+	MotionLogFrameHeader	*fh;
+	size_t					offset, end;
+	double					t, t_detect = 0;
+	boolean					in_event = FALSE, have_key = FALSE;
+	int						n = mb_width * mb_height, events = 0;
+
+	end = ((MotionLogHeader *) in->data)->index_offset;
+	if (end == 0 || end > in->size)
+		end = in->size;		/* unfinished log, walk the records */
+	for (offset = sizeof(MotionLogHeader);
+			offset + sizeof(MotionLogFrameHeader) <= end; offset += fh->length)
+		{
+		fh = (MotionLogFrameHeader *) (in->data + offset);
+		if (fh->length < sizeof(MotionLogFrameHeader) || offset + fh->length > end)
+			break;
+		if (fh->flags & MOTION_LOG_KEYFRAME)
+			{
+			memset(mf->vectors, 0, mf->vectors_size);
+			have_key = TRUE;
+			}
+		if (!have_key)
+			continue;
+		if (motion_log_decode((uint8_t *) (fh + 1),
+					fh->length - sizeof(MotionLogFrameHeader), mf->vectors, n) < 0)
+			{
+			fprintf(stderr, "%s: bad frame at offset %zu\n", in->name, offset);
+			break;
+			}
+		t = (double) fh->pts / 1000000.0;
+		events += sweep_frame(mf, set, t, &in_event, &t_detect);
+		}
+	return events;
+	}
+
+static int
+sweep_raw(MotionFrame *mf, SweepSet *set, SweepInput *in)
+	{
+	size_t		n_frames, i;
+	double		t_detect = 0;
+	boolean		in_event = FALSE;
+	int			events = 0;
+
+	/* Like video_h264_data(), detection sees every divider'th frame.
+	*/
+	n_frames = in->size / mf->vectors_size;
+	for (i = divider - 1; i < n_frames; i += divider)
+		{
+		memcpy(mf->vectors, in->data + i * mf->vectors_size, mf->vectors_size);
+		events += sweep_frame(mf, set, (double) i / video_fps,
+					&in_event, &t_detect);
+		}
+	return events;
+	}
+
+static void *
+sweep_thread(void *ptr)
+	{
+	MotionFrame		mf;
+	SweepSet		*set;
+	SweepInput		*in;
+	struct timespec	t0, t1;
+	int				i, k, events;
+
+	motion_frame_setup(&mf);
+	while ((k = __atomic_fetch_add(&next_set, 1, __ATOMIC_RELAXED)) < n_sets)
+		{
+		set = &sets[k];
+		mf.settings = set->settings;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (i = 0; i < n_inputs; ++i)
+			{
+			in = &inputs[i];
+			motion_frame_detect_reset(&mf);
+			if (in->mvlog)
+				events = sweep_mvlog(&mf, set, in);
+			else
+				events = sweep_raw(&mf, set, in);
+			set->events += events;
+			if (in->quiet)
+				set->false_events += events;
+			else if (events > 0)
+				set->files_detected += 1;
+			}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		set->msec = (t1.tv_sec - t0.tv_sec) * 1000.0
+					+ (t1.tv_nsec - t0.tv_nsec) / 1000000.0;
+		}
+	return NULL;
+	}
+
+int
+main(int argc, char *argv[])
+	{
+	SweepRange		mag = {5, 5, 1}, count = {4, 4, 1},
+					burst = {400, 400, 1}, burst_frames = {3, 3, 1};
+	MotionSettings	*s;
+	MotionRegion	*mreg;
+	pthread_t		*threads;
+	struct timespec	t0, t1;
+	char			*arg;
+	int				i, a, b, c, d, n_threads = 0, confirm_gap = 4, slow_frames = 0,
+					n_motion_files = 0;
+	boolean			quiet, vertical_filter = FALSE, noise_filter = TRUE,
+					lighting_filter = TRUE;
+	double			msec;
+
+	for (i = 1; i < argc; ++i)
+		{
+		arg = argv[i];
+		quiet = FALSE;
+		if (   *arg == '-' && i + 1 >= argc
+		    && strcmp(arg, "-vertical_filter") && strcmp(arg, "-no_noise_filter")
+		    && strcmp(arg, "-no_lighting_filter")
+		   )
+			usage();
+		if (!strcmp(arg, "-mag"))
+			range_arg(&mag, argv[++i]);
+		else if (!strcmp(arg, "-count"))
+			range_arg(&count, argv[++i]);
+		else if (!strcmp(arg, "-burst"))
+			range_arg(&burst, argv[++i]);
+		else if (!strcmp(arg, "-burst_frames"))
+			range_arg(&burst_frames, argv[++i]);
+		else if (!strcmp(arg, "-confirm"))
+			confirm_gap = atoi(argv[++i]);
+		else if (!strcmp(arg, "-slow_frames"))
+			slow_frames = atoi(argv[++i]);
+		else if (!strcmp(arg, "-event_gap"))
+			event_gap = atoi(argv[++i]);
+		else if (!strcmp(arg, "-vertical_filter"))
+			vertical_filter = TRUE;
+		else if (!strcmp(arg, "-no_noise_filter"))
+			noise_filter = FALSE;
+		else if (!strcmp(arg, "-no_lighting_filter"))
+			lighting_filter = FALSE;
+		else if (!strcmp(arg, "-regions"))
+			regions_load(argv[++i]);
+		else if (!strcmp(arg, "-j"))
+			n_threads = atoi(argv[++i]);
+		else if (!strcmp(arg, "-size"))
+			{
+			if (sscanf(argv[++i], "%dx%d", &video_width, &video_height) != 2)
+				usage();
+			}
+		else if (!strcmp(arg, "-fps"))
+			{
+			video_fps = atoi(argv[++i]);
+			video_fps = MAX(video_fps, 1);
+			}
+		else if (!strcmp(arg, "-divider"))
+			{
+			divider = atoi(argv[++i]);
+			divider = MAX(divider, 1);
+			}
+		else if (*arg == '-' && strcmp(arg, "-quiet"))
+			usage();
+		else
+			{
+			if (!strcmp(arg, "-quiet"))
+				{
+				quiet = TRUE;
+				arg = argv[++i];
+				}
+			if (!input_add(arg, quiet))
+				exit(1);
+			if (!quiet)
+				++n_motion_files;
+			}
+		}
+	if (n_inputs == 0)
+		usage();
+	if (!input_rates_check())
+		exit(1);
+
+	if (!region_list)
+		{
+		mreg = calloc(1, sizeof(MotionRegion));
+		mreg->dxf = mreg->dyf = 1.0;
+		region_list = slist_append(region_list, mreg);
+		}
+
+	n_sets = range_count(&mag) * range_count(&count)
+				* range_count(&burst) * range_count(&burst_frames);
+	sets = calloc(n_sets, sizeof(SweepSet));
+	n_sets = 0;
+	for (a = mag.low; a <= mag.high; a += mag.step)
+	  for (b = count.low; b <= count.high; b += count.step)
+	    for (c = burst.low; c <= burst.high; c += burst.step)
+	      for (d = burst_frames.low; d <= burst_frames.high; d += burst_frames.step)
+			{
+			s = &sets[n_sets++].settings;
+			s->magnitude_limit = a;
+			s->magnitude_limit_count = b;
+			s->burst_count = c;
+			s->burst_frames = d;
+			s->confirm_frames = video_fps * confirm_gap / divider;
+			s->slow_frames = slow_frames;
+			s->vertical_filter = vertical_filter;
+			s->noise_filter = noise_filter;
+			s->lighting_filter = lighting_filter;
+			}
+
+	if (n_threads <= 0)
+		n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	n_threads = MIN(MAX(n_threads, 1), n_sets);
+	threads = calloc(n_threads, sizeof(pthread_t));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n_threads; ++i)
+		if (pthread_create(&threads[i], NULL, sweep_thread, NULL) != 0)
+			{
+			fprintf(stderr, "Sweep thread create failed: %s\n", strerror(errno));
+			exit(1);
+			}
+	for (i = 0; i < n_threads; ++i)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	msec = (t1.tv_sec - t0.tv_sec) * 1000.0
+				+ (t1.tv_nsec - t0.tv_nsec) / 1000000.0;
+
+	printf(" mag count burst frames |  events  dir burst  slow | detected  false | msec  frames/s\n");
+	for (i = 0; i < n_sets; ++i)
+		{
+		s = &sets[i].settings;
+		printf("%4d %5d %5d %6d | %7d %4d %5d %5d | %4d/%-4d %5d | %4.0f %9.0f\n",
+				s->magnitude_limit, s->magnitude_limit_count,
+				s->burst_count, s->burst_frames,
+				sets[i].events, sets[i].direction_detects, sets[i].burst_detects,
+				sets[i].slow_detects,
+				sets[i].files_detected, n_motion_files, sets[i].false_events,
+				sets[i].msec,
+				sets[i].msec > 0 ? sets[i].frames * 1000.0 / sets[i].msec : 0);
+		}
+	printf("%d settings, %d files, %d threads: %.2f sec\n",
+			n_sets, n_inputs, n_threads, msec / 1000.0);
+	return 0;
+	}
@@ -0,0 +1,403 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+#include "pikrellcam.h"
+
+  /* Object tracking on top of the motion detection.  Region composite
+  |  vectors average everything in a region, so two objects moving different
+  |  ways cancel or fail.  Here the hits of the trigger bit planes that are
+  |  not sparkles are grouped into 8-connected blobs, each with its own
+  |  average vector, and blobs are matched to the tracks of the previous
+  |  frame by nearest predicted centroid.  Direction rejects are not left
+  |  out because they are rejects relative to a region composite vector
+  |  that several objects can pull in different directions.
+  |
+  |  Labelling works on runs of set bits so the cost follows the number of
+  |  runs and not the frame size:  runs of a row are unioned with the
+  |  overlapping runs of the row above and blob sums are collected per
+  |  union-find root.
+  */
+
+#define TRACK_GATE          4	/* macroblocks beyond the blob half size */
+#define TRACK_MISSED_MAX    3	/* frames a track can go unmatched */
+#define TRACK_SMOOTH_SHIFT  1	/* centroid velocity averaging */
+
+  /* Positions and velocities are kept in 1/16 macroblock.
+  */
+#define FP_SHIFT            4
+
+static int
+run_root(int *parent, int i)
+	{
+	while (parent[i] != i)
+		{
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+		}
+	return i;
+	}
+
+static void
+run_union(int *parent, int a, int b)
+	{
+	a = run_root(parent, a);
+	b = run_root(parent, b);
+	if (a < b)
+		parent[b] = a;
+	else if (b < a)
+		parent[a] = b;
+	}
+
+  /* Get the runs of a row of non sparkle hits, returns the new run count.
+  */
+static int
+track_row_runs(MotionFrame *mf, int y, int n_runs)
+	{
+	MotionRun	*run;
+	uint64_t	pass, inv;
+	int			k, x, x_end, k_base,
+				n_words = mf->trigger_words;
+
+	run = NULL;
+	for (k = 0; k < n_words; ++k)
+		{
+		pass = mf->trigger_hit[n_words * y + k]
+					& ~mf->trigger_sparkle[n_words * y + k];
+		k_base = k << 6;
+		while (pass)
+			{
+			x = __builtin_ctzll(pass);
+			inv = ~(pass >> x);			/* run bits are now low zeros */
+			x_end = (inv == 0) ? 64 : x + __builtin_ctzll(inv);
+			pass = (x_end >= 64) ? 0 : pass & (~(uint64_t) 0 << x_end);
+
+			/* Extend a run continuing from the previous word.
+			*/
+			if (run && run->x1 == k_base + x)
+				run->x1 = k_base + x_end;
+			else
+				{
+				run = &mf->track_runs[n_runs];
+				run->y = y;
+				run->x0 = k_base + x;
+				run->x1 = k_base + x_end;
+				mf->track_parent[n_runs] = n_runs;
+				++n_runs;
+				}
+			}
+		}
+	return n_runs;
+	}
+
+static int
+blob_compare(const void *a, const void *b)
+	{
+	return ((MotionBlob *) b)->count - ((MotionBlob *) a)->count;
+	}
+
+static void
+track_blobs(MotionFrame *mf)
+	{
+	MotionRun		*run, *prev;
+	MotionBlob		*bs, *blob;
+	MotionVector	*mv;
+	int				*parent = mf->track_parent;
+	int				i, j, x, y, r, n, n_runs, prev_start, prev_end, row_start,
+					min_count = mf->settings.magnitude_limit_count;
+
+	n_runs = 0;
+	prev_start = prev_end = 0;
+	for (y = 1; y < mf->height - 1; ++y)
+		{
+		row_start = n_runs;
+		n_runs = track_row_runs(mf, y, n_runs);
+
+		/* Union with 8-connected runs of the row above.  Both rows
+		|  are sorted so one merge style scan does it.
+		*/
+		for (i = row_start, j = prev_start; i < n_runs && j < prev_end; )
+			{
+			run = &mf->track_runs[i];
+			prev = &mf->track_runs[j];
+			if (prev->x1 < run->x0)
+				++j;
+			else if (run->x1 < prev->x0)
+				++i;
+			else
+				{
+				run_union(parent, i, j);
+				if (prev->x1 < run->x1)
+					++j;
+				else
+					++i;
+				}
+			}
+		if (n_runs > row_start)
+			{
+			prev_start = row_start;
+			prev_end = n_runs;
+			}
+		else
+			prev_start = prev_end = n_runs;
+		}
+
+	/* Blob sums go into the blobs slot of the root run and are then
+	|  averaged and packed to the front (root indexes only increase).
+	*/
+	for (i = 0; i < n_runs; ++i)
+		{
+		r = run_root(parent, i);
+		run = &mf->track_runs[i];
+		bs = &mf->blobs[r];
+		if (r == i)
+			{
+			memset(bs, 0, sizeof(MotionBlob));
+			bs->box.x0 = run->x0;
+			bs->box.x1 = run->x1 - 1;
+			bs->box.y0 = run->y;
+			}
+		n = run->x1 - run->x0;
+		bs->count += n;
+		bs->x += (run->x0 + run->x1 - 1) * n / 2;
+		bs->y += run->y * n;
+		mv = mf->vectors + mf->width * run->y + run->x0;
+		for (x = run->x0; x < run->x1; ++x, ++mv)
+			{
+			bs->vx += mv->vx;
+			bs->vy += mv->vy;
+			}
+		bs->box.x0 = MIN(bs->box.x0, run->x0);
+		bs->box.x1 = MAX(bs->box.x1, run->x1 - 1);
+		bs->box.y1 = run->y;
+		}
+
+	mf->n_blobs = 0;
+	for (i = 0; i < n_runs; ++i)
+		{
+		bs = &mf->blobs[i];
+		if (parent[i] != i || bs->count < min_count)
+			continue;
+		blob = &mf->blobs[mf->n_blobs++];
+		blob->count = bs->count;
+		blob->x = (bs->x << FP_SHIFT) / bs->count;
+		blob->y = (bs->y << FP_SHIFT) / bs->count;
+		blob->vx = bs->vx / bs->count;
+		blob->vy = bs->vy / bs->count;
+		blob->box = bs->box;
+		blob->track = -1;
+		blob->merged = FALSE;
+		}
+	if (mf->n_blobs > MOTION_BLOB_MAX)
+		{
+		qsort(mf->blobs, mf->n_blobs, sizeof(MotionBlob), blob_compare);
+		mf->n_blobs = MOTION_BLOB_MAX;
+		}
+	}
+
+  /* Distance^2 from the predicted track position to a blob or -1 if the blob
+  |  is out of the track gate.
+  */
+static int
+track_distance(MotionTrack *track, MotionBlob *blob)
+	{
+	int		dx, dy, d2, gate;
+
+	dx = blob->x - (track->x + track->dx);
+	dy = blob->y - (track->y + track->dy);
+	d2 = dx * dx + dy * dy;
+	gate = MAX(blob->box.x1 - blob->box.x0,
+				blob->box.y1 - blob->box.y0) / 2 + TRACK_GATE;
+	gate <<= FP_SHIFT;
+	return (d2 > gate * gate) ? -1 : d2;
+	}
+
+  /* Greedy nearest first matching of blobs to the predicted track
+  |  positions.  There are only a few of each, so all pairs are looked at.
+  |  When objects cross, their blobs merge into one that the predictions of
+  |  several established tracks land in.  Those tracks all take the merged
+  |  blob and coast on their predictions so they can pick up their own
+  |  blobs again when the objects separate.
+  */
+static void
+track_associate(MotionFrame *mf)
+	{
+	MotionTrack	*track;
+	MotionBlob	*blob;
+	int			i, j, best_i, best_j, d2, best_d2;
+
+	for (;;)
+		{
+		best_d2 = -1;
+		best_i = best_j = -1;
+		for (i = 0; i < MOTION_TRACK_MAX; ++i)
+			{
+			track = &mf->tracks[i];
+			if (track->id == 0 || track->matched)
+				continue;
+			for (j = 0; j < mf->n_blobs; ++j)
+				{
+				blob = &mf->blobs[j];
+				if (blob->track >= 0 && !blob->merged)
+					continue;
+				d2 = track_distance(track, blob);
+				if (d2 >= 0 && (best_d2 < 0 || d2 < best_d2))
+					{
+					best_d2 = d2;
+					best_i = i;
+					best_j = j;
+					}
+				}
+			}
+		if (best_d2 < 0)
+			break;
+		track = &mf->tracks[best_i];
+		blob = &mf->blobs[best_j];
+		track->matched = TRUE;
+
+		if (!blob->merged && track->age >= 2)
+			for (i = 0; i < MOTION_TRACK_MAX; ++i)
+				if (   i != best_i && mf->tracks[i].id != 0
+				    && !mf->tracks[i].matched && mf->tracks[i].age >= 2
+				    && track_distance(&mf->tracks[i], blob) >= 0
+				   )
+					blob->merged = TRUE;
+		blob->track = best_i;
+		if (blob->merged)
+			{
+			track->x += track->dx;
+			track->y += track->dy;
+			track->age += 1;
+			track->missed = 0;
+			continue;
+			}
+		track->dx += ((blob->x - track->x) - track->dx) >> TRACK_SMOOTH_SHIFT;
+		track->dy += ((blob->y - track->y) - track->dy) >> TRACK_SMOOTH_SHIFT;
+		track->x = blob->x;
+		track->y = blob->y;
+		track->vx = blob->vx;
+		track->vy = blob->vy;
+		track->count = blob->count;
+		track->box = blob->box;
+		track->age += 1;
+		track->missed = 0;
+		}
+	}
+
+  /* Run after the detection of a frame has set the trigger bit planes.
+  */
+void
+motion_track_frame(MotionFrame *mf)
+	{
+	MotionTrack	*track;
+	MotionBlob	*blob;
+	int			i, j;
+
+	if (!mf->track_runs)
+		return;
+	track_blobs(mf);
+
+	for (i = 0; i < MOTION_TRACK_MAX; ++i)
+		mf->tracks[i].matched = FALSE;
+	track_associate(mf);
+
+	for (i = 0; i < MOTION_TRACK_MAX; ++i)
+		{
+		track = &mf->tracks[i];
+		if (track->id == 0 || track->matched)
+			continue;
+		if (++track->missed > TRACK_MISSED_MAX)
+			track->id = 0;
+		else
+			{
+			track->x += track->dx;		/* coast on the prediction */
+			track->y += track->dy;
+			}
+		}
+
+	/* New tracks for unmatched blobs, largest first if out of slots.
+	*/
+	for (j = 0, i = 0; j < mf->n_blobs; ++j)
+		{
+		blob = &mf->blobs[j];
+		if (blob->track >= 0)
+			continue;
+		while (i < MOTION_TRACK_MAX && mf->tracks[i].id != 0)
+			++i;
+		if (i >= MOTION_TRACK_MAX)
+			break;
+		track = &mf->tracks[i];
+		memset(track, 0, sizeof(MotionTrack));
+		if (++mf->track_id <= 0)
+			mf->track_id = 1;
+		track->id = mf->track_id;
+		track->x = blob->x;
+		track->y = blob->y;
+		track->vx = blob->vx;
+		track->vy = blob->vy;
+		track->count = blob->count;
+		track->box = blob->box;
+		track->age = 1;
+		track->matched = TRUE;
+		blob->track = i;
+		}
+
+	if (mf->settings.verbose)
+		for (i = 0; i < MOTION_TRACK_MAX; ++i)
+			{
+			track = &mf->tracks[i];
+			if (!motion_track_visible(track))
+				continue;
+			printf("track[%d]: x,y(%d,%d) dx,dy(%d,%d) count:%d age:%d\n",
+				track->id, track->x >> FP_SHIFT, track->y >> FP_SHIFT,
+				track->vx, track->vy, track->count, track->age);
+			}
+	}
+
+  /* A track is reported once seen on two frames and while it is matched.
+  */
+boolean
+motion_track_visible(MotionTrack *track)
+	{
+	return (track->id > 0 && track->matched && track->age >= 2);
+	}
+
+void
+motion_track_reset(MotionFrame *mf)
+	{
+	memset(mf->tracks, 0, sizeof(mf->tracks));
+	mf->n_blobs = 0;
+	}
+
+void
+motion_track_alloc(MotionFrame *mf)
+	{
+	int		n;
+
+	/* At most one run per two macroblocks of a row.
+	*/
+	n = (mf->width / 2 + 1) * mf->height;
+	free(mf->track_runs);
+	mf->track_runs = malloc(n * sizeof(MotionRun));
+	free(mf->track_parent);
+	mf->track_parent = malloc(n * sizeof(int));
+	free(mf->blobs);
+	mf->blobs = malloc(n * sizeof(MotionBlob));
+	motion_track_reset(mf);
+	}
@@ -0,0 +1,761 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+#include "pikrellcam.h"
+
+  /* Minimal mp4 muxer for a single h264 video track.  The file is written
+  |  as ftyp, then mdat with the samples as they arrive, then moov with
+  |  the sample tables when the record is finished.  The mdat uses a 64 bit
+  |  size so records over 4GB are OK.
+  |  Samples come in as h264 byte stream (start code delimited) frames
+  |  and are written as 4 byte length prefixed NAL units.  SPS and PPS
+  |  from the encoder header go into the avcC and are not repeated in
+  |  the samples.
+  */
+
+#define	MP4_TIMESCALE		90000	/* media time units per second */
+#define	MP4_MOVIE_TIMESCALE	1000
+
+#define	NAL_TYPE_SPS		7
+#define	NAL_TYPE_PPS		8
+#define	NAL_TYPE_AUD		9
+
+typedef struct
+	{
+	uint8_t	*data;
+	int		length,
+			alloc;
+	}
+	Mp4Buf;
+
+
+static void
+buf_put(Mp4Buf *b, void *data, int length)
+	{
+	if (b->length + length > b->alloc)
+		{
+		b->alloc = (b->length + length) * 2 + 1024;
+		b->data = realloc(b->data, b->alloc);
+		}
+	memcpy(b->data + b->length, data, length);
+	b->length += length;
+	}
+
+static void
+put8(Mp4Buf *b, int val)
+	{
+	uint8_t	c = (uint8_t) val;
+
+	buf_put(b, &c, 1);
+	}
+
+static void
+put16(Mp4Buf *b, int val)
+	{
+	put8(b, val >> 8);
+	put8(b, val);
+	}
+
+static void
+put32(Mp4Buf *b, uint32_t val)
+	{
+	put16(b, val >> 16);
+	put16(b, val);
+	}
+
+static void
+put64(Mp4Buf *b, uint64_t val)
+	{
+	put32(b, (uint32_t) (val >> 32));
+	put32(b, (uint32_t) val);
+	}
+
+static void
+put_zeros(Mp4Buf *b, int n)
+	{
+	while (n-- > 0)
+		put8(b, 0);
+	}
+
+static int
+box_start(Mp4Buf *b, char *type)
+	{
+	int		position = b->length;
+
+	put32(b, 0);
+	buf_put(b, type, 4);
+	return position;
+	}
+
+static int
+full_box_start(Mp4Buf *b, char *type, int version, int flags)
+	{
+	int		position = box_start(b, type);
+
+	put8(b, version);
+	put8(b, flags >> 16);
+	put16(b, flags);
+	return position;
+	}
+
+static void
+box_end(Mp4Buf *b, int position)
+	{
+	uint32_t	size = b->length - position;
+	uint8_t		*p = b->data + position;
+
+	p[0] = size >> 24;
+	p[1] = size >> 16;
+	p[2] = size >> 8;
+	p[3] = size;
+	}
+
+static void
+put_matrix(Mp4Buf *b)
+	{
+	put32(b, 0x00010000);
+	put32(b, 0);
+	put32(b, 0);
+	put32(b, 0);
+	put32(b, 0x00010000);
+	put32(b, 0);
+	put32(b, 0);
+	put32(b, 0);
+	put32(b, 0x40000000);
+	}
+
+
+  /* Return a pointer to the next NAL unit in a byte stream and set its
+  |  length with trailing zero bytes (from a following 4 byte start code)
+  |  stripped.  Returns NULL when there are no more.  Also used by the
+  |  replay camera source to split h264 files into NAL units.
+  */
+uint8_t *
+h264_nal_next(uint8_t **pp, uint8_t *end, int *length)
+	{
+	uint8_t	*p = *pp, *nal, *nal_end;
+
+	while (p + 3 <= end && !(p[0] == 0 && p[1] == 0 && p[2] == 1))
+		++p;
+	if (p + 3 > end)
+		return NULL;
+	nal = p + 3;
+	for (p = nal; p + 3 <= end; ++p)
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+			break;
+	if (p + 3 > end)
+		p = end;
+	*pp = p;
+	nal_end = p;
+	while (nal_end > nal && *(nal_end - 1) == 0)
+		--nal_end;
+	*length = nal_end - nal;
+	return (*length > 0) ? nal : h264_nal_next(pp, end, length);
+	}
+
+static void
+array_grow(void **array, int *alloc, int n, int element_size)
+	{
+	if (n < *alloc)
+		return;
+	*alloc = (*alloc == 0) ? 1024 : *alloc * 2;
+	*array = realloc(*array, *alloc * element_size);
+	}
+
+static void
+stts_add(Mp4Mux *mux, uint32_t duration)
+	{
+	if (mux->n_stts > 0 && mux->stts[2 * mux->n_stts - 1] == duration)
+		mux->stts[2 * mux->n_stts - 2] += 1;
+	else
+		{
+		array_grow((void **) &mux->stts, &mux->stts_alloc, 2 * mux->n_stts + 2,
+					sizeof(uint32_t));
+		mux->stts[2 * mux->n_stts] = 1;
+		mux->stts[2 * mux->n_stts + 1] = duration;
+		mux->n_stts += 1;
+		}
+	mux->duration += duration;
+	}
+
+  /* Get the SPS and PPS for the avcC out of the encoder config data.
+  */
+static boolean
+mux_config_set(Mp4Mux *mux, int8_t *header, int header_size)
+	{
+	uint8_t	*p, *end, *nal;
+	int		length;
+
+	p = (uint8_t *) header;
+	end = p + header_size;
+	while ((nal = h264_nal_next(&p, end, &length)) != NULL)
+		{
+		if ((*nal & 0x1f) == NAL_TYPE_SPS && !mux->sps)
+			{
+			mux->sps = malloc(length);
+			memcpy(mux->sps, nal, length);
+			mux->sps_size = length;
+			}
+		else if ((*nal & 0x1f) == NAL_TYPE_PPS && !mux->pps)
+			{
+			mux->pps = malloc(length);
+			memcpy(mux->pps, nal, length);
+			mux->pps_size = length;
+			}
+		}
+	if (!mux->sps || mux->sps_size < 4 || !mux->pps)
+		{
+		log_printf("mp4 mux: no SPS/PPS in h264 header.\n");
+		return FALSE;
+		}
+	return TRUE;
+	}
+
+  /* Start a mp4 file.  The header is the encoder SPS/PPS config data.
+  |  If fps is non zero, samples get a fixed duration for that rate
+  |  (slow or fast motion if it is not the camera rate).  Otherwise sample
+  |  durations come from the frame pts with nominal_fps used where there
+  |  is no pts.
+  */
+boolean
+mp4_mux_start(Mp4Mux *mux, FILE *file, int8_t *header, int header_size,
+			int width, int height, int fps, int nominal_fps)
+	{
+	Mp4Buf	b = { 0 };
+	int		n;
+
+	memset(mux, 0, sizeof(Mp4Mux));
+	mux->file = file;
+	mux->width = width;
+	mux->height = height;
+	if (nominal_fps <= 0)
+		nominal_fps = 24;
+	mux->nominal_duration = MP4_TIMESCALE / nominal_fps;
+	mux->fixed_duration = (fps > 0) ? MP4_TIMESCALE / fps : 0;
+
+	if (!mux_config_set(mux, header, header_size))
+		return FALSE;
+
+	n = box_start(&b, "ftyp");
+	buf_put(&b, "isom", 4);
+	put32(&b, 0x200);
+	buf_put(&b, "isomiso2avc1mp41", 16);
+	box_end(&b, n);
+
+	mux->mdat_position = b.length;
+	put32(&b, 1);				/* 64 bit largesize follows */
+	buf_put(&b, "mdat", 4);
+	put64(&b, 0);
+	mux->offset = b.length;
+
+	n = fwrite(b.data, 1, b.length, file);
+	free(b.data);
+	return (n == mux->offset);
+	}
+
+  /* Add a frame of h264 byte stream data as a sample.  Returns the number
+  |  of bytes written or -1 on a write error.
+  */
+int
+mp4_mux_sample(Mp4Mux *mux, uint8_t *frame, int frame_length,
+			boolean keyframe, uint64_t pts)
+	{
+	uint8_t		*p, *end, *nal, prefix[4];
+	uint32_t	duration;
+	int			length, size = 0;
+
+	p = frame;
+	end = frame + frame_length;
+	while ((nal = h264_nal_next(&p, end, &length)) != NULL)
+		{
+		if (   (*nal & 0x1f) == NAL_TYPE_SPS
+		    || (*nal & 0x1f) == NAL_TYPE_PPS
+		    || (*nal & 0x1f) == NAL_TYPE_AUD
+		   )
+			continue;
+		prefix[0] = length >> 24;
+		prefix[1] = length >> 16;
+		prefix[2] = length >> 8;
+		prefix[3] = length;
+		if (   fwrite(prefix, 1, 4, mux->file) != 4
+		    || fwrite(nal, 1, length, mux->file) != length
+		   )
+			return -1;
+		size += length + 4;
+		}
+	if (size == 0)
+		return 0;
+
+	/* The duration of the previous sample is known now.
+	*/
+	if (mux->n_samples > 0)
+		{
+		if (mux->fixed_duration > 0)
+			duration = mux->fixed_duration;
+		else if (pts > mux->prev_pts && mux->prev_pts > 0)
+			duration = (uint32_t) ((pts - mux->prev_pts) * MP4_TIMESCALE / 1000000);
+		else
+			duration = mux->nominal_duration;
+		stts_add(mux, duration);
+		}
+	mux->prev_pts = pts;
+
+	array_grow((void **) &mux->sample_size, &mux->sample_alloc,
+				mux->n_samples, sizeof(uint32_t));
+	array_grow((void **) &mux->chunk_offset, &mux->chunk_alloc,
+				mux->n_samples, sizeof(uint64_t));
+	mux->sample_size[mux->n_samples] = size;
+	mux->chunk_offset[mux->n_samples] = mux->offset;
+	mux->n_samples += 1;
+	if (keyframe)
+		{
+		array_grow((void **) &mux->sync_sample, &mux->sync_alloc,
+					mux->n_sync, sizeof(uint32_t));
+		mux->sync_sample[mux->n_sync++] = mux->n_samples;
+		}
+	mux->offset += size;
+	return size;
+	}
+
+  /* A fragmented mp4 init segment has empty sample tables, the samples
+  |  are described in the fragments.
+  */
+static void
+mp4_stbl_write(Mp4Mux *mux, Mp4Buf *b, boolean fragmented)
+	{
+	int		i, stbl, box, entry, avcc;
+	boolean	co64;
+
+	stbl = box_start(b, "stbl");
+
+	box = full_box_start(b, "stsd", 0, 0);
+	put32(b, 1);
+	entry = box_start(b, "avc1");
+	put_zeros(b, 6);
+	put16(b, 1);				/* data reference index */
+	put_zeros(b, 16);
+	put16(b, mux->width);
+	put16(b, mux->height);
+	put32(b, 0x00480000);		/* 72 dpi */
+	put32(b, 0x00480000);
+	put32(b, 0);
+	put16(b, 1);				/* frame count */
+	put_zeros(b, 32);			/* compressor name */
+	put16(b, 0x18);				/* depth */
+	put16(b, 0xffff);
+
+	avcc = box_start(b, "avcC");
+	put8(b, 1);
+	put8(b, mux->sps[1]);		/* profile */
+	put8(b, mux->sps[2]);		/* profile compatibility */
+	put8(b, mux->sps[3]);		/* level */
+	put8(b, 0xff);				/* 4 byte NAL lengths */
+	put8(b, 0xe1);				/* 1 SPS */
+	put16(b, mux->sps_size);
+	buf_put(b, mux->sps, mux->sps_size);
+	put8(b, 1);					/* 1 PPS */
+	put16(b, mux->pps_size);
+	buf_put(b, mux->pps, mux->pps_size);
+	box_end(b, avcc);
+	box_end(b, entry);
+	box_end(b, box);
+
+	box = full_box_start(b, "stts", 0, 0);
+	put32(b, mux->n_stts);
+	for (i = 0; i < 2 * mux->n_stts; ++i)
+		put32(b, mux->stts[i]);
+	box_end(b, box);
+
+	if (!fragmented)
+		{
+		box = full_box_start(b, "stss", 0, 0);
+		put32(b, mux->n_sync);
+		for (i = 0; i < mux->n_sync; ++i)
+			put32(b, mux->sync_sample[i]);
+		box_end(b, box);
+		}
+
+	box = full_box_start(b, "stsc", 0, 0);	/* one sample per chunk */
+	if (fragmented)
+		put32(b, 0);
+	else
+		{
+		put32(b, 1);
+		put32(b, 1);
+		put32(b, 1);
+		put32(b, 1);
+		}
+	box_end(b, box);
+
+	box = full_box_start(b, "stsz", 0, 0);
+	put32(b, 0);
+	put32(b, mux->n_samples);
+	for (i = 0; i < mux->n_samples; ++i)
+		put32(b, mux->sample_size[i]);
+	box_end(b, box);
+
+	co64 = (mux->offset > 0xffffffffULL);
+	box = full_box_start(b, co64 ? "co64" : "stco", 0, 0);
+	put32(b, mux->n_samples);
+	for (i = 0; i < mux->n_samples; ++i)
+		{
+		if (co64)
+			put64(b, mux->chunk_offset[i]);
+		else
+			put32(b, (uint32_t) mux->chunk_offset[i]);
+		}
+	box_end(b, box);
+
+	box_end(b, stbl);
+	}
+
+static void
+mp4_moov_write(Mp4Mux *mux, Mp4Buf *b, boolean fragmented)
+	{
+	uint32_t	movie_duration;
+	int			moov, trak, mdia, minf, dinf, mvex, box;
+
+	movie_duration = (uint32_t) (mux->duration * MP4_MOVIE_TIMESCALE
+								/ MP4_TIMESCALE);
+	moov = box_start(b, "moov");
+
+	box = full_box_start(b, "mvhd", 0, 0);
+	put32(b, 0);				/* creation, modification time */
+	put32(b, 0);
+	put32(b, MP4_MOVIE_TIMESCALE);
+	put32(b, movie_duration);
+	put32(b, 0x00010000);		/* rate 1.0 */
+	put16(b, 0x0100);			/* volume 1.0 */
+	put_zeros(b, 10);
+	put_matrix(b);
+	put_zeros(b, 24);
+	put32(b, 2);				/* next track ID */
+	box_end(b, box);
+
+	trak = box_start(b, "trak");
+	box = full_box_start(b, "tkhd", 0, 3);	/* enabled, in movie */
+	put32(b, 0);
+	put32(b, 0);
+	put32(b, 1);				/* track ID */
+	put32(b, 0);
+	put32(b, movie_duration);
+	put_zeros(b, 8);
+	put16(b, 0);				/* layer */
+	put16(b, 0);				/* alternate group */
+	put16(b, 0);				/* volume */
+	put16(b, 0);
+	put_matrix(b);
+	put32(b, mux->width << 16);
+	put32(b, mux->height << 16);
+	box_end(b, box);
+
+	mdia = box_start(b, "mdia");
+	box = full_box_start(b, "mdhd", 0, 0);
+	put32(b, 0);
+	put32(b, 0);
+	put32(b, MP4_TIMESCALE);
+	put32(b, (uint32_t) mux->duration);
+	put16(b, 0x55c4);			/* language "und" */
+	put16(b, 0);
+	box_end(b, box);
+
+	box = full_box_start(b, "hdlr", 0, 0);
+	put32(b, 0);
+	buf_put(b, "vide", 4);
+	put_zeros(b, 12);
+	buf_put(b, "VideoHandler", 13);
+	box_end(b, box);
+
+	minf = box_start(b, "minf");
+	box = full_box_start(b, "vmhd", 0, 1);
+	put_zeros(b, 8);
+	box_end(b, box);
+
+	dinf = box_start(b, "dinf");
+	box = full_box_start(b, "dref", 0, 0);
+	put32(b, 1);
+	box_end(b, full_box_start(b, "url ", 0, 1));	/* data in this file */
+	box_end(b, box);
+	box_end(b, dinf);
+
+	mp4_stbl_write(mux, b, fragmented);
+	box_end(b, minf);
+	box_end(b, mdia);
+	box_end(b, trak);
+
+	if (fragmented)
+		{
+		mvex = box_start(b, "mvex");
+		box = full_box_start(b, "trex", 0, 0);
+		put32(b, 1);			/* track ID */
+		put32(b, 1);			/* sample description index */
+		put32(b, 0);			/* defaults are in each trun */
+		put32(b, 0);
+		put32(b, 0);
+		box_end(b, box);
+		box_end(b, mvex);
+		}
+	box_end(b, moov);
+	}
+
+  /* Write the moov and fix up the mdat size.  Frees the sample tables
+  |  but does not close the file.
+  */
+boolean
+mp4_mux_finish(Mp4Mux *mux)
+	{
+	Mp4Buf		b = { 0 };
+	uint8_t		size[8];
+	uint64_t	mdat_size;
+	boolean		ok = TRUE;
+	int			i;
+
+	if (mux->n_samples > 0)
+		stts_add(mux, mux->fixed_duration ? mux->fixed_duration
+							: mux->nominal_duration);
+
+	mp4_moov_write(mux, &b, FALSE);
+	if (fwrite(b.data, 1, b.length, mux->file) != b.length)
+		ok = FALSE;
+	free(b.data);
+
+	mdat_size = mux->offset - mux->mdat_position;
+	for (i = 0; i < 8; ++i)
+		size[i] = (uint8_t) (mdat_size >> (56 - 8 * i));
+	if (   fseeko(mux->file, (off_t) mux->mdat_position + 8, SEEK_SET) != 0
+	    || fwrite(size, 1, 8, mux->file) != 8
+	   )
+		ok = FALSE;
+
+	free(mux->sps);
+	free(mux->pps);
+	free(mux->sample_size);
+	free(mux->chunk_offset);
+	free(mux->sync_sample);
+	free(mux->stts);
+	memset(mux, 0, sizeof(Mp4Mux));
+	return ok;
+	}
+
+
+  /* Fragmented mp4 for HLS (see hls.c).  The init segment is a ftyp and a
+  |  moov with no samples, then each fragment is a moof and its mdat.
+  |  Fragment decode times come from the frame pts so they stay right
+  |  across frames the segmenter skips.
+  */
+boolean
+mp4_frag_init_write(FILE *file, int8_t *header, int header_size,
+			int width, int height)
+	{
+	Mp4Mux	mux;
+	Mp4Buf	b = { 0 };
+	int		n;
+	boolean	ok;
+
+	memset(&mux, 0, sizeof(Mp4Mux));
+	mux.width = width;
+	mux.height = height;
+	if (!mux_config_set(&mux, header, header_size))
+		{
+		free(mux.sps);
+		free(mux.pps);
+		return FALSE;
+		}
+	n = box_start(&b, "ftyp");
+	buf_put(&b, "iso5", 4);
+	put32(&b, 0x200);
+	buf_put(&b, "iso5iso6mp41avc1", 16);
+	box_end(&b, n);
+	mp4_moov_write(&mux, &b, TRUE);
+
+	ok = (fwrite(b.data, 1, b.length, file) == b.length);
+	free(b.data);
+	free(mux.sps);
+	free(mux.pps);
+	return ok;
+	}
+
+void
+mp4_frag_start(Mp4Frag *frag, int nominal_fps)
+	{
+	memset(frag, 0, sizeof(Mp4Frag));
+	if (nominal_fps <= 0)
+		nominal_fps = 24;
+	frag->nominal_duration = MP4_TIMESCALE / nominal_fps;
+	}
+
+static uint64_t
+frag_decode_time(Mp4Frag *frag, uint64_t pts)
+	{
+	return (pts - frag->pts_origin) * MP4_TIMESCALE / 1000000;
+	}
+
+  /* Durations are differences of decode times so they add up to the
+  |  next fragment decode time without rounding drift.
+  */
+static uint32_t
+frag_duration(Mp4Frag *frag, uint64_t pts)
+	{
+	if (pts > frag->prev_pts && frag->prev_pts > 0)
+		return (uint32_t) (frag_decode_time(frag, pts)
+					- frag_decode_time(frag, frag->prev_pts));
+	return frag->nominal_duration;
+	}
+
+  /* Add a frame of h264 byte stream data as a sample of the fragment
+  |  being built.  The previous sample duration is known now, but only if
+  |  the frame has sample data, else it is as if the frame never came.
+  */
+void
+mp4_frag_sample(Mp4Frag *frag, uint8_t *frame, int frame_length,
+			boolean keyframe, uint64_t pts)
+	{
+	Mp4Buf	b;
+	uint8_t	*p, *end, *nal;
+	int		length, start, n, alloc;
+
+	b.data = frag->data;
+	b.length = frag->length;
+	b.alloc = frag->alloc;
+	start = b.length;
+	p = frame;
+	end = frame + frame_length;
+	while ((nal = h264_nal_next(&p, end, &length)) != NULL)
+		{
+		if (   (*nal & 0x1f) == NAL_TYPE_SPS
+		    || (*nal & 0x1f) == NAL_TYPE_PPS
+		    || (*nal & 0x1f) == NAL_TYPE_AUD
+		   )
+			continue;
+		put32(&b, length);
+		buf_put(&b, nal, length);
+		}
+	frag->data = b.data;
+	frag->length = b.length;
+	frag->alloc = b.alloc;
+	if (b.length == start)
+		return;
+
+	n = frag->n_samples;
+	if (n > 0)
+		frag->sample_duration[n - 1] = frag_duration(frag, pts);
+	else
+		{
+		if (frag->pts_origin == 0)
+			frag->pts_origin = pts;
+		if (pts > frag->pts_origin)
+			frag->decode_time = frag_decode_time(frag, pts);
+		else
+			frag->decode_time = frag->next_decode_time;
+		}
+	frag->prev_pts = pts;
+
+	alloc = frag->sample_alloc;
+	array_grow((void **) &frag->sample_size, &frag->sample_alloc,
+				n, sizeof(uint32_t));
+	if (frag->sample_alloc != alloc)
+		{
+		frag->sample_duration = realloc(frag->sample_duration,
+					frag->sample_alloc * sizeof(uint32_t));
+		frag->sample_flags = realloc(frag->sample_flags,
+					frag->sample_alloc * sizeof(uint32_t));
+		}
+	frag->sample_size[n] = b.length - start;
+	frag->sample_duration[n] = frag->nominal_duration;
+	frag->sample_flags[n] = keyframe ? 0x02000000 : 0x01010000;
+	frag->n_samples += 1;
+	}
+
+  /* Write the fragment as a moof and mdat and empty it for the next one.
+  |  next_pts is the pts of the frame after the fragment for the last
+  |  sample duration, or 0 if unknown.  Returns the bytes written, 0 if
+  |  there were no samples, or -1 on a write error.
+  */
+int
+mp4_frag_write(Mp4Frag *frag, FILE *file, uint32_t sequence, uint64_t next_pts)
+	{
+	Mp4Buf	b = { 0 };
+	int		i, moof, traf, box, data_offset, n;
+	uint8_t	*p;
+
+	if (frag->n_samples == 0)
+		return 0;
+	if (next_pts > 0)
+		frag->sample_duration[frag->n_samples - 1] = frag_duration(frag, next_pts);
+
+	moof = box_start(&b, "moof");
+	box = full_box_start(&b, "mfhd", 0, 0);
+	put32(&b, sequence);
+	box_end(&b, box);
+
+	traf = box_start(&b, "traf");
+	box = full_box_start(&b, "tfhd", 0, 0x020000);	/* default base is moof */
+	put32(&b, 1);				/* track ID */
+	box_end(&b, box);
+	box = full_box_start(&b, "tfdt", 1, 0);
+	put64(&b, frag->decode_time);
+	box_end(&b, box);
+
+	/* data offset, sample durations, sizes and flags */
+	box = full_box_start(&b, "trun", 0, 0x000701);
+	put32(&b, frag->n_samples);
+	data_offset = b.length;
+	put32(&b, 0);
+	frag->next_decode_time = frag->decode_time;
+	for (i = 0; i < frag->n_samples; ++i)
+		{
+		frag->next_decode_time += frag->sample_duration[i];
+		put32(&b, frag->sample_duration[i]);
+		put32(&b, frag->sample_size[i]);
+		put32(&b, frag->sample_flags[i]);
+		}
+	box_end(&b, box);
+	box_end(&b, traf);
+	box_end(&b, moof);
+
+	p = b.data + data_offset;
+	n = b.length + 8;			/* mdat data follows the moof */
+	p[0] = n >> 24;
+	p[1] = n >> 16;
+	p[2] = n >> 8;
+	p[3] = n;
+	put32(&b, frag->length + 8);
+	buf_put(&b, "mdat", 4);
+
+	n = b.length + frag->length;
+	if (   fwrite(b.data, 1, b.length, file) != b.length
+	    || fwrite(frag->data, 1, frag->length, file) != frag->length
+	   )
+		n = -1;
+	free(b.data);
+	frag->length = 0;
+	frag->n_samples = 0;
+	return n;
+	}
+
+void
+mp4_frag_free(Mp4Frag *frag)
+	{
+	free(frag->data);
+	free(frag->sample_size);
+	free(frag->sample_duration);
+	free(frag->sample_flags);
+	memset(frag, 0, sizeof(Mp4Frag));
+	}
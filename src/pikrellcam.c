@@ -21,7 +21,6 @@
 #include "pikrellcam.h"
 #include <signal.h>
 #include <locale.h>
-#include <sys/statvfs.h>
 
 
 PiKrellCam	pikrellcam;
@@ -187,16 +186,29 @@ annotate_string_remove(char *id)
 void
 camera_start(void)
 	{
-	MMAL_STATUS_T status;
 	char          *cmd;
 
 	motion_init();
+	pthread_mutex_lock(&video_circular_buffer.mutex);
 	circular_buffer_init();
+	pthread_mutex_unlock(&video_circular_buffer.mutex);
+	video_circular_buffer.h264_header_position = 0;
 
-	if (!camera_create())
+	pikrellcam.mjpeg_height = pikrellcam.mjpeg_width *
+					pikrellcam.camera_config.video_height / pikrellcam.camera_config.video_width;
+	pikrellcam.mjpeg_width &= ~0xf;		/* Make resize multiple of 16 */
+	pikrellcam.mjpeg_height &= ~0xf;
+
+	/* A replay source can deliver frames as soon as it is started, so have
+	|  the display ready for them.
+	*/
+	display_init();
+
+	if (!camera_source->start())
 		{
 		pikrellcam.verbose = TRUE;
-		log_printf("Failed to start the camera.  Possible causes:\n");
+		log_printf("Failed to start the %s.  Possible causes:\n",
+					camera_source->name);
 		log_printf("   Another program is using the camera.\n");
 		log_printf("   Camera ribbon cable connection problem.\n");
 		fprintf(stderr, "See /tmp/pikrellcam.log for an error message.\n");
@@ -205,61 +217,12 @@ camera_start(void)
 		exec_wait(cmd, NULL);
 		exit(1);
 		}
-
-	/* ====== Create the camera preview port path ====== :
-	|  preview --(tunnel)--> resizer --> I420_callback --> jpeg_encoder --> mjpeg_callback
-	|                                   (draws on frame)                   (writes stream mjpeg.jpg)
-	*/
-	pikrellcam.mjpeg_height = pikrellcam.mjpeg_width *
-					pikrellcam.camera_config.video_height / pikrellcam.camera_config.video_width;
-	pikrellcam.mjpeg_width &= ~0xf;		/* Make resize multiple of 16 */
-	pikrellcam.mjpeg_height &= ~0xf;
-	resizer_create("stream_resizer", &stream_resizer,
-							camera.component->output[CAMERA_PREVIEW_PORT],
-							pikrellcam.mjpeg_width, pikrellcam.mjpeg_height);
-	ports_tunnel_connect(&camera, CAMERA_PREVIEW_PORT, &stream_resizer);
-	jpeg_encoder_create("mjpeg_encoder", &mjpeg_encoder,
-					stream_resizer.component->output[0], pikrellcam.mjpeg_quality);
-	ports_callback_connect(&stream_resizer, 0, &mjpeg_encoder,
-					I420_video_callback);
-	out_port_callback(&mjpeg_encoder, 0, mjpeg_callback);
-
-
-	/* ====== Create the camera still port path ====== :
-	|  camera_capture --(tunnel)--> jpeg_encoder --> still_jpeg__callback
-	|                                               (writes stills and timelapse jpegs)
-	*/
-	jpeg_encoder_create("still_jpeg_encoder", &still_jpeg_encoder,
-					NULL, pikrellcam.camera_adjust.still_quality);
-	ports_tunnel_connect(&camera, CAMERA_CAPTURE_PORT, &still_jpeg_encoder);
-	out_port_callback(&still_jpeg_encoder, 0, still_jpeg_callback);
-
-
-	/* ====== Create the camera video port path ====== :
-	|  camera_video--(tunnel)-->h264 encoder-->video_h264_encoder_callback
-	|                                         (writes data into video circular buffer)
-	|                                         (records video / checks motion vectors)
-	|                                         (schedules mjpeg.jpg copy into previews)
-	*/
-	h264_encoder_create("video_h264_encoder", &video_h264_encoder, NULL);
-	ports_tunnel_connect(&camera, CAMERA_VIDEO_PORT, &video_h264_encoder);
-	out_port_callback(&video_h264_encoder, 0, video_h264_encoder_callback);
-
 	time(&pikrellcam.t_start);
 
-	/* Turn on the video stream. It free runs into the video circular buffer.
-	*/
-	if ((status = mmal_port_parameter_set_boolean(
-				camera.component->output[CAMERA_VIDEO_PORT],
-				MMAL_PARAMETER_CAPTURE, 1)) != MMAL_SUCCESS)
-		log_printf("Video capture startup failed. Status %s\n",
-					mmal_status[status]);
-
 	/* With everything created and running, set the config'ed camera params.
 	*/
 	mmalcam_config_parameters_set_camera();
 
-	display_init();
 	video_circular_buffer.state = VCB_STATE_NONE;
 	video_circular_buffer.pause = FALSE;
 	pikrellcam.state_modified = TRUE;
@@ -269,14 +232,7 @@ camera_start(void)
 void
 camera_stop(void)
 	{
-	mmal_port_parameter_set_boolean(camera.component->output[CAMERA_VIDEO_PORT],
-				MMAL_PARAMETER_CAPTURE, 0);
-
-	camera_object_destroy(&video_h264_encoder);
-	camera_object_destroy(&still_jpeg_encoder);
-	camera_object_destroy(&stream_resizer);
-	camera_object_destroy(&mjpeg_encoder);
-	camera_object_destroy(&camera);
+	camera_source->stop();
 	}
 
 void
@@ -299,36 +255,32 @@ still_capture(char *fname)
 	{
 	Event			*event;
 	int				n;
-	MMAL_STATUS_T	status;
 	boolean			result = FALSE;
 
-	/* timelapse_shapshot() also uses the still_jpeg_encoder, so wait if busy.
+	/* timelapse_shapshot() also uses the still jpeg file, so wait if busy.
 	*/
 	for (n = 0; n < 10; ++n)
 		{
-		if (still_jpeg_encoder.file == NULL)
+		if (still_jpeg_file == NULL)
 			break;
 		usleep(50000);
 		}
-	if (still_jpeg_encoder.file != NULL)
+	if (still_jpeg_file != NULL)
 		{
 		/* inform() */
 		log_printf("still capture failed because jpeg encoder is busy.\n");
 		return FALSE;
 		}
 
-	if ((still_jpeg_encoder.file = fopen(fname, "w")) == NULL)
+	if ((still_jpeg_file = fopen(fname, "w")) == NULL)
 		log_printf("Could not create still file %s.  %m\n", fname);
 	else
 		{
-		if ((status = mmal_port_parameter_set_boolean(
-						camera.component->output[CAMERA_CAPTURE_PORT],
-						MMAL_PARAMETER_CAPTURE, 1)) != MMAL_SUCCESS)
+		if (!camera_source->still_capture())
 			{
-			fclose(still_jpeg_encoder.file);
-			still_jpeg_encoder.file = NULL;
-			log_printf("Still capture startup failed. Status %s\n",
-						mmal_status[status]);
+			fclose(still_jpeg_file);
+			still_jpeg_file = NULL;
+			log_printf("Still capture startup failed.\n");
 			}
 		else
 			{
@@ -356,20 +308,19 @@ timelapse_capture(void)
 	{
 	char			*path, seq_buf[12], series_buf[12];
 	int				n, nd;
-	MMAL_STATUS_T	status;
 
 	if (time_lapse.on_hold)
 		return;
 
-	/* still_capture()  also uses the still_jpeg_encoder, so wait if busy.
+	/* still_capture()  also uses the still jpeg file, so wait if busy.
 	*/
 	for (n = 0; n < 10; ++n)
 		{
-		if (still_jpeg_encoder.file == NULL)
+		if (still_jpeg_file == NULL)
 			break;
 		usleep(50000);
 		}
-	if (still_jpeg_encoder.file != NULL)
+	if (still_jpeg_file != NULL)
 		{
 		log_printf("timelapse capture failed because jpeg encoder is busy.\n");
 		return;
@@ -382,23 +333,20 @@ timelapse_capture(void)
 						'N',  seq_buf,
 						'n',  series_buf);
 
-	if ((still_jpeg_encoder.file = fopen(path, "w")) == NULL)
+	if ((still_jpeg_file = fopen(path, "w")) == NULL)
 		log_printf("Could not create timelapse file %s.  %m\n", path);
 	else
 		{
 		dup_string(&pikrellcam.timelapse_jpeg_last, path);
 		pikrellcam.timelapse_capture_event = TRUE;
-		if ((status = mmal_port_parameter_set_boolean(
-						camera.component->output[CAMERA_CAPTURE_PORT],
-						MMAL_PARAMETER_CAPTURE, 1)) != MMAL_SUCCESS)
+		if (!camera_source->still_capture())
 			{
-			fclose(still_jpeg_encoder.file);
+			fclose(still_jpeg_file);
 			unlink(path);
-			still_jpeg_encoder.file = NULL;
+			still_jpeg_file = NULL;
 			dup_string(&pikrellcam.timelapse_jpeg_last, "failed");
 			pikrellcam.timelapse_capture_event = FALSE;
-			log_printf("Timelapse capture startup failed. Status %s\n",
-						mmal_status[status]);
+			log_printf("Timelapse capture startup failed.\n");
 			}
 		else
 			{
@@ -448,8 +396,9 @@ video_record_start(VideoCircularBuffer *vcb, int start_state)
 	MotionFrame	*mf = &motion_frame;
 	time_t		t_cur = pikrellcam.t_now;
 	int			n;
-	char		*s, *path, *stats_path = NULL, seq_buf[12];
+	char		*s, *path, *stats_path = NULL, *mvlog_path = NULL, seq_buf[12];
 	boolean		do_stats = FALSE;
+	VideoRecord	*record;
 
 	if (vcb->state == VCB_STATE_MANUAL_RECORD)
 		return;
@@ -534,63 +483,71 @@ video_record_start(VideoCircularBuffer *vcb, int start_state)
 	free(path);
 	path = pikrellcam.video_pathname;
 
+	/* A .mp4 video is muxed as it is recorded.  Any other name gets the
+	|  raw h264 stream.
+	*/
 	if ((s = strstr(path, ".mp4")) != NULL && *(s + 4) == '\0')
 		{
+		*s = '\0';
 		if (do_stats)
-			{
-			*s = '\0';
 			asprintf(&stats_path, "%s.csv", path);
-			*s = '.';
-			}
-		asprintf(&path, "%s.h264", pikrellcam.video_pathname);
-		dup_string(&pikrellcam.video_h264, path);
-		free(path);
-		path = pikrellcam.video_h264;
-		pikrellcam.video_mp4box = TRUE;
+		if (   start_state == VCB_STATE_MOTION_RECORD_START
+		    && pikrellcam.motion_vectors_record
+		   )
+			asprintf(&mvlog_path, "%s.mvlog", path);
+		*s = '.';
+		pikrellcam.video_mp4 = TRUE;
 		}
 	else
-		pikrellcam.video_mp4box = FALSE;
+		pikrellcam.video_mp4 = FALSE;
 
-	if ((vcb->file = fopen(path, "w")) == NULL)
-		log_printf("Could not create video file %s.  %m\n", path);
-	else
-		{
-		log_printf("Video record: %s ...\n", path);
-		vcb->state = start_state;
-		pikrellcam.state_modified = TRUE;
-		if (   do_stats
-		    && (vcb->motion_stats_file = fopen(stats_path, "w")) != NULL
-		   )
-			vcb->motion_stats_do_header = TRUE;
-		}
+	/* The file is opened by the video writer thread.  If that fails, the
+	|  h264 callback sees record->failed and stops the record.
+	*/
+	record = calloc(1, sizeof(VideoRecord));
+	record->pathname = strdup(path);
+	record->mp4 = pikrellcam.video_mp4;
+	record->motion = (start_state == VCB_STATE_MOTION_RECORD_START);
+	record->width = pikrellcam.camera_config.video_width;
+	record->height = pikrellcam.camera_config.video_height;
+	record->fps = pikrellcam.camera_adjust.video_mp4box_fps;
+	record->nominal_fps = pikrellcam.camera_adjust.video_fps;
+	record->mvlog.pathname = mvlog_path;
+	vcb->record = record;
+	video_write_queue(vcb, VIDEO_WRITE_OPEN, record, 0, 0, 0);
+	pikrellcam.video_header_size = 0;
+	pikrellcam.video_size = 0;
+
+	vcb->state = start_state;
+	pikrellcam.state_modified = TRUE;
+	if (   do_stats
+	    && (vcb->motion_stats_file = fopen(stats_path, "w")) != NULL
+	   )
+		vcb->motion_stats_do_header = TRUE;
+	if (stats_path)
+		free(stats_path);
 	}
 
   /* vcb should be locked before calling video_record_stop()
+  |  The video file is closed by the writer thread after it has written out
+  |  everything queued, and then video_record_finish() is run.
   */
 void
 video_record_stop(VideoCircularBuffer *vcb)
 	{
-	struct statvfs st;
-	struct stat    st_h264;
 	MotionFrame    *mf = &motion_frame;
-	unsigned long  tmp_space;
-	Event          *event = NULL;
-	char           *s, *cmd, *tmp_dir, *detect, *thumb_name, *thumb_cmd = NULL;
-	int            thumb_height;
+	char           *detect;
 
-	if (!vcb->file)
+	if (!vcb->record)
 		return;
 
-	fclose(vcb->file);
-	vcb->file = NULL;
+	video_write_queue(vcb, VIDEO_WRITE_CLOSE, vcb->record, 0, 0, 0);
+	vcb->record = NULL;
 	if (vcb->motion_stats_file)
 		{
 		fclose(vcb->motion_stats_file);
 		vcb->motion_stats_file = NULL;
 		}
-	log_printf("Video %s record stopped. Header size: %d  h264 file size: %d\n",
-			(vcb->state & VCB_STATE_MOTION_RECORD) ? "motion" : "manual",
-			pikrellcam.video_header_size, pikrellcam.video_size);
 	if (vcb->state & VCB_STATE_MOTION_RECORD)
 		{
 		if ((mf->first_detect & (MOTION_BURST | MOTION_DIRECTION))
@@ -598,71 +555,21 @@ video_record_stop(VideoCircularBuffer *vcb)
 			detect = "both";
 		else if (mf->first_detect & MOTION_BURST)
 			detect = "burst";
-		else
+		else if (mf->first_detect & MOTION_DIRECTION)
 			detect = "direction";
+		else if (mf->first_detect & MOTION_SLOW)
+			detect = "slow";
+		else
+			detect = "external";
 		log_printf(
-"    first detect: %s  totals - direction: %d  burst: %d  max burst count: %d\n",
-				detect,
-				mf->direction_detects, mf->burst_detects, mf->max_burst_count);
+"    first detect: %s  totals - direction: %d  burst: %d  slow: %d  max burst count: %d\n",
+				detect, mf->direction_detects, mf->burst_detects,
+				mf->slow_detects, mf->max_burst_count);
 		}
 
 	if (pikrellcam.verbose_motion && !pikrellcam.verbose)
 		printf("***Motion record stop: %s\n", pikrellcam.video_pathname);
 
-	st_h264.st_size = 0;
-	stat(pikrellcam.video_h264, &st_h264);
-
-	if (pikrellcam.video_mp4box)
-		{
-		statvfs("/tmp", &st);
-		tmp_space = st.f_bfree * st.f_frsize;
-
-		if (tmp_space > 4 * (unsigned long) st_h264.st_size / 3)
-			tmp_dir = "/tmp";
-		else
-			tmp_dir = pikrellcam.video_dir;
-
-		if (vcb->state & VCB_STATE_MANUAL_RECORD)
-			{
-			thumb_height = 150 * pikrellcam.camera_config.video_height
-							/ pikrellcam.camera_config.video_width;
-			asprintf(&thumb_name, "%s/%s   ", pikrellcam.thumb_dir,
-					fname_base(pikrellcam.video_pathname));
-			if ((s = strstr(thumb_name, ".mp4")) != NULL)
-				strcpy(s, ".th.jpg");
-
-			asprintf(&thumb_cmd, "&& avconv -i %s -ss 0 -s 150x%d %s",
-				pikrellcam.video_pathname, thumb_height,
-				thumb_name);
-			free(thumb_name);
-			}
-
-		if (st_h264.st_size > 0)  // can be 0 if no space left
-			asprintf(&cmd, "(MP4Box %s -tmp %s -fps %d -add %s %s %s && rm %s %s)",
-				pikrellcam.verbose ? "" : "-quiet",
-				tmp_dir,
-				(pikrellcam.camera_adjust.video_mp4box_fps > 0) ?
-						pikrellcam.camera_adjust.video_mp4box_fps :
-						pikrellcam.camera_adjust.video_fps,
-				pikrellcam.video_h264, pikrellcam.video_pathname,
-				pikrellcam.verbose ? "" : "2> /dev/null",
-				pikrellcam.video_h264,
-				thumb_cmd ? thumb_cmd : "");
-		else
-			asprintf(&cmd, "rm %s", pikrellcam.video_h264);
-
-		if (thumb_cmd)
-			free(thumb_cmd);
-
-		if (   (vcb->state & VCB_STATE_MOTION_RECORD)
-		    && *pikrellcam.on_motion_end_cmd
-		    && st_h264.st_size > 0
-		   )
-			event = exec_child_event("motion end command", cmd, NULL);
-		else
-			exec_no_wait(cmd, NULL);
-		free(cmd);
-		}
 	dup_string(&pikrellcam.video_last, pikrellcam.video_pathname);
 	pikrellcam.video_last_frame_count = vcb->video_frame_count;
 	pikrellcam.video_end_pts = vcb->last_pts;
@@ -673,27 +580,16 @@ video_record_stop(VideoCircularBuffer *vcb)
 	event_count_down_add("video saved notify",
 				pikrellcam.notify_duration * EVENT_LOOP_FREQUENCY,
 				event_notify_expire, &pikrellcam.video_notify);
-	if (vcb->state & VCB_STATE_MOTION_RECORD)
+	if (   (vcb->state & VCB_STATE_MOTION_RECORD)
+	    && !strcmp(pikrellcam.motion_preview_save_mode, "best")
+	   )
 		{
-		if (!strcmp(pikrellcam.motion_preview_save_mode, "best"))
-			{
-			motion_preview_area_fixup();
-			event_add("motion area thumb", pikrellcam.t_now, 0,
-					event_motion_area_thumb, NULL);
-			event_add("preview save command", pikrellcam.t_now, 0,
-					event_preview_save_cmd,
-					pikrellcam.on_motion_preview_save_cmd);
-			}
-		if (event)	/* a mp4 video save event needs a MP4Box child exit */
-			{
-			event->data = pikrellcam.on_motion_end_cmd;
-			event->func = event_motion_end_cmd;
-			}
-		else if (   *pikrellcam.on_motion_end_cmd	/* a h264 video save */
-		         && st_h264.st_size > 0
-		        )
-			event_add("motion end command", pikrellcam.t_now, 0,
-					event_motion_end_cmd, pikrellcam.on_motion_end_cmd);
+		motion_preview_area_fixup();
+		event_add("motion area thumb", pikrellcam.t_now, 0,
+				event_motion_area_thumb, NULL);
+		event_add("preview save command", pikrellcam.t_now, 0,
+				event_preview_save_cmd,
+				pikrellcam.on_motion_preview_save_cmd);
 		}
 	event_add("preview dispose", pikrellcam.t_now, 0,
 					event_preview_dispose, NULL);
@@ -708,6 +604,55 @@ video_record_stop(VideoCircularBuffer *vcb)
 	vcb->pause = FALSE;
 	}
 
+  /* Event run after the video writer thread has closed a record file.
+  |  The file is already a complete video, so there is no post processing
+  |  other than a thumb for manual records.
+  */
+void
+video_record_finish(VideoRecord *record)
+	{
+	char	*s, *cmd, *thumb_name;
+	int		thumb_height;
+
+	log_printf("Video %s record stopped. Header size: %d  %s file size: %d\n",
+			record->motion ? "motion" : "manual",
+			record->header_size, record->mp4 ? "mp4" : "h264", record->size);
+	if (record->overruns > 0)
+		log_printf("    video writer overruns: %d\n", record->overruns);
+
+	if (record->size <= record->header_size || record->failed)
+		{
+		/* can be empty if no space left */
+		unlink(record->pathname);
+		if (record->mvlog.pathname)
+			unlink(record->mvlog.pathname);
+		}
+	else
+		{
+		if (record->mp4 && !record->motion)
+			{
+			thumb_height = 150 * record->height / record->width;
+			asprintf(&thumb_name, "%s/%s   ", pikrellcam.thumb_dir,
+					fname_base(record->pathname));
+			if ((s = strstr(thumb_name, ".mp4")) != NULL)
+				strcpy(s, ".th.jpg");
+
+			asprintf(&cmd, "avconv -i %s -ss 0 -s 150x%d %s %s",
+				record->pathname, thumb_height, thumb_name,
+				pikrellcam.verbose ? "" : "2> /dev/null");
+			exec_no_wait(cmd, NULL);
+			free(cmd);
+			free(thumb_name);
+			}
+		if (record->motion && *pikrellcam.on_motion_end_cmd)
+			event_add("motion end command", pikrellcam.t_now, 0,
+					event_motion_end_cmd, pikrellcam.on_motion_end_cmd);
+		}
+	free(record->pathname);
+	free(record->mvlog.pathname);
+	free(record);
+	}
+
 static boolean
 get_arg_pass1(char *arg)
 	{
@@ -740,6 +685,10 @@ get_arg_pass1(char *arg)
 		user_gid = atoi(arg + 6);
 	else if (!strncmp(arg, "-home", 5))
 		homedir = strdup(arg + 5);
+	else if (!strcmp(arg, "-replay-fast"))
+		pikrellcam.replay_fast = TRUE;
+	else if (!strncmp(arg, "-replay", 7))
+		dup_string(&pikrellcam.replay_dir, arg + 7);
 	else
 		return FALSE;
 	return TRUE;
@@ -754,6 +703,7 @@ pikrellcam_cleanup(void)
 		config_save(pikrellcam.config_file);
 	if (pikrellcam.preset_modified)
 		preset_config_save();
+	motion_heatmap_save();
 	}
 
 static void
@@ -862,13 +812,13 @@ command_process(char *command_line)
 	{
 	VideoCircularBuffer	*vcb = &video_circular_buffer;
 	Command	*cmd;
-	char	command[64], args[128], arg1[128], arg2[64], arg3[64], buf[128], *path;
+	char	command[64], args[256], arg1[128], arg2[64], arg3[64], buf[128], *path;
 	int		i, n;
 
 	if (!command_line || *command_line == '\0')
 		return;
 
-	n = sscanf(command_line, "%63s %127[^\n]", command, args);
+	n = sscanf(command_line, "%63s %255[^\n]", command, args);
 	if (n < 1 || command[0] == '#')
 		return;
 	for (cmd = NULL, i = 0; i < COMMAND_SIZE; cmd = NULL, ++i)
@@ -1430,7 +1380,22 @@ main(int argc, char *argv[])
 	else
 		log_start(TRUE, TRUE, TRUE);
 
-	bcm_host_init();
+#ifndef PIKRELLCAM_NO_MMAL
+	if (!pikrellcam.replay_dir)
+		{
+		bcm_host_init();
+		camera_source = &mmal_camera_source;
+		}
+	else
+#endif
+	if (pikrellcam.replay_dir && *pikrellcam.replay_dir)
+		camera_source = &replay_camera_source;
+	else
+		{
+		log_printf_no_timestamp("No camera source, run with -replay<dir>\n");
+		exit(1);
+		}
+
 	if (!homedir)
 		homedir = getpwuid(geteuid())->pw_dir;
 
@@ -1440,6 +1405,7 @@ main(int argc, char *argv[])
 	if (!motion_regions_config_load(pikrellcam.motion_regions_config_file, FALSE))
 		motion_regions_config_save(pikrellcam.motion_regions_config_file, FALSE);
 	preset_config_load();
+	motion_profiles_config_load(pikrellcam.motion_profiles_config_file);
 
 	if (!at_commands_config_load(pikrellcam.at_commands_config_file))
 		at_commands_config_save(pikrellcam.at_commands_config_file);
@@ -1552,10 +1518,14 @@ main(int argc, char *argv[])
 	fcntl(fifo, F_SETFL, 0);
 	read(fifo, buf, sizeof(buf));
 	
+	video_writer_init();
+	motion_worker_init();
 	camera_start();
 	config_timelapse_load_status();
 	preset_state_load();
 	pikrellcam.state_modified = TRUE;
+	event_add("motion heatmap save", pikrellcam.t_now + HEATMAP_SAVE_PERIOD,
+				HEATMAP_SAVE_PERIOD, motion_heatmap_save, NULL);
 
 	signal(SIGINT, signal_quit);
 	signal(SIGTERM, signal_quit);
@@ -1563,6 +1533,8 @@ main(int argc, char *argv[])
 
 	setup_h264_tcp_server();
 	setup_mjpeg_tcp_server();
+	setup_rtsp_server();
+	hls_init();
 	multicast_init();
 
 	while (1)
@@ -1574,7 +1546,6 @@ main(int argc, char *argv[])
 
 		event_process();
 		multicast_recv();
-		tcp_poll_connect();
 
 		/* Process lines in the FIFO.  Single lines via an echo "xxx" > FIFO
 		|  or from a web page may not have a terminating \n.
@@ -1600,8 +1571,5 @@ main(int argc, char *argv[])
 			}
 		}
 
-	//close listening socket
-	close (listenfd);  
-
 	return 0;
 	}
@@ -29,6 +29,7 @@
 #include <math.h>
 #include <memory.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <time.h>
@@ -40,6 +41,10 @@
 #include <sys/time.h>
 #include <sys/types.h>
 
+  /* PIKRELLCAM_NO_MMAL builds without the Pi camera libraries for running
+  |  the frame processing on replayed files (make replay).
+  */
+#ifndef PIKRELLCAM_NO_MMAL
 #include "bcm_host.h"
 #include "interface/vcos/vcos.h"
 #include "interface/mmal/mmal.h"
@@ -47,6 +52,15 @@
 #include "interface/mmal/util/mmal_util_params.h"
 #include "interface/mmal/util/mmal_default_components.h"
 #include "interface/mmal/util/mmal_connection.h"
+#else
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+
+typedef int		MMAL_STATUS_T;
+#define	MMAL_SUCCESS	0
+#endif
 
 #include "utils.h"
 
@@ -55,18 +69,10 @@
 
 //TCP Stream Server
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>  
 
-#define H264_TCP_WAIT_FOR_CONNECT 0
-#define H264_TCP_SEND_HEADER      1
-#define H264_TCP_SEND_DATA        2
-
-extern int listenfd, connfd, num_sent;
-extern socklen_t clilen;
-extern struct sockaddr_in cliaddr, servaddr;
-extern int h264_conn_status;
-
 
 #ifndef MAX
 #define MAX(a,b)	(((a) > (b)) ? (a) : (b))
@@ -82,6 +88,8 @@ extern int h264_conn_status;
 #define PIKRELLCAM_MOTION_REGIONS_CONFIG		"motion-regions.conf"
 #define PIKRELLCAM_MOTION_REGIONS_CUSTOM_CONFIG	"motion-regions-%s.conf"
 #define PIKRELLCAM_AT_COMMANDS_CONFIG			"at-commands.conf"
+#define PIKRELLCAM_MOTION_HEATMAP				"motion-heatmap.bin"
+#define PIKRELLCAM_MOTION_PROFILES_CONFIG		"motion-profiles.conf"
 #define PIKRELLCAM_TIMELAPSE_STATUS				"timelapse.status"
 
   /* These subdirs must match what is in www/config.php
@@ -107,6 +115,7 @@ extern int h264_conn_status;
 #define BUFFER_NUMBER_MIN		3
 
 
+#ifndef PIKRELLCAM_NO_MMAL
 /* A camera object is a RPi camera, encoder, resizer or splitter component
 |  and its associated data we need to manage.
 */ 
@@ -138,6 +147,52 @@ typedef struct
 	MMAL_POOL_T			*callback_pool_in;
 	}
 	CameraObject;
+#endif
+
+
+  /* ------------------ Camera Source ---------------
+  |  Frame data comes from a camera source which hands it to the video.c
+  |  frame handlers: video_h264_data(), video_mjpeg_data(), video_i420_*()
+  |  and video_still_data().  The source is the MMAL camera pipeline, or a
+  |  replay of recorded files for running the frame processing off the Pi.
+  |  keyframe_request and annotate may be NULL if the source can't do them.
+  */
+#define	VIDEO_FLAG_CONFIG		0x1		/* h264 SPS/PPS header data */
+#define	VIDEO_FLAG_SIDEINFO		0x2		/* motion vectors */
+#define	VIDEO_FLAG_KEYFRAME		0x4
+#define	VIDEO_FLAG_FRAME_END	0x8
+
+typedef struct
+	{
+	char	*name;
+	boolean	(*start)(void);
+	void	(*stop)(void);
+	boolean	(*still_capture)(void);
+	void	(*keyframe_request)(void);
+	boolean	(*system_time)(uint64_t *stc);
+	void	(*annotate)(time_t t_annotate);
+	}
+	CameraSource;
+
+
+  /* ------------------ Encoded MJPEG frames ---------------
+  |  Each mjpeg encoder output is kept in memory in a ring of the last
+  |  MJPEG_RING_FRAMES frames, see mjpeg_ring.c.  The stream server and
+  |  preview saves take references to frames instead of copying files.
+  */
+#define	MJPEG_RING_FRAMES	4
+
+typedef struct MjpegFrame
+	{
+	int			refs;
+	unsigned int	seq,		/* in the mjpeg stream, 0 for none */
+				video_seq;		/* vcb frame_seq of the motion frame drawn on */
+	int			length,
+				size;
+	uint8_t		*data;
+	struct MjpegFrame	*next;	/* free list */
+	}
+	MjpegFrame;
 
 
 
@@ -230,10 +285,55 @@ typedef struct
 	}
 	CompositeVector;
 
+  /* Summed-area table entry.  Each entry holds sums of the passing (after
+  |  sparkle removal) motion vectors above and to the left of a macroblock so
+  |  any rectangle, eg a composite vector box, can be summed with four lookups.
+  */
+typedef struct
+	{
+	int		count,
+			sparkles,
+			vx, vy,
+			x, y;
+	}
+	MotionSum;
+
+#define	MOTION_REGIONS_MAX         64		/* region ids are bits of a uint64_t */
+#define	MOTION_REGION_POINTS_MAX   16
+
+  /* A painted mask image for a motion region.  White pixels are inside of
+  |  the region and the image is stretched over the region rectangle.
+  */
+typedef struct
+	{
+	char	*path;
+	int		width,
+			height;
+	uint8_t	*pixels;		/* nonzero is inside */
+	}
+	MotionMask;
+
+  /* Motion region macroblocks compiled from the region list.  Bit n of an
+  |  ids entry is set if the macroblock is inside of region_number n.
+  |  A map is shared by presets and the motion frame, see motion_region.c
+  */
+typedef struct
+	{
+	int			width,
+				height,
+				words,			/* uint64_t words in a bits row */
+				refs;
+	uint64_t	*ids,			/* per macroblock */
+				*bits;			/* rows of macroblocks inside any region */
+	}
+	MotionRegionMap;
+
   /* A composite vector for a region is composed of a > limit count motion
   |  vectors that have a > than mag2_limit magnitude.  The component vectors
   |  may have other contstraints, eg individual vectors must all more or less
-  |  point in the same direction.  See motion.c
+  |  point in the same direction.  See motion_detect.c
+  |  A region is its rectangle unless it has polygon points or a mask.
+  |  The per frame results of a region are in its MotionRegionState.
   */
 typedef struct
 	{
@@ -243,13 +343,36 @@ typedef struct
 	int		x, y,			/* Computed from the fractions. */
 			dx, dy;
 
+	int		n_points;		/* polygon points are 0 - 1.0 fractions */
+	float	px[MOTION_REGION_POINTS_MAX],	/* of the region rectangle */
+			py[MOTION_REGION_POINTS_MAX];
+	MotionMask	*mask;
+	}
+	MotionRegion;
+
+typedef struct
+	{
 	CompositeVector  vector;
 
 	int		reject_count,	/* vectors not pointing in composite direction.  */
 			sparkle_count;	/* number of isolated vectors */
 	boolean	motion;
 	}
-	MotionRegion;
+	MotionRegionState;
+
+  /* The motion regions are published as a MotionRegionSet that is never
+  |  changed once published.  An edit publishes a new set, so readers
+  |  never wait on an edit.  See motion_region.c
+  */
+#define	MOTION_REGION_READERS      8
+
+typedef struct
+	{
+	int				n_regions;
+	MotionRegion	*regions;		/* region_number is the index */
+	MotionRegionMap	*map;
+	}
+	MotionRegionSet;
 
 
 #define	MOTION_NONE          0
@@ -259,6 +382,25 @@ typedef struct
 #define	MOTION_EXTERNAL      8
 #define	MOTION_PENDING_DIR   0x10
 #define	MOTION_PENDING_BURST 0x20
+#define	MOTION_SLOW          0x40
+
+#define	MOTION_SLOW_FRAMES_MAX	16
+
+  /* Motion heatmap counts are HEATMAP_HIT per trigger hit, decayed once an
+  |  hour of motion frames and capped at HEATMAP_MAX so a decay step is
+  |  reached before they can wrap.  The heatmap is saved every
+  |  HEATMAP_SAVE_PERIOD seconds and exported with each macroblock as a
+  |  HEATMAP_EXPORT_SCALE pixel square.
+  */
+#define	HEATMAP_HIT				64
+#define	HEATMAP_MAX				0x80000000
+#define	HEATMAP_HOURS_MAX		168
+#define	HEATMAP_SAVE_PERIOD		(15 * 60)
+#define	HEATMAP_EXPORT_SCALE	8
+
+#define	TAMPER_NONE          0
+#define	TAMPER_COVERED       1
+#define	TAMPER_MOVED         2
 
 /* Possible motion types for a region
 */
@@ -275,12 +417,106 @@ typedef struct
 #define EXT_TRIG_MODE_ENABLE    1
 #define EXT_TRIG_MODE_TIMES     2
 
+  /* Detection settings of a MotionFrame.  For the live motion_frame they
+  |  come from the pikrellcam config each frame.
+  */
 typedef struct
 	{
+	int		magnitude_limit,
+			magnitude_limit_count,
+			burst_count,
+			burst_frames,
+			confirm_frames,		/* confirm_gap in motion frames, 0 for none */
+			slow_frames,		/* slow motion accumulation frames, 0 for none */
+			heatmap_frames,		/* frames per heatmap decay step, 0 for none */
+			heatmap_hours;		/* heatmap half life */
+	boolean	vertical_filter,
+			noise_filter,		/* mask chronically noisy macroblocks */
+			lighting_filter,	/* no detects during frame wide SAD changes */
+			verbose;
+	}
+	MotionSettings;
+
+  /* A named motion profile, see motion_profile.c.  It is switched in at its
+  |  at_time and the settings flagged in set_mask then replace the config or
+  |  preset values each frame.  Profile regions are compiled ahead and
+  |  replace the preset regions while the profile is active.
+  */
+#define	PROFILE_MAGNITUDE_LIMIT		0x1
+#define	PROFILE_MAGNITUDE_COUNT		0x2
+#define	PROFILE_BURST_COUNT			0x4
+#define	PROFILE_BURST_FRAMES		0x8
+#define	PROFILE_SLOW_FRAMES			0x10
+#define	PROFILE_VERTICAL_FILTER		0x20
+#define	PROFILE_NOISE_FILTER		0x40
+#define	PROFILE_LIGHTING_FILTER		0x80
+
+typedef struct
+	{
+	char			*name,
+					*at_time;		/* at-command time of day, eg "dusk+15" */
+	int				set_mask;
+	MotionSettings	settings;
+	boolean			noise_reset;	/* relearn the noise model on switch in */
+	MotionRegionSet	*regions;		/* NULL to keep the preset regions */
+	}
+	MotionProfile;
+
+  /* Object tracking, see motion_track.c.  Positions and centroid motion
+  |  dx,dy are in 1/16 macroblocks, vx,vy are the average motion vector.
+  */
+#define	MOTION_TRACK_MAX	16
+#define	MOTION_BLOB_MAX		64
+
+typedef struct
+	{
+	int		y,
+			x0, x1;			/* x1 is one past the run */
+	}
+	MotionRun;
+
+typedef struct
+	{
+	int		x, y,
+			vx, vy,
+			count,
+			track;			/* index of the matched track or -1 */
+	boolean	merged;			/* blob of crossing tracks */
+	Area	box;
+	}
+	MotionBlob;
+
+typedef struct
+	{
+	int		id,				/* 0 for a free slot */
+			x, y,
+			dx, dy,			/* predicted centroid move per motion frame */
+			vx, vy,
+			count,
+			age,			/* frames matched */
+			missed;			/* frames since last matched */
+	boolean	matched;		/* matched this frame */
+	Area	box;
+	}
+	MotionTrack;
+
+  /* Per macroblock background activity, 16 bit fixed point averages.
+  */
+typedef struct
+	{
+	uint16_t	hit_rate,		/* fraction of frames with mag2 >= mag2_limit */
+				mag2;			/* of those hits */
+	}
+	MotionNoise;
+
+typedef struct
+	{
+	MotionSettings	settings;
 	int				motion_status;
 	boolean			motion_enable,
 					show_vectors,
-					show_preset;
+					show_preset,
+					show_heatmap;
 
 	boolean			do_preview_save,
 					do_preview_save_cmd;
@@ -293,13 +529,69 @@ typedef struct
 					preview_frame_vector,
 					final_preview_vector;
 	int				cvec_count;
-	int16_t			*trigger;
-	int				n_regions,
-					selected_region,
+	int				trigger_words;	/* uint64_t words in a trigger bit row */
+	uint64_t		*trigger_hit,	/* trigger bit planes, see motion_detect.c */
+					*trigger_sparkle,
+					*trigger_reject,
+					*noise_bits;	/* chronically noisy macroblocks */
+	MotionSum		region_sums[MOTION_REGIONS_MAX];	/* passing vectors */
+	MotionRegionState	region_state[MOTION_REGIONS_MAX];
+	MotionNoise		*noise;
+	int				noise_count;	/* hits masked out as noise this frame */
+	boolean			noise_reset;
+	uint32_t		*heat;			/* decaying trigger hit counts */
+	int				heat_width,
+					heat_height,
+					heat_frames;	/* frames since the last decay step */
+	boolean			heat_reset;
+	MotionRun		*track_runs;
+	int				*track_parent;	/* union-find of track_runs */
+	MotionBlob		*blobs;
+	int				n_blobs;
+	MotionTrack		tracks[MOTION_TRACK_MAX];
+	int				track_id;		/* last track id given out */
+
+	uint64_t		sad_sum,		/* SAD statistics of the interior rows */
+					sad_sum2;
+	int				sad_blocks,
+					sad_mean,
+					sad_stddev,
+					sad_high_count,	/* blocks with a SAD well over sad_expma */
+					hit_count;		/* mag2_limit hits, regions or not */
+	float			sad_expma,
+					sad_long_expma;
+	int				lighting_frames,	/* > 0 while lighting detects are ignored */
+					covered_frames,
+					tamper;				/* TAMPER_ state */
+	boolean			tamper_event;		/* tamper state started this frame */
+
+	int8_t			*slow_ring;		/* vx,vy of the last slow_n frames */
+	int16_t			*slow_sums;		/* vx,vy summed over slow_ring */
+	MotionVector	*slow_vectors;	/* slow_sums / sqrt(slow_n) */
+	uint64_t		*slow_hit,
+					*slow_sparkle;
+	int				slow_n,
+					slow_index,
+					slow_filled,
+					slow_passes;	/* consecutive frames passing */
+	CompositeVector	slow_vector;
+	unsigned int	trigger_gen,
+					*reject_gen;
+	MotionSum		*sums;			/* (width + 1) x (height + 1) table */
+	int				*passing,		/* mb indexes of passing vectors */
+					*passing_row;	/* passing index of each row start */
+	MotionVector	*passing_vectors;
+	uint8_t			*passing_accept;	/* direction filter results */
+	int				selected_region,
 					prev_selected_region;
 
-	pthread_mutex_t	region_list_mutex;
-	SList			*motion_region_list;
+	MotionProfile	*profile;		/* active motion profile or NULL */
+	MotionRegionSet	*region_set,	/* published regions */
+					*region_hazard[MOTION_REGION_READERS];	/* sets in use */
+	SList			*region_retired;	/* sets to free when not in use */
+	MotionRegionSet	*detect_set;	/* region_state is for this set, held */
+	int				detect_slot;	/*   until the next motion_frame_detect() */
+	pthread_mutex_t	region_write_mutex;	/* serializes region set publishers */
 	int				mag2_limit;      /* magnitude^2 limit for a vector to add to region_vector */
 	int				mag2_limit_count; /* Threshold number of vectors added into */
 			                          /* region_vector to make it a valid motion event */
@@ -310,6 +602,7 @@ typedef struct
 			first_detect,
 			direction_detects,
 			burst_detects,
+			slow_detects,
 			first_burst_count,
 			max_burst_count;
 
@@ -324,12 +617,21 @@ typedef struct
 	float	sparkle_expma,
 			any_count_expma;	/* of the total frame vector */
 
-	int		frame_window;
+	int		frame_window,
+			burst_frame,
+			region_motion_count,	/* regions with direction motion */
+			region_fail_count;		/* regions with vectors but no motion */
+
+	unsigned int	frames_queued,		/* motion worker queue counts */
+					frames_dropped;
 	}
 	MotionFrame;
 
-#define MF_TRIGGER_SIZE	(motion_frame.width * motion_frame.height \
-							* sizeof(*motion_frame.trigger))
+#define	TRIGGER_NONE		0
+#define	TRIGGER_SPARKLE		1
+#define	TRIGGER_REJECT		2
+#define	TRIGGER_PASS		3
+#define	TRIGGER_NOISE		4
 
 #define	VCB_STATE_NONE					0
 #define	VCB_STATE_MOTION_RECORD_START	1
@@ -347,9 +649,29 @@ typedef struct
 	time_t		t_frame;
 	int			frame_count;
 	uint64_t	frame_pts;
+	unsigned int offset,		/* stream byte offset at position */
+				frame_seq;
 	}
 	KeyFrame;
 
+  /* Every frame written into the circular buffer is indexed so video
+  |  writers can find frame boundaries.  The index is a power of 2 size
+  |  ring indexed by frame sequence number.  Byte offsets count all data
+  |  ever put into the circular buffer and can wrap, so compare them as
+  |  differences.  seq is written last so a reader can tell when an entry
+  |  has been reused.
+  */
+typedef struct
+	{
+	int			position,
+				length;
+	unsigned int offset;
+	uint64_t	pts;
+	boolean		keyframe;
+	unsigned int seq;
+	}
+	VideoFrame;
+
 
 #define	H264_MAX_HEADER_SIZE	29	/* Can be less */
 
@@ -361,12 +683,235 @@ typedef struct
   */
 #define KEYFRAME_SIZE	(15 * 60)
 
+
+  /* mp4 file writing state, see mp4mux.c
+  */
+typedef struct
+	{
+	FILE		*file;
+	uint8_t		*sps,
+				*pps;
+	int			sps_size,
+				pps_size,
+				width,
+				height;
+	uint32_t	nominal_duration,
+				fixed_duration;
+	uint64_t	mdat_position,
+				offset,
+				duration,
+				prev_pts;
+
+	uint32_t	*sample_size,
+				*sync_sample,
+				*stts;
+	uint64_t	*chunk_offset;
+	int			n_samples,
+				n_sync,
+				n_stts,
+				sample_alloc,
+				chunk_alloc,
+				sync_alloc,
+				stts_alloc;
+	}
+	Mp4Mux;
+
+  /* Fragmented mp4 state for HLS segments, see mp4mux.c
+  */
+typedef struct
+	{
+	uint8_t		*data;			/* mdat data of the fragment being built */
+	int			length,
+				alloc;
+	uint32_t	*sample_size,
+				*sample_duration,
+				*sample_flags;
+	int			n_samples,
+				sample_alloc;
+	uint32_t	nominal_duration;
+	uint64_t	pts_origin,			/* pts at decode time 0 */
+				prev_pts,
+				decode_time,
+				next_decode_time;
+	}
+	Mp4Frag;
+
+  /* Binary motion vector log (.mvlog) written alongside motion .mp4 videos
+  |  when motion_vectors_record is on.  All file structs are fixed size and
+  |  8 byte aligned so a log can be mmap()ed and read in place,
+  |  see motion_log.c for the layout.
+  */
+#define	MOTION_LOG_MAGIC		"PKCMVLOG"
+#define	MOTION_LOG_VERSION		1
+#define	MOTION_LOG_KEYFRAME		1
+#define	MOTION_LOG_KEY_INTERVAL	8
+#define	MOTION_LOG_RUN_MAX		128
+#define	MOTION_LOG_ENCODE_MAX(length)	\
+			((length) + (length) / MOTION_LOG_RUN_MAX + 1)
+
+typedef struct
+	{
+	char		magic[8];
+	uint32_t	version,
+				header_size,
+				frame_header_size,
+				width,				/* motion frame macroblock columns */
+				height,
+				n_frames,
+				key_interval,
+				video_fps,
+				mjpeg_divider;		/* motion frame every divider video frames */
+	uint64_t	index_offset,		/* MotionLogIndex[n_frames], 0 if unfinished */
+				start_pts;			/* pts of the first video frame */
+	uint32_t	reserved;
+	}
+	MotionLogHeader;
+
+typedef struct
+	{
+	int32_t		x, y, vx, vy,		/* motion_frame.frame_vector */
+				mag2,
+				mag2_count,
+				reject_count,
+				sparkle_count,
+				any_count,
+				motion_status,
+				mag2_limit,
+				mag2_limit_count;
+	}
+	MotionLogSummary;
+
+typedef struct
+	{
+	uint32_t	length,				/* frame record bytes with this header */
+				flags;
+	int32_t		video_frame;		/* video frame number in the record */
+	uint32_t	reserved;
+	uint64_t	pts;
+	MotionLogSummary summary;
+	}
+	MotionLogFrameHeader;
+
+typedef struct
+	{
+	uint64_t	pts,
+				offset;				/* of the MotionLogFrameHeader */
+	uint32_t	flags;
+	int32_t		video_frame;
+	}
+	MotionLogIndex;
+
+  /* In memory ring of encoded frame records.  The motion worker puts them
+  |  in and the video writer thread reads them out in place, like the video
+  |  circular buffer and its frame index.
+  */
+typedef struct
+	{
+	unsigned int	seq,
+					video_seq,		/* vcb->frame_seq of the vectors frame */
+					offset;			/* total bytes put in before this frame */
+	int				length;
+	boolean			keyframe;
+	}
+	MotionLogEntry;
+
+typedef struct
+	{
+	uint8_t			*data;
+	int				size;
+	unsigned int	head_offset,	/* total bytes ever put in */
+					write_end;		/* ring bytes being overwritten end here */
+	MotionLogEntry	*index;
+	int				index_size;
+	unsigned int	seq;			/* seq of the next frame */
+
+	/* Motion worker side only.
+	*/
+	MotionVector	*prev;			/* what deltas are taken from */
+	uint8_t			*delta,
+					*buf;
+	int				n_vectors,
+					buf_size,
+					key_count;
+	}
+	MotionLog;
+
+  /* Writer thread state for the .mvlog of a VideoRecord.
+  */
+typedef struct
+	{
+	char			*pathname;		/* NULL if not logging this record */
+	FILE			*file;
+	unsigned int	seq,			/* next MotionLogEntry to write */
+					video_seq;		/* record start video frame */
+	uint64_t		offset;
+	MotionLogIndex	*index;
+	int				n_frames,
+					index_alloc,
+					overruns;
+	boolean			need_keyframe,
+					write_error;
+	}
+	MotionLogFile;
+
+  /* A video record in progress.  Allocated at video_record_start() and
+  |  handed through the video write queue to the writer thread which
+  |  owns the file.  After the writer closes the file, video_record_finish()
+  |  is run from the event loop and frees it.
+  */
+typedef struct
+	{
+	char		*pathname;			/* file being written */
+	boolean		mp4,
+				motion;
+	int8_t		header[H264_MAX_HEADER_SIZE];
+	int			header_size;
+	int			width,
+				height,
+				fps,				/* fixed mp4 fps if non zero */
+				nominal_fps;
+
+	/* Writer thread side only.
+	*/
+	FILE		*file;
+	Mp4Mux		mux;
+	MotionLogFile mvlog;
+	unsigned int frame_seq,			/* next frame to mux */
+				mux_prev_seq,
+				avail_offset,		/* range of queued data muxing can use */
+				avail_end;
+	boolean		need_keyframe;
+	int			size,
+				overruns;
+	boolean		failed,
+				write_error;
+	}
+	VideoRecord;
+
+#define	VIDEO_WRITE_OPEN	0
+#define	VIDEO_WRITE_HEADER	1
+#define	VIDEO_WRITE_DATA	2
+#define	VIDEO_WRITE_CLOSE	3
+
+#define	VIDEO_WRITE_QUEUE_SIZE	64
+#define	VIDEO_WRITE_DEFER_SIZE	16
+
+typedef struct
+	{
+	int			type;
+	VideoRecord	*record;
+	int			position,			/* circular buffer data range */
+				length;
+	unsigned int offset;
+	}
+	VideoWriteJob;
+
 typedef struct
 	{
 	pthread_mutex_t	mutex;
 
-	FILE		*file,
-				*motion_stats_file;
+	VideoRecord	*record;
+	FILE		*motion_stats_file;
 	boolean		motion_stats_do_header;
 	int			state,
 				frame_count,
@@ -380,6 +925,17 @@ typedef struct
 	int         seconds;	/* max seconds in the buffer */
 	int			head,
 				tail;
+	unsigned int head_offset,	/* total bytes ever put in at head */
+				write_end;		/* bytes being copied in at head end here */
+
+	VideoFrame	*frame_index;
+	int			frame_index_size;
+	unsigned int frame_seq;		/* sequence number of the next frame */
+	int			frame_position;	/* start of the frame coming in */
+	unsigned int frame_offset;
+	uint64_t	frame_pts;
+	boolean		in_frame,
+				frame_keyframe;
 				
 	KeyFrame	key_frame[KEYFRAME_SIZE];
 	int			pre_frame_index,
@@ -398,9 +954,49 @@ typedef struct
 
 	time_t		motion_last_detect_time,
 				motion_sync_time;
+
+	/* Video writer thread queue.  write_in is only modified by the producer
+	|  (vcb locked) and write_out only by the writer thread.
+	*/
+	VideoWriteJob	write_queue[VIDEO_WRITE_QUEUE_SIZE];
+	unsigned int	write_in,
+					write_out;
+	int				write_pending;		/* queued data bytes not yet written */
+	sem_t			write_sem,
+					write_done_sem;		/* posted for video_writer_sync() */
+	boolean			write_sync;			/* set while video_writer_sync() waits */
+	VideoWriteJob	write_deferred[VIDEO_WRITE_DEFER_SIZE];	/* queue was full */
+	int				n_write_deferred;
+
+	/* Live stream readers, see video_stream.c.  They hold stream_lock for
+	|  reading while using the buffer, circular_buffer_init() holds it for
+	|  writing and bumps stream_generation.
+	*/
+	pthread_rwlock_t	stream_lock;
+	unsigned int		stream_generation;
 	}
 	VideoCircularBuffer;
 
+#define	VIDEO_STREAM_OK		0
+#define	VIDEO_STREAM_WAIT	1		/* frame not in the buffer yet */
+#define	VIDEO_STREAM_LOST	2		/* frame overwritten or about to be */
+#define	VIDEO_STREAM_RESTART	3	/* frame is a keyframe the reader restarted on */
+
+  /* A live stream reader's place in the circular buffer, moved along by
+  |  video_stream_next().
+  */
+typedef struct
+	{
+	unsigned int	seq,				/* next frame */
+					generation;			/* of the circular buffer */
+	int				ago;				/* seconds back to start from */
+	boolean			need_keyframe,
+					catch_up,			/* no lag skips until live */
+					lag_skip;			/* skip ahead when falling behind */
+	int				skips;
+	}
+	VideoStreamCursor;
+
 
   /* -------------- The Global PiKrellCam Environment -----------
   */
@@ -455,7 +1051,8 @@ typedef struct
 			mag_limit_count,
 	        burst_count,
 	        burst_frames;
-	SList	*region_list;  /* string "xf0 yf0 dxf dyf" */
+	SList	*region_list;  /* strings "add_region xf0 yf0 dxf dyf" and others */
+	MotionRegionMap	*region_map;	/* compiled region_list, or NULL */
 	}
 	PresetSettings;
 
@@ -487,6 +1084,8 @@ typedef struct
 			*config_file,
 			*motion_regions_config_file,
 			*at_commands_config_file,
+			*motion_heatmap_file,
+			*motion_profiles_config_file,
 			*on_startup_cmd;
 
 	char	*log_file;
@@ -516,9 +1115,12 @@ typedef struct
 			motion_magnitude_limit_count,
 			motion_burst_count,
 			motion_burst_frames,
+			motion_slow_frames,
+			motion_heatmap_hours,
 			motion_record_time_limit;
 	char	*on_motion_begin_cmd,
 			*on_motion_end_cmd,
+			*on_motion_tamper_cmd,
 			*motion_regions_name;
 	char	*preview_filename,
 			*preview_thumb_filename;
@@ -526,7 +1128,10 @@ typedef struct
 			*on_motion_preview_save_cmd;
 	boolean	motion_preview_clean,
 			motion_vertical_filter,
+			motion_noise_filter,
+			motion_lighting_filter,
 			motion_stats,
+			motion_vectors_record,
 			motion_show_counts;
 	int		motion_area_min_side;
 
@@ -537,7 +1142,6 @@ typedef struct
 
 	char	*video_motion_name_format,
 			*video_manual_name_format,
-			*video_h264,
 			*video_last,
 			*video_pathname,
 			*video_manual_tag,
@@ -550,7 +1154,7 @@ typedef struct
 	uint64_t video_start_pts,
 			video_end_pts;
 
-	boolean	video_mp4box;
+	boolean	video_mp4;
 
 
 	char	*mjpeg_filename;
@@ -558,7 +1162,14 @@ typedef struct
 			mjpeg_height,
 			mjpeg_quality,
 			mjpeg_divider;
-	boolean	mjpeg_rename_holdoff;
+	boolean	mjpeg_file_write;
+
+	int		rtsp_port;
+
+	boolean	hls_enable;
+	int		hls_segment_time,
+			hls_part_msec,
+			hls_segments;
 
 	char	*still_name_format,
 			*still_last;
@@ -650,6 +1261,9 @@ typedef struct
 	int		debug,
 			debug_fps;
 	boolean	halt_enable;
+
+	char	*replay_dir;
+	boolean	replay_fast;
 	}
 	PiKrellCam;
 
@@ -716,6 +1330,7 @@ typedef struct
 
 extern PiKrellCam	pikrellcam;
 
+#ifndef PIKRELLCAM_NO_MMAL
 extern CameraObject	camera;
 extern CameraObject	still_jpeg_encoder;
 extern CameraObject	mjpeg_encoder;
@@ -723,15 +1338,24 @@ extern CameraObject	video_h264_encoder;
 extern CameraObject	stream_splitter;
 extern CameraObject	stream_resizer;
 
+extern CameraSource	mmal_camera_source;
+#endif
+extern CameraSource	replay_camera_source;
+extern CameraSource	*camera_source;
+
 extern VideoCircularBuffer video_circular_buffer;
 extern MotionFrame  motion_frame;
+extern MotionLog	motion_log;
 extern TimeLapse	time_lapse;
 
+extern FILE	*still_jpeg_file;
+
 extern char  *mmal_status[];
 
 
 /* ========================== */
 
+#ifndef PIKRELLCAM_NO_MMAL
 boolean		out_port_callback(CameraObject *obj, int port_num,
 					void callback());
 boolean		ports_callback_connect(CameraObject *out, int port_num,
@@ -750,15 +1374,74 @@ boolean		resizer_create(char *name, CameraObject *resizer,
 void		mjpeg_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
 void		I420_video_callback(MMAL_PORT_T *port,
 					MMAL_BUFFER_HEADER_T *buffer);
-boolean		still_capture(char *fname);
 void		still_jpeg_callback(MMAL_PORT_T *port,
 					MMAL_BUFFER_HEADER_T *buffer);
 void		video_h264_encoder_callback(MMAL_PORT_T *port,
 					MMAL_BUFFER_HEADER_T *mmalbuf);
 boolean		camera_create(void);
 void		camera_object_destroy(CameraObject *obj);
+#endif
+boolean		still_capture(char *fname);
 void		circular_buffer_init(void);
 
+void		h264_header_save(uint8_t *data, int length);
+void		video_h264_data(uint8_t *data, int length, int flags, int64_t pts);
+void		video_mjpeg_data(uint8_t *data, int length, int flags);
+boolean		video_i420_frame_wanted(void);
+void		video_i420_frame_send(uint8_t *i420);
+void		video_still_data(uint8_t *data, int length, int flags);
+
+MjpegFrame	*mjpeg_frame_new(void);
+boolean		mjpeg_frame_append(MjpegFrame *frame, uint8_t *data, int length);
+void		mjpeg_frame_publish(MjpegFrame *frame);
+void		mjpeg_frame_unref(MjpegFrame *frame);
+MjpegFrame	*mjpeg_frame_latest(unsigned int seq);
+boolean		mjpeg_frame_save(MjpegFrame *frame, char *path);
+void		mjpeg_file_update(void);
+void		mjpeg_preview_frame_set(MjpegFrame *frame);
+MjpegFrame	*mjpeg_preview_frame_take(void);
+
+uint8_t		*h264_nal_next(uint8_t **pp, uint8_t *end, int *length);
+
+void		video_writer_init(void);
+void		video_writer_sync(VideoCircularBuffer *vcb);
+boolean		video_write_queue(VideoCircularBuffer *vcb, int type,
+					VideoRecord *record, int position, int length,
+					unsigned int offset);
+void		video_write_deferred(VideoCircularBuffer *vcb);
+void		vcb_video_write(VideoCircularBuffer *vcb);
+void		video_write_overrun_check(VideoCircularBuffer *vcb, int length);
+
+int			video_stream_frame(unsigned int seq, VideoFrame *frame);
+boolean		video_stream_valid(VideoFrame *frame, int done);
+boolean		video_stream_keyframe(int seconds_ago, unsigned int *seq);
+int			video_stream_iov(VideoFrame *frame, int done, struct iovec *iov);
+int			video_stream_header(uint8_t *header);
+void		video_stream_cursor_init(VideoStreamCursor *cursor, boolean lag_skip);
+boolean		video_stream_new_generation(VideoStreamCursor *cursor);
+void		video_stream_skip(VideoStreamCursor *cursor);
+int			video_stream_next(VideoStreamCursor *cursor, VideoFrame *frame);
+void		video_stream_notify(void);
+
+void		hls_init(void);
+void		hls_notify(void);
+boolean		hls_keyframe_wanted(void);
+
+boolean		mp4_mux_start(Mp4Mux *mux, FILE *file, int8_t *header,
+					int header_size, int width, int height,
+					int fps, int nominal_fps);
+int			mp4_mux_sample(Mp4Mux *mux, uint8_t *frame, int length,
+					boolean keyframe, uint64_t pts);
+boolean		mp4_mux_finish(Mp4Mux *mux);
+boolean		mp4_frag_init_write(FILE *file, int8_t *header, int header_size,
+					int width, int height);
+void		mp4_frag_start(Mp4Frag *frag, int nominal_fps);
+void		mp4_frag_sample(Mp4Frag *frag, uint8_t *frame, int length,
+					boolean keyframe, uint64_t pts);
+int			mp4_frag_write(Mp4Frag *frag, FILE *file, uint32_t sequence,
+					uint64_t next_pts);
+void		mp4_frag_free(Mp4Frag *frag);
+
 void		mmalcam_config_parameters_set_camera(void);
 boolean 	mmalcam_config_parameter_set(char *name, char *value, boolean set_camera);
 CameraParameter
@@ -778,6 +1461,7 @@ void		log_printf_no_timestamp(char *fmt, ...);
 void		log_printf(char *fmt, ...);
 void		video_record_start(VideoCircularBuffer *vcb, int);
 void		video_record_stop(VideoCircularBuffer *vcb);
+void		video_record_finish(VideoRecord *record);
 void		camera_start(void);
 void		camera_stop(void);
 void		camera_restart(void);
@@ -790,6 +1474,10 @@ void	command_process(char *command_line);
 void	motion_init(void);
 void	motion_command(char *cmd_line);
 void	motion_frame_process(VideoCircularBuffer *vcb, MotionFrame *mf);
+void	motion_worker_init(void);
+void	motion_frame_queue(uint8_t *data, int length, int64_t pts);
+void	motion_detect_record(VideoCircularBuffer *vcb);
+void	motion_detect_done(void);
 void	motion_regions_config_save(char *config_file, boolean inform);
 boolean	motion_regions_config_load(char *config_file, boolean inform);
 void	motion_preview_file_event(void);
@@ -797,6 +1485,69 @@ void	motion_preview_area_fixup(void);
 void	print_cvec(char *str, CompositeVector *cvec);
 void	motion_event_write(VideoCircularBuffer *vcb, MotionFrame *mf);
 
+int		motion_trigger_state(MotionFrame *mf, int x, int y);
+void	motion_frame_detect(MotionFrame *mf, boolean recording);
+void	motion_frame_detect_reset(MotionFrame *mf);
+void	motion_frame_alloc(MotionFrame *mf);
+
+boolean	motion_region_parse(MotionRegion *mreg, char *line, char *dir);
+void	motion_region_config_line(MotionRegion *mreg, char *buf, int size,
+				char *dir);
+void	motion_region_fixup(MotionFrame *mf, MotionRegion *mreg);
+void	motion_region_bounds(MotionFrame *mf, MotionRegion *mreg,
+				int *x0, int *y0, int *x1, int *y1);
+MotionRegionMap *motion_region_map_ref(MotionRegionMap *map);
+void	motion_region_map_unref(MotionRegionMap *map);
+MotionRegionSet *motion_region_set_copy(MotionRegionSet *src);
+void	motion_region_set_free(MotionRegionSet *set);
+boolean	motion_region_set_append(MotionFrame *mf, MotionRegionSet *set,
+				MotionRegion *mreg);
+boolean	motion_region_set_add(MotionFrame *mf, MotionRegionSet *set,
+				char *line, char *dir);
+void	motion_region_set_remove(MotionRegionSet *set, int n);
+void	motion_region_set_compile(MotionFrame *mf, MotionRegionSet *set);
+void	motion_region_set_publish(MotionFrame *mf, MotionRegionSet *set);
+MotionRegionSet *motion_region_set_acquire(MotionFrame *mf, int *slot);
+void	motion_region_set_release(MotionFrame *mf, int slot);
+
+void	motion_track_frame(MotionFrame *mf);
+boolean	motion_track_visible(MotionTrack *track);
+void	motion_track_reset(MotionFrame *mf);
+void	motion_track_alloc(MotionFrame *mf);
+
+void	motion_log_init(void);
+void	motion_log_frame(MotionFrame *mf, unsigned int video_seq, uint64_t pts);
+void	motion_log_start(VideoRecord *record);
+void	motion_log_write(VideoRecord *record);
+void	motion_log_finish(VideoRecord *record);
+int		motion_log_encode(uint8_t *out, uint8_t *in, int length);
+int		motion_log_decode(uint8_t *in, int length, MotionVector *vectors, int n);
+int		motion_log_rle_decode(uint8_t *in, int in_length, uint8_t *out, int length);
+
+boolean	motion_heatmap_levels(MotionFrame *mf, uint8_t *levels);
+void	motion_heatmap_save(void);
+void	motion_heatmap_load(void);
+void	motion_heatmap_export(char *name);
+
+void	motion_profiles_config_load(char *config_file);
+void	motion_profiles_compile(void);
+void	motion_profile_check(int minute_now);
+boolean	motion_profile_set(char *name);
+void	motion_profile_apply(MotionProfile *profile, MotionSettings *s);
+boolean	motion_profile_regions_publish(void);
+boolean	motion_profile_regions_modified(void);
+
+void	motion_mag2_threshold(MotionVector *vectors, uint64_t *bits,
+				int n, int mag2_limit);
+void	motion_sparkle_flag(uint64_t *up, uint64_t *row, uint64_t *down,
+				uint64_t *sparkle, int n_words);
+void	motion_direction_filter(MotionVector *vectors, int n,
+				int t_vx, int t_vy, int t_mag2, uint8_t *accept);
+void	motion_mag2_threshold_scalar(MotionVector *vectors, uint64_t *bits,
+				int n, int mag2_limit);
+void	motion_direction_filter_scalar(MotionVector *vectors, int n,
+				int t_vx, int t_vy, int t_mag2, uint8_t *accept);
+
 /* On Screen Display
 */
 void	display_init(void);
@@ -867,14 +1618,16 @@ void	servo_init(void);
 
 void	set_exec_with_session(boolean set);
 void	sun_times_init(void);
+boolean	at_time_minute(char *at_time, int *minute);
 void	at_commands_config_save(char *config_file);
 boolean	at_commands_config_load(char *config_file);
 
 void	setup_h264_tcp_server(void);
+void	h264_server_notify(void);
 int		setup_mjpeg_tcp_server(void);
-void	tcp_poll_connect(void);
-void	tcp_send_h264_header(void *data, int len);
-void	tcp_send_h264_data(char * what, void *data, int len);
+void	mjpeg_server_notify(void);
+void	setup_rtsp_server(void);
+void	rtsp_server_notify(void);
 
 
 
@@ -218,9 +218,8 @@ preset_load_values(boolean do_pan)
 	PresetSettings	*settings;
 	Event			*event;
 	MotionFrame		*mf = &motion_frame;
+	MotionRegionSet	*set;
 	SList			*rlist;
-	char			*region, buf[100];
-	boolean			save_show;
 
 	pos = (PresetPosition *) slist_nth_data(pikrellcam.preset_position_list,
 				pikrellcam.preset_position_index);
@@ -259,15 +258,31 @@ preset_load_values(boolean do_pan)
 		pikrellcam.motion_burst_count = settings->burst_count;
 		pikrellcam.motion_burst_frames = settings->burst_frames;
 		}
-	save_show = mf->show_preset;
-	motion_command("delete_regions all");
+	/* Publish the preset regions as one set with the preset's compiled
+	|  region map if it has one (publish compiles it if it doesn't fit the
+	|  motion frame size).  The published map is kept for the next load.
+	|  An active motion profile with regions overrides the preset regions.
+	*/
+	if (motion_profile_regions_publish())
+		{
+		pikrellcam.preset_modified_warning = FALSE;
+		pikrellcam.state_modified = TRUE;
+		return;
+		}
+	pthread_mutex_lock(&mf->region_write_mutex);
+	set = motion_region_set_copy(NULL);
 	for (rlist = settings->region_list; rlist; rlist = rlist->next)
+		motion_region_set_add(mf, set, (char *) rlist->data,
+					pikrellcam.config_dir);
+	set->map = motion_region_map_ref(settings->region_map);
+	motion_region_set_publish(mf, set);
+	if (set->map != settings->region_map)
 		{
-		region = (char *) rlist->data;
-		snprintf(buf, sizeof(buf), "%s", region);
-		motion_command(buf);
+		motion_region_map_unref(settings->region_map);
+		settings->region_map = motion_region_map_ref(set->map);
 		}
-	mf->show_preset = save_show;
+	mf->selected_region = set->n_regions - 1;
+	pthread_mutex_unlock(&mf->region_write_mutex);
 	pikrellcam.preset_modified_warning = FALSE;
 	pikrellcam.state_modified = TRUE;
 	}
@@ -276,21 +291,24 @@ static void
 preset_settings_regions_set(PresetSettings *settings)
 	{
 	MotionFrame		*mf = &motion_frame;
-	MotionRegion	*mreg;
-	SList			*list;
-	char			*region;
+	MotionRegionSet	*set;
+	char			buf[256];
+	int				i, slot;
 
 	if (!settings)
 		return;
 	slist_and_data_free(settings->region_list);
 	settings->region_list = NULL;
-	for (list = mf->motion_region_list; list; list = list->next)
+	motion_region_map_unref(settings->region_map);
+	settings->region_map = NULL;
+	set = motion_region_set_acquire(mf, &slot);
+	for (i = 0; set && i < set->n_regions; ++i)
 		{
-		mreg = (MotionRegion *) list->data;
-		asprintf(&region, "add_region %.3f %.3f %.3f %.3f\n",
-				mreg->xf0, mreg->yf0, mreg->dxf, mreg->dyf);
-		settings->region_list = slist_append(settings->region_list, region);
+		motion_region_config_line(&set->regions[i], buf, sizeof(buf),
+					pikrellcam.config_dir);
+		settings->region_list = slist_append(settings->region_list, strdup(buf));
 		}
+	motion_region_set_release(mf, slot);
 	}
 
 void
@@ -318,7 +336,8 @@ preset_settings_set_modified(void)
 		pikrellcam.preset_modified_warning = TRUE;
 	}
 
-  /* Called from locked mf->region_list_mutex when a region is modified.
+  /* Called after a region edit is published.  While a motion profile has
+  |  its own regions, they are the published ones and get the edit instead.
   */
 void
 preset_regions_set_modified(void)
@@ -327,6 +346,8 @@ preset_regions_set_modified(void)
 	PresetSettings	*settings = NULL;
 	int				pan, tilt;
 
+	if (motion_profile_regions_modified())
+		return;
 	servo_get_position(&pan, &tilt);
 	if ((pos = preset_find_at_position(pan, tilt)) != NULL)
 		{
@@ -451,6 +472,7 @@ preset_delete(void)
 		}
 	settings = (PresetSettings *) slist_nth_data(pos->settings_list, pos->settings_index);
 	slist_and_data_free(settings->region_list);
+	motion_region_map_unref(settings->region_map);
 	pos->settings_list = slist_remove(pos->settings_list, settings);
 	free(settings);
 
@@ -714,7 +736,7 @@ preset_config_load(void)
 	PresetSettings	*settings = NULL;
 	char			*region;
 	int				pan, tilt;
-	char			buf[100];
+	char			buf[256];
 
 	if ((f = fopen(pikrellcam.preset_config_file, "r")) == NULL)
 		{
@@ -760,7 +782,10 @@ preset_config_load(void)
 			sscanf(buf + 12, "%d", &settings->burst_count);
 		else if (!strncmp(buf, "burst_frames", 12))
 			sscanf(buf + 13, "%d", &settings->burst_frames);
-		else if (!strncmp(buf, "add_region", 10))
+		else if (   !strncmp(buf, "add_region", 10)
+		         || !strncmp(buf, "add_polygon", 11)
+		         || !strncmp(buf, "add_mask", 8)
+		        )
 			{
 			region = strdup(buf);	/* string "add_region xf0 yf0 dxf dyf" */
 			settings->region_list = slist_append(settings->region_list, region);
@@ -0,0 +1,358 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+#include "pikrellcam.h"
+
+#ifdef PIKRELLCAM_NO_MMAL
+#include "mmal_status.h"
+#endif
+
+  /* The replay camera source feeds recorded files through the video.c
+  |  frame handlers the way the MMAL callbacks do, so recording and motion
+  |  detection can be run and profiled without a Pi camera.  Run with
+  |  -replay<dir> and the dir has:
+  |
+  |    video.h264  h264 elementary stream (raspivid -o), must be there.
+  |    video.mv    inline motion vector buffers (raspivid -x) for the
+  |                video_width x video_height config.
+  |    video.i420  I420 frames at the mjpeg_width stream size for drawing on.
+  |    mjpeg.jpg   a jpeg used for every mjpeg stream frame and for stills.
+  |
+  |  Frames are delivered at video_fps, or as fast as they can be handled
+  |  with -replay-fast.  Motion timings still go by the system clock, so
+  |  use real time replays to check motion behavior and fast replays for
+  |  profiling.  There is no encoder to request keyframes from, so records
+  |  start on keyframes that are in the h264 file.  When the h264 file runs
+  |  out, any record is stopped and pikrellcam quits.
+  */
+
+#define	REPLAY_H264			"video.h264"
+#define	REPLAY_VECTORS		"video.mv"
+#define	REPLAY_I420			"video.i420"
+#define	REPLAY_JPEG			"mjpeg.jpg"
+
+#define	NAL_TYPE_SLICE		1
+#define	NAL_TYPE_IDR		5
+#define	NAL_TYPE_SPS		7
+#define	NAL_TYPE_PPS		8
+
+typedef struct
+	{
+	pthread_t	thread;
+	boolean		running,
+				still_pending;
+	uint64_t	stc;
+
+	uint8_t		*h264,
+				*jpeg,
+				*nal,
+				*vectors,
+				*i420,
+				*i420_send;
+	int			h264_size,
+				jpeg_size,
+				i420_size;
+	FILE		*vectors_file,
+				*i420_file;
+	}
+	Replay;
+
+static Replay	replay;
+
+
+static uint8_t *
+replay_file_load(char *name, int *size)
+	{
+	FILE		*f;
+	struct stat	st;
+	uint8_t		*data = NULL;
+	char		*path;
+
+	asprintf(&path, "%s/%s", pikrellcam.replay_dir, name);
+	if (stat(path, &st) == 0 && st.st_size > 0 && (f = fopen(path, "r")))
+		{
+		data = malloc(st.st_size);
+		if (fread(data, 1, st.st_size, f) != st.st_size)
+			{
+			log_printf("replay: %s read failed.  %m\n", path);
+			free(data);
+			data = NULL;
+			}
+		else
+			*size = st.st_size;
+		fclose(f);
+		}
+	free(path);
+	return data;
+	}
+
+static FILE *
+replay_file_open(char *name)
+	{
+	FILE	*f;
+	char	*path;
+
+	asprintf(&path, "%s/%s", pikrellcam.replay_dir, name);
+	if ((f = fopen(path, "r")) != NULL)
+		log_printf("replay: using %s\n", path);
+	free(path);
+	return f;
+	}
+
+static boolean
+nal_is_slice(uint8_t *nal)
+	{
+	int		type = *nal & 0x1f;
+
+	return (type == NAL_TYPE_SLICE || type == NAL_TYPE_IDR);
+	}
+
+  /* The side data MMAL sends after each encoded frame: the inline motion
+  |  vectors, then the resized I420 frame and its mjpeg encode, and a still
+  |  if one was asked for.
+  */
+static void
+replay_frame_side_data(int64_t pts)
+	{
+	if (   replay.vectors_file
+	    && fread(replay.vectors, 1, motion_frame.vectors_size,
+					replay.vectors_file) != motion_frame.vectors_size
+	   )
+		{
+		log_printf("replay: %s ended.\n", REPLAY_VECTORS);
+		fclose(replay.vectors_file);
+		replay.vectors_file = NULL;
+		}
+	if (replay.vectors_file)
+		video_h264_data(replay.vectors, motion_frame.vectors_size,
+					VIDEO_FLAG_SIDEINFO, pts);
+
+	/* Keep showing the last frame when the I420 file runs out.
+	*/
+	if (   replay.i420_file
+	    && fread(replay.i420, 1, replay.i420_size, replay.i420_file)
+					!= replay.i420_size
+	   )
+		{
+		log_printf("replay: %s ended.\n", REPLAY_I420);
+		fclose(replay.i420_file);
+		replay.i420_file = NULL;
+		}
+	if (video_i420_frame_wanted())
+		{
+		memcpy(replay.i420_send, replay.i420, replay.i420_size);
+		video_i420_frame_send(replay.i420_send);
+		video_mjpeg_data(replay.jpeg, replay.jpeg_size, VIDEO_FLAG_FRAME_END);
+		}
+
+	if (replay.still_pending)
+		{
+		replay.still_pending = FALSE;
+		video_still_data(replay.jpeg, replay.jpeg_size, VIDEO_FLAG_FRAME_END);
+		}
+	}
+
+static void
+replay_quit(void)
+	{
+	kill(getpid(), SIGTERM);
+	}
+
+static void
+replay_end(int n_frames, struct timespec *t0)
+	{
+	VideoCircularBuffer	*vcb = &video_circular_buffer;
+	struct timespec		t1;
+	double				t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	t = (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+	log_printf("replay: %d frames in %.2f sec (%.1f fps)\n",
+				n_frames, t, (t > 0) ? n_frames / t : 0.0);
+	log_printf("replay: motion worker %u frames queued, %u dropped\n",
+				motion_frame.frames_queued, motion_frame.frames_dropped);
+
+	pthread_mutex_lock(&vcb->mutex);
+	video_record_stop(vcb);
+	video_writer_sync(vcb);
+	pthread_mutex_unlock(&vcb->mutex);
+
+	/* Give the event loop a second to run video_record_finish().
+	*/
+	event_count_down_add("replay quit", EVENT_LOOP_FREQUENCY,
+				replay_quit, NULL);
+	}
+
+static void *
+replay_thread(void *ptr)
+	{
+	struct timespec	t0, t_frame;
+	uint8_t		*p, *end, *nal, *next_p, *next;
+	int			length, next_length, type, flags, n_frames = 0;
+	int64_t		pts, dt_frame, t_ns;
+
+	dt_frame = 1000000 / pikrellcam.camera_adjust.video_fps;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	p = replay.h264;
+	end = replay.h264 + replay.h264_size;
+	while (   __atomic_load_n(&replay.running, __ATOMIC_ACQUIRE)
+	       && (nal = h264_nal_next(&p, end, &length)) != NULL
+	      )
+		{
+		/* Hand NAL units over with a 4 byte start code like the encoder.
+		*/
+		memcpy(replay.nal + 4, nal, length);
+		length += 4;
+		type = *nal & 0x1f;
+
+		if (type == NAL_TYPE_SPS || type == NAL_TYPE_PPS)
+			{
+			video_h264_data(replay.nal, length, VIDEO_FLAG_CONFIG, 0);
+			continue;
+			}
+		if (!nal_is_slice(nal))
+			{
+			video_h264_data(replay.nal, length, 0, 0);	/* eg SEI */
+			continue;
+			}
+
+		/* A frame ends unless the next NAL is another slice of it, which
+		|  is a slice with first_mb_in_slice != 0.
+		*/
+		flags = (type == NAL_TYPE_IDR) ? VIDEO_FLAG_KEYFRAME : 0;
+		next_p = p;
+		next = h264_nal_next(&next_p, end, &next_length);
+		if (!next || next_length < 2 || !nal_is_slice(next) || (next[1] & 0x80))
+			flags |= VIDEO_FLAG_FRAME_END;
+
+		pts = (n_frames + 1) * dt_frame;
+		if (!pikrellcam.replay_fast)
+			{
+			t_ns = t0.tv_nsec + (pts % 1000000) * 1000;
+			t_frame.tv_sec = t0.tv_sec + pts / 1000000 + t_ns / 1000000000;
+			t_frame.tv_nsec = t_ns % 1000000000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t_frame, NULL);
+			}
+		replay.stc = pts;
+		video_h264_data(replay.nal, length, flags, pts);
+
+		if (flags & VIDEO_FLAG_FRAME_END)
+			{
+			++n_frames;
+			replay_frame_side_data(pts);
+			}
+		}
+	if (__atomic_load_n(&replay.running, __ATOMIC_ACQUIRE))
+		replay_end(n_frames, &t0);
+	return NULL;
+	}
+
+
+static void
+replay_free(void)
+	{
+	free(replay.h264);
+	free(replay.jpeg);
+	free(replay.nal);
+	free(replay.vectors);
+	free(replay.i420);
+	free(replay.i420_send);
+	if (replay.vectors_file)
+		fclose(replay.vectors_file);
+	if (replay.i420_file)
+		fclose(replay.i420_file);
+	memset(&replay, 0, sizeof(Replay));
+	}
+
+static boolean
+replay_start(void)
+	{
+	if ((replay.h264 = replay_file_load(REPLAY_H264, &replay.h264_size)) == NULL)
+		{
+		log_printf("replay: could not load %s/%s\n",
+					pikrellcam.replay_dir, REPLAY_H264);
+		return FALSE;
+		}
+	replay.jpeg = replay_file_load(REPLAY_JPEG, &replay.jpeg_size);
+	replay.vectors_file = replay_file_open(REPLAY_VECTORS);
+	replay.i420_file = replay_file_open(REPLAY_I420);
+
+	replay.nal = malloc(replay.h264_size + 4);
+	replay.nal[0] = replay.nal[1] = replay.nal[2] = 0;
+	replay.nal[3] = 1;
+	replay.vectors = malloc(motion_frame.vectors_size);
+
+	/* Start with a mid gray frame for when there is no I420 file.
+	*/
+	replay.i420_size = pikrellcam.mjpeg_width * pikrellcam.mjpeg_height * 3 / 2;
+	replay.i420 = malloc(replay.i420_size);
+	replay.i420_send = malloc(replay.i420_size);
+	memset(replay.i420, 0x80, replay.i420_size);
+
+	log_printf("replay: %s at %s\n", pikrellcam.replay_dir,
+				pikrellcam.replay_fast ? "max speed" : "real time");
+
+	replay.running = TRUE;
+	if (pthread_create(&replay.thread, NULL, replay_thread, NULL) != 0)
+		{
+		log_printf("replay: thread create failed.  %m\n");
+		replay_free();
+		return FALSE;
+		}
+	return TRUE;
+	}
+
+static void
+replay_stop(void)
+	{
+	if (!replay.h264)
+		return;
+	__atomic_store_n(&replay.running, FALSE, __ATOMIC_RELEASE);
+	pthread_join(replay.thread, NULL);
+	replay_free();
+	}
+
+  /* The still is delivered with the next frame like a camera capture.
+  */
+static boolean
+replay_still_capture(void)
+	{
+	replay.still_pending = TRUE;
+	return TRUE;
+	}
+
+static boolean
+replay_system_time(uint64_t *stc)
+	{
+	*stc = replay.stc;
+	return TRUE;
+	}
+
+CameraSource	replay_camera_source =
+	{
+	"replay",
+	replay_start,
+	replay_stop,
+	replay_still_capture,
+	NULL,
+	replay_system_time,
+	NULL
+	};
@@ -0,0 +1,1105 @@
+/*
+ * RTSP server
+ *
+ * Live h264 video for NVRs and players over RTSP, e.g.
+ *     vlc rtsp://your_pi_addr:8554/
+ *     ffplay -rtsp_transport tcp rtsp://your_pi_addr:8554/
+ * Enable it by setting rtsp_port in pikrellcam.conf.
+ *
+ * One h264 track is served with DESCRIBE, SETUP, PLAY, PAUSE and TEARDOWN,
+ * with RTP/AVP over UDP or interleaved on the RTSP connection.  As in the
+ * port 3000 h264 server (tcpserver.c), every client reads frames out of the
+ * video circular buffer with its own frame cursor (video_stream.c).  Frames
+ * are packetized in place into single NAL unit and FU-A packets (RFC 6184),
+ * so the encoder callback never waits on a client and the frame data
+ * is not copied.  RTP timestamps are the MMAL frame pts.
+ * A session lasts as long as its RTSP connection.  RTCP receiver reports
+ * keep UDP sessions alive but no sender reports are sent.
+ * A URL query of ago=N, e.g. rtsp://your_pi_addr:8554/?ago=10, starts the
+ * play at the keyframe nearest N seconds back in the circular buffer and
+ * sends frames as fast as the client takes them until it is live.  UDP does
+ * not push back, so there frames behind live are paced to at most twice
+ * real time by their pts.
+ */
+
+#include "pikrellcam.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define RTP_SERVER_PORT	6970	/* RTCP is on the next port */
+#define MAX_CLIENTS	8
+#define MAX_EVENTS	16
+#define REQUEST_SIZE	2048
+#define REPLY_SIZE	2048
+#define URL_SIZE	256
+#define SESSION_TIMEOUT	60	/* seconds without a request or RTCP */
+#define CLIENT_TIMEOUT	10	/* seconds without send progress */
+#define PACE_SPEED	2	/* UDP catch up, times real time */
+#define PACE_GAP	5000000	/* pts jump (usec) that restarts the pacing */
+
+#define MAX_NALS	64	/* per frame */
+#define RTP_PAYLOAD_MAX	1400
+#define RTP_PT		96
+#define RTP_CLOCK	90000
+#define RTP_HEADER_SIZE	12
+#define NAL_TYPE_SPS	7
+#define NAL_TYPE_PPS	8
+#define NAL_TYPE_AUD	9
+#define NAL_TYPE_FU_A	28
+
+enum rtsp_state {
+	RTSP_INIT,
+	RTSP_READY,		/* SETUP done */
+	RTSP_PLAYING,
+};
+
+struct nal {
+	int start, length;	/* after the start code */
+};
+
+struct rtsp_client {
+	int fd;
+	struct sockaddr_in addr;
+	char request[REQUEST_SIZE];
+	int request_len;
+	int discard;		/* rest of an interleaved packet from the client */
+	char reply[REPLY_SIZE];
+	int reply_len, reply_sent;
+	int close_after_reply;
+
+	enum rtsp_state state;
+	unsigned int session;
+	char url[URL_SIZE];	/* of the track */
+	int interleaved;	/* RTP on this connection, else UDP */
+	int channel;
+	struct sockaddr_in rtp_addr;
+	uint32_t ssrc, ts_base, rtp_ts, ts_first;
+	uint64_t pts_first;
+	uint16_t rtp_seq;
+	int ts_started;
+
+	VideoStreamCursor cursor;
+	int send_config;	/* SPS/PPS go before the next frame */
+	VideoFrame frame;
+	int in_frame;
+	int pace_wait;		/* UDP frame not sent before pace_due */
+	int64_t pace_due, pace_t;
+	uint64_t pace_pts;
+
+	/* NAL units being packetized, out of header[] or the frame */
+	uint8_t header[H264_MAX_HEADER_SIZE];
+	int header_len;
+	struct nal nals[MAX_NALS];
+	int n_nals, nal, nal_done, from_header;
+
+	/* The packet being sent.  Data comes from the frame at pkt_start, or
+	 * from header[] if pkt_start is -1.
+	 */
+	uint8_t pkt[4 + RTP_HEADER_SIZE + 2];
+	struct iovec iov[3];
+	int n_iov, pkt_len, pkt_sent, pkt_start;
+	int in_packet;
+
+	int blocked, dead;
+	int drops;
+	time_t t_progress, t_alive;
+};
+
+static int listen_fd = -1;
+static int rtp_fd = -1, rtcp_fd = -1;
+static int epoll_fd = -1;
+static int wake_fd = -1;
+static struct rtsp_client *clients[MAX_CLIENTS];
+
+static void client_close(struct rtsp_client *c, char *why)
+{
+	if (c->dead)
+		return;
+	log_printf("RTSP: closing %s:%u, %s (skipped %d times, %d dropped)\n",
+		inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), why,
+		c->cursor.skips, c->drops);
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->dead = 1;
+}
+
+static void client_set_blocked(struct rtsp_client *c, int blocked)
+{
+	struct epoll_event ev;
+
+	if (c->blocked == blocked)
+		return;
+	ev.events = EPOLLIN | (blocked ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->blocked = blocked;
+}
+
+/*
+ * Find the NAL units in byte stream data that may be split across two
+ * iovecs by the circular buffer wrap.  AUD NAL units are left out.
+ * nals must have room for MAX_NALS.
+ */
+static int nal_scan(struct iovec *iov, int n_iov, struct nal *nals)
+{
+	uint8_t *p;
+	int i, j, pos = 0, zeros = 0, n = 0, start = -1;
+
+	for (i = 0; i < n_iov; ++i) {
+		p = iov[i].iov_base;
+		for (j = 0; j < iov[i].iov_len; ++j, ++pos) {
+			if (p[j] == 0) {
+				++zeros;
+				continue;
+			}
+			if (p[j] == 1 && zeros >= 2) {
+				if (start >= 0 && n < MAX_NALS) {
+					nals[n].start = start;
+					nals[n++].length = pos - zeros - start;
+				}
+				start = pos + 1;
+			}
+			zeros = 0;
+		}
+	}
+	if (start >= 0 && n < MAX_NALS) {
+		nals[n].start = start;
+		nals[n++].length = pos - zeros - start;
+	}
+
+	/* drop empty and AUD NAL units */
+	for (i = j = 0; i < n; ++i) {
+		if (nals[i].length <= 0)
+			continue;
+		p = iov[0].iov_base;
+		if (nals[i].start < iov[0].iov_len)
+			p += nals[i].start;
+		else
+			p = (uint8_t *) iov[1].iov_base + nals[i].start - iov[0].iov_len;
+		if ((*p & 0x1f) != NAL_TYPE_AUD)
+			nals[j++] = nals[i];
+	}
+	return j;
+}
+
+/* A range of the frame data as up to two iovecs. */
+static int frame_iov(VideoFrame *frame, int start, int length, struct iovec *iov)
+{
+	video_stream_iov(frame, start, iov);
+	if (iov[0].iov_len >= length) {
+		iov[0].iov_len = length;
+		return 1;
+	}
+	iov[1].iov_len = length - iov[0].iov_len;
+	return 2;
+}
+
+static uint8_t nal_header(struct rtsp_client *c, struct nal *nal)
+{
+	struct iovec iov[2];
+
+	if (c->from_header)
+		return c->header[nal->start];
+	frame_iov(&c->frame, nal->start, 1, iov);
+	return *(uint8_t *) iov[0].iov_base;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/*
+ * Make the next RTP packet out of the NAL units.  A NAL unit too big for
+ * one packet is sent as FU-A fragments with its header byte folded into
+ * the FU indicator and FU header.  Returns 0 when there are no more.
+ */
+static int client_packet(struct rtsp_client *c)
+{
+	struct nal *nal;
+	uint8_t *h = c->pkt, nh;
+	int start, length, fu, last, n = 0;
+
+	if (c->nal >= c->n_nals)
+		return 0;
+	nal = &c->nals[c->nal];
+	nh = nal_header(c, nal);
+	fu = nal->length > RTP_PAYLOAD_MAX;
+	if (!fu) {
+		start = nal->start;
+		length = nal->length;
+		last = 1;
+	} else {
+		if (c->nal_done == 0)
+			c->nal_done = 1;
+		start = nal->start + c->nal_done;
+		length = MIN(nal->length - c->nal_done, RTP_PAYLOAD_MAX - 2);
+		last = (c->nal_done + length == nal->length);
+	}
+
+	if (c->interleaved) {
+		h[0] = '$';
+		h[1] = c->channel;
+		n = 4;
+	}
+	h[n] = 0x80;			/* version 2 */
+	h[n + 1] = RTP_PT;
+	if (last && !c->from_header && c->nal == c->n_nals - 1)
+		h[n + 1] |= 0x80;	/* marker on the end of the frame */
+	h[n + 2] = c->rtp_seq >> 8;
+	h[n + 3] = c->rtp_seq;
+	put32(h + n + 4, c->rtp_ts);
+	put32(h + n + 8, c->ssrc);
+	n += RTP_HEADER_SIZE;
+	if (fu) {
+		h[n] = (nh & 0xe0) | NAL_TYPE_FU_A;
+		h[n + 1] = (nh & 0x1f) | (c->nal_done == 1 ? 0x80 : 0) | (last ? 0x40 : 0);
+		n += 2;
+	}
+	if (c->interleaved) {
+		h[2] = (n - 4 + length) >> 8;
+		h[3] = (n - 4 + length);
+	}
+
+	c->iov[0].iov_base = h;
+	c->iov[0].iov_len = n;
+	if (c->from_header) {
+		c->iov[1].iov_base = c->header + start;
+		c->iov[1].iov_len = length;
+		c->n_iov = 2;
+		c->pkt_start = -1;
+	} else {
+		c->n_iov = 1 + frame_iov(&c->frame, start, length, c->iov + 1);
+		c->pkt_start = start;
+	}
+	c->pkt_len = n + length;
+	c->pkt_sent = 0;
+	c->in_packet = 1;
+	c->rtp_seq++;
+
+	if (fu && !last)
+		c->nal_done += length;
+	else {
+		c->nal++;
+		c->nal_done = 0;
+	}
+	return 1;
+}
+
+static void client_nals_reset(struct rtsp_client *c)
+{
+	c->n_nals = 0;
+	c->nal = 0;
+	c->nal_done = 0;
+	c->from_header = 0;
+	c->pace_wait = 0;
+}
+
+static int64_t time_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * A UDP client is never blocked, so frames behind live, for an ago play
+ * or after a stall, would all go out in one burst and mostly be lost.
+ * Such frames are sent no faster than PACE_SPEED times real time going
+ * by their pts.  Pacing starts over from a frame that is not early, so a
+ * live client is not held back.  Returns 0 until the frame is due.
+ */
+static int client_paced(struct rtsp_client *c)
+{
+	uint64_t pts = c->frame.pts;
+	int64_t now = time_usec();
+
+	if (!c->pace_wait)
+		return 1;
+	if (   pts > c->pace_pts && pts - c->pace_pts < PACE_GAP
+	    && c->pace_pts > 0
+	   ) {
+		c->pace_due = c->pace_t + (int64_t) (pts - c->pace_pts) / PACE_SPEED;
+		if (c->pace_due > now)
+			return 0;
+	}
+	c->pace_t = now;
+	c->pace_pts = pts;
+	c->pace_wait = 0;
+	return 1;
+}
+
+static void client_skip(struct rtsp_client *c)
+{
+	video_stream_skip(&c->cursor);
+	c->in_frame = 0;
+	c->in_packet = 0;
+	client_nals_reset(c);
+}
+
+/*
+ * RTP timestamps follow the frame pts from the first frame sent, or the
+ * nominal frame rate where a frame has no pts.
+ */
+static void client_frame_ts(struct rtsp_client *c)
+{
+	uint64_t pts = c->frame.pts;
+	int fps = pikrellcam.camera_adjust.video_fps;
+
+	if (!c->ts_started) {
+		c->ts_started = 1;
+		c->rtp_ts = c->ts_base;
+		c->ts_first = c->rtp_ts;
+		c->pts_first = pts;
+	} else if (c->pts_first > 0 && pts > c->pts_first)
+		c->rtp_ts = c->ts_first + (uint32_t) ((pts - c->pts_first) * 9 / 100);
+	else {
+		c->rtp_ts += RTP_CLOCK / (fps > 0 ? fps : 25);
+		c->ts_first = c->rtp_ts;
+		c->pts_first = pts;
+	}
+}
+
+/* Set up the NAL units of the next frame.  Returns 0 if there is none yet. */
+static int client_next_frame(struct rtsp_client *c)
+{
+	struct iovec iov[2];
+	int n;
+
+	switch (video_stream_next(&c->cursor, &c->frame)) {
+	case VIDEO_STREAM_WAIT:
+		return 0;
+	case VIDEO_STREAM_RESTART:
+		c->header_len = video_stream_header(c->header);
+		c->send_config = 1;
+		break;
+	}
+	client_nals_reset(c);
+	n = video_stream_iov(&c->frame, 0, iov);
+	c->n_nals = nal_scan(iov, n, c->nals);
+	if (!video_stream_valid(&c->frame, 0)) {
+		client_skip(c);		/* overwritten while scanning */
+		return 1;
+	}
+	c->in_frame = 1;
+	c->pace_wait = !c->interleaved;
+	client_frame_ts(c);
+
+	if (c->send_config) {
+		/* the frame NAL units are scanned again after these */
+		iov[0].iov_base = c->header;
+		iov[0].iov_len = c->header_len;
+		c->n_nals = nal_scan(iov, 1, c->nals);
+		c->from_header = 1;
+		c->send_config = 0;
+	}
+	return 1;
+}
+
+/* Send a packet, or what is left of it.  Returns 0 if the send blocked. */
+static int client_packet_send(struct rtsp_client *c)
+{
+	struct iovec iov[3];
+	struct msghdr msg;
+	int i, n_iov = 0, skip = c->pkt_sent;
+	ssize_t n;
+
+	for (i = 0; i < c->n_iov; ++i) {
+		if (skip >= c->iov[i].iov_len) {
+			skip -= c->iov[i].iov_len;
+			continue;
+		}
+		iov[n_iov].iov_base = (uint8_t *) c->iov[i].iov_base + skip;
+		iov[n_iov++].iov_len = c->iov[i].iov_len - skip;
+		skip = 0;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n_iov;
+
+	if (!c->interleaved) {
+		msg.msg_name = &c->rtp_addr;
+		msg.msg_namelen = sizeof(c->rtp_addr);
+		if (sendmsg(rtp_fd, &msg, MSG_NOSIGNAL) < 0)
+			c->drops++;	/* UDP does not wait */
+		c->in_packet = 0;
+		return 1;
+	}
+	n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			client_set_blocked(c, 1);
+		else if (errno != EINTR)
+			client_close(c, strerror(errno));
+		return 0;
+	}
+	c->t_progress = time(NULL);
+	c->pkt_sent += n;
+	if (c->pkt_sent == c->pkt_len)
+		c->in_packet = 0;
+	return 1;
+}
+
+static int client_reply_send(struct rtsp_client *c)
+{
+	ssize_t n;
+
+	n = send(c->fd, c->reply + c->reply_sent, c->reply_len - c->reply_sent,
+			MSG_NOSIGNAL);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			client_set_blocked(c, 1);
+		else if (errno != EINTR)
+			client_close(c, strerror(errno));
+		return 0;
+	}
+	c->t_progress = time(NULL);
+	c->reply_sent += n;
+	if (c->reply_sent < c->reply_len)
+		return 1;
+	c->reply_len = 0;
+	c->reply_sent = 0;
+	if (c->close_after_reply)
+		client_close(c, "teardown");
+	return 1;
+}
+
+static void client_requests(struct rtsp_client *c);
+
+/*
+ * Send as much as the sockets take without blocking.  A reply waits for a
+ * partly sent interleaved packet so it does not land inside one.
+ */
+static void client_send(struct rtsp_client *c)
+{
+	VideoCircularBuffer *vcb = &video_circular_buffer;
+
+	pthread_rwlock_rdlock(&vcb->stream_lock);
+	if (video_stream_new_generation(&c->cursor)) {
+		/* new video size or bitrate, start over with the new SPS/PPS */
+		if (c->in_packet && c->pkt_start >= 0 && c->pkt_sent > 0)
+			client_close(c, "stream restarted");
+		else if (c->in_packet && c->pkt_start >= 0)
+			c->in_packet = 0;
+		c->in_frame = 0;
+		client_nals_reset(c);
+	}
+	while (!c->dead) {
+		if (c->in_packet) {
+			if (c->pkt_start >= 0 && !video_stream_valid(&c->frame, c->pkt_start)) {
+				if (c->pkt_sent > 0) {
+					client_close(c, "fell behind");
+					break;
+				}
+				client_skip(c);
+				continue;
+			}
+			if (!client_packet_send(c))
+				break;
+			continue;
+		}
+		if (c->reply_len) {
+			if (!client_reply_send(c))
+				break;
+			if (!c->reply_len)
+				client_requests(c);	/* any that waited */
+			continue;
+		}
+		if (c->state != RTSP_PLAYING)
+			break;
+		if (!client_paced(c))
+			break;
+		if (client_packet(c))
+			continue;
+		if (c->from_header) {
+			/* SPS/PPS sent, now the frame */
+			struct iovec iov[2];
+			int n = video_stream_iov(&c->frame, 0, iov);
+
+			client_nals_reset(c);
+			c->n_nals = nal_scan(iov, n, c->nals);
+			if (!video_stream_valid(&c->frame, 0))
+				client_skip(c);
+			continue;
+		}
+		if (c->in_frame) {
+			c->in_frame = 0;
+			c->cursor.seq++;
+			client_nals_reset(c);
+		}
+		if (!client_next_frame(c))
+			break;
+	}
+	if (!c->dead && !c->in_packet && !c->reply_len)
+		client_set_blocked(c, 0);
+	pthread_rwlock_unlock(&vcb->stream_lock);
+}
+
+static int header_value(char *request, char *name, char *value, int size)
+{
+	char *s, *eol;
+	int len = strlen(name);
+
+	for (s = strstr(request, "\r\n"); s; s = strstr(s + 2, "\r\n")) {
+		if (strncasecmp(s + 2, name, len) || s[2 + len] != ':')
+			continue;
+		s += 3 + len;
+		while (*s == ' ' || *s == '\t')
+			++s;
+		if ((eol = strstr(s, "\r\n")) == NULL)
+			eol = s + strlen(s);
+		snprintf(value, size, "%.*s", (int) (eol - s), s);
+		return 1;
+	}
+	return 0;
+}
+
+static void client_reply(struct rtsp_client *c, char *status, char *cseq,
+			char *headers, char *body)
+{
+	int len;
+
+	len = snprintf(c->reply, REPLY_SIZE,
+			"RTSP/1.0 %s\r\n"
+			"CSeq: %s\r\n"
+			"Server: PiKrellCam\r\n",
+			status, cseq);
+	if (c->session && len < REPLY_SIZE)
+		len += snprintf(c->reply + len, REPLY_SIZE - len,
+			"Session: %08X;timeout=%d\r\n", c->session, SESSION_TIMEOUT);
+	if (headers && len < REPLY_SIZE)
+		len += snprintf(c->reply + len, REPLY_SIZE - len, "%s", headers);
+	if (body && len < REPLY_SIZE)
+		len += snprintf(c->reply + len, REPLY_SIZE - len,
+			"Content-Length: %d\r\n\r\n%s", (int) strlen(body), body);
+	else if (len < REPLY_SIZE)
+		len += snprintf(c->reply + len, REPLY_SIZE - len, "\r\n");
+	c->reply_len = MIN(len, REPLY_SIZE - 1);
+	c->reply_sent = 0;
+}
+
+/* out must hold BASE64_SIZE(len) bytes */
+#define BASE64_SIZE(len)	(((len) + 2) / 3 * 4 + 1)
+
+static void base64(uint8_t *in, int len, char *out)
+{
+	static char b64[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint32_t v;
+	int i;
+
+	for (i = 0; i < len; i += 3) {
+		v = in[i] << 16;
+		if (i + 1 < len)
+			v |= in[i + 1] << 8;
+		if (i + 2 < len)
+			v |= in[i + 2];
+		*out++ = b64[(v >> 18) & 0x3f];
+		*out++ = b64[(v >> 12) & 0x3f];
+		*out++ = (i + 1 < len) ? b64[(v >> 6) & 0x3f] : '=';
+		*out++ = (i + 2 < len) ? b64[v & 0x3f] : '=';
+	}
+	*out = '\0';
+}
+
+/* A time shift may be asked for in the query of any request URL. */
+static void url_ago(struct rtsp_client *c, char *url)
+{
+	char *s;
+
+	if ((s = strchr(url, '?')) != NULL && (s = strstr(s, "ago=")) != NULL)
+		c->cursor.ago = MAX(0, atoi(s + 4));
+}
+
+static void client_describe(struct rtsp_client *c, char *url, char *cseq)
+{
+	uint8_t header[H264_MAX_HEADER_SIZE], *sps = NULL, *pps = NULL;
+	char sps64[BASE64_SIZE(H264_MAX_HEADER_SIZE)];
+	char pps64[BASE64_SIZE(H264_MAX_HEADER_SIZE)];
+	char sdp[1024], headers[URL_SIZE + 64];
+	struct sockaddr_in local;
+	socklen_t size = sizeof(local);
+	struct nal nals[MAX_NALS];	/* nal_scan() may fill them all */
+	struct iovec iov;
+	int i, n, sps_len = 0, pps_len = 0;
+
+	url_ago(c, url);
+	iov.iov_base = header;
+	iov.iov_len = video_stream_header(header);
+	n = nal_scan(&iov, 1, nals);
+	for (i = 0; i < n; ++i) {
+		if ((header[nals[i].start] & 0x1f) == NAL_TYPE_SPS) {
+			sps = header + nals[i].start;
+			sps_len = nals[i].length;
+		} else if ((header[nals[i].start] & 0x1f) == NAL_TYPE_PPS) {
+			pps = header + nals[i].start;
+			pps_len = nals[i].length;
+		}
+	}
+	if (!sps || sps_len < 4 || !pps) {
+		client_reply(c, "503 Service Unavailable", cseq, NULL, NULL);
+		return;
+	}
+	base64(sps, sps_len, sps64);
+	base64(pps, pps_len, pps64);
+	getsockname(c->fd, (struct sockaddr *) &local, &size);
+
+	snprintf(sdp, sizeof(sdp),
+		"v=0\r\n"
+		"o=- %u 1 IN IP4 %s\r\n"
+		"s=PiKrellCam\r\n"
+		"c=IN IP4 0.0.0.0\r\n"
+		"t=0 0\r\n"
+		"a=control:*\r\n"
+		"a=range:npt=now-\r\n"
+		"m=video 0 RTP/AVP %d\r\n"
+		"a=rtpmap:%d H264/%d\r\n"
+		"a=fmtp:%d packetization-mode=1;profile-level-id=%02X%02X%02X;"
+			"sprop-parameter-sets=%s,%s\r\n"
+		"a=framerate:%d\r\n"
+		"a=control:track1\r\n",
+		(unsigned int) time(NULL), inet_ntoa(local.sin_addr),
+		RTP_PT, RTP_PT, RTP_CLOCK, RTP_PT, sps[1], sps[2], sps[3],
+		sps64, pps64, pikrellcam.camera_adjust.video_fps);
+	snprintf(headers, sizeof(headers),
+		"Content-Base: %s%s\r\n"
+		"Content-Type: application/sdp\r\n",
+		url, url[strlen(url) - 1] == '/' ? "" : "/");
+	client_reply(c, "200 OK", cseq, headers, sdp);
+}
+
+static void client_setup(struct rtsp_client *c, char *url, char *cseq)
+{
+	char transport[256], headers[256], *s;
+	int port = 0;
+
+	url_ago(c, url);
+	if (c->state == RTSP_PLAYING) {
+		client_reply(c, "455 Method Not Valid in This State", cseq, NULL, NULL);
+		return;
+	}
+	if (!header_value(c->request, "Transport", transport, sizeof(transport))) {
+		client_reply(c, "400 Bad Request", cseq, NULL, NULL);
+		return;
+	}
+	if (strstr(transport, "RTP/AVP/TCP")) {
+		c->interleaved = 1;
+		c->channel = 0;
+		if ((s = strstr(transport, "interleaved=")) != NULL)
+			sscanf(s + 12, "%d", &c->channel);
+		snprintf(headers, sizeof(headers),
+			"Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d;ssrc=%08X\r\n",
+			c->channel, c->channel + 1, c->ssrc);
+	} else if (   rtp_fd >= 0 && !strstr(transport, "multicast")
+	           && (s = strstr(transport, "client_port=")) != NULL
+	           && sscanf(s + 12, "%d", &port) == 1 && port > 0 && port < 65535
+	          ) {
+		c->interleaved = 0;
+		c->rtp_addr = c->addr;
+		c->rtp_addr.sin_port = htons(port);
+		snprintf(headers, sizeof(headers),
+			"Transport: RTP/AVP;unicast;client_port=%d-%d;"
+				"server_port=%d-%d;ssrc=%08X\r\n",
+			port, port + 1, RTP_SERVER_PORT, RTP_SERVER_PORT + 1, c->ssrc);
+	} else {
+		client_reply(c, "461 Unsupported Transport", cseq, NULL, NULL);
+		return;
+	}
+	snprintf(c->url, URL_SIZE, "%s", url);
+	while (c->session == 0)
+		c->session = random();
+	c->state = RTSP_READY;
+	client_reply(c, "200 OK", cseq, headers, NULL);
+}
+
+static void client_play(struct rtsp_client *c, char *url, char *cseq)
+{
+	char headers[URL_SIZE + 128];
+
+	url_ago(c, url);
+	if (c->state == RTSP_INIT) {
+		client_reply(c, "455 Method Not Valid in This State", cseq, NULL, NULL);
+		return;
+	}
+	if (c->state == RTSP_READY) {
+		c->state = RTSP_PLAYING;
+		c->cursor.need_keyframe = TRUE;
+		c->cursor.catch_up = (c->cursor.ago > 0);
+		c->in_frame = 0;
+		client_nals_reset(c);
+		log_printf("RTSP: %s:%u playing over %s, %d seconds ago\n",
+			inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port),
+			c->interleaved ? "TCP" : "UDP", c->cursor.ago);
+	}
+	snprintf(headers, sizeof(headers),
+		"Range: npt=now-\r\n"
+		"RTP-Info: url=%s;seq=%u;rtptime=%u\r\n",
+		c->url, c->rtp_seq, c->ts_started ? c->rtp_ts : c->ts_base);
+	client_reply(c, "200 OK", cseq, headers, NULL);
+}
+
+/*
+ * Handle the next complete request if the reply to the last one is out.
+ * The client may also send interleaved RTCP packets on the connection.
+ */
+static int client_request(struct rtsp_client *c)
+{
+	char method[16], url[URL_SIZE], version[16], cseq[32], value[32], *end;
+	int len, body = 0;
+
+	if (c->reply_len || c->dead)
+		return 0;
+	if (c->discard) {
+		len = MIN(c->discard, c->request_len);
+		memmove(c->request, c->request + len, c->request_len - len);
+		c->request_len -= len;
+		c->discard -= len;
+	}
+	if (c->request_len >= 4 && c->request[0] == '$') {
+		len = 4 + ((uint8_t) c->request[2] << 8 | (uint8_t) c->request[3]);
+		c->t_alive = time(NULL);
+		c->discard = len;
+		return 1;
+	}
+	if (c->request_len == 0 || c->request[0] == '$')
+		return 0;
+
+	c->request[c->request_len] = '\0';
+	if ((end = strstr(c->request, "\r\n\r\n")) == NULL) {
+		if (c->request_len == REQUEST_SIZE - 1) {
+			c->close_after_reply = 1;
+			client_reply(c, "400 Bad Request", "0", NULL, NULL);
+		}
+		return 0;
+	}
+	*end = '\0';
+	if (header_value(c->request, "Content-Length", value, sizeof(value)))
+		body = atoi(value);
+	len = end + 4 - c->request + MAX(body, 0);
+	if (len > c->request_len) {
+		*end = '\r';
+		if (len > REQUEST_SIZE - 1) {
+			c->close_after_reply = 1;
+			client_reply(c, "413 Request Entity Too Large", "0", NULL, NULL);
+		}
+		return 0;
+	}
+	c->t_alive = time(NULL);
+
+	if (!header_value(c->request, "CSeq", cseq, sizeof(cseq)))
+		strcpy(cseq, "0");
+	if (sscanf(c->request, "%15s %255s %15s", method, url, version) != 3)
+		client_reply(c, "400 Bad Request", cseq, NULL, NULL);
+	else if (!strcmp(method, "OPTIONS"))
+		client_reply(c, "200 OK", cseq,
+			"Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, "
+			"GET_PARAMETER, SET_PARAMETER\r\n", NULL);
+	else if (!strcmp(method, "DESCRIBE"))
+		client_describe(c, url, cseq);
+	else if (!strcmp(method, "SETUP"))
+		client_setup(c, url, cseq);
+	else if (   c->session
+	         && (   !header_value(c->request, "Session", value, sizeof(value))
+	             || strtoul(value, NULL, 16) != c->session
+	            )
+	        )
+		client_reply(c, "454 Session Not Found", cseq, NULL, NULL);
+	else if (!strcmp(method, "PLAY"))
+		client_play(c, url, cseq);
+	else if (!strcmp(method, "PAUSE")) {
+		if (c->state == RTSP_PLAYING)
+			c->state = RTSP_READY;
+		client_reply(c, "200 OK", cseq, NULL, NULL);
+	} else if (!strcmp(method, "TEARDOWN")) {
+		c->state = RTSP_INIT;
+		c->close_after_reply = 1;
+		client_reply(c, "200 OK", cseq, NULL, NULL);
+	} else if (!strcmp(method, "GET_PARAMETER") || !strcmp(method, "SET_PARAMETER"))
+		client_reply(c, "200 OK", cseq, NULL, NULL);
+	else
+		client_reply(c, "501 Not Implemented", cseq, NULL, NULL);
+
+	memmove(c->request, c->request + len, c->request_len - len);
+	c->request_len -= len;
+	return 1;
+}
+
+static void client_requests(struct rtsp_client *c)
+{
+	while (client_request(c))
+		;
+}
+
+static void client_read(struct rtsp_client *c)
+{
+	ssize_t n;
+
+	if (c->request_len == REQUEST_SIZE - 1) {
+		client_close(c, "requests not taken");	/* while a reply waits */
+		return;
+	}
+	n = read(c->fd, c->request + c->request_len,
+			REQUEST_SIZE - 1 - c->request_len);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		client_close(c, "client closed");
+		return;
+	}
+	if (n > 0) {
+		c->request_len += n;
+		client_requests(c);
+		client_send(c);
+	}
+}
+
+/* RTCP receiver reports from UDP clients keep their sessions alive. */
+static void rtcp_read(void)
+{
+	struct sockaddr_in from;
+	socklen_t size = sizeof(from);
+	struct rtsp_client *c;
+	char buf[1500];
+	int i;
+
+	while (recvfrom(rtcp_fd, buf, sizeof(buf), 0,
+			(struct sockaddr *) &from, &size) >= 0) {
+		for (i = 0; i < MAX_CLIENTS; ++i) {
+			if (   (c = clients[i]) != NULL && !c->interleaved
+			    && c->rtp_addr.sin_addr.s_addr == from.sin_addr.s_addr
+			    && ntohs(c->rtp_addr.sin_port) + 1 == ntohs(from.sin_port)
+			   )
+				c->t_alive = time(NULL);
+		}
+		size = sizeof(from);
+	}
+}
+
+static void add_new_connection(void)
+{
+	struct sockaddr_in addr;
+	socklen_t size = sizeof(addr);
+	struct rtsp_client *c;
+	struct epoll_event ev;
+	int fd, i;
+
+	fd = accept4(listen_fd, (struct sockaddr *) &addr, &size,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+	for (i = 0; i < MAX_CLIENTS; ++i)
+		if (!clients[i])
+			break;
+	if (i == MAX_CLIENTS || (c = calloc(1, sizeof(*c))) == NULL) {
+		log_printf("RTSP: too many clients, refusing %s\n",
+			inet_ntoa(addr.sin_addr));
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	c->addr = addr;
+	video_stream_cursor_init(&c->cursor, TRUE);
+	c->ssrc = random();
+	c->ts_base = random();
+	c->rtp_seq = random();
+	c->t_progress = c->t_alive = time(NULL);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		close(fd);
+		free(c);
+		return;
+	}
+	clients[i] = c;
+	log_printf("RTSP: connect from host %s, port %u.\n",
+		inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+}
+
+/* Milliseconds the epoll wait may last, up to the next paced frame. */
+static int wait_timeout(void)
+{
+	struct rtsp_client *c;
+	int64_t now = time_usec(), wait = 1000000;
+	int i;
+
+	for (i = 0; i < MAX_CLIENTS; ++i) {
+		if ((c = clients[i]) != NULL && !c->dead && c->pace_wait)
+			wait = MIN(wait, MAX(c->pace_due - now, 0));
+	}
+	return (wait + 999) / 1000;
+}
+
+static void* rtsp_server(void *unused)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct rtsp_client *c;
+	uint64_t count;
+	int64_t t_usec;
+	time_t t_now;
+	int i, n, new_frame;
+
+	while (1) {
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS, wait_timeout());
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			log_printf("RTSP: epoll failure: %s\n", strerror(errno));
+			break;
+		}
+		new_frame = 0;
+		for (i = 0; i < n; ++i) {
+			if (events[i].data.ptr == &listen_fd) {
+				add_new_connection();
+				continue;
+			}
+			if (events[i].data.ptr == &rtcp_fd) {
+				rtcp_read();
+				continue;
+			}
+			if (events[i].data.ptr == &wake_fd) {
+				if (read(wake_fd, &count, sizeof(count)) > 0)
+					new_frame = 1;
+				continue;
+			}
+			c = events[i].data.ptr;
+			if (!c->dead && (events[i].events & (EPOLLERR | EPOLLHUP)))
+				client_close(c, "hangup");
+			if (!c->dead && (events[i].events & EPOLLIN))
+				client_read(c);
+			if (!c->dead && (events[i].events & EPOLLOUT))
+				client_send(c);
+		}
+
+		t_now = time(NULL);
+		t_usec = time_usec();
+		for (i = 0; i < MAX_CLIENTS; ++i) {
+			if ((c = clients[i]) == NULL)
+				continue;
+			if (   !c->dead && !c->blocked && c->state == RTSP_PLAYING
+			    && (new_frame || (c->pace_wait && t_usec >= c->pace_due))
+			   )
+				client_send(c);
+			if (!c->dead && c->blocked && t_now - c->t_progress > CLIENT_TIMEOUT)
+				client_close(c, "send timeout");
+			/* interleaved players show they are alive by taking packets */
+			if (   !c->dead && !(c->state == RTSP_PLAYING && c->interleaved)
+			    && t_now - c->t_alive > SESSION_TIMEOUT
+			   )
+				client_close(c, "session timeout");
+			if (c->dead) {
+				free(c);
+				clients[i] = NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Called from video_stream_notify() at each frame end, never blocks. */
+void rtsp_server_notify(void)
+{
+	uint64_t one = 1;
+
+	if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		log_printf("RTSP: wakeup failed: %s\n", strerror(errno));
+}
+
+static int udp_socket(int port)
+{
+	struct sockaddr_in addr;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void setup_rtsp_server(void)
+{
+	struct sockaddr_in servaddr;
+	struct epoll_event ev;
+	pthread_t tid;
+	int reuse = 1;
+
+	if (pikrellcam.rtsp_port <= 0)
+		return;
+	srandom(time(NULL) ^ getpid());
+
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		log_printf("RTSP: socket failed: %s\n", strerror(errno));
+		return;
+	}
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	memset(&servaddr, 0, sizeof(servaddr));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	servaddr.sin_port = htons(pikrellcam.rtsp_port);
+	if (   bind(listen_fd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0
+	    || listen(listen_fd, 4) < 0
+	   ) {
+		log_printf("RTSP: bind/listen port %d failed: %s\n",
+			pikrellcam.rtsp_port, strerror(errno));
+		close(listen_fd);
+		listen_fd = -1;
+		return;
+	}
+
+	rtp_fd = udp_socket(RTP_SERVER_PORT);
+	rtcp_fd = udp_socket(RTP_SERVER_PORT + 1);
+	if (rtp_fd < 0 || rtcp_fd < 0) {
+		log_printf("RTSP: UDP ports %d-%d not available, TCP only.\n",
+			RTP_SERVER_PORT, RTP_SERVER_PORT + 1);
+		if (rtp_fd >= 0)
+			close(rtp_fd);
+		if (rtcp_fd >= 0)
+			close(rtcp_fd);
+		rtp_fd = rtcp_fd = -1;
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd < 0 || wake_fd < 0) {
+		log_printf("RTSP: epoll setup failed: %s\n", strerror(errno));
+		wake_fd = -1;
+		return;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listen_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	ev.data.ptr = &wake_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+	if (rtcp_fd >= 0) {
+		ev.data.ptr = &rtcp_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, rtcp_fd, &ev);
+	}
+
+	if (pthread_create(&tid, NULL, rtsp_server, NULL) != 0) {
+		log_printf("RTSP: thread create failed\n");
+		return;
+	}
+	pthread_detach(tid);
+	log_printf("RTSP server listening on port %d\n", pikrellcam.rtsp_port);
+}
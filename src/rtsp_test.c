@@ -0,0 +1,479 @@
+/*
+ * RTSP server loopback check, run by "make rtsp-test".
+ *
+ *     pikrellcam-rtsp-test rtsp://127.0.0.1:8554/ tcp|udp seconds [video.h264]
+ *
+ * Plays the stream for some seconds over interleaved TCP or UDP and checks
+ * the SDP sprop-parameter-sets and profile-level-id, the RTP headers and
+ * sequence numbers, frame markers and timestamps, and that FU-A fragments
+ * reassemble into whole NAL units.  The stream must start with SPS, PPS and
+ * an IDR slice, and given the replayed video.h264 every NAL unit must be
+ * found in it byte for byte.  Exits 1 if any check fails.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define UDP_PORT	56970	/* RTCP is on the next port */
+#define BUF_SIZE	(256 * 1024)
+#define REPLY_SIZE	4096
+#define NAL_MAX		(512 * 1024)
+#define TIMEOUT_MSEC	5000
+#define RTP_PT		96
+#define NAL_TYPE_SPS	7
+#define NAL_TYPE_PPS	8
+#define NAL_TYPE_IDR	5
+#define NAL_TYPE_FU_A	28
+
+static int rtsp_fd = -1, udp_fd = -1;
+static uint8_t buf[BUF_SIZE];
+static int buf_len;
+static int cseq = 1;
+static char session[64];
+static int n_failures;
+
+/* NAL units of the replayed video */
+static uint8_t *src;
+static int *src_start, *src_length;
+static int n_src;
+
+/* RTP and reassembly state */
+static uint8_t nal[NAL_MAX];
+static int nal_len, in_fu;
+static int n_packets, n_nals, n_matched, n_frames, n_gaps;
+static int have_seq, have_ts, in_frame;
+static uint16_t last_seq;
+static uint32_t ssrc, frame_ts, last_ts;
+
+static void fail(char *fmt, ...)
+{
+	va_list args;
+
+	if (n_failures++ >= 10)
+		return;
+	printf("rtsp_test: ");
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+	printf("\n");
+}
+
+/* Wait for and read more from fd.  Returns 0 on timeout or close. */
+static int read_more(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	ssize_t n;
+
+	if (buf_len == BUF_SIZE || poll(&pfd, 1, TIMEOUT_MSEC) <= 0)
+		return 0;
+	n = recv(fd, buf + buf_len, BUF_SIZE - buf_len, 0);
+	if (n <= 0)
+		return 0;
+	buf_len += n;
+	return 1;
+}
+
+static void buf_consume(int n)
+{
+	memmove(buf, buf + n, buf_len - n);
+	buf_len -= n;
+}
+
+/* Take an interleaved packet off the front of buf.  Returns its length. */
+static int interleaved_packet(uint8_t *pkt, int *channel)
+{
+	int len;
+
+	while (buf_len < 4)
+		if (!read_more(rtsp_fd))
+			return -1;
+	if (buf[0] != '$')
+		return -1;
+	len = (buf[2] << 8) | buf[3];
+	while (buf_len < 4 + len)
+		if (!read_more(rtsp_fd))
+			return -1;
+	*channel = buf[1];
+	memcpy(pkt, buf + 4, len);
+	buf_consume(4 + len);
+	return len;
+}
+
+/*
+ * Send a request and get the reply headers and body into reply, skipping
+ * any interleaved packets before it.  Returns 0 unless it is a 200 OK.
+ */
+static int request(char *method, char *url, char *headers, char *reply)
+{
+	static uint8_t pkt[65536];
+	char req[1024], *s;
+	uint8_t *end;
+	int n, hlen, clen = 0, channel;
+
+	n = snprintf(req, sizeof(req), "%s %s RTSP/1.0\r\nCSeq: %d\r\n%s",
+			method, url, cseq++, headers ? headers : "");
+	if (*session)
+		n += snprintf(req + n, sizeof(req) - n, "Session: %s\r\n", session);
+	n += snprintf(req + n, sizeof(req) - n, "\r\n");
+	if (send(rtsp_fd, req, n, MSG_NOSIGNAL) != n) {
+		fail("%s send failed", method);
+		return 0;
+	}
+	while (1) {
+		while (buf_len > 0 && buf[0] == '$')
+			if (interleaved_packet(pkt, &channel) < 0)
+				break;
+		if (   buf_len > 0 && buf[0] != '$'
+		    && (end = memmem(buf, buf_len, "\r\n\r\n", 4)) != NULL
+		   )
+			break;
+		if (!read_more(rtsp_fd)) {
+			fail("no reply to %s", method);
+			return 0;
+		}
+	}
+	hlen = end + 4 - buf;
+	if (hlen >= REPLY_SIZE) {
+		fail("%s reply too long", method);
+		return 0;
+	}
+	memcpy(reply, buf, hlen);
+	reply[hlen] = '\0';
+	if ((s = strcasestr(reply, "Content-Length:")) != NULL)
+		clen = atoi(s + 15);
+	if (hlen + clen >= REPLY_SIZE) {
+		fail("%s reply too long", method);
+		return 0;
+	}
+	while (buf_len < hlen + clen)
+		if (!read_more(rtsp_fd)) {
+			fail("%s reply body short", method);
+			return 0;
+		}
+	memcpy(reply, buf, hlen + clen);
+	reply[hlen + clen] = '\0';
+	buf_consume(hlen + clen);
+	if (strncmp(reply, "RTSP/1.0 200 ", 13) != 0) {
+		fail("%s: %.*s", method, (int) strcspn(reply, "\r\n"), reply);
+		return 0;
+	}
+	return 1;
+}
+
+static int base64_decode(char *in, int len, uint8_t *out)
+{
+	static char b64[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint32_t v = 0;
+	int i, bits = 0, n = 0;
+	char *p;
+
+	for (i = 0; i < len && in[i] != '='; ++i) {
+		if ((p = strchr(b64, in[i])) == NULL || *p == '\0')
+			return -1;
+		v = (v << 6) | (p - b64);
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			out[n++] = v >> bits;
+		}
+	}
+	return n;
+}
+
+static void sdp_check(char *sdp)
+{
+	uint8_t sps[256], pps[256];
+	char *s, *comma, profile[8];
+	int sps_len, pps_len, len;
+
+	if (!strstr(sdp, "m=video 0 RTP/AVP 96\r\n"))
+		fail("SDP has no H264 video media line");
+	if (!strstr(sdp, "packetization-mode=1"))
+		fail("SDP is not packetization-mode=1");
+	if ((s = strstr(sdp, "sprop-parameter-sets=")) == NULL
+	    || (comma = strchr(s, ',')) == NULL) {
+		fail("SDP has no sprop-parameter-sets");
+		return;
+	}
+	s += 21;
+	len = strcspn(comma + 1, ";\r\n");
+	if (comma - s > 340 || len > 340) {
+		fail("SDP sprop-parameter-sets too long");
+		return;
+	}
+	sps_len = base64_decode(s, comma - s, sps);
+	pps_len = base64_decode(comma + 1, len, pps);
+	if (sps_len < 4 || (sps[0] & 0x1f) != NAL_TYPE_SPS)
+		fail("SDP sprop-parameter-sets has no SPS");
+	else if (pps_len < 1 || (pps[0] & 0x1f) != NAL_TYPE_PPS)
+		fail("SDP sprop-parameter-sets has no PPS");
+	else {
+		snprintf(profile, sizeof(profile), "%02X%02X%02X",
+			sps[1], sps[2], sps[3]);
+		if ((s = strstr(sdp, "profile-level-id=")) == NULL
+		    || strncasecmp(s + 17, profile, 6) != 0)
+			fail("SDP profile-level-id does not match the SPS %s", profile);
+	}
+}
+
+static int src_load(char *path)
+{
+	FILE *f;
+	long size;
+	int i, start = -1, alloc = 0;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return 0;
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	src = malloc(size + 3);
+	if (!src || fread(src, 1, size, f) != size) {
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	memcpy(src + size, "\0\0\1", 3);	/* ends the last NAL unit */
+	for (i = 0; i + 3 <= size + 3; ++i) {
+		if (src[i] || src[i + 1] || src[i + 2] != 1)
+			continue;
+		if (start >= 0) {
+			if (n_src == alloc) {
+				alloc = alloc ? alloc * 2 : 1024;
+				src_start = realloc(src_start, alloc * sizeof(int));
+				src_length = realloc(src_length, alloc * sizeof(int));
+			}
+			src_start[n_src] = start;
+			src_length[n_src] = i - start;
+			while (src_length[n_src] > 0 && !src[start + src_length[n_src] - 1])
+				src_length[n_src]--;	/* zero of a 4 byte start code */
+			n_src++;
+		}
+		start = i + 3;
+		i += 2;
+	}
+	return 1;
+}
+
+static int src_find(uint8_t *data, int len)
+{
+	int i;
+
+	for (i = 0; i < n_src; ++i)
+		if (src_length[i] == len && !memcmp(src + src_start[i], data, len))
+			return 1;
+	return 0;
+}
+
+static void nal_check(uint8_t *data, int len)
+{
+	static int first_types[] = { NAL_TYPE_SPS, NAL_TYPE_PPS, NAL_TYPE_IDR };
+
+	if (n_nals < 3 && (data[0] & 0x1f) != first_types[n_nals])
+		fail("NAL unit %d is type %d, the stream must start SPS, PPS, IDR",
+			n_nals, data[0] & 0x1f);
+	n_nals++;
+	if (!src)
+		return;
+	if (src_find(data, len))
+		n_matched++;
+	else
+		fail("NAL unit %d (type %d, %d bytes) is not in the replayed video",
+			n_nals - 1, data[0] & 0x1f, len);
+}
+
+static void rtp_check(uint8_t *p, int len)
+{
+	uint8_t *pl = p + 12;
+	uint16_t seq;
+	uint32_t ts, s;
+	int pl_len = len - 12, type;
+
+	n_packets++;
+	if (len < 14 || (p[0] >> 6) != 2 || (p[0] & 0x3f) != 0) {
+		fail("packet %d: bad RTP header", n_packets);
+		return;
+	}
+	if ((p[1] & 0x7f) != RTP_PT)
+		fail("packet %d: payload type %d", n_packets, p[1] & 0x7f);
+	seq = (p[2] << 8) | p[3];
+	ts = ((uint32_t) p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+	s = ((uint32_t) p[8] << 24) | (p[9] << 16) | (p[10] << 8) | p[11];
+	if (!have_seq)
+		ssrc = s;
+	else {
+		if (s != ssrc)
+			fail("packet %d: SSRC changed", n_packets);
+		if (seq != (uint16_t) (last_seq + 1)) {
+			fail("packet %d: sequence %u after %u", n_packets, seq, last_seq);
+			n_gaps++;
+			in_fu = 0;
+		}
+		if (in_frame && ts != frame_ts)
+			fail("packet %d: timestamp changed within a frame", n_packets);
+	}
+	have_seq = 1;
+	last_seq = seq;
+	frame_ts = ts;
+	in_frame = !(p[1] & 0x80);
+
+	type = pl[0] & 0x1f;
+	if (type == NAL_TYPE_FU_A) {
+		if (pl[1] & 0x80) {
+			if (in_fu)
+				fail("packet %d: FU-A start inside a fragmented NAL unit",
+					n_packets);
+			nal[0] = (pl[0] & 0xe0) | (pl[1] & 0x1f);
+			nal_len = 1;
+			in_fu = 1;
+		} else if (!in_fu) {
+			fail("packet %d: FU-A fragment without a start", n_packets);
+			return;
+		}
+		if (nal_len + pl_len - 2 > NAL_MAX) {
+			fail("packet %d: FU-A NAL unit too long", n_packets);
+			in_fu = 0;
+			return;
+		}
+		memcpy(nal + nal_len, pl + 2, pl_len - 2);
+		nal_len += pl_len - 2;
+		if (pl[1] & 0x40) {
+			in_fu = 0;
+			nal_check(nal, nal_len);
+		}
+	} else if (type >= 1 && type <= 23) {
+		if (in_fu) {
+			fail("packet %d: NAL unit inside a fragmented one", n_packets);
+			in_fu = 0;
+		}
+		nal_check(pl, pl_len);
+	} else
+		fail("packet %d: unexpected NAL unit type %d", n_packets, type);
+
+	if (p[1] & 0x80) {
+		if (in_fu)
+			fail("packet %d: frame marker inside a fragmented NAL unit",
+				n_packets);
+		if (have_ts && (int32_t) (ts - last_ts) <= 0)
+			fail("packet %d: frame timestamp did not advance", n_packets);
+		have_ts = 1;
+		last_ts = ts;
+		n_frames++;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static uint8_t pkt[65536];
+	struct sockaddr_in addr;
+	struct pollfd pfd;
+	char host[64], reply[REPLY_SIZE], track[512], headers[256];
+	char *url, *s;
+	int port = 554, tcp, seconds, len, channel, rcvbuf = 4 << 20;
+	time_t t_end;
+
+	if (argc < 4 || (strcmp(argv[2], "tcp") && strcmp(argv[2], "udp"))) {
+		fprintf(stderr, "usage: %s rtsp://host:port/ tcp|udp seconds [video.h264]\n",
+			argv[0]);
+		return 2;
+	}
+	url = argv[1];
+	tcp = !strcmp(argv[2], "tcp");
+	seconds = atoi(argv[3]);
+	if (argc > 4 && !src_load(argv[4])) {
+		fprintf(stderr, "rtsp_test: cannot read %s\n", argv[4]);
+		return 2;
+	}
+	if (sscanf(url, "rtsp://%63[^:/]:%d", host, &port) < 1) {
+		fprintf(stderr, "rtsp_test: bad URL %s\n", url);
+		return 2;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_aton(host, &addr.sin_addr) == 0
+	    || (rtsp_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0
+	    || connect(rtsp_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "rtsp_test: cannot connect to %s\n", url);
+		return 1;
+	}
+
+	if (   !request("OPTIONS", url, NULL, reply)
+	    || !request("DESCRIBE", url, "Accept: application/sdp\r\n", reply)
+	   )
+		return 1;
+	if ((s = strstr(reply, "\r\n\r\n")) != NULL)
+		sdp_check(s + 4);
+
+	if (tcp)
+		snprintf(headers, sizeof(headers),
+			"Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n");
+	else {
+		udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+		setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+		addr.sin_port = htons(UDP_PORT);
+		if (bind(udp_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+			fprintf(stderr, "rtsp_test: cannot bind UDP port %d\n", UDP_PORT);
+			return 1;
+		}
+		snprintf(headers, sizeof(headers),
+			"Transport: RTP/AVP;unicast;client_port=%d-%d\r\n",
+			UDP_PORT, UDP_PORT + 1);
+	}
+	len = strcspn(url, "?");
+	snprintf(track, sizeof(track), "%.*s%strack1", len, url,
+		url[len - 1] == '/' ? "" : "/");
+	if (!request("SETUP", track, headers, reply))
+		return 1;
+	if ((s = strstr(reply, "Session: ")) == NULL) {
+		fail("SETUP reply has no session");
+		return 1;
+	}
+	snprintf(session, sizeof(session), "%.*s", (int) strcspn(s + 9, ";\r\n"), s + 9);
+	if (!request("PLAY", url, "Range: npt=0.000-\r\n", reply))
+		return 1;
+
+	t_end = time(NULL) + seconds;
+	while (time(NULL) < t_end && n_failures < 10) {
+		if (tcp) {
+			if ((len = interleaved_packet(pkt, &channel)) < 0) {
+				fail("interleaved stream ended or broken");
+				break;
+			}
+			if (channel != 0)
+				continue;
+		} else {
+			pfd.fd = udp_fd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, TIMEOUT_MSEC) <= 0) {
+				fail("no RTP packets");
+				break;
+			}
+			if ((len = recv(udp_fd, pkt, sizeof(pkt), 0)) < 0)
+				continue;
+		}
+		rtp_check(pkt, len);
+	}
+	request("TEARDOWN", url, NULL, reply);
+
+	if (n_frames == 0)
+		fail("no frames");
+	printf("rtsp_test: %s %d packets, %d NAL units", argv[2], n_packets, n_nals);
+	if (src)
+		printf(" (%d in %s)", n_matched, argv[4]);
+	printf(", %d frames, %d sequence gaps: %s\n", n_frames, n_gaps,
+		n_failures ? "FAILED" : "OK");
+	return n_failures ? 1 : 0;
+}
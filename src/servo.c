@@ -27,7 +27,6 @@
 #include "pikrellcam.h"
 #include <stdint.h>
 #include <sys/mman.h>
-#include <wiringPiI2C.h>
 #include "pca9685.h"
 
 #define PI_1_PERIPHERAL_BASE	0x20000000
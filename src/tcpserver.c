@@ -2,7 +2,7 @@
 // TCP Stream Server for Pikrellcam
 // V1.0  2015-12-07
 // Thomas Götz
-// 
+//
 // Goal:
 // Live preview of the h264 Full HD Camera Stream
 //
@@ -11,170 +11,387 @@
 // Maybe there is a better solution, like a further Pipeline which gets the h264 live stream and sends it.
 // Maybe also multiple streams possible with different resolution (full, medium, mobile, ...)
 //
-// use with gst-rtsp-server-1.4.4 on Raspbian Jessie (on Wheezy I didn't get gst-rtsp-server built) or 
+// use with gst-rtsp-server-1.4.4 on Raspbian Jessie (on Wheezy I didn't get gst-rtsp-server built) or
 // gst-variable-rtsp-server (look for gst-gateworks-apps-master)
 // and the following pipeline (!! do-timestamp=true is important !!, blocksize=262144 optional, can be lower)
 //
-// ./gst-variable-rtsp-server -d 99 -p 8555 -m /stream  
-//   -u "(tcpclientsrc port=3000 do-timestamp=true blocksize=262144 
-//   ! video/x-h264,stream-format=byte-stream,profile=high 
-//   ! h264parse ! rtph264pay name=pay0 pt=96 )" 
+// ./gst-variable-rtsp-server -d 99 -p 8555 -m /stream
+//   -u "(tcpclientsrc port=3000 do-timestamp=true blocksize=262144
+//   ! video/x-h264,stream-format=byte-stream,profile=high
+//   ! h264parse ! rtph264pay name=pay0 pt=96 )"
 //
 // then open the stream, e.g. vlc rtsp://your_pi_addr:8555/stream
 //
 // delay between live and stream is ~ 1 sec.
 // CPU load with 1 active full hd stream is ~10% on a PI2 (4 Cores, 100% load is 400% displayed with 'top')
 //
+// Up to MAX_CLIENTS clients are served by one thread.  Each client gets the
+// SPS/PPS header and then frames from the latest keyframe, read out of the
+// video circular buffer with its own frame cursor (see video_stream.c), so
+// the h264 encoder callback never waits on a client.
+//
+// A client may first send an HTTP request, e.g. curl http://pi:3000/?ago=10,
+// and is then answered with an HTTP header and the stream starting at the
+// keyframe nearest 10 seconds ago, sent as fast as the client takes it until
+// it has caught up to live.  Clients sending nothing get the live stream
+// after START_WAKEUPS frames.
+//
 //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 
 
 #include "pikrellcam.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/poll.h>
-#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <unistd.h>
-#include <netdb.h>
-#include <signal.h>
-#include <fcntl.h>
-#include <arpa/inet.h>  
-
-#define SERV_PORT 3000  //port
-#define LISTENQ 1       //maximum number of client connections
-
-extern PiKrellCam	pikrellcam;
-
-int listenfd, connfd, num_sent=0;
-socklen_t clilen;
-struct sockaddr_in cliaddr, servaddr;
-long save_fd;
-int h264_conn_status=H264_TCP_WAIT_FOR_CONNECT;
-  
-void setup_h264_tcp_server(void)
+#include <arpa/inet.h>
+
+#define SERV_PORT	3000
+#define LISTENQ		4
+#define MAX_CLIENTS	8
+#define MAX_EVENTS	16
+#define CLIENT_TIMEOUT	10	/* seconds without send progress */
+#define START_WAKEUPS	3	/* frames to wait for a request */
+#define REQUEST_SIZE	512
+
+#define HTTP_RESPONSE	"HTTP/1.0 200 OK\r\n" \
+			"Content-Type: video/h264\r\n" \
+			"Cache-Control: no-cache\r\n\r\n"
+
+struct h264_client {
+	int fd;
+	struct sockaddr_in addr;
+	uint8_t header[sizeof(HTTP_RESPONSE) + H264_MAX_HEADER_SIZE];
+	int header_len, header_sent;
+	char request[REQUEST_SIZE];
+	int request_len;
+	int started, wakeups;
+	int http;			/* HTTP response not yet sent */
+	VideoStreamCursor cursor;
+	VideoFrame frame;		/* being sent */
+	int in_frame, done;
+	int blocked, dead;
+	time_t t_progress;
+};
+
+static int listen_fd = -1;
+static int epoll_fd = -1;
+static int wake_fd = -1;
+static struct h264_client *clients[MAX_CLIENTS];
+
+static void client_close(struct h264_client *c, char *why)
+{
+	if (c->dead)
+		return;
+	log_printf("h264 stream: closing %s:%u, %s (skipped %d times)\n",
+		inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), why, c->cursor.skips);
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->dead = 1;
+}
+
+static void client_set_blocked(struct h264_client *c, int blocked)
+{
+	struct epoll_event ev;
+
+	if (c->blocked == blocked)
+		return;
+	ev.events = EPOLLIN | (blocked ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->blocked = blocked;
+}
+
+/*
+ * Returns 0 when nothing more can be sent now.  The header goes before the
+ * first keyframe, and again after the stream restarts with a new one.
+ */
+static int client_next_frame(struct h264_client *c)
+{
+	int n = 0;
+
+	switch (video_stream_next(&c->cursor, &c->frame)) {
+	case VIDEO_STREAM_WAIT:
+		return 0;
+	case VIDEO_STREAM_RESTART:
+		if (c->header_sent >= 0)
+			break;
+		if (c->http) {
+			n = sizeof(HTTP_RESPONSE) - 1;
+			memcpy(c->header, HTTP_RESPONSE, n);
+			c->http = 0;
+		}
+		c->header_len = n + video_stream_header(c->header + n);
+		c->header_sent = 0;
+		break;
+	}
+	c->in_frame = 1;
+	c->done = 0;
+	return 1;
+}
+
+/* Send as much as the socket takes without blocking. */
+static void client_send(struct h264_client *c)
+{
+	VideoCircularBuffer *vcb = &video_circular_buffer;
+	struct iovec iov[3];
+	struct msghdr msg;
+	int n_iov;
+	ssize_t n;
+
+	pthread_rwlock_rdlock(&vcb->stream_lock);
+	if (video_stream_new_generation(&c->cursor)) {
+		/* new video size or bitrate, start over with the new header */
+		c->header_sent = -1;
+		c->in_frame = 0;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	while (c->in_frame || client_next_frame(c)) {
+		n_iov = 0;
+		if (c->header_sent >= 0 && c->header_sent < c->header_len) {
+			iov[0].iov_base = c->header + c->header_sent;
+			iov[0].iov_len = c->header_len - c->header_sent;
+			n_iov = 1;
+		}
+		else if (!video_stream_valid(&c->frame, c->done)) {
+			/* the rest of a partly sent frame is gone */
+			client_close(c, "fell behind");
+			break;
+		}
+		n_iov += video_stream_iov(&c->frame, c->done, iov + n_iov);
+		msg.msg_iovlen = n_iov;
+		n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				client_set_blocked(c, 1);
+			else if (errno != EINTR)
+				client_close(c, strerror(errno));
+			break;
+		}
+		c->t_progress = time(NULL);
+		if (c->header_sent >= 0 && c->header_sent < c->header_len) {
+			int h = MIN((int) n, c->header_len - c->header_sent);
+
+			c->header_sent += h;
+			n -= h;
+		}
+		c->done += n;
+		if (c->done == c->frame.length) {
+			c->in_frame = 0;
+			c->cursor.seq++;
+		}
+	}
+	if (!c->dead && !c->in_frame)
+		client_set_blocked(c, 0);
+	pthread_rwlock_unlock(&vcb->stream_lock);
+}
+
+static void client_start(struct h264_client *c)
+{
+	c->started = 1;
+	c->cursor.catch_up = (c->cursor.ago > 0);
+	if (c->http || c->cursor.ago > 0)
+		log_printf("h264 stream: %s:%u requested%s, %d seconds ago\n",
+			inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port),
+			c->http ? " over HTTP" : "", c->cursor.ago);
+	client_send(c);
+}
+
+/*
+ * Collect a "GET /?ago=N HTTP/1.x" request up to its blank line.  Anything
+ * not starting like a GET starts the live stream right away.
+ */
+static void client_request(struct h264_client *c, char *buf, int len)
+{
+	char *s;
+
+	len = MIN(len, REQUEST_SIZE - 1 - c->request_len);
+	memcpy(c->request + c->request_len, buf, len);
+	c->request_len += len;
+	c->request[c->request_len] = '\0';
+
+	if (strncmp(c->request, "GET ", MIN(c->request_len, 4)) != 0) {
+		client_start(c);
+		return;
+	}
+	if (   !strstr(c->request, "\r\n\r\n") && !strstr(c->request, "\n\n")
+	    && c->request_len < REQUEST_SIZE - 1
+	   )
+		return;
+	c->http = 1;
+	s = strchr(c->request + 4, ' ');
+	if (s)
+		*s = '\0';
+	if ((s = strstr(c->request + 4, "ago=")) != NULL)
+		c->cursor.ago = MAX(0, atoi(s + 4));
+	client_start(c);
+}
+
+static void add_new_connection(void)
 {
- //creation of the socket
- listenfd = socket (AF_INET, SOCK_STREAM, 0);
-
- //preparation of the socket address
- servaddr.sin_family = AF_INET;
- //servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
- servaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
- servaddr.sin_port = htons(SERV_PORT);
- 
- int reuse = 1;
- if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) < 0)
- {
-    perror("Server: setsockopt(SO_REUSEADDR) failed\n");
-    log_printf("Server: setsockopt(SO_REUSEADDR) failed\n");
-    return;
- }
- 
-  #ifdef SO_REUSEPORT
-  if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse)) < 0) 
-  {
-    perror("Server: setsockopt(SO_REUSEPORT) failed\n");
-    log_printf("Server: setsockopt(SO_REUSEPORT) failed\n");
-    return;
-  }
-  #endif
- 
- if(bind (listenfd, (struct sockaddr *) &servaddr, sizeof(servaddr))<0);
- { 
-//    perror("Server: error binding\n");
-    log_printf("Server: error binding\n");  
-    //return;
- } 
-
- listen (listenfd, LISTENQ);
-
- save_fd = fcntl( listenfd, F_GETFL );
- save_fd |= O_NONBLOCK;
- fcntl( listenfd, F_SETFL, save_fd );
- 
-
-// fprintf(stderr,"%s\n","Server running...waiting for connections.");
- log_printf("Server running...waiting for connections.\n");  
+	struct sockaddr_in addr;
+	socklen_t size = sizeof(addr);
+	struct h264_client *c;
+	struct epoll_event ev;
+	int fd, i;
+
+	fd = accept4(listen_fd, (struct sockaddr *) &addr, &size,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+	for (i = 0; i < MAX_CLIENTS; ++i)
+		if (!clients[i])
+			break;
+	if (i == MAX_CLIENTS || (c = calloc(1, sizeof(*c))) == NULL) {
+		log_printf("h264 stream: too many clients, refusing %s\n",
+			inet_ntoa(addr.sin_addr));
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	c->addr = addr;
+	video_stream_cursor_init(&c->cursor, TRUE);
+	c->header_sent = -1;
+	c->t_progress = time(NULL);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		close(fd);
+		free(c);
+		return;
+	}
+	clients[i] = c;
+	log_printf("h264 stream: connect from host %s, port %u.\n",
+		inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
 }
 
+static void* h264_server(void *unused)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct h264_client *c;
+	char buf[256];
+	uint64_t count;
+	time_t t_now;
+	int i, n, new_frame;
+
+	while (1) {
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			log_printf("h264 stream: epoll failure: %s\n", strerror(errno));
+			break;
+		}
+		new_frame = 0;
+		for (i = 0; i < n; ++i) {
+			if (events[i].data.ptr == &listen_fd) {
+				add_new_connection();
+				continue;
+			}
+			if (events[i].data.ptr == &wake_fd) {
+				if (read(wake_fd, &count, sizeof(count)) > 0)
+					new_frame = 1;
+				continue;
+			}
+			c = events[i].data.ptr;
+			if (!c->dead && (events[i].events & (EPOLLERR | EPOLLHUP)))
+				client_close(c, "hangup");
+			if (!c->dead && (events[i].events & EPOLLIN)) {
+				/* after the request, read only to see clients close */
+				ssize_t r = read(c->fd, buf, sizeof(buf));
+
+				if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+					client_close(c, "client closed");
+				else if (r > 0 && !c->started)
+					client_request(c, buf, r);
+			}
+			if (!c->dead && (events[i].events & EPOLLOUT))
+				client_send(c);
+		}
 
-void tcp_poll_connect(void)
+		t_now = time(NULL);
+		for (i = 0; i < MAX_CLIENTS; ++i) {
+			if ((c = clients[i]) == NULL)
+				continue;
+			if (   !c->dead && new_frame && !c->started
+			    && ++c->wakeups >= START_WAKEUPS
+			   )
+				client_start(c);
+			else if (!c->dead && new_frame && !c->blocked && c->started)
+				client_send(c);
+			if (!c->dead && c->blocked && t_now - c->t_progress > CLIENT_TIMEOUT)
+				client_close(c, "send timeout");
+			if (c->dead) {
+				free(c);
+				clients[i] = NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Called from the h264 callback at each frame end, never blocks. */
+void h264_server_notify(void)
 {
-    if((h264_conn_status == H264_TCP_WAIT_FOR_CONNECT))
-    {  
-      clilen = sizeof(cliaddr);
-      connfd = accept (listenfd, (struct sockaddr *) &cliaddr, &clilen);
-    
-      if (connfd <=0)
-      {
-        if (pikrellcam.debug)
-          printf("Poll: Kein Client am Socket ...\n");
-      }
-      else
-      {
-        h264_conn_status=H264_TCP_SEND_HEADER; //must send header
-        num_sent=0;
-//        fprintf (stderr, "Server: connect from host %s, port %u.\n",
-//                    inet_ntoa (cliaddr.sin_addr),
-//                    ntohs (cliaddr.sin_port));
-        log_printf("Server: connect from host %s, port %u.\n",
-                    inet_ntoa (cliaddr.sin_addr),
-                    ntohs (cliaddr.sin_port));            
-      }
-    }      
+	uint64_t one = 1;
+
+	if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		log_printf("h264 stream: wakeup failed: %s\n", strerror(errno));
 }
 
+void setup_h264_tcp_server(void)
+{
+	struct sockaddr_in servaddr;
+	struct epoll_event ev;
+	pthread_t tid;
+	int reuse = 1;
 
-void tcp_send_h264_header(void *data, int len)
-  {
-     if(h264_conn_status != H264_TCP_WAIT_FOR_CONNECT)
-      {        
-        if(h264_conn_status == H264_TCP_SEND_HEADER) 
-        {
-          num_sent=send(connfd, data, len, MSG_NOSIGNAL);
-          h264_conn_status=H264_TCP_SEND_DATA;
-          if (pikrellcam.debug)
-            printf("write h264 header:%d \n",len);
-          
-         if (num_sent < 0 || num_sent !=len) 
-          {
-            perror("Server: Client connection closed\n");
-            log_printf("Server: Client connection closed\n");
-            shutdown(connfd, SHUT_RDWR); 
-            close(connfd);
-            h264_conn_status=H264_TCP_WAIT_FOR_CONNECT;
-          }
-        }
-      }
-  }
-  
- void tcp_send_h264_data(char * what, void *data, int len)
-  {
-    if(h264_conn_status != H264_TCP_WAIT_FOR_CONNECT)
-    {  
-      if(h264_conn_status == H264_TCP_SEND_DATA)
-      {
-        num_sent=send(connfd, data,len, MSG_NOSIGNAL);
-        if (pikrellcam.debug)
-          printf("write tcp %s:%d \n",what, len);
-        if (num_sent < 0 || num_sent !=len) 
-        {
-          perror("Server: Client connection closed\n");
-          log_printf("Server: Client connection closed\n");
-          close(connfd);
-          h264_conn_status=H264_TCP_WAIT_FOR_CONNECT;
-          return;
-        }
-      }        
-  
-    }
-  }
-  
-  
-  
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		log_printf("h264 stream: socket failed: %s\n", strerror(errno));
+		return;
+	}
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
+	memset(&servaddr, 0, sizeof(servaddr));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	servaddr.sin_port = htons(SERV_PORT);
+	if (   bind(listen_fd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0
+	    || listen(listen_fd, LISTENQ) < 0
+	   ) {
+		log_printf("h264 stream: bind/listen port %d failed: %s\n",
+			SERV_PORT, strerror(errno));
+		close(listen_fd);
+		listen_fd = -1;
+		return;
+	}
 
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd < 0 || wake_fd < 0) {
+		log_printf("h264 stream: epoll setup failed: %s\n", strerror(errno));
+		wake_fd = -1;
+		return;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listen_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	ev.data.ptr = &wake_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
 
+	if (pthread_create(&tid, NULL, h264_server, NULL) != 0) {
+		log_printf("h264 stream: thread create failed\n");
+		return;
+	}
+	pthread_detach(tid);
+	log_printf("Server running...waiting for connections.\n");
+}
@@ -6,8 +6,11 @@
  * by accessing http://<YOUR_IP>:8081/mjpeg_live.php or Andriod MJPEG viewer apps
  * (tinycam monitor etc).
  *
- * Eventhough the server is designed to work with single producer and consumer mind but we do
- * not refuse the connection from more than one clients.
+ * Each frame is written once and every connected client sends it from
+ * there at its own pace, as an HTTP multipart stream or as snapshots,
+ * so nginx can proxy to it directly.  One epoll thread serves all clients with
+ * non-blocking sockets, so the thread count and memory stay bounded no
+ * matter how many viewers connect or how slow they are.
  */
 
 #include "pikrellcam.h"
@@ -18,168 +21,374 @@
 #include <errno.h>
 #include <pthread.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 
-#define MAX_WIDTH	1920
-#define MAX_HEIGHT	1080
-#define MAX_IMAGE_SIZE	(MAX_WIDTH * MAX_HEIGHT * 1.5) /* worst case compression */
 #define SERVER_PORT	9999
 #define MAX_BUF_SIZE	1024
-#define NUM_CIRC_BUFS	2
+#define MAX_HEADER_SIZE	512
+#define MAX_CLIENTS	32
+#define MAX_EVENTS	16
+#define CLIENT_TIMEOUT	30	/* seconds without send progress */
 
-struct buffer {
-	int len;
-	char *data;
+#define NO_CACHE_HEADERS	"Cache-Control: no-cache, no-store, must-revalidate\r\n" \
+				"Pragma: no-cache\r\n" \
+				"Expires: 0\r\n"
+
+/*
+ * Clients speak HTTP.  GET /stream (or /) is a multipart/x-mixed-replace
+ * stream of the latest frames and GET /snapshot.jpg is the next frame,
+ * on a keep-alive connection.  A client sends one response part at a
+ * time, a header plus a frame, tracking its offset into both.  A stream
+ * goes on to the latest frame when a part is done, skipping any it fell
+ * behind on while sending.  Frames are referenced from the mjpeg ring
+ * (mjpeg_ring.c), so at most MJPEG_RING_FRAMES + MAX_CLIENTS exist.
+ */
+enum client_mode {
+	CLIENT_IDLE,		/* waiting for a request */
+	CLIENT_REPLY,		/* sending a reply without a frame */
+	CLIENT_SNAPSHOT,
+	CLIENT_STREAM,
 };
 
 struct client_info {
 	int fd;
 	struct sockaddr_in sockaddr;
+	enum client_mode mode;
+	int keep_alive;
+	int started;			/* stream response header sent */
+	char request[MAX_BUF_SIZE];
+	int request_len;
+	char header[MAX_HEADER_SIZE];
+	int header_len;
+	MjpegFrame *frame;		/* being sent, NULL for none */
+	unsigned int seq;		/* of the last frame taken */
+	int offset;			/* into header + frame */
+	int blocked;			/* waiting for EPOLLOUT */
+	int dead;
+	time_t t_progress;
 };
 
 static int server_fd;
-static int head, tail;
+static int epoll_fd;
+static int wake_fd = -1;	/* eventfd signalled when a frame is published */
 static pthread_t handler_tid;
-static struct buffer buffers[NUM_CIRC_BUFS];
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct client_info *clients[MAX_CLIENTS];
 
 static int new_connection_log_count;
 
-/* returned a new buffer, after use the buffer must be free'd with image_buffer_free() */
-static struct buffer* client_queue_get()
+static void client_set_mode(struct client_info *c, enum client_mode mode)
 {
-	struct buffer *buf;
+	MjpegFrame *frame;
 
-	buf = calloc(1, sizeof(*buf));
-	if (!buf)
-		return NULL;
+	/* start on the next frame, not a stale one */
+	if (   (mode == CLIENT_SNAPSHOT || mode == CLIENT_STREAM)
+	    && (frame = mjpeg_frame_latest(0)) != NULL) {
+		c->seq = frame->seq;
+		mjpeg_frame_unref(frame);
+	}
+	c->mode = mode;
+}
 
-	buf->data = malloc(MAX_IMAGE_SIZE);
-	if (!buf->data) {
-		free(buf);
-		return NULL;
+/*
+ * Reference the latest frame if the client has not taken it yet and
+ * make the header to send with it.
+ */
+static int client_frame_get(struct client_info *c)
+{
+	int len = 0;
+
+	if (c->mode != CLIENT_SNAPSHOT && c->mode != CLIENT_STREAM)
+		return 0;
+
+	if ((c->frame = mjpeg_frame_latest(c->seq)) == NULL)
+		return 0;
+	c->seq = c->frame->seq;
+
+	if (c->mode == CLIENT_SNAPSHOT) {
+		len = snprintf(c->header, MAX_HEADER_SIZE,
+				"HTTP/1.1 200 OK\r\n"
+				"Content-Type: image/jpeg\r\n"
+				"Content-Length: %d\r\n"
+				NO_CACHE_HEADERS
+				"Connection: %s\r\n\r\n",
+				c->frame->length, c->keep_alive ? "keep-alive" : "close");
+	} else {
+		if (!c->started)
+			len = snprintf(c->header, MAX_HEADER_SIZE,
+				"HTTP/1.1 200 OK\r\n"
+				"Content-Type: multipart/x-mixed-replace; boundary=fooboundary\r\n"
+				NO_CACHE_HEADERS
+				"Connection: close\r\n\r\n");
+		len += snprintf(c->header + len, MAX_HEADER_SIZE - len,
+				"%s--fooboundary\r\n"
+				"Content-Type: image/jpeg\r\n"
+				"Content-Length: %d\r\n\r\n",
+				c->started ? "\r\n" : "", c->frame->length);
+		c->started = 1;
 	}
+	c->header_len = len;
+	c->offset = 0;
+	return 1;
+}
 
-	pthread_mutex_lock(&mutex);
-	if (head == tail) /* queue is empty */
-		pthread_cond_wait(&cond, &mutex);
-	buf->len = buffers[head].len;
-	memcpy(buf->data, buffers[head].data, buf->len);
-	head = (head + 1) % NUM_CIRC_BUFS;
-	pthread_mutex_unlock(&mutex);
+static void client_frame_put(struct client_info *c)
+{
+	mjpeg_frame_unref(c->frame);
+	c->frame = NULL;
+}
 
-	return buf;
+static void client_reply(struct client_info *c, char *status)
+{
+	c->header_len = snprintf(c->header, MAX_HEADER_SIZE,
+			"HTTP/1.1 %s\r\n"
+			"Content-Type: text/plain\r\n"
+			"Content-Length: %d\r\n"
+			"Connection: %s\r\n\r\n%s\n",
+			status, (int) strlen(status) + 1,
+			c->keep_alive ? "keep-alive" : "close", status);
+	c->offset = 0;
+	client_set_mode(c, CLIENT_REPLY);
 }
 
-static void image_buffer_free(struct buffer *buf)
+static void client_set_blocked(struct client_info *c, int blocked)
 {
-	if (buf) {
-		free(buf->data);
-		free(buf);
-	}
+	struct epoll_event ev;
+
+	if (c->blocked == blocked)
+		return;
+	ev.events = EPOLLIN | (blocked ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->blocked = blocked;
+}
+
+/*
+ * The client is freed after the current batch of events is handled in
+ * case there are more events for it.
+ */
+static void client_close(struct client_info *c)
+{
+	if (c->dead)
+		return;
+	if (new_connection_log_count < 30)		/* punt - FIXME */
+		log_printf("closing connection from host '%s' on port '%d'\n",
+			inet_ntoa(c->sockaddr.sin_addr),
+			ntohs(c->sockaddr.sin_port));
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	if (c->frame)
+		client_frame_put(c);
+	client_set_mode(c, CLIENT_IDLE);
+	c->dead = 1;
 }
 
-static void* handle_client(void *args)
+/*
+ * Parse a request when its header is complete.  Only the request line
+ * and the Connection header matter here.
+ */
+static void client_request(struct client_info *c)
 {
-	char *data = NULL;
-	int i, fd;
-	struct client_info *client = args;
-	char header[MAX_BUF_SIZE];
-	struct buffer *buf = NULL;
+	char method[16], path[256], version[16], *end, *eol, *s;
+	int len;
 
-	if (++new_connection_log_count < 30)		/* punt - FIXME */
-		log_printf("new connection from host '%s' on port '%d'\n",
-			inet_ntoa(client->sockaddr.sin_addr),
-			ntohs(client->sockaddr.sin_port));
-
-	/* We had delayed the circular buffer allocation until atleast one client is
-	 * connected to the socket. let allocate the buffer now */
-	for (i = 0; i < NUM_CIRC_BUFS; i++) {
-		/* if the buffer is already allocated by some other client then share it */
-		if (!buffers[i].data) {
-			buffers[i].data = malloc(MAX_IMAGE_SIZE);
-			if (!buffers[i].data) {
-				log_printf("failed to allocate memory %s\n", strerror(errno));
-				goto failed;
-			}
+	c->request[c->request_len] = '\0';
+	if ((end = strstr(c->request, "\r\n\r\n")) == NULL) {
+		if (c->request_len == MAX_BUF_SIZE - 1) {
+			c->keep_alive = 0;
+			client_reply(c, "400 Bad Request");
 		}
+		return;
+	}
+	if (sscanf(c->request, "%15s %255s %15s", method, path, version) != 3) {
+		c->keep_alive = 0;
+		client_reply(c, "400 Bad Request");
+		return;
+	}
+	c->keep_alive = !strcmp(version, "HTTP/1.1");
+	*end = '\0';
+	if ((s = strcasestr(c->request, "\r\nConnection:")) != NULL) {
+		if ((eol = strstr(s + 2, "\r\n")) != NULL)
+			*eol = '\0';
+		if (strcasestr(s, "close"))
+			c->keep_alive = 0;
+		else if (strcasestr(s, "keep-alive"))
+			c->keep_alive = 1;
 	}
-	
-	fd = client->fd;
-
-	while(1) {
-		buf = client_queue_get();
-		if (!buf)
-			goto failed;
-
-		/* send JPEG boundary start header */
-		memset(header, '\0', MAX_BUF_SIZE);
-		snprintf(header, MAX_BUF_SIZE,
-				"\r\n--fooboundary\r\n"
-				"Content-type: image/jpeg\r\n\r\n");
-		if (send(fd, header, strlen(header), MSG_NOSIGNAL) < 0)
-			goto failed;
 
-		/* send image contents */
-		if (send(fd, buf->data, buf->len, MSG_NOSIGNAL) < 0)
-			goto failed;
+	/* keep any pipelined request */
+	len = end + 4 - c->request;
+	memmove(c->request, end + 4, c->request_len - len);
+	c->request_len -= len;
+
+	if ((s = strchr(path, '?')) != NULL)
+		*s = '\0';
+	if (strcmp(method, "GET"))
+		client_reply(c, "405 Method Not Allowed");
+	else if (!strcmp(path, "/") || !strcmp(path, "/stream")) {
+		c->keep_alive = 0;
+		c->started = 0;
+		client_set_mode(c, CLIENT_STREAM);
+	} else if (!strcmp(path, "/snapshot.jpg"))
+		client_set_mode(c, CLIENT_SNAPSHOT);
+	else
+		client_reply(c, "404 Not Found");
+}
 
-		/* we are done with the image buffer */
-		image_buffer_free(buf);
+/*
+ * Send as much as the socket takes without blocking.  This is writev() of
+ * the header and JPEG, as sendmsg() for MSG_NOSIGNAL.
+ */
+static void client_send(struct client_info *c)
+{
+	struct iovec iov[2];
+	struct msghdr msg;
+	int flen;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	while (c->header_len || client_frame_get(c)) {
+		flen = c->frame ? c->frame->length : 0;
+		msg.msg_iovlen = 0;
+		if (c->offset < c->header_len) {
+			iov[0].iov_base = c->header + c->offset;
+			iov[0].iov_len = c->header_len - c->offset;
+			iov[1].iov_base = c->frame ? c->frame->data : NULL;
+			iov[1].iov_len = flen;
+			msg.msg_iovlen = flen ? 2 : 1;
+		} else {
+			iov[0].iov_base = c->frame->data + c->offset - c->header_len;
+			iov[0].iov_len = flen - (c->offset - c->header_len);
+			msg.msg_iovlen = 1;
+		}
+		n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				client_set_blocked(c, 1);
+			else if (errno != EINTR)
+				client_close(c);
+			return;
+		}
+		c->offset += n;
+		c->t_progress = time(NULL);
+		if (c->offset < c->header_len + flen)
+			continue;
+
+		/* response part done */
+		if (c->frame)
+			client_frame_put(c);
+		c->header_len = 0;
+		c->offset = 0;
+		if (c->mode == CLIENT_STREAM)
+			continue;
+		if (!c->keep_alive) {
+			client_close(c);
+			return;
+		}
+		client_set_mode(c, CLIENT_IDLE);
+		client_request(c);
 	}
-failed:
-	if (new_connection_log_count < 30)		/* punt - FIXME */
-		log_printf("closing connection from host '%s' on port '%d'\n",
-			inet_ntoa(client->sockaddr.sin_addr),
-			ntohs(client->sockaddr.sin_port));
-
-	image_buffer_free(buf);
+	client_set_blocked(c, 0);
+}
 
-	if (data)
-		free(data);
-	close(client->fd);
-	free(client);
-	pthread_detach(pthread_self());
-	return NULL;
+/*
+ * Requests are kept while a reply is being sent, so pipelined ones are
+ * handled after it.  A stream takes no more requests, and a client
+ * pipelining more than the request buffer holds is closed after the
+ * current reply.
+ */
+static void client_read(struct client_info *c)
+{
+	char buf[MAX_BUF_SIZE];
+	ssize_t n;
+	int keep;
+
+	keep = (c->mode != CLIENT_STREAM && c->request_len < MAX_BUF_SIZE - 1);
+	if (keep)
+		n = read(c->fd, c->request + c->request_len,
+				MAX_BUF_SIZE - 1 - c->request_len);
+	else
+		n = read(c->fd, buf, sizeof(buf));
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		client_close(c);
+		return;
+	}
+	if (n <= 0)
+		return;
+	if (!keep) {
+		if (c->mode != CLIENT_STREAM && c->mode != CLIENT_IDLE)
+			c->keep_alive = 0;
+		return;
+	}
+	c->request_len += n;
+	c->t_progress = time(NULL);
+	if (c->mode == CLIENT_IDLE) {
+		client_request(c);
+		client_send(c);
+	}
 }
 
 static void add_new_connection (int server_fd)
 {
-	int fd;
-	pthread_t tid;
+	int fd, i;
 	socklen_t size;
 	struct sockaddr_in client;
 	struct client_info *c;
+	struct epoll_event ev;
 
 	size = sizeof(client);
-	fd = accept(server_fd, (struct sockaddr*)&client, &size);
+	fd = accept4(server_fd, (struct sockaddr*)&client, &size,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
 	if (fd < 0) {
-		log_printf("failed to accept");
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			log_printf("accept failed: %s\n", strerror(errno));
 		return;
 	}
 
-	c = calloc(1, sizeof(*c));
-	if (!c)
+	for (i = 0; i < MAX_CLIENTS; ++i)
+		if (!clients[i])
+			break;
+	if (i == MAX_CLIENTS || (c = calloc(1, sizeof(*c))) == NULL) {
+		log_printf("MJPEG server: too many clients, refusing '%s'\n",
+			inet_ntoa(client.sin_addr));
+		close(fd);
 		return;
+	}
+
+	if (++new_connection_log_count < 30)		/* punt - FIXME */
+		log_printf("new connection from host '%s' on port '%d'\n",
+			inet_ntoa(client.sin_addr), ntohs(client.sin_port));
 
 	memcpy(&c->sockaddr, &client, sizeof(struct sockaddr_in));
 	c->fd = fd;
-	pthread_create(&tid, NULL, handle_client, (void*)c);
-
-	return;
+	c->t_progress = time(NULL);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		log_printf("epoll add failed: %s\n", strerror(errno));
+		c->dead = 1;
+		close(fd);
+	}
+	clients[i] = c;
 }
 
 static int create_sock (int port)
 {
 	struct sockaddr_in server;
-	
-	server_fd = socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+
+	/* nonblocking so a connection gone before accept() cannot stall the loop */
+	server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (server_fd < 0) {
 		log_printf("socket create failed: %s\n", strerror(errno));
 		return 1;
 	}
+	setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
 	server.sin_family = AF_INET;
 	server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
@@ -201,25 +410,60 @@ static int create_sock (int port)
 
 static void* handler(void *unused)
 {
-	int i;
-	fd_set active_fd_set, read_fd_set;
-
-	FD_ZERO(&active_fd_set);
-	FD_SET(server_fd, &active_fd_set);
+	struct epoll_event events[MAX_EVENTS];
+	struct client_info *c;
+	uint64_t count;
+	time_t t_now;
+	int i, n, new_frame;
 
 	while(1) {
-		/* block until input arrives on one or more active sockets */
-		read_fd_set = active_fd_set;
-		if (select(FD_SETSIZE, &read_fd_set, NULL, NULL, NULL) < 0) {
-			log_printf("select failure: %s\n", strerror(errno) );
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			log_printf("epoll failure: %s\n", strerror(errno));
 			goto failed;
 		}
 
-		/* service all the socket with input pending */
-		for(i=0; i < FD_SETSIZE; ++i) {
-			if (FD_ISSET(i, &read_fd_set)) {
-				if (i == server_fd)
-					add_new_connection(i);
+		new_frame = 0;
+		for (i = 0; i < n; ++i) {
+			if (events[i].data.ptr == &server_fd) {
+				add_new_connection(server_fd);
+				continue;
+			}
+			if (events[i].data.ptr == &wake_fd) {
+				if (read(wake_fd, &count, sizeof(count)) > 0)
+					new_frame = 1;
+				continue;
+			}
+			c = events[i].data.ptr;
+			if (!c->dead && (events[i].events & (EPOLLERR | EPOLLHUP)))
+				client_close(c);
+			if (!c->dead && (events[i].events & EPOLLIN))
+				client_read(c);
+			if (!c->dead && (events[i].events & EPOLLOUT))
+				client_send(c);
+		}
+
+		/* idle clients start on the new frame, blocked ones get it when
+		 * they are done with the frame they are on.
+		 */
+		t_now = time(NULL);
+		for (i = 0; i < MAX_CLIENTS; ++i) {
+			if ((c = clients[i]) == NULL)
+				continue;
+			if (!c->dead && new_frame && !c->blocked)
+				client_send(c);
+			/* stuck sends, snapshots with no frames coming and idle
+			 * keep-alive connections
+			 */
+			if (   !c->dead && (c->mode != CLIENT_STREAM || c->frame)
+			    && t_now - c->t_progress > CLIENT_TIMEOUT
+			   )
+				client_close(c);
+			if (c->dead) {
+				free(c);
+				clients[i] = NULL;
 			}
 		}
 	}
@@ -229,31 +473,37 @@ failed:
 	return NULL;
 }
 
-char* mjpeg_server_queue_get()
+/* Called from mjpeg_frame_publish(), never blocks. */
+void mjpeg_server_notify(void)
 {
-	return buffers[tail].data;
-}
+	uint64_t one = 1;
 
-void mjpeg_server_queue_put(char *data, int len)
-{
-	pthread_mutex_lock(&mutex);
-	buffers[tail].len = len;
-	tail = (tail + 1) % NUM_CIRC_BUFS;
-	if (tail == head) /* queue is full */
-		head = head + 1;
-	if (head >= NUM_CIRC_BUFS) /* if head reach to end of queue then reset it */
-		head = 0;
-	pthread_cond_broadcast(&cond);
-	pthread_mutex_unlock(&mutex);
+	if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		log_printf("MJPEG server wakeup failed: %s\n", strerror(errno));
 }
 
 int setup_mjpeg_tcp_server()
 {
+	struct epoll_event ev;
+
 	/* create a server socket */
 	if (create_sock(SERVER_PORT))
 		return 1;
 
-	/* spwan a thread to accept connections */
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd < 0 || wake_fd < 0) {
+		wake_fd = -1;
+		log_printf("MJPEG server epoll setup failed: %s\n", strerror(errno));
+		return 1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &server_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev);
+	ev.data.ptr = &wake_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+	/* spwan the one thread serving all clients */
 	pthread_create(&handler_tid, NULL, handler, NULL);
 
         return 0;
@@ -0,0 +1,697 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+#include "pikrellcam.h"
+
+  /* Frame handlers for the data a camera source delivers.  The MMAL
+  |  callbacks in mmalcam.c and the replay source in replay.c call these,
+  |  so nothing here may touch MMAL.  Each handler is only ever called
+  |  from one thread at a time, but the h264, i420, mjpeg and still
+  |  handlers can run on different threads.
+  */
+
+CameraSource	*camera_source;
+
+VideoCircularBuffer video_circular_buffer;
+
+FILE	*still_jpeg_file;
+
+static boolean      motion_frame_event;
+static unsigned int motion_frame_seq;		/* video_seq of the motion frame */
+static boolean      mjpeg_preview_pending;
+static unsigned int mjpeg_preview_seq;
+
+static pthread_mutex_t mjpeg_encoder_count_lock;
+static unsigned int	   mjpeg_encoder_send_count,
+                       mjpeg_encoder_recv_count;
+
+  /* video_seq tags of the I420 frames sent to the mjpeg encoder which
+  |  returns them in order.
+  */
+#define MJPEG_TAGS	8
+static unsigned int	   mjpeg_encoder_tag[MJPEG_TAGS];
+
+
+  /* If video_fps is too high and strains GPU, resized frames to the
+  |  mjpeg encoder may be dropped.  Set debug_fps to 1 to check things... or
+  |  just watch the web mjpeg stream and see it slow down.
+  |  Encoded frames go into the mjpeg ring tagged with the video_seq of the
+  |  motion frame they were drawn from so a preview save gets the exact
+  |  frame without copying the mjpeg.jpg file back.
+  */
+void
+video_mjpeg_data(uint8_t *data, int length, int flags)
+	{
+	static struct timeval  timer;
+	int                    utime;
+	static MjpegFrame      *frame;
+	static boolean         frame_bad;
+	boolean                do_preview_save = FALSE;
+
+	if (!frame && (frame = mjpeg_frame_new()) == NULL)
+		return;
+
+	if (length > 0 && !mjpeg_frame_append(frame, data, length))
+		frame_bad = TRUE;
+
+	if (flags & VIDEO_FLAG_FRAME_END)
+		{
+		if (pikrellcam.debug_fps && (utime = micro_elapsed_time(&timer)) > 0)
+			printf("mjpeg fps %d\n", 1000000 / utime);
+
+		pthread_mutex_lock(&mjpeg_encoder_count_lock);
+		frame->video_seq = mjpeg_encoder_tag[mjpeg_encoder_recv_count % MJPEG_TAGS];
+		++mjpeg_encoder_recv_count;
+		if (   mjpeg_preview_pending
+		    && (int) (frame->video_seq - mjpeg_preview_seq) >= 0
+		   )
+			{
+			mjpeg_preview_pending = FALSE;
+			do_preview_save = TRUE;
+			}
+		pthread_mutex_unlock(&mjpeg_encoder_count_lock);
+
+		if (frame_bad || frame->length == 0)
+			{
+			mjpeg_frame_unref(frame);
+			frame = NULL;
+			frame_bad = FALSE;
+			return;
+			}
+		if (pikrellcam.mjpeg_file_write)
+			mjpeg_frame_save(frame, pikrellcam.mjpeg_filename);
+
+		/* The preview frame is held until event_preview_save() writes it,
+		|  so there is no race with newer frames.  Could just directly save
+		|  it here, but we are inside a GPU callback and I don't want to
+		|  overload the time spent here.
+		*/
+		if (do_preview_save)
+			{
+			mjpeg_preview_frame_set(frame);
+			event_add("motion preview save", pikrellcam.t_now, 0,
+					event_preview_save, NULL);
+			if (motion_frame.do_preview_save_cmd)
+				{
+				event_add("motion area thumb", pikrellcam.t_now, 0,
+						event_motion_area_thumb, NULL);
+				event_add("preview save command", pikrellcam.t_now, 0,
+						event_preview_save_cmd,
+						pikrellcam.on_motion_preview_save_cmd);
+				}
+			motion_frame.do_preview_save_cmd = FALSE;
+			}
+		mjpeg_frame_publish(frame);
+		frame = NULL;
+		}
+	}
+
+
+void
+video_still_data(uint8_t *data, int length, int flags)
+	{
+	int				n;
+	static int		bytes_written;
+
+	if (length && still_jpeg_file)
+		{
+		n = fwrite(data, 1, length, still_jpeg_file);
+		bytes_written += n;
+		if (n != length)
+			{
+			log_printf("video_still_data: file write error.  %m\n");
+			exit(1);
+			}
+		}
+	if ((flags & VIDEO_FLAG_FRAME_END) && still_jpeg_file)
+		{
+		fclose(still_jpeg_file);
+		if (pikrellcam.still_capture_event)
+			event_add("still capture command", pikrellcam.t_now, 0,
+					event_still_capture_cmd,
+					pikrellcam.on_still_capture_cmd);
+		else if (pikrellcam.timelapse_capture_event)
+			{
+			if (bytes_written > 0)
+				time_lapse.sequence += 1;
+			else if (pikrellcam.timelapse_jpeg_last)
+				{
+				unlink(pikrellcam.timelapse_jpeg_last);
+				dup_string(&pikrellcam.timelapse_jpeg_last, "failed");
+				}
+			}
+		pikrellcam.still_capture_event = FALSE;
+		pikrellcam.timelapse_capture_event = FALSE;
+		bytes_written = 0;
+		pikrellcam.state_modified = TRUE;
+		still_jpeg_file = NULL;
+		}
+	}
+
+
+  /* In pikrellcam, resized I420 frames are drawn on before being sent
+  |  on to a jpeg encoder which generates the mjpeg.jpg stream image.
+  |  Motion vectors are queued for the motion worker in video_h264_data()
+  |  and a flag is set there so these two paths can be synchronized so motion
+  |  vectors can be drawn close to the right frame.  A camera source asks video_i420_frame_wanted() for
+  |  each frame and if TRUE, copies the frame into an encoder input buffer,
+  |  calls video_i420_frame_send() to draw on it and then sends it.
+  */
+boolean
+video_i420_frame_wanted(void)
+	{
+	static int	encoder_busy_count;
+
+	if (!motion_frame_event)
+		return FALSE;
+	motion_frame_event = FALSE;
+
+	/* Do not send buffer to encoder if it has not received the previous
+	|  one we sent unless this is the frame we want for a preview save.
+	|  In that case, we may be sending a buffer to preview save before
+	|  the previous buffer is handled.  This is accounted for below.
+	*/
+	if (   mjpeg_encoder_send_count == mjpeg_encoder_recv_count
+	    || motion_frame.do_preview_save
+	   )
+		return TRUE;
+
+	++encoder_busy_count;
+	if (pikrellcam.debug)
+		printf("encoder not clear (%d) -> skipping mjpeg frame.\n",
+			   encoder_busy_count);
+	if (encoder_busy_count > 2)	/* Frame maybe dropped ??, move on */
+		{
+		if (pikrellcam.debug)
+			printf("  Syncing recv/send counts.\n");
+		encoder_busy_count = 0;
+		mjpeg_encoder_recv_count = mjpeg_encoder_send_count;
+		}
+	return FALSE;
+	}
+
+void
+video_i420_frame_send(uint8_t *i420)
+	{
+	display_draw(i420);
+
+	/* The preview is the jpeg encoded from this frame, found by its tag
+	|  when the encoder returns it.
+	*/
+	pthread_mutex_lock(&mjpeg_encoder_count_lock);
+	mjpeg_encoder_tag[mjpeg_encoder_send_count % MJPEG_TAGS] = motion_frame_seq;
+	if (motion_frame.do_preview_save)
+		{
+		mjpeg_preview_seq = motion_frame_seq;
+		mjpeg_preview_pending = TRUE;
+		if (   mjpeg_encoder_send_count != mjpeg_encoder_recv_count
+		    && pikrellcam.debug
+		   )
+			printf("%s: encoder not clear -> preview save delayed\n",
+				fname_base(pikrellcam.video_pathname));
+		}
+	++mjpeg_encoder_send_count;
+	pthread_mutex_unlock(&mjpeg_encoder_count_lock);
+	motion_frame.do_preview_save = FALSE;
+	}
+
+
+  /* Call with vcb locked.
+  */
+void
+circular_buffer_init()
+	{
+	VideoCircularBuffer *vcb = &video_circular_buffer;
+	int					i, seconds, size, n_frames;
+
+	/* When waiting for motion, we need at least pre_capture in the circular
+	|  buffer, and after motion recording starts, we need the event_gap time
+	|  in the buffer.  So make sure either will fit.
+	*/
+	seconds = MAX(pikrellcam.motion_times.event_gap,
+							pikrellcam.motion_times.pre_capture) + 5;
+	size = pikrellcam.camera_adjust.video_bitrate * seconds / 8;
+	vcb->seconds = seconds;
+
+	/* The writer thread may still be writing out of the old buffer and
+	|  live stream readers may be sending from it.  Data not yet queued
+	|  for the writer is dropped with the old buffer.
+	*/
+	video_writer_sync(vcb);
+	pthread_rwlock_wrlock(&vcb->stream_lock);
+	++vcb->stream_generation;
+
+	if (size != vcb->size)
+		{
+		if (vcb->data)
+			free(vcb->data);
+		vcb->data = (int8_t *)malloc(size);
+		log_printf("circular buffer allocate: %.2f MBytes (%d seconds at %.1f Mbits/sec)\n",
+				(float) size / 1000000.0, seconds,
+				(double)pikrellcam.camera_adjust.video_bitrate / 1000000.0);
+		}
+	if (!vcb->data)
+		{
+		log_printf("Aborting because circular buffer malloc() failed.\n");
+		exit(1);
+		}
+	vcb->size = size;
+	vcb->head = 0;
+	vcb->tail = 0;
+
+	/* Size the frame index to hold more frames than can fit in the
+	|  buffer seconds.  Keep seq numbers going across reinits, but make
+	|  every entry look older than the next frame.
+	*/
+	n_frames = seconds * (pikrellcam.camera_adjust.video_fps + 10);
+	for (i = 64; i < n_frames; i <<= 1)
+		;
+	if (i != vcb->frame_index_size)
+		{
+		free(vcb->frame_index);
+		vcb->frame_index = (VideoFrame *) calloc(i, sizeof(VideoFrame));
+		vcb->frame_index_size = i;
+		}
+	for (i = 0; i < vcb->frame_index_size; ++i)
+		vcb->frame_index[i].seq = vcb->frame_seq - vcb->frame_index_size
+				+ ((i - vcb->frame_seq) & (vcb->frame_index_size - 1));
+	vcb->in_frame = FALSE;
+
+	vcb->cur_frame_index = 0;
+	vcb->pre_frame_index = 0;
+	vcb->in_keyframe = FALSE;
+	for (i = 0; i < KEYFRAME_SIZE; ++i)
+		{
+		vcb->key_frame[i].position = 0;
+		vcb->key_frame[i].t_frame = 0;
+		vcb->key_frame[i].frame_count = 0;
+		}
+	pthread_rwlock_unlock(&vcb->stream_lock);
+	}
+
+void
+h264_header_save(uint8_t *data, int length)
+	{
+	VideoCircularBuffer *vcb = &video_circular_buffer;
+
+	if (vcb->h264_header_position + length > H264_MAX_HEADER_SIZE)
+		log_printf("h264 header bytes error.\n");
+	else
+		{
+		/* Save header bytes to write to .mp4 video files
+		*/
+		memcpy(vcb->h264_header + vcb->h264_header_position, data, length);
+		vcb->h264_header_position += length;
+		}
+	}
+
+  /* Encoded h264 data, the inline motion vectors (VIDEO_FLAG_SIDEINFO)
+  |  and the SPS/PPS header (VIDEO_FLAG_CONFIG) all come in here.  pts is
+  |  in usec and is <= 0 if not known.
+  */
+void
+video_h264_data(uint8_t *data, int length, int flags, int64_t pts)
+	{
+	VideoCircularBuffer *vcb = &video_circular_buffer;
+	MotionFrame		*mf = &motion_frame;
+	KeyFrame		*kf;
+	VideoFrame		*frame;
+	int				i, end_space, t_elapsed, event = 0;
+	int				t_usec, dt_frame;
+	boolean			force_stop;
+	time_t			t_cur = pikrellcam.t_now;
+	static int		fps_count, pause_frame_count_adjust;
+	static time_t	t_sec, t_prev;
+	uint64_t		t64_now;
+	static int		t_annotate, t_key_frame;
+	static struct timeval	tv;
+	static uint64_t	t0_stc, pts_prev;
+	static boolean	prev_pause;
+
+	if (vcb->state == VCB_STATE_RESTARTING)
+		{
+		if (flags & VIDEO_FLAG_CONFIG)
+			h264_header_save(data, length);
+		fps_count = 0;
+		motion_detect_done();
+		return;
+		}
+
+	if (pts > 0)
+		{
+		if (pikrellcam.t_now > tv.tv_sec + 10)
+			{	/* Rarely, but time skew can change if ntp updates. */
+			gettimeofday(&tv, NULL);
+			camera_source->system_time(&t0_stc);
+			t0_stc = (uint64_t) tv.tv_sec * 1000000LL + (uint64_t) tv.tv_usec - t0_stc;
+			}
+
+		/* Skew adjust to the system clock to get second transitions.
+		|  Annotate times need to be set early to get displayed time synced
+		|  with system time.  Needs >2 frames + offset to get it to work over
+		|  range of fps values.
+		|  Key frames can be delivered one frame after a request, so request
+		|  within 1 1/2 frames before second time transitions.
+		*/
+		t64_now = t0_stc + pts;
+		t_sec = (int) (t64_now / 1000000LL);
+		t_usec = (int) (t64_now % 1000000LL);
+		dt_frame = 1000000 / pikrellcam.camera_adjust.video_fps;
+
+		if (   t_annotate < t_sec
+		    && t_usec > 900000 - 5 * dt_frame / 2
+		   )
+			{
+			t_annotate = t_sec;
+			if (camera_source->annotate)
+				camera_source->annotate(t_annotate + 1);
+			}
+
+		if (   (vcb->state == VCB_STATE_NONE || vcb->pause)
+		    && t_key_frame < t_sec
+		    && t_usec > 1000000 - 3 * dt_frame / 2
+		   )
+			{
+			t_key_frame = t_sec;
+			if (camera_source->keyframe_request)
+				camera_source->keyframe_request();
+			}
+		if (   (flags & VIDEO_FLAG_KEYFRAME)
+		         && t_cur < t_sec
+		        )
+			t_cur = t_sec;
+		}
+	if (hls_keyframe_wanted() && camera_source->keyframe_request)
+		camera_source->keyframe_request();		/* to end a HLS segment */
+
+	pthread_mutex_lock(&vcb->mutex);
+	video_write_deferred(vcb);
+	motion_detect_record(vcb);
+
+	if (flags & VIDEO_FLAG_CONFIG)
+		h264_header_save(data, length);
+	else if (flags & VIDEO_FLAG_SIDEINFO)
+		{
+		if (++fps_count >= pikrellcam.mjpeg_divider)
+			{
+			motion_frame_event = TRUE;		/* synchronize with i420 frames */
+			motion_frame_seq = vcb->frame_seq - 1;
+			fps_count = 0;
+			motion_frame_queue(data, length, pts);
+			}
+		}
+	else
+		{
+		if (  (flags & VIDEO_FLAG_KEYFRAME)
+		    && !vcb->in_keyframe
+		   )
+			{
+			/* Keep key_frame[cur_frame_index] always pointing to the latest
+			|  keyframe (this one) in the video buffer.  Then adjust the
+			|  key_frame[pre_frame_index] to point to a keyframe
+			|  in the video buffer that is pre_capture time behind.
+			|  If paused, always keep tail pointing to the latest keyframe.
+			*/
+			vcb->in_keyframe = TRUE;
+			vcb->cur_frame_index = (vcb->cur_frame_index + 1) % KEYFRAME_SIZE;
+			kf = &vcb->key_frame[vcb->cur_frame_index];
+			kf->position = vcb->head;
+			kf->offset = vcb->head_offset;
+			kf->frame_seq = vcb->frame_seq;
+			kf->frame_count = 0;
+			pause_frame_count_adjust = 0;
+			if (vcb->pause && vcb->state == VCB_STATE_MANUAL_RECORD)
+				{
+				vcb->tail = vcb->head;
+				pts_prev = pts;
+				pause_frame_count_adjust = 0;
+				}
+			kf->t_frame = t_cur;
+			kf->frame_pts = pts;
+			while (t_cur - vcb->key_frame[vcb->pre_frame_index].t_frame
+						 > pikrellcam.motion_times.pre_capture)
+				{
+				vcb->pre_frame_index = (vcb->pre_frame_index + 1) % KEYFRAME_SIZE;
+				if (vcb->pre_frame_index == vcb->cur_frame_index)
+					break;
+				}
+			}
+		if (flags & VIDEO_FLAG_FRAME_END)
+			{
+			vcb->in_keyframe = FALSE;
+			i = vcb->pre_frame_index;
+			while (1)
+				{
+				vcb->key_frame[i].frame_count += 1;
+				if (i++ == vcb->cur_frame_index)
+					break;
+				i %= KEYFRAME_SIZE;
+				}
+			if (   vcb->state == VCB_STATE_MOTION_RECORD
+			    || vcb->state == VCB_STATE_MANUAL_RECORD
+			   )
+				{
+				if (!vcb->pause)
+					vcb->frame_count += 1;
+				else
+					pause_frame_count_adjust += 1;
+				}
+			}
+
+		if (t_cur > t_prev)
+			{
+			if (!vcb->pause)
+				++vcb->record_elapsed_time;
+			t_prev = t_cur;
+			}
+
+		if (vcb->state == VCB_STATE_MOTION_RECORD_START)
+			{
+			/* Write mp4 header and set tail to beginning of pre_capture
+			|  video data, then write the entire pre_capture time data.
+			|  The keyframe data we collected above keeps a pointer to
+			|  video data close to the pre_capture time we want.
+			*/
+			memcpy(vcb->record->header, vcb->h264_header,
+						vcb->h264_header_position);
+			vcb->record->header_size = vcb->h264_header_position;
+			vcb->record->frame_seq =
+					vcb->key_frame[vcb->record_start_frame_index].frame_seq;
+			video_write_queue(vcb, VIDEO_WRITE_HEADER, vcb->record, 0, 0, 0);
+
+			vcb->tail = vcb->key_frame[vcb->record_start_frame_index].position;
+			vcb_video_write(vcb);
+			vcb->frame_count = vcb->key_frame[vcb->record_start_frame_index].frame_count;
+			vcb->video_frame_count = vcb->frame_count;
+			motion_event_write(vcb, mf);
+			motion_detect_done();
+			vcb->state = VCB_STATE_MOTION_RECORD;
+			if (mf->external_trigger_time_limit > 0)
+				{
+				vcb->motion_sync_time = t_cur + mf->external_trigger_time_limit;
+				vcb->max_record_time = mf->external_trigger_time_limit;
+				}
+			else
+				{
+				vcb->motion_sync_time = t_cur + pikrellcam.motion_times.post_capture;
+				vcb->max_record_time = pikrellcam.motion_record_time_limit;
+				}
+
+			/* Schedule any motion begin command.
+			*/
+			event |= EVENT_MOTION_BEGIN;
+			}
+
+		if (vcb->state == VCB_STATE_MANUAL_RECORD_START)
+			{
+			/* Write mp4 header and set tail to most recent keyframe.
+			|  So manual records may have up to about a sec pre_capture.
+			*/
+			memcpy(vcb->record->header, vcb->h264_header,
+						vcb->h264_header_position);
+			vcb->record->header_size = vcb->h264_header_position;
+			vcb->record->frame_seq =
+					vcb->key_frame[vcb->record_start_frame_index].frame_seq;
+			video_write_queue(vcb, VIDEO_WRITE_HEADER, vcb->record, 0, 0, 0);
+
+			vcb->tail = vcb->key_frame[vcb->record_start_frame_index].position;
+
+			vcb_video_write(vcb);
+			vcb->frame_count = vcb->key_frame[vcb->record_start_frame_index].frame_count;
+			pts_prev = 0;
+			vcb->state = VCB_STATE_MANUAL_RECORD;
+			event |= EVENT_PREVIEW_SAVE;
+			}
+
+		/* Save video data into the circular buffer.
+		*/
+		video_write_overrun_check(vcb, length);
+		if (!vcb->in_frame)
+			{
+			vcb->in_frame = TRUE;
+			vcb->frame_position = vcb->head;
+			vcb->frame_offset = vcb->head_offset;
+			vcb->frame_pts = 0;
+			vcb->frame_keyframe = FALSE;
+			}
+		if (pts > 0 && vcb->frame_pts == 0)
+			vcb->frame_pts = pts;
+		if (flags & VIDEO_FLAG_KEYFRAME)
+			vcb->frame_keyframe = TRUE;
+
+		/* Let the video writer see what is about to be overwritten.
+		*/
+		__atomic_store_n(&vcb->write_end, vcb->head_offset + length,
+					__ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		end_space = vcb->size - vcb->head;
+		if (length <= end_space)
+			memcpy(vcb->data + vcb->head, data, length);
+		else
+			{
+			memcpy(vcb->data + vcb->head, data, end_space);
+			memcpy(vcb->data, data + end_space, length - end_space);
+			}
+		vcb->head = (vcb->head + length) % vcb->size;
+		vcb->head_offset += length;
+
+		if (flags & VIDEO_FLAG_FRAME_END)
+			{
+			/* Mark the entry as being rewritten (to a seq a reader of the
+			|  old entry will see as lost), then fill it and publish.
+			*/
+			frame = &vcb->frame_index[vcb->frame_seq & (vcb->frame_index_size - 1)];
+			__atomic_store_n(&frame->seq, vcb->frame_seq - 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			frame->position = vcb->frame_position;
+			frame->offset = vcb->frame_offset;
+			frame->length = vcb->head_offset - vcb->frame_offset;
+			frame->pts = vcb->frame_pts;
+			frame->keyframe = vcb->frame_keyframe;
+			__atomic_store_n(&frame->seq, vcb->frame_seq, __ATOMIC_RELEASE);
+			vcb->frame_seq += 1;
+			vcb->in_frame = FALSE;
+			video_stream_notify();		/* live stream clients */
+			}
+
+		/* And write video data to a video file according to record state.
+		|  Record time limit (if any) does not include pre capture times or
+		|  manual paused time which is accounted for in record_elapsed_time.
+		*/
+		force_stop = FALSE;
+		if (   vcb->record
+		    && __atomic_load_n(&vcb->record->failed, __ATOMIC_ACQUIRE)
+		   )
+			force_stop = TRUE;		/* writer could not open the file */
+		else if (vcb->max_record_time > 0)
+			{
+			t_elapsed = vcb->record_elapsed_time;
+			if (vcb->state == VCB_STATE_MOTION_RECORD)
+				t_elapsed -= (mf->external_trigger_pre_capture > 0) ?
+							  mf->external_trigger_pre_capture
+							: pikrellcam.motion_times.pre_capture;
+			else
+				t_elapsed -= vcb->manual_pre_capture;
+
+			if (t_elapsed >= vcb->max_record_time)
+				force_stop = TRUE;
+			}
+
+		if (vcb->state == VCB_STATE_MANUAL_RECORD)
+			{
+			if (!vcb->pause)
+				{
+				if (pts > 0)
+					{
+					if (pts_prev > 0)
+						vcb->last_pts += pts - pts_prev;
+					else
+						vcb->last_pts = pts;
+					pts_prev = pts;
+					}
+				if (prev_pause)
+					{
+					vcb->frame_count += pause_frame_count_adjust;
+					pause_frame_count_adjust = 0;
+					}
+				vcb->video_frame_count = vcb->frame_count;
+				vcb_video_write(vcb);	/* Continuously write video data */
+				}
+			prev_pause = vcb->pause;
+
+			if (force_stop)
+				video_record_stop(vcb);
+			}
+		else if (vcb->state == VCB_STATE_MOTION_RECORD)
+			{
+			/* Always write until we reach motion_sync time (which is last
+			|  motion detect time + post_capture time), then hold during
+			|  event_gap time.  Motion events during event_gap time will bump
+			|  motion_sync_time and event_gap expiration time higher thus
+			|  triggering more writes up to the new sync_time.
+			|  If there is not another motion event, event_gap time will be
+			|  reached and we stop recording with the post_capture time
+			|  already written.
+			*/
+			if (t_cur <= vcb->motion_sync_time)
+				{
+				if (pts > 0)
+					vcb->last_pts = pts;
+				vcb->video_frame_count = vcb->frame_count;
+				vcb_video_write(vcb);
+				}
+			if (   force_stop
+		        || (   mf->external_trigger_time_limit == 0
+			        && t_cur >= vcb->motion_last_detect_time + pikrellcam.motion_times.event_gap
+			       )
+		       )
+				{
+				/* For motion recording, preview_save_mode "first" has been
+				|  handled in motion_detect_record().  But if not "first",
+				|  there is a preview save waiting to be handled.
+				*/
+				video_record_stop(vcb);
+				event |= EVENT_MOTION_END;
+				if (strcmp(pikrellcam.motion_preview_save_mode, "first") != 0)
+					event |= EVENT_MOTION_PREVIEW_SAVE_CMD;
+				}
+			}
+		}
+	pthread_mutex_unlock(&vcb->mutex);
+
+	/* This handles preview saves for manual records for possible future use.
+	|  preview_save_cmd does not apply for manual records.
+	|  All preview saves for motion records are scheduled in motion_detect_record().
+	|  preview_save_cmd for save mode "best" is handled in video_record_stop().
+	*/
+	if (event & EVENT_PREVIEW_SAVE)
+		event_add("manual preview save", pikrellcam.t_now, 0,
+					event_preview_save, NULL);
+
+	if (   (event & EVENT_MOTION_BEGIN)
+	    && *pikrellcam.on_motion_begin_cmd != '\0'
+	   )
+		event_add("motion begin", pikrellcam.t_now, 0,
+					exec_no_wait, pikrellcam.on_motion_begin_cmd);
+	/* preview dispose is handled in video_record_stop() and the motion end
+	|  event in video_record_finish() after the video writer closes the file.
+	*/
+	}
@@ -0,0 +1,251 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+#include "pikrellcam.h"
+
+  /* Live stream readers follow the circular buffer frame index with their
+  |  own frame seq cursor the same way the video writer does, so the h264
+  |  callback never waits for them.  A reader sends frame data in place
+  |  out of the circular buffer, so before each send it checks that the
+  |  data is not close to being overwritten by the head.  A reader that
+  |  falls behind that margin has lost its frame and should skip ahead to
+  |  a keyframe.
+  |  Readers call these holding vcb->stream_lock for reading, and restart
+  |  from a keyframe with the new header if vcb->stream_generation changed.
+  |  video_stream_next() does the keyframe, lag and generation bookkeeping
+  |  for a reader's VideoStreamCursor.
+  */
+#define	STREAM_MARGIN(vcb)	((vcb)->size / 4)
+
+  /* A lag_skip reader more than this many seconds of frames behind is
+  |  skipped ahead to the latest keyframe at its next frame boundary.
+  */
+#define	STREAM_LAG_SECONDS	2
+
+
+  /* Is the frame data from byte done on still safe from the head?
+  */
+boolean
+video_stream_valid(VideoFrame *frame, int done)
+	{
+	VideoCircularBuffer	*vcb = &video_circular_buffer;
+	unsigned int		head_offset;
+
+	head_offset = __atomic_load_n(&vcb->head_offset, __ATOMIC_ACQUIRE);
+	return ((int) (head_offset - (frame->offset + done))
+				< vcb->size - STREAM_MARGIN(vcb));
+	}
+
+  /* Copy the index entry of frame seq.
+  */
+int
+video_stream_frame(unsigned int seq, VideoFrame *frame)
+	{
+	VideoCircularBuffer	*vcb = &video_circular_buffer;
+	VideoFrame			*entry;
+	unsigned int		s;
+
+	entry = &vcb->frame_index[seq & (vcb->frame_index_size - 1)];
+	s = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+	if ((int) (s - seq) < 0)
+		return VIDEO_STREAM_WAIT;
+	*frame = *entry;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (   s != seq
+	    || __atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq
+	    || !video_stream_valid(frame, 0)
+	   )
+		return VIDEO_STREAM_LOST;
+	return VIDEO_STREAM_OK;
+	}
+
+  /* Find the latest keyframe at or before seconds_ago seconds before the
+  |  newest frame, going by the frame pts (or the frame rate for frames
+  |  without one).  If the buffer does not go back that far, it is the
+  |  oldest keyframe a reader can still get.  Returns FALSE if there is no
+  |  keyframe yet.  With seconds_ago 0 it is the latest keyframe.
+  */
+boolean
+video_stream_keyframe(int seconds_ago, unsigned int *seq)
+	{
+	VideoCircularBuffer	*vcb = &video_circular_buffer;
+	VideoFrame			frame;
+	unsigned int		s, next;
+	uint64_t			pts_target = 0;
+	int					i, frames_target;
+	boolean				found = FALSE;
+
+	frames_target = seconds_ago * pikrellcam.camera_adjust.video_fps;
+	next = __atomic_load_n(&vcb->frame_seq, __ATOMIC_ACQUIRE);
+	for (i = 1; i <= vcb->frame_index_size; ++i)
+		{
+		s = next - i;
+		if (video_stream_frame(s, &frame) != VIDEO_STREAM_OK)
+			break;
+		if (i == 1 && frame.pts > (uint64_t) seconds_ago * 1000000)
+			pts_target = frame.pts - (uint64_t) seconds_ago * 1000000;
+		if (!frame.keyframe)
+			continue;
+		*seq = s;
+		found = TRUE;
+		if (   (pts_target > 0 && frame.pts > 0)
+		    ? frame.pts <= pts_target : i > frames_target
+		   )
+			break;
+		}
+	return found;
+	}
+
+  /* The rest of a frame from byte done as up to two iovecs since it may
+  |  wrap around the end of the circular buffer.
+  */
+int
+video_stream_iov(VideoFrame *frame, int done, struct iovec *iov)
+	{
+	VideoCircularBuffer	*vcb = &video_circular_buffer;
+	int					position, length, end_space;
+
+	position = (frame->position + done) % vcb->size;
+	length = frame->length - done;
+	end_space = vcb->size - position;
+
+	iov[0].iov_base = vcb->data + position;
+	if (length <= end_space)
+		{
+		iov[0].iov_len = length;
+		return 1;
+		}
+	iov[0].iov_len = end_space;
+	iov[1].iov_base = vcb->data;
+	iov[1].iov_len = length - end_space;
+	return 2;
+	}
+
+  /* Copy the SPS/PPS header a stream has to start with.  header must hold
+  |  H264_MAX_HEADER_SIZE bytes.
+  */
+int
+video_stream_header(uint8_t *header)
+	{
+	VideoCircularBuffer	*vcb = &video_circular_buffer;
+	int					length;
+
+	length = __atomic_load_n(&vcb->h264_header_position, __ATOMIC_ACQUIRE);
+	length = MIN(length, H264_MAX_HEADER_SIZE);
+	memcpy(header, vcb->h264_header, length);
+	return length;
+	}
+
+void
+video_stream_cursor_init(VideoStreamCursor *cursor, boolean lag_skip)
+	{
+	memset(cursor, 0, sizeof(VideoStreamCursor));
+	cursor->generation = video_circular_buffer.stream_generation;
+	cursor->need_keyframe = TRUE;
+	cursor->lag_skip = lag_skip;
+	}
+
+  /* TRUE once after the circular buffer was reallocated, with the cursor
+  |  set to restart from a keyframe.  The reader drops anything it has
+  |  from the old buffer and sends the new header before the keyframe.
+  */
+boolean
+video_stream_new_generation(VideoStreamCursor *cursor)
+	{
+	VideoCircularBuffer	*vcb = &video_circular_buffer;
+
+	if (cursor->generation == vcb->stream_generation)
+		return FALSE;
+	cursor->generation = vcb->stream_generation;
+	cursor->need_keyframe = TRUE;
+	cursor->catch_up = FALSE;
+	return TRUE;
+	}
+
+  /* The reader lost the frame it was on, restart from the latest keyframe.
+  */
+void
+video_stream_skip(VideoStreamCursor *cursor)
+	{
+	cursor->need_keyframe = TRUE;
+	cursor->catch_up = FALSE;
+	cursor->skips += 1;
+	}
+
+  /* Get the frame at the cursor, restarting on a keyframe if the cursor
+  |  needs one or lost its frame.  A lag_skip reader falling behind jumps
+  |  ahead to the latest keyframe, but only if that is ahead of it, since
+  |  while recording a GOP can be longer than the lag.  Returns
+  |  VIDEO_STREAM_RESTART when frame is a keyframe the stream restarts on,
+  |  VIDEO_STREAM_OK for the next frame or VIDEO_STREAM_WAIT if there is
+  |  none yet.  The reader bumps cursor->seq after it is done with frame.
+  */
+int
+video_stream_next(VideoStreamCursor *cursor, VideoFrame *frame)
+	{
+	VideoCircularBuffer	*vcb = &video_circular_buffer;
+	unsigned int		next, seq;
+	int					result, lag_frames;
+	boolean				restart = FALSE;
+
+	next = __atomic_load_n(&vcb->frame_seq, __ATOMIC_ACQUIRE);
+	if (cursor->catch_up && (int) (next - cursor->seq) <= 1)
+		cursor->catch_up = FALSE;
+	lag_frames = STREAM_LAG_SECONDS * pikrellcam.camera_adjust.video_fps;
+	if (   cursor->lag_skip && !cursor->need_keyframe && !cursor->catch_up
+	    && (int) (next - cursor->seq) > lag_frames
+	    && video_stream_keyframe(0, &seq)
+	    && (int) (seq - cursor->seq) > 0
+	   )
+		{
+		cursor->seq = seq;
+		cursor->skips += 1;
+		restart = TRUE;
+		}
+	while (1)
+		{
+		if (cursor->need_keyframe)
+			{
+			if (!video_stream_keyframe(cursor->catch_up ? cursor->ago : 0,
+						&cursor->seq))
+				return VIDEO_STREAM_WAIT;
+			cursor->need_keyframe = FALSE;
+			restart = TRUE;
+			}
+		result = video_stream_frame(cursor->seq, frame);
+		if (result == VIDEO_STREAM_WAIT)
+			return VIDEO_STREAM_WAIT;
+		if (result == VIDEO_STREAM_OK)
+			break;
+		video_stream_skip(cursor);
+		}
+	return restart ? VIDEO_STREAM_RESTART : VIDEO_STREAM_OK;
+	}
+
+  /* A frame was added to the circular buffer, wake up the stream servers.
+  |  Called from the h264 callback so these must not block.
+  */
+void
+video_stream_notify(void)
+	{
+	h264_server_notify();
+	rtsp_server_notify();
+	hls_notify();
+	}
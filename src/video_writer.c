@@ -0,0 +1,463 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015-2016 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+#include "pikrellcam.h"
+
+  /* The h264 callback runs on the GPU callback thread and must never wait
+  |  on the SD card.  So record file opens, header and video data writes
+  |  and closes are queued here as jobs on a single producer / single
+  |  consumer ring and done by the video writer thread.
+  |  The producer side (video_write_queue) is only called with vcb->mutex
+  |  locked so callback and command thread enqueues are serialized.  The
+  |  producer owns write_in and the consumer owns write_out and each only
+  |  reads the other's index, so the ring itself needs no lock.
+  |  Video data jobs are tail to head ranges of the circular buffer, and
+  |  the writer reads the buffer in place.  That data stays valid as long
+  |  as the writer keeps up to within the circular buffer size, which is
+  |  checked by video_write_overrun_check() in the h264 callback.  The mp4
+  |  muxer also checks each frame it copies out against vcb->write_end and
+  |  drops it if the callback got to it first.
+  */
+
+static pthread_t	video_writer_thread_id;
+
+  /* Keep some queue slots reserved for open, header and close jobs
+  |  so a stalled writer backs up data jobs (which just coalesce into
+  |  larger tail to head ranges) before it can block a record stop.
+  */
+#define	VIDEO_WRITE_CONTROL_RESERVE	8
+
+
+static int
+video_write_queue_used(VideoCircularBuffer *vcb)
+	{
+	unsigned int	out;
+
+	out = __atomic_load_n(&vcb->write_out, __ATOMIC_ACQUIRE);
+	return (int) (vcb->write_in - out);
+	}
+
+static void
+video_write_put(VideoCircularBuffer *vcb, VideoWriteJob *src)
+	{
+	VideoWriteJob	*job;
+
+	job = &vcb->write_queue[vcb->write_in % VIDEO_WRITE_QUEUE_SIZE];
+	*job = *src;
+	if (job->type == VIDEO_WRITE_DATA)
+		__atomic_add_fetch(&vcb->write_pending, job->length, __ATOMIC_RELAXED);
+
+	/* Publish the job (and the circular buffer data it refers to).
+	*/
+	__atomic_store_n(&vcb->write_in, vcb->write_in + 1, __ATOMIC_RELEASE);
+	sem_post(&vcb->write_sem);
+	}
+
+  /* Move deferred control jobs to the queue as slots free up.  Called
+  |  with vcb locked from each h264 callback and before any new job so
+  |  jobs stay in order.
+  */
+void
+video_write_deferred(VideoCircularBuffer *vcb)
+	{
+	int		i, n;
+
+	if (vcb->n_write_deferred == 0)
+		return;
+	n = MIN(vcb->n_write_deferred,
+				VIDEO_WRITE_QUEUE_SIZE - video_write_queue_used(vcb));
+	if (n <= 0)
+		return;
+	for (i = 0; i < n; ++i)
+		video_write_put(vcb, &vcb->write_deferred[i]);
+	vcb->n_write_deferred -= n;
+	memmove(&vcb->write_deferred[0], &vcb->write_deferred[n],
+				vcb->n_write_deferred * sizeof(VideoWriteJob));
+	if (vcb->n_write_deferred == 0)
+		log_printf("video_write_queue: writer caught up.\n");
+	}
+
+  /* vcb should be locked before calling video_write_queue().  It is
+  |  called from the h264 callback so it never waits for the writer.
+  |  A data job that does not fit is refused and its range is picked up
+  |  by a later call.  A control job that does not fit is deferred until
+  |  the writer frees a slot and data jobs are refused until then.
+  */
+boolean
+video_write_queue(VideoCircularBuffer *vcb, int type, VideoRecord *record,
+				int position, int length, unsigned int offset)
+	{
+	VideoWriteJob	job;
+	int				used;
+
+	job.type = type;
+	job.record = record;
+	job.position = position;
+	job.length = length;
+	job.offset = offset;
+
+	video_write_deferred(vcb);
+	used = video_write_queue_used(vcb);
+	if (type == VIDEO_WRITE_DATA)
+		{
+		if (   vcb->n_write_deferred > 0
+		    || vcb->write_sync
+		    || used >= VIDEO_WRITE_QUEUE_SIZE - VIDEO_WRITE_CONTROL_RESERVE
+		   )
+			return FALSE;
+		}
+	else if (vcb->n_write_deferred > 0 || used >= VIDEO_WRITE_QUEUE_SIZE)
+		{
+		/* Should never happen unless the writer has been stuck for
+		|  many record starts and stops.
+		*/
+		if (vcb->n_write_deferred == VIDEO_WRITE_DEFER_SIZE)
+			{
+			log_printf("video_write_queue: writer is stuck, dropped %s job for %s\n",
+					type == VIDEO_WRITE_OPEN ? "open" :
+					(type == VIDEO_WRITE_HEADER ? "header" : "close"),
+					fname_base(record->pathname));
+			if (type != VIDEO_WRITE_CLOSE)
+				__atomic_store_n(&record->failed, TRUE, __ATOMIC_RELEASE);
+			return FALSE;
+			}
+		if (vcb->n_write_deferred == 0)
+			log_printf("video_write_queue: writer is stuck, deferring jobs...\n");
+		vcb->write_deferred[vcb->n_write_deferred++] = job;
+		return TRUE;
+		}
+	video_write_put(vcb, &job);
+	return TRUE;
+	}
+
+  /* Queue circular buffer data from the tail to head for writing and
+  |  update the tail.  If the queue is full, leave the tail alone and the
+  |  range will be picked up by the next call.
+  */
+void
+vcb_video_write(VideoCircularBuffer *vcb)
+	{
+	int		length;
+
+	if (!vcb || !vcb->record || vcb->tail == vcb->head)
+		return;
+
+	length = (vcb->head - vcb->tail + vcb->size) % vcb->size;
+	if (video_write_queue(vcb, VIDEO_WRITE_DATA, vcb->record,
+				vcb->tail, length, vcb->head_offset - length))
+		vcb->tail = vcb->head;
+	}
+
+  /* Called from the h264 callback with vcb locked before "length" bytes
+  |  are copied in at the head.  If the writer has fallen so far behind
+  |  that the copy would overwrite data not yet written, the record will
+  |  have a glitch.  Nothing can be done about it here except to say so.
+  */
+void
+video_write_overrun_check(VideoCircularBuffer *vcb, int length)
+	{
+	int		unwritten;
+
+	if (!vcb->record || vcb->pause)
+		return;
+	unwritten = __atomic_load_n(&vcb->write_pending, __ATOMIC_RELAXED)
+				+ (vcb->head - vcb->tail + vcb->size) % vcb->size;
+	if (unwritten + length < vcb->size)
+		return;
+
+	if (vcb->record->overruns++ == 0)
+		log_printf("Video writer overrun: %s storage is not keeping up.\n",
+				fname_base(vcb->record->pathname));
+	}
+
+  /* Wait for the writer to finish all queued jobs so the circular buffer
+  |  or motion log ring can be reallocated.  Call with vcb locked, but not
+  |  from the h264 callback.  vcb is unlocked while waiting on the writer
+  |  so slow storage does not hold up the callback, which meanwhile gets
+  |  its data jobs refused.  The range they would have queued stays behind
+  |  the tail and is dropped by circular_buffer_init().  Returns with vcb
+  |  locked and the queue empty.
+  */
+void
+video_writer_sync(VideoCircularBuffer *vcb)
+	{
+	__atomic_store_n(&vcb->write_sync, TRUE, __ATOMIC_SEQ_CST);
+	while (sem_trywait(&vcb->write_done_sem) == 0)
+		;
+	while (1)
+		{
+		video_write_deferred(vcb);
+		if (   vcb->n_write_deferred == 0
+		    && __atomic_load_n(&vcb->write_out, __ATOMIC_SEQ_CST)
+		          == vcb->write_in
+		   )
+			break;
+		pthread_mutex_unlock(&vcb->mutex);
+		while (sem_wait(&vcb->write_done_sem) < 0)
+			;
+		pthread_mutex_lock(&vcb->mutex);
+		}
+	__atomic_store_n(&vcb->write_sync, FALSE, __ATOMIC_RELAXED);
+	}
+
+static void
+video_write_error(VideoRecord *record)
+	{
+	if (!record->write_error)
+		{
+		record->write_error = TRUE;
+		log_printf("Video write error: %s.  %m\n", record->pathname);
+		}
+	}
+
+  /* Mux all complete frames in the queued data available to this record.
+  |  A data job can end in the middle of a frame which is then muxed
+  |  when a following job makes the rest of it available.  Frames that
+  |  start before the available data were skipped over (manual pause)
+  |  and are dropped.
+  */
+static void
+video_mux_data(VideoCircularBuffer *vcb, VideoRecord *record,
+				unsigned int offset, int length)
+	{
+	VideoFrame			*entry, frame;
+	static uint8_t		*buf;
+	static int			buf_size;
+	int					end_space, n, lost;
+	unsigned int		seq;
+	uint64_t			pts;
+
+	if (offset != record->avail_end)
+		record->avail_offset = offset;
+	record->avail_end = offset + length;
+
+	while (1)
+		{
+		entry = &vcb->frame_index[record->frame_seq & (vcb->frame_index_size - 1)];
+		seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+		lost = (int) (seq - record->frame_seq);
+		if (lost < 0)		/* not indexed yet */
+			break;
+		frame = *entry;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq)
+			continue;		/* rewritten while copying, so now lost */
+		if (lost > 0)
+			{
+			/* Writer fell more than the frame index behind.  Skip to the
+			|  next keyframe so the video can still be decoded.
+			*/
+			record->overruns += 1;
+			record->frame_seq = frame.seq;
+			record->need_keyframe = TRUE;
+			continue;
+			}
+		if ((int) (frame.offset - record->avail_offset) < 0)
+			{
+			record->frame_seq += 1;
+			continue;
+			}
+		if ((int) (frame.offset + frame.length - record->avail_end) > 0)
+			break;
+		record->frame_seq += 1;
+		if (record->need_keyframe && !frame.keyframe)
+			continue;
+		record->need_keyframe = FALSE;
+
+		if (frame.length > buf_size)
+			{
+			buf_size = frame.length + frame.length / 4;
+			buf = realloc(buf, buf_size);
+			}
+		end_space = vcb->size - frame.position;
+		if (frame.length <= end_space)
+			memcpy(buf, vcb->data + frame.position, frame.length);
+		else
+			{
+			memcpy(buf, vcb->data + frame.position, end_space);
+			memcpy(buf + end_space, vcb->data, frame.length - end_space);
+			}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&vcb->write_end, __ATOMIC_RELAXED) - frame.offset
+					> (unsigned int) vcb->size)
+			{
+			/* Overwritten before or while copying.  Skip to the next
+			|  keyframe so torn data does not go into the video.
+			*/
+			record->overruns += 1;
+			record->need_keyframe = TRUE;
+			continue;
+			}
+
+		/* The frame pts gives the sample its real duration only when the
+		|  frame follows the previous muxed one.
+		*/
+		pts = (frame.seq == record->mux_prev_seq + 1) ? frame.pts : 0;
+		record->mux_prev_seq = frame.seq;
+
+		if ((n = mp4_mux_sample(&record->mux, buf, frame.length,
+					frame.keyframe, pts)) < 0)
+			video_write_error(record);
+		else
+			record->size += n;
+		}
+	pikrellcam.video_size = record->size;
+	}
+
+static void
+video_write_data(VideoCircularBuffer *vcb, VideoRecord *record,
+				int position, int length)
+	{
+	int		end_space, n;
+
+	if (!record->file)
+		return;
+	end_space = vcb->size - position;
+	if (length <= end_space)
+		n = fwrite(vcb->data + position, 1, length, record->file);
+	else
+		{
+		n = fwrite(vcb->data + position, 1, end_space, record->file);
+		n += fwrite(vcb->data, 1, length - end_space, record->file);
+		}
+	record->size += n;
+	pikrellcam.video_size = record->size;
+	if (n != length)
+		video_write_error(record);
+	}
+
+static void
+video_write_job(VideoCircularBuffer *vcb, VideoWriteJob *job)
+	{
+	VideoRecord	*record = job->record;
+	int			n;
+
+	switch (job->type)
+		{
+		case VIDEO_WRITE_OPEN:
+			if ((record->file = fopen(record->pathname, "w")) == NULL)
+				{
+				log_printf("Could not create video file %s.  %m\n",
+						record->pathname);
+				__atomic_store_n(&record->failed, TRUE, __ATOMIC_RELEASE);
+				}
+			else
+				log_printf("Video record: %s ...\n", record->pathname);
+			break;
+
+		case VIDEO_WRITE_HEADER:
+			if (!record->file)
+				break;
+			if (record->mp4)
+				{
+				if (!mp4_mux_start(&record->mux, record->file,
+							record->header, record->header_size,
+							record->width, record->height,
+							record->fps, record->nominal_fps))
+					{
+					video_write_error(record);
+					fclose(record->file);
+					record->file = NULL;
+					__atomic_store_n(&record->failed, TRUE, __ATOMIC_RELEASE);
+					break;
+					}
+				record->size = record->mux.offset;
+				record->mux_prev_seq = record->frame_seq - 1;
+				record->need_keyframe = TRUE;
+				motion_log_start(record);
+				}
+			else
+				{
+				n = fwrite(record->header, 1, record->header_size, record->file);
+				record->size = n;
+				}
+			pikrellcam.video_header_size = record->header_size;
+			pikrellcam.video_size = record->size;
+			break;
+
+		case VIDEO_WRITE_DATA:
+			if (record->file && record->mp4)
+				{
+				video_mux_data(vcb, record, job->offset, job->length);
+				motion_log_write(record);
+				}
+			else
+				video_write_data(vcb, record, job->position, job->length);
+			__atomic_sub_fetch(&vcb->write_pending, job->length,
+						__ATOMIC_RELAXED);
+			break;
+
+		case VIDEO_WRITE_CLOSE:
+			if (record->file)
+				{
+				if (record->mp4 && !mp4_mux_finish(&record->mux))
+					video_write_error(record);
+				if (fclose(record->file) != 0)
+					video_write_error(record);
+				record->file = NULL;
+				}
+			motion_log_finish(record);
+			/* File is complete, do the rest of record stop processing
+			|  (thumb, motion end command) in the event loop.
+			*/
+			event_add("video record finish", pikrellcam.t_now, 0,
+					video_record_finish, record);
+			break;
+		}
+	}
+
+static void *
+video_writer_thread(void *ptr)
+	{
+	VideoCircularBuffer	*vcb = (VideoCircularBuffer *) ptr;
+	VideoWriteJob		*job;
+	unsigned int		out;
+
+	while (1)
+		{
+		while (sem_wait(&vcb->write_sem) < 0)
+			;
+		out = vcb->write_out;
+		while (out != __atomic_load_n(&vcb->write_in, __ATOMIC_ACQUIRE))
+			{
+			job = &vcb->write_queue[out % VIDEO_WRITE_QUEUE_SIZE];
+			video_write_job(vcb, job);
+			__atomic_store_n(&vcb->write_out, ++out, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&vcb->write_sync, __ATOMIC_SEQ_CST))
+				sem_post(&vcb->write_done_sem);
+			}
+		}
+	return NULL;
+	}
+
+void
+video_writer_init(void)
+	{
+	VideoCircularBuffer	*vcb = &video_circular_buffer;
+
+	sem_init(&vcb->write_sem, 0, 0);
+	sem_init(&vcb->write_done_sem, 0, 0);
+	if (pthread_create(&video_writer_thread_id, NULL,
+				video_writer_thread, vcb) != 0)
+		{
+		log_printf("Aborting because video writer thread create failed.  %m\n");
+		exit(1);
+		}
+	}
@@ -226,6 +226,10 @@ if (file_exists("custom-control.php"))
 						onclick="fifo_command('motion show_vectors toggle')"
 						class="btn-control motion-control"
 						>
+        <input type="button" id="heatmap_button" value="Heatmap"
+						onclick="fifo_command('motion show_heatmap toggle')"
+						class="btn-control motion-control"
+						>
       </span>
     </div>
 
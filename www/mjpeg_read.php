@@ -4,6 +4,21 @@
 <?php
 
 	header("Content-Type: image/jpeg");
-	readfile(MJPEG_FILE);
+
+	// With the install nginx config this file is not used, nginx proxies
+	// mjpeg_read.php directly to pikrellcam.  Otherwise get the snapshot
+	// from pikrellcam, or the mjpeg file if pikrellcam is not running
+	// (a camera error jpeg is copied there).
+	$fp = @fsockopen("localhost", 9999, $errno, $errstr, 1);
+	if ($fp)
+		{
+		fwrite($fp, "GET /snapshot.jpg HTTP/1.0\r\n\r\n");
+		while (!feof($fp) && fgets($fp, 1024) != "\r\n")
+			;
+		fpassthru($fp);
+		fclose($fp);
+		}
+	else
+		readfile(MJPEG_FILE);
 
 ?>
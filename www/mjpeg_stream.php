@@ -8,6 +8,13 @@ $fp = fsockopen($host, $port, $error, $errstr);
 if (!$fp)
         return;
 
+// pikrellcam serves the stream over HTTP, skip its response header.
+// With the install nginx config this file is not used, nginx proxies
+// mjpeg_stream.php directly to pikrellcam.
+fwrite($fp, "GET /stream HTTP/1.0\r\n\r\n");
+while (!feof($fp) && fgets($fp, 1024) != "\r\n")
+        ;
+
 // create multipart header
 header("Cache-Control: no-cache");
 header("Cache-Control: private");